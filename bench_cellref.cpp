@@ -0,0 +1,113 @@
+#include "xlrd/xlsx.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+// A1 cell references per second, decode_cell_ref against a per-character
+// loop plus atoi.
+// clang++ -O2 -std=c++11 -pthread bench_cellref.cpp
+// ./a.out [refs] [rounds]
+
+using namespace xlrd::xlsx;
+
+// Random references over the whole sheet, one in eight with '$' markers,
+// stored back to back in text; ends[i] is where reference i stops.
+static void
+make_refs(size_t n, std::string& text, std::vector<size_t>& ends)
+{
+    std::mt19937 rng(12345);
+    std::uniform_int_distribution<int> cols(1, X12_MAX_COLS);
+    std::uniform_int_distribution<int> rows(1, X12_MAX_ROWS);
+    char letters[4];
+    char ref[32];
+    for (size_t i = 0; i < n; i++) {
+        int col = cols(rng);
+        int nletters = 0;
+        for (; col > 0; col = (col - 1) / 26) {
+            letters[nletters++] = char('A' + (col - 1) % 26);
+        }
+        std::string name(letters, letters + nletters);
+        const char* dollar = i % 8 == 0 ? "$" : "";
+        snprintf(ref, sizeof(ref), "%s%s%s%d", dollar, std::string(name.rbegin(), name.rend()).c_str(),
+                 dollar, rows(rng));
+        text += ref;
+        ends.push_back(text.size());
+    }
+}
+
+// The decoding scan_rows did before decode_cell_ref: letters one at a time,
+// then atoi on the digits.
+static bool
+loop_cell_ref(const char* p, const char* end, int* rowx, int* colx)
+{
+    int col = 0;
+    for (; p < end; ++p) {
+        char c = *p;
+        if (c == '$') continue;
+        if ('A' <= c && c <= 'Z') {
+            col = col * 26 + (c - 'A' + 1);
+        } else if ('1' <= c && c <= '9') {
+            break;
+        } else {
+            return false;
+        }
+    }
+    char digits[16];
+    size_t ndigits = std::min(size_t(end - p), sizeof(digits) - 1);
+    memcpy(digits, p, ndigits);
+    digits[ndigits] = '\0';
+    *rowx = atoi(digits) - 1;
+    *colx = col - 1;
+    return 0 <= *colx && *colx < X12_MAX_COLS;
+}
+
+template <typename Decode>
+static double
+run(const std::string& text, const std::vector<size_t>& ends, int rounds, Decode decode, long long& checksum)
+{
+    double best = 1e300;
+    for (int round = 0; round < rounds; round++) {
+        checksum = 0;
+        auto start = std::chrono::steady_clock::now();
+        const char* base = text.data();
+        size_t begin = 0;
+        for (size_t end: ends) {
+            int rowx, colx;
+            if (decode(base + begin, base + end, &rowx, &colx)) {
+                checksum += (long long)rowx * X12_MAX_COLS + colx;
+            }
+            begin = end;
+        }
+        best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = argc > 1 ? std::atol(argv[1]) : 10000000;
+    int rounds = argc > 2 ? std::atoi(argv[2]) : 5;
+
+    std::string text;
+    std::vector<size_t> ends;
+    make_refs(n, text, ends);
+
+    long long loop_sum = 0, decode_sum = 0;
+    double loop_ms = run(text, ends, rounds, loop_cell_ref, loop_sum);
+    double decode_ms = run(text, ends, rounds,
+                           static_cast<bool (*)(const char*, const char*, int*, int*)>(decode_cell_ref),
+                           decode_sum);
+    printf("%zu references, best of %d rounds\n", n, rounds);
+    printf("loop + atoi      %8.1f ms\n", loop_ms);
+    printf("decode_cell_ref  %8.1f ms (x%.2f)\n", decode_ms, loop_ms / decode_ms);
+
+    if (decode_sum != loop_sum) {
+        printf("results differ\n");
+        return 1;
+    }
+    return 0;
+}
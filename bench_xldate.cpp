@@ -0,0 +1,126 @@
+#include "xlrd/xldate.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+// Batch Excel date conversion against xldate_as_tuple one value at a time.
+// clang++ -O2 -std=c++11 bench_xldate.cpp (or -O3 -march=native: the batch loops
+// only vectorise with a packed double to int64 conversion)
+// ./a.out [values] [rounds]
+
+using namespace xlrd::xldate;
+
+// Random serials from 1900 to 9999 with random fractions; every 100th is
+// negative, every 101st is in the 1900 leap-year gap.
+static std::vector<double>
+make_serials(size_t n)
+{
+    std::mt19937_64 rng(12345);
+    std::uniform_real_distribution<double> days(0.0, 2958465.0);
+    std::vector<double> xldates(n);
+    for (size_t i = 0; i < n; i++) {
+        xldates[i] = days(rng);
+        if (i % 100 == 0) {
+            xldates[i] = -xldates[i];
+        } else if (i % 101 == 0) {
+            xldates[i] = 1.0 + std::fmod(xldates[i], 60.0);
+        }
+    }
+    return xldates;
+}
+
+static double
+ms_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// xldate_as_tuple into the same arrays xldates_as_fields fills.
+static size_t
+tuple_fields(const std::vector<double>& xldates, int datemode, XLDateFields& out)
+{
+    size_t n = xldates.size();
+    out.year.resize(n);
+    out.month.resize(n);
+    out.day.resize(n);
+    out.hour.resize(n);
+    out.minute.resize(n);
+    out.second.resize(n);
+    size_t nbad = 0;
+    for (size_t i = 0; i < n; i++) {
+        int year = 0, month = 0, day = 0, hour = 0, minute = 0, second = 0;
+        try {
+            std::tie(year, month, day, hour, minute, second) = xldate_as_tuple(xldates[i], datemode);
+        } catch (XLDateError&) {
+            nbad++;
+        }
+        out.year[i] = int16_t(year);
+        out.month[i] = uint8_t(month);
+        out.day[i] = uint8_t(day);
+        out.hour[i] = uint8_t(hour);
+        out.minute[i] = uint8_t(minute);
+        out.second[i] = uint8_t(second);
+    }
+    return nbad;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t n = argc > 1 ? std::atol(argv[1]) : 4000000;
+    int rounds = argc > 2 ? std::atoi(argv[2]) : 5;
+    const int datemode = 0;
+    std::vector<double> xldates = make_serials(n);
+
+    XLDateFields expected, fields;
+    std::vector<int64_t> micros(n), batch_micros;
+    std::vector<uint64_t> errors;
+    size_t nbad_tuple = 0, nbad_fields = 0, nbad_micros = 0, nbad_batch = 0;
+    double tuple_ms = 1e300, fields_ms = 1e300, micros_ms = 1e300, batch_ms = 1e300;
+    for (int round = 0; round < rounds; round++) {
+        auto start = std::chrono::steady_clock::now();
+        nbad_tuple = tuple_fields(xldates, datemode, expected);
+        tuple_ms = std::min(tuple_ms, ms_since(start));
+
+        start = std::chrono::steady_clock::now();
+        nbad_fields = xldates_as_fields(xldates.data(), n, datemode, fields, errors);
+        fields_ms = std::min(fields_ms, ms_since(start));
+
+        start = std::chrono::steady_clock::now();
+        nbad_micros = 0;
+        for (size_t i = 0; i < n; i++) {
+            nbad_micros += !xldate_as_epoch_micros(xldates[i], datemode, micros[i]);
+        }
+        micros_ms = std::min(micros_ms, ms_since(start));
+
+        start = std::chrono::steady_clock::now();
+        nbad_batch = xldates_as_epoch_micros(xldates.data(), n, datemode, batch_micros, errors);
+        batch_ms = std::min(batch_ms, ms_since(start));
+    }
+
+    printf("%zu values, %zu invalid, best of %d rounds\n", n, nbad_tuple, rounds);
+    printf("xldate_as_tuple          %8.1f ms\n", tuple_ms);
+    printf("xldates_as_fields        %8.1f ms (x%.2f)\n", fields_ms, tuple_ms / fields_ms);
+    printf("xldate_as_epoch_micros   %8.1f ms\n", micros_ms);
+    printf("xldates_as_epoch_micros  %8.1f ms (x%.2f)\n", batch_ms, micros_ms / batch_ms);
+
+    if (nbad_fields != nbad_tuple || nbad_micros != nbad_tuple || nbad_batch != nbad_tuple) {
+        printf("invalid counts differ: %zu %zu %zu %zu\n", nbad_tuple, nbad_fields, nbad_micros, nbad_batch);
+        return 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (fields.year[i] != expected.year[i] || fields.month[i] != expected.month[i]
+                || fields.day[i] != expected.day[i] || fields.hour[i] != expected.hour[i]
+                || fields.minute[i] != expected.minute[i] || fields.second[i] != expected.second[i]) {
+            printf("fields differ for %.17g\n", xldates[i]);
+            return 1;
+        }
+        if (batch_micros[i] != micros[i]) {
+            printf("micros differ for %.17g\n", xldates[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -96,13 +96,13 @@ biff_text_from_num = {
 
 const MAP<int, std::string>
 error_text_from_code = {
-    {0x00, "//NULL!"},   // Intersection of two cell ranges is empty
-    {0x07, "//DIV/0!"},  // Division by zero
-    {0x0F, "//VALUE!"},  // Wrong type of operand
-    {0x17, "//REF!"},    // Illegal or deleted cell reference
-    {0x1D, "//NAME?"},   // Wrong function or range name
-    {0x24, "//NUM!"},    // Value range overflow
-    {0x2A, "//N/A"}      // Argument or function not available
+    {0x00, "#NULL!"},   // Intersection of two cell ranges is empty
+    {0x07, "#DIV/0!"},  // Division by zero
+    {0x0F, "#VALUE!"},  // Wrong type of operand
+    {0x17, "#REF!"},    // Illegal or deleted cell reference
+    {0x1D, "#NAME?"},   // Wrong function or range name
+    {0x24, "#NUM!"},    // Value range overflow
+    {0x2A, "#N/A"}      // Argument or function not available
 };
 
 const int BIFF_FIRST_UNICODE = 80;
@@ -401,7 +401,8 @@ unpack_unicode_update_pos(std::vector<uint8_t> data, int pos, int lenlen=2, int
     else {
         // Note: this is COMPRESSED (not ASCII!) encoding!!!
         // strg = unicode(data[pos:pos+nchars], "latin_1")
-        strg = std::string((char*)&utils::slice(data, pos, pos+nchars)[0]);
+        auto raw = utils::slice(data, pos, pos+nchars);
+        strg = std::string(raw.begin(), raw.end());
         pos += nchars;
     }
     if (richtext) {
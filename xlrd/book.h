@@ -27,6 +27,9 @@ empty_cell = sheet.empty_cell # for exposure to the world ...
 #include "./sheet.h"
 #include "./compdoc.h"
 #include "./formula.h"  // __all__
+#include "./formula_ast.h"
+#include "./formula_cache.h"
+#include "./formula_refs.h"
 
 #include <string>
 #include <vector>
@@ -136,6 +139,12 @@ public:
     // A Unicode string. If builtin, decoded as per OOo docs.
     std::string name;  // = "";
 
+    ////
+    // The sheet fields of the NAME record; names_epilogue() derives scope
+    // from them.
+    int extn_sheet_num = 0;
+    int excel_sheet_index = 0;
+
     ////
     // An 8-bit string.
     std::vector<uint8_t> raw_formula;
@@ -261,6 +270,15 @@ public:
     // <br />  -- New in version 0.6.0
     std::vector<Name> name_obj_list;
 
+    ////
+    // Storage for formulas decompiled with formula::decompile_formula_ast().
+    // Shared by all the book's formulas.
+    formula::FormulaArena formula_arena;
+
+    ////
+    // Formula text templates, for formulas that are only wanted as text.
+    formula::FormulaTextCache formula_text_cache;
+
     ////
     // An integer denoting the character set used for strings in this file.
     // For BIFF 8 and later, this will be 1200, meaning Unicode; more precisely, UTF_16_LE.
@@ -287,67 +305,8 @@ public:
     // What (if anything) is recorded as the name of the last user to save the file.
     std::string user_name;  // = UNICODE_LITERAL('')
 
-    ////
-    // A list of Font class instances, each corresponding to a FONT record.
-    // <br /> -- New in version 0.6.1
-    std::vector<utils::any> font_list; // = []
-
-    ////
-    // A list of XF class instances, each corresponding to an XF record.
-    // <br /> -- New in version 0.6.1
-    std::vector<utils::any> xf_list;  // = []
-
-    ////
-    // A list of Format objects, each corresponding to a FORMAT record, in
-    // the order that they appear in the input file.
-    // It does <i>not</i> contain builtin formats.
-    // If you are creating an output file using (for example) pyExcelerator,
-    // use this list.
-    // The collection to be used for all visual rendering purposes is format_map.
-    // <br /> -- New in version 0.6.1
-    std::vector<utils::any> format_list;  // = []
-
-    ////
-    // The mapping from XF.format_key to Format object.
-    // <br /> -- New in version 0.6.1
-    std::map<int, utils::any> format_map;  // = {}
-
-    ////
-    // This provides access via name to the extended format information for
-    // both built-in styles and user-defined styles.<br />
-    // It maps <i>name</i> to (<i>built_in</i>, <i>xf_index</i>), where:<br />
-    // <i>name</i> is either the name of a user-defined style,
-    // or the name of one of the built-in styles. Known built-in names are
-    // Normal, RowLevel_1 to RowLevel_7,
-    // ColLevel_1 to ColLevel_7, Comma, Currency, Percent, "Comma [0]",
-    // "Currency [0]", Hyperlink, and "Followed Hyperlink".<br />
-    // <i>built_in</i> 1 = built-in style, 0 = user-defined<br />
-    // <i>xf_index</i> is an index into Book.xf_list.<br />
-    // References: OOo docs s6.99 (STYLE record); Excel UI Format/Style
-    // <br /> -- New in version 0.6.1; since 0.7.4, extracted only if
-    // open_workbook(..., formatting_info=True)
-    std::map<std::string, utils::any> style_name_map;  /// = {}
-
-    ////
-    // This provides definitions for colour indexes. Please refer to the
-    // above section "The Palette; Colour Indexes" for an explanation
-    // of how colours are represented in Excel.<br />
-    // Colour indexes into the palette map into (red, green, blue) tuples.
-    // "Magic" indexes e.g. 0x7FFF map to None.
-    // <i>colour_map</i> is what you need if you want to render cells on screen or in a PDF
-    // file. If you are writing an output XLS file, use <i>palette_record</i>.
-    // <br /> -- New in version 0.6.1. Extracted only if open_workbook(..., formatting_info=True)
-    std::map<int, utils::any> colour_map;  // = {}
-
-    ////
-    // If the user has changed any of the colours in the standard palette, the XLS
-    // file will contain a PALETTE record with 56 (16 for Excel 4.0 and earlier)
-    // RGB values in it, and this list will be e.g. [(r0, b0, g0), ..., (r55, b55, g55)].
-    // Otherwise this list will be empty. This is what you need if you are
-    // writing an output XLS file. If you want to render cells on screen or in a PDF
-    // file, use colour_map.
-    // <br /> -- New in version 0.6.1. Extracted only if open_workbook(..., formatting_info=True)
-    std::vector<utils::any> palette_record;  // = []
+    // font_list, xf_list, format_list, format_map, style_name_map,
+    // colour_map and palette_record: see formatting::FormattingDelegate
 
     ////
     // Time in seconds to extract the XLS image as a contiguous string (or mmap equivalent).
@@ -402,16 +361,11 @@ public:
     void release_resources();
     
     ////
-    // A mapping from (lower_case_name, scope) to a single Name object.
+    // Index of name_obj_list by (lower_case_name, scope); it replaces the
+    // name_and_scope_map and name_map dicts. See name_and_scope() and
+    // names_named(). Built by make_name_access_maps().
     // <br />  -- New in version 0.6.0
-    std::map<std::string, utils::any> name_and_scope_map;
-
-    ////
-    // A mapping from lower_case_name to a list of Name objects. The list is
-    // sorted in scope order. Typically there will be one item (of global scope)
-    // in the list.
-    // <br />  -- New in version 0.6.0
-    std::map<std::string, Name> name_map; // = {}
+    formula::NameIndex name_lookup;
 
     int logfile = 0;
     int verbosity = 0;
@@ -420,7 +374,6 @@ public:
     int formatting_info = 0;
     int on_demand = 0;
     int ragged_rows = 0;
-    std::map<int, int> _xf_index_to_xl_type_map;
     int base;
     int _position;
     std::vector<uint8_t> filestr;
@@ -562,6 +515,16 @@ public:
 
     void handle_builtinfmtcount(std::vector<uint8_t>& data);
 
+    ////
+    // Sheets classify number cells through the table xf_epilogue builds.
+    const std::vector<uint8_t>* xf_index_to_xl_type_map() const override {
+        return &this->formatting::FormattingDelegate::_xf_index_to_xl_type_map;
+    }
+
+    int get_biff_version() override {
+        return this->biff_version;
+    }
+
     virtual
     std::string derive_encoding() {
         if (!this->encoding_override.empty()) {
@@ -612,6 +575,8 @@ public:
             this->user_name = strg;
             this->raw_user_name = "";
         }
+        // FONT and STYLE names are decoded through the delegate's copy
+        this->formatting::FormattingDelegate::encoding = this->encoding;
         return this->encoding;
     }
 
@@ -643,6 +608,7 @@ public:
         }
         assert(datemode==0 or datemode==1);
         this->datemode = datemode;
+        this->sheet::SheetOwnerInterface::datemode = datemode;
     }
 
     inline void
@@ -801,80 +767,6 @@ public:
                 footer="-------------------",
                 )
 
-    def names_epilogue(self):
-        blah = self.verbosity >= 2
-        f = self.logfile
-        if blah:
-            print("+++++ names_epilogue +++++", file=f)
-            print("_all_sheets_map", REPR(self._all_sheets_map), file=f)
-            print("_extnsht_name_from_num", REPR(self._extnsht_name_from_num), file=f)
-            print("_sheet_num_from_name", REPR(self._sheet_num_from_name), file=f)
-        num_names = len(self.name_obj_list)
-        for namex in range(num_names):
-            nobj = self.name_obj_list[namex]
-            // Convert from excel_sheet_index to scope.
-            // This is done here because in BIFF7 and earlier, the
-            // BOUNDSHEET records (from which _all_sheets_map is derived)
-            // come after the NAME records.
-            if self.biff_version >= 80:
-                sheet_index = nobj.excel_sheet_index
-                if sheet_index == 0:
-                    intl_sheet_index = -1 // global
-                elif 1 <= sheet_index <= len(self._all_sheets_map):
-                    intl_sheet_index = self._all_sheets_map[sheet_index-1]
-                    if intl_sheet_index == -1: // maps to a macro or VBA sheet
-                        intl_sheet_index = -2 // valid sheet reference but not useful
-                else:
-                    // huh?
-                    intl_sheet_index = -3 // invalid
-            elif 50 <= self.biff_version <= 70:
-                sheet_index = nobj.extn_sheet_num
-                if sheet_index == 0:
-                    intl_sheet_index = -1 // global
-                else:
-                    sheet_name = self._extnsht_name_from_num[sheet_index]
-                    intl_sheet_index = self._sheet_num_from_name.get(sheet_name, -2)
-            nobj.scope = intl_sheet_index
-
-        for namex in range(num_names):
-            nobj = self.name_obj_list[namex]
-            // Parse the formula ...
-            if nobj.macro or nobj.binary: continue
-            if nobj.evaluated: continue
-            evaluate_name_formula(self, nobj, namex, blah=blah)
-
-        if self.verbosity >= 2:
-            print("---------- name object dump ----------", file=f)
-            for namex in range(num_names):
-                nobj = self.name_obj_list[namex]
-                nobj.dump(f, header="--- name[%d] ---" % namex)
-            print("--------------------------------------", file=f)
-        //
-        // Build some dicts for access to the name objects
-        //
-        name_and_scope_map = {} // (name.lower(), scope): Name_object
-        name_map = {}           // name.lower() : list of Name_objects (sorted in scope order)
-        for namex in range(num_names):
-            nobj = self.name_obj_list[namex]
-            name_lcase = nobj.name.lower()
-            key = (name_lcase, nobj.scope)
-            if key in name_and_scope_map and self.verbosity:
-                fprintf(f, 'Duplicate entry %r in name_and_scope_map\n', key)
-            name_and_scope_map[key] = nobj
-            sort_data = (nobj.scope, namex, nobj)
-            // namex (a temp unique ID) ensures the Name objects will not
-            // be compared (fatal in py3)
-            if name_lcase in name_map:
-                name_map[name_lcase].append(sort_data)
-            else:
-                name_map[name_lcase] = [sort_data]
-        for key in name_map.keys():
-            alist = name_map[key]
-            alist.sort()
-            name_map[key] = [x[2] for x in alist]
-        self.name_and_scope_map = name_and_scope_map
-        self.name_map = name_map
-
     def handle_obj(self, data):
         // Not doing much handling at all.
         // Worrying about embedded (BOF ... EOF) substreams is done elsewhere.
@@ -995,16 +887,104 @@ public:
         self.user_name = strg
 */
 
+    ////
+    // The Name object with the given name (in any case) and scope,
+    // or nullptr.
+    inline
+    Name* name_and_scope(const std::string& name, int scope) {
+        int namex = this->name_lookup.find(name, scope);
+        return namex < 0 ? nullptr : &this->name_obj_list[namex];
+    }
+
+    ////
+    // The Name objects with the given name (in any case), in scope order.
+    // Typically there will be one (of global scope).
+    inline
+    std::vector<Name*> names_named(const std::string& name) {
+        std::vector<Name*> res;
+        auto range = this->name_lookup.find_all(name);
+        for (const int* p = range.first; p != range.second; ++p) {
+            res.push_back(&this->name_obj_list[*p]);
+        }
+        return res;
+    }
+
+    inline
+    void make_name_access_maps() {
+        size_t duplicates = this->name_lookup.build(this->name_obj_list);
+        if (duplicates && this->verbosity) {
+            pprint("%d duplicate entries in name_and_scope_map", (int)duplicates);
+        }
+    }
+
+    inline
+    void names_epilogue() {
+        int blah = this->verbosity >= 2;
+        int num_names = this->name_obj_list.size();
+        for (int namex = 0; namex < num_names; ++namex) {
+            Name& nobj = this->name_obj_list[namex];
+            // Convert from excel_sheet_index to scope.
+            // This is done here because in BIFF7 and earlier, the
+            // BOUNDSHEET records (from which _all_sheets_map is derived)
+            // come after the NAME records.
+            int intl_sheet_index = -3; // invalid
+            if (this->biff_version >= 80) {
+                int sheet_index = nobj.excel_sheet_index;
+                if (sheet_index == 0) {
+                    intl_sheet_index = -1; // global
+                } else if (1 <= sheet_index &&
+                           sheet_index <= (int)this->_all_sheets_map.size()) {
+                    intl_sheet_index = this->_all_sheets_map[sheet_index-1];
+                    if (intl_sheet_index == -1) { // maps to a macro or VBA sheet
+                        intl_sheet_index = -2; // valid sheet reference but not useful
+                    }
+                }
+            } else if (50 <= this->biff_version && this->biff_version <= 70) {
+                int sheet_index = nobj.extn_sheet_num;
+                if (sheet_index == 0) {
+                    intl_sheet_index = -1; // global
+                } else {
+                    const auto& sheet_name = this->_extnsht_name_from_num.at(sheet_index);
+                    auto it = this->_sheet_num_from_name.find(sheet_name);
+                    intl_sheet_index = it == this->_sheet_num_from_name.end()
+                                     ? -2 : it->second;
+                }
+            }
+            nobj.scope = intl_sheet_index;
+        }
+
+        // Parse the formulas, each after the names it refers to, so that
+        // every name is evaluated once and without recursion.
+        for (int namex : formula::name_evaluation_order(this, num_names)) {
+            Name& nobj = this->name_obj_list[namex];
+            if (nobj.macro or nobj.binary) continue;
+            if (nobj.evaluated) continue;
+            formula::evaluate_name_formula(this, &nobj, namex, blah);
+        }
+        //
+        // Build the index for access to the name objects
+        //
+        this->make_name_access_maps();
+    }
+
     inline
     void xf_epilogue() {
         formatting::xf_epilogue(this);
     }
 
+    inline
+    void palette_epilogue() {
+        formatting::palette_epilogue(this);
+    }
+
     inline
     void parse_globals()
     {
         // DEBUG = 0
         // no need to position, just start reading (after the BOF)
+        // the formatting handlers read the delegate's copies of these
+        this->formatting::FormattingDelegate::formatting_info = this->formatting_info;
+        this->formatting::FormattingDelegate::verbosity = this->verbosity;
         formatting::initialise_book(this);
         while (1) {
             int rc, length;
@@ -1016,11 +996,11 @@ public:
             if (rc == biffh::XL_SST) {
                 this->handle_sst(data);
             } else if (rc == biffh::XL_FONT || rc == biffh::XL_FONT_B3B4) {
-                this->handle_font(data);
+                formatting::handle_font(this, data);
             } else if (rc == biffh::XL_FORMAT) { // biffh::XL_FORMAT2 is BIFF <= 3.0, can't appear in globals
                 this->handle_format(data);
             } else if (rc == biffh::XL_XF) {
-                this->handle_xf(data);
+                formatting::handle_xf(this, data);
             } else if (rc ==  biffh::XL_BOUNDSHEET) {
                 this->handle_boundsheet(data);
             } else if (rc == biffh::XL_DATEMODE) {
@@ -1046,9 +1026,9 @@ public:
             } else if (rc == biffh::XL_NAME) {
                 this->handle_name(data);
             } else if (rc == biffh::XL_PALETTE) {
-                this->handle_palette(data);
+                formatting::handle_palette(this, data);
             } else if (rc == biffh::XL_STYLE) {
-                this->handle_style(data);
+                formatting::handle_style(this, data);
             } else if ((rc & 0xff) == 9 && this->verbosity) {
                 pprint(
                     "*** Unexpected BOF at posn %d: 0x%04x len=%d data=%s\n",
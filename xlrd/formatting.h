@@ -12,9 +12,16 @@
 
 // No part of the content of this file was derived from the works of David Giffin.
 
+#include <algorithm>
 #include <vector>
 #include <array>
+#include <cstring>
 #include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <mutex>
+#include <unordered_map>
 
 #include "./biffh.h"
 // unpack_unicode, unpack_string,
@@ -114,6 +121,156 @@ default_palette = {
     {20, excel_default_palette_b2},
 };
 
+// === Dense palette ===
+
+////
+// A colour as 0xRRGGBBAA. Colours from the file are opaque (AA == 0xFF),
+// which leaves the transparent values free for the two sentinels below.
+using rgba = uint32_t;
+
+////
+// A "magic" system colour (0x40, 0x41, 0x51, 0x7FFF, ...): the RGB value is
+// not known. These map to None in the Python colour_map.
+const rgba RGBA_SYSTEM = 0x00000000;
+////
+// A colour index the palette does not define at all.
+const rgba RGBA_UNDEFINED = 0x00000001;
+
+inline rgba
+pack_rgba(const color& c) {
+    return (rgba(c[0]) << 24) | (rgba(c[1]) << 16) | (rgba(c[2]) << 8) | 0xFF;
+}
+
+inline color
+unpack_rgb(rgba c) {
+    return color{{uint8_t(c >> 24), uint8_t(c >> 16), uint8_t(c >> 8)}};
+}
+
+////
+// The colour_map as a flat array indexed by colour index.
+// <p>Every colour index that occurs in a file is below 0x80 except the
+// system window text colour 0x7FFF, which is folded onto the SYSTEM sentinel.</p>
+// <p>nearest() answers the same question as nearest_colour_index with a
+// precomputed grid: the RGB cube is cut into 16x16x16 cells and each cell
+// lists the only palette entries that can be nearest to a point in it,
+// so a lookup compares against one to three colours instead of all 64.
+// The grid is built on the first nearest() after the palette changes;
+// not thread-safe while that happens.</p>
+class Palette
+{
+public:
+    static const int SIZE = 0x80;
+
+    Palette() {
+        this->clear();
+    }
+
+    void clear() {
+        _entries.fill(RGBA_UNDEFINED);
+        _grid_valid = false;
+    }
+
+    rgba operator[](int colour_index) const {
+        if (0 <= colour_index && colour_index < SIZE) {
+            return _entries[colour_index];
+        }
+        return colour_index == 0x7FFF ? RGBA_SYSTEM : RGBA_UNDEFINED;
+    }
+
+    bool is_defined(int colour_index) const {
+        return (*this)[colour_index] != RGBA_UNDEFINED;
+    }
+
+    void set(int colour_index, rgba value) {
+        if (0 <= colour_index && colour_index < SIZE) {
+            _entries[colour_index] = value;
+            _grid_valid = false;
+        }
+    }
+
+    ////
+    // The colour index whose RGB is nearest (Euclidean distance) to rgb,
+    // ignoring system colours; the lowest index wins ties.
+    int nearest(const color& rgb) const {
+        if (!_grid_valid) {
+            this->_build_grid();
+        }
+        int cell = _cell_of(rgb[0]) * 256 + _cell_of(rgb[1]) * 16 + _cell_of(rgb[2]);
+        int best_metric = 3 * 256 * 256;
+        int best_colourx = 0;
+        for (uint32_t i = _cell_begin[cell]; i < _cell_begin[cell + 1]; ++i) {
+            int colourx = _candidates[i];
+            int metric = _metric(_entries[colourx], rgb);
+            if (metric < best_metric) {
+                best_metric = metric;
+                best_colourx = colourx;
+            }
+        }
+        return best_colourx;
+    }
+
+private:
+    std::array<rgba, SIZE> _entries;
+    mutable bool _grid_valid;
+    mutable std::vector<uint32_t> _cell_begin;  // 4096 + 1 offsets into _candidates
+    mutable std::vector<uint8_t> _candidates;   // colour indexes, ascending per cell
+
+    static int _cell_of(int v) { return v >> 4; }
+
+    static int _metric(rgba c, const color& rgb) {
+        int dr = int(c >> 24) - rgb[0];
+        int dg = int((c >> 16) & 0xFF) - rgb[1];
+        int db = int((c >> 8) & 0xFF) - rgb[2];
+        return dr * dr + dg * dg + db * db;
+    }
+
+    // Squared distance from v to the nearest / farthest point of [lo, hi].
+    static int _axis_min(int v, int lo, int hi) {
+        int d = v < lo ? lo - v : v > hi ? v - hi : 0;
+        return d * d;
+    }
+    static int _axis_max(int v, int lo, int hi) {
+        int d = std::max(v - lo, hi - v);
+        return d * d;
+    }
+
+    void _build_grid() const {
+        std::vector<int> real;
+        for (int cx = 0; cx < SIZE; ++cx) {
+            if (_entries[cx] & 0xFF) {  // opaque: not a sentinel
+                real.push_back(cx);
+            }
+        }
+        _cell_begin.assign(16 * 16 * 16 + 1, 0);
+        _candidates.clear();
+        std::vector<int> dmin(real.size());
+        for (int cell = 0; cell < 16 * 16 * 16; ++cell) {
+            _cell_begin[cell] = uint32_t(_candidates.size());
+            int lo[3] = {(cell >> 8) * 16, ((cell >> 4) & 15) * 16, (cell & 15) * 16};
+            // An entry can only win in this cell if its nearest possible
+            // distance beats the best farthest distance of any entry.
+            int bound = 3 * 256 * 256;
+            for (size_t k = 0; k < real.size(); ++k) {
+                color c = unpack_rgb(_entries[real[k]]);
+                int near = 0, far = 0;
+                for (int ch = 0; ch < 3; ++ch) {
+                    near += _axis_min(c[ch], lo[ch], lo[ch] + 15);
+                    far += _axis_max(c[ch], lo[ch], lo[ch] + 15);
+                }
+                dmin[k] = near;
+                bound = std::min(bound, far);
+            }
+            for (size_t k = 0; k < real.size(); ++k) {
+                if (dmin[k] <= bound) {
+                    _candidates.push_back(uint8_t(real[k]));
+                }
+            }
+        }
+        _cell_begin[16 * 16 * 16] = uint32_t(_candidates.size());
+        _grid_valid = true;
+    }
+};
+
 /*"""
 00H = Normal
 01H = RowLevel_lv (see next field)
@@ -273,20 +430,204 @@ public:
     // No methods ...
 };
 
+// === Packed XF / Font tables ===
+
+////
+// All the attributes of an XF record -- including those of its XFAlignment,
+// XFBorder, XFBackground and XFProtection -- in 22 bytes, without pointers.
+// Field meanings are as documented on those classes.
+// Instances are compared and hashed byte-wise, so always value-initialise
+// (<code>PackedXF x = PackedXF();</code>).
+struct PackedXF
+{
+    uint16_t font_index;
+    uint16_t format_key;
+    uint16_t parent_style_index;
+    uint8_t rotation;
+    uint8_t fill_pattern;
+    uint8_t top_colour_index;
+    uint8_t bottom_colour_index;
+    uint8_t left_colour_index;
+    uint8_t right_colour_index;
+    uint8_t diag_colour_index;
+    uint8_t pattern_colour_index;
+    uint8_t background_colour_index;
+    uint8_t top_line_style: 4, bottom_line_style: 4;
+    uint8_t left_line_style: 4, right_line_style: 4;
+    uint8_t diag_line_style: 4, diag_down: 1, diag_up: 1, text_direction: 2;
+    uint8_t hor_align: 3, vert_align: 3, text_wrapped: 1, shrink_to_fit: 1;
+    uint8_t indent_level: 4, cell_locked: 1, formula_hidden: 1, is_style: 1, lotus_123_prefix: 1;
+    uint8_t _format_flag: 1, _font_flag: 1, _alignment_flag: 1, _border_flag: 1,
+            _background_flag: 1, _protection_flag: 1, _unused: 2;
+    uint8_t _pad;
+};
+
+////
+// A Font without its name, which lives in FormattingDelegate.font_names[name_id].
+struct PackedFont
+{
+    uint16_t height;
+    uint16_t colour_index;
+    uint16_t weight;
+    uint16_t name_id;
+    uint8_t escapement;
+    uint8_t underline_type;
+    uint8_t family;
+    uint8_t character_set;
+    uint8_t bold: 1, italic: 1, underlined: 1, struck_out: 1, outline: 1, shadow: 1, _unused: 2;
+    uint8_t _pad;
+};
+
+static_assert(sizeof(PackedXF) == 22, "PackedXF must have no padding");
+static_assert(sizeof(PackedFont) == 14, "PackedFont must have no padding");
+
+// Byte-wise hash and equality for the padding-free structs above.
+template<class T>
+struct _PodHash
+{
+    size_t operator()(const T& v) const {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(&v);
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < sizeof(T); ++i) {
+            h = (h ^ p[i]) * 1099511628211ULL;
+        }
+        return size_t(h);
+    }
+};
+
+template<class T>
+struct _PodEqual
+{
+    bool operator()(const T& a, const T& b) const {
+        return std::memcmp(&a, &b, sizeof(T)) == 0;
+    }
+};
+
+////
+// Where a deferred FONT/XF/STYLE/PALETTE record body sits in
+// FormattingDelegate._formatting_records.
+struct FormattingRecordRef
+{
+    int pos;
+    int length;
+};
+
 class FormattingDelegate
 {
 public:
     int _xf_epilogue_done;
+
+    ////
+    // A list of XF class instances, each corresponding to an XF record.
+    // <br />With lazy_formatting_info, only xf_index and format_key are
+    // filled in until the entry is fetched with xf_at().
+    // <br /> -- New in version 0.6.1
     std::vector<Format> xf_list;
     int verbosity;
+
+    ////
+    // The mapping from XF.format_key to Format object.
+    // <br /> -- New in version 0.6.1
     MAP<int, Format> format_map;
-    MAP<int, int> _xf_index_to_xl_type_map;
+
+    ////
+    // A list of Format objects, each corresponding to a FORMAT record, in
+    // the order that they appear in the input file.
+    // It does <i>not</i> contain builtin formats.
+    // The collection to be used for all visual rendering purposes is format_map.
+    // <br /> -- New in version 0.6.1
+    std::vector<Format> format_list;
+
+    // XL_CELL_NUMBER/XL_CELL_DATE/... indexed by xf_index, built by xf_epilogue
+    std::vector<uint8_t> _xf_index_to_xl_type_map;
     int formatting_info;
+
+    ////
+    // With formatting_info, keep the FONT, XF, STYLE and PALETTE records
+    // undecoded while parsing the globals and decode each one the first time
+    // it is asked for: see font_at(), xf_at(), get_style_name_map() and
+    // get_colour_map(). The XF -> cell type table is still built eagerly.
+    int lazy_formatting_info = 0;
     int biff_version;
+
+    ////
+    // This provides definitions for colour indexes. Please refer to the
+    // above section "The Palette; Colour Indexes" for an explanation
+    // of how colours are represented in Excel.<br />
+    // Colour indexes into the palette map into (red, green, blue) tuples.
+    // "Magic" indexes e.g. 0x7FFF map to nullcolor.
+    // <br />With lazy_formatting_info, use get_colour_map().
+    // <br /> -- New in version 0.6.1. Extracted only if open_workbook(..., formatting_info=True)
     MAP<int, color> colour_map;
+
+    ////
+    // colour_map as a dense array of packed RGBA, with the magic indexes
+    // set to RGBA_SYSTEM; what renderers should use.
+    // <br />With lazy_formatting_info, use get_palette().
+    Palette palette;
+
+    ////
+    // If the user has changed any of the colours in the standard palette, the XLS
+    // file will contain a PALETTE record with 56 (16 for Excel 4.0 and earlier)
+    // RGB values in it, and this list will be e.g. [(r0, b0, g0), ..., (r55, b55, g55)].
+    // Otherwise this list will be empty.
+    // <br /> -- New in version 0.6.1. Extracted only if open_workbook(..., formatting_info=True)
+    std::vector<color> palette_record;
+
+    ////
+    // Maps the name of a built-in or user-defined style to
+    // (<i>built_in</i>, <i>xf_index</i>); <i>built_in</i> 1 = built-in style,
+    // 0 = user-defined, <i>xf_index</i> is an index into Book.xf_list.
+    // <br />With lazy_formatting_info, use get_style_name_map().
+    // <br /> -- New in version 0.6.1; since 0.7.4, extracted only if
+    // open_workbook(..., formatting_info=True)
+    std::map<std::string, std::pair<int, int>> style_name_map;
+
     MAP<int, int> colour_indexes_used;
+
+    ////
+    // A list of Font class instances, each corresponding to a FONT record.
+    // <br />With lazy_formatting_info, use font_at().
+    // <br /> -- New in version 0.6.1
     vector<Font> font_list;
     std::string encoding;
+
+    // lazy_formatting_info: the deferred record bodies, back to back
+    std::vector<uint8_t> _formatting_records;
+    // indexed like font_list / xf_list
+    std::vector<FormattingRecordRef> _font_refs;
+    std::vector<uint8_t> _font_decoded;
+    std::vector<FormattingRecordRef> _xf_refs;
+    std::vector<uint8_t> _xf_decoded;
+    // decoded as a whole by get_style_name_map() / get_colour_map()
+    std::vector<FormattingRecordRef> _style_refs;
+    std::vector<FormattingRecordRef> _palette_refs;
+
+    ////
+    // One entry per distinct XF record, in order of first appearance.
+    // Built with formatting_info; with lazy_formatting_info, on the first
+    // packed_xf() or packed_font() call. A few dozen entries typically
+    // stand for thousands of XF records.
+    std::vector<PackedXF> xf_table;
+    ////
+    // xf_index -> index into xf_table. Cells whose XFs share a canonical id
+    // look the same, so renderers can group by it. Two XFs that differ only
+    // in pointing at identical FONT records share an id.
+    std::vector<uint16_t> xf_canonical;
+    ////
+    // One entry per distinct FONT record; see xf_table.
+    std::vector<PackedFont> font_table;
+    ////
+    // font_index -> index into font_table.
+    std::vector<uint16_t> font_canonical;
+    ////
+    // Distinct font names, indexed by PackedFont.name_id.
+    std::vector<std::string> font_names;
+
+    std::unordered_map<PackedXF, uint16_t, _PodHash<PackedXF>, _PodEqual<PackedXF>> _xf_intern;
+    // keyed by the raw FONT record, so each distinct font is decoded once
+    std::unordered_map<std::string, uint16_t> _font_intern;
+    std::unordered_map<std::string, uint16_t> _font_name_intern;
     
     virtual int get_biff_version() {
         throw std::logic_error("NotImplemented");
@@ -299,22 +640,38 @@ public:
     }
 };
 
+////
+// Cell type of a number (NUMBER, RK, MULRK, FORMULA) cell: XL_CELL_DATE if
+// its XF has a date format, else XL_CELL_NUMBER; a text format ("@") counts
+// as a number too, as in _cellty_from_fmtty.
+// xf_index_to_xl_type is Book._xf_index_to_xl_type_map; an XF index
+// that no XF record defined counts as a number.
+inline int
+xl_type_from_xf_index(const std::vector<uint8_t>& xf_index_to_xl_type, int xf_index) {
+    return (size_t)xf_index < xf_index_to_xl_type.size()
+        ? xf_index_to_xl_type[xf_index]
+        : (int)XL_CELL_NUMBER;
+}
+
 inline void
 initialise_colour_map(FormattingDelegate* book) {
     book->colour_map = {};
     book->colour_indexes_used = {};
+    book->palette.clear();
     if (!book->formatting_info) {
         return;
     }
     // Add the 8 invariant colours
     for (int i=0; i < 8; ++i) {
         book->colour_map[i] = excel_default_palette_b8.at(i);
+        book->palette.set(i, pack_rgba(excel_default_palette_b8.at(i)));
     }
     // Add the default palette depending on the version
     auto& dpal = default_palette.at(book->biff_version);
     int ndpal = dpal.size();
     for (int i=0; i < ndpal; ++i) {
         book->colour_map[i+8] = dpal.at(i);
+        book->palette.set(i+8, pack_rgba(dpal.at(i)));
     }
     // Add the specials -- None means the RGB value is not known
     // System window text colour for border lines
@@ -329,6 +686,10 @@ initialise_colour_map(FormattingDelegate* book) {
     //     book->colour_map[ci] = None
     book->colour_map[0x51] = nullcolor; // System ToolTip text colour (used in note objects)
     book->colour_map[0x7FFF] = nullcolor; // 32767, system window text colour for fonts
+    book->palette.set(ndpal+8, RGBA_SYSTEM);
+    book->palette.set(ndpal+8+1, RGBA_SYSTEM);
+    book->palette.set(0x51, RGBA_SYSTEM);
+    // 0x7FFF is RGBA_SYSTEM by construction.
 }
 
 inline int
@@ -360,6 +721,12 @@ nearest_colour_index(const MAP<int, color>& colour_map, color rgb)
     return best_colourx;
 }
 
+inline int
+nearest_colour_index(const Palette& palette, color rgb)
+{
+    return palette.nearest(rgb);
+}
+
 /*
 ////
 // This mixin class exists solely so that Format, Font, and XF.... objects
@@ -380,28 +747,16 @@ handle_efont(FormattingDelegate* book, const vector<u8>& data) { // BIFF2 only
     book->font_list[-1].colour_index = utils::as_uint16(data, 0);
 }
 
+// Fill in f (whose font_index is already set) from a FONT record.
 inline void
-handle_font(FormattingDelegate* book,
-            const std::vector<uint8_t>& data)
+_decode_font(FormattingDelegate* book,
+             const std::vector<uint8_t>& data,
+             Font& f)
 {
-    if (not book->formatting_info)
-        return;
     if (book->encoding.empty())
         book->derive_encoding();
     int blah = DEBUG or book->verbosity >= 2;
     int bv = book->get_biff_version();
-    int k = book->font_list.size();
-    Font f;
-    if (k == 4) {
-        // f = Font();
-        f.name = "Dummy Font";
-        f.font_index = k;
-        book->font_list.push_back(f);
-        k += 1;
-    }
-    f = Font();
-    f.font_index = k;
-    book->font_list.push_back(f);
     if (bv >= 50) {
         // (
         //     f.height, option_flags, f.colour_index, f.weight,
@@ -470,6 +825,598 @@ handle_font(FormattingDelegate* book,
     }
 }
 
+inline FormattingRecordRef
+_defer_record(FormattingDelegate* book, const std::vector<uint8_t>& data)
+{
+    FormattingRecordRef ref = {int(book->_formatting_records.size()), int(data.size())};
+    book->_formatting_records.insert(book->_formatting_records.end(), data.begin(), data.end());
+    return ref;
+}
+
+inline std::vector<uint8_t>
+_deferred_record(const FormattingDelegate* book, const FormattingRecordRef& ref)
+{
+    auto first = book->_formatting_records.begin() + ref.pos;
+    return std::vector<uint8_t>(first, first + ref.length);
+}
+
+inline uint16_t
+_intern_font_name(FormattingDelegate* book, const std::string& name)
+{
+    auto ins = book->_font_name_intern.emplace(name, uint16_t(book->font_names.size()));
+    if (ins.second) {
+        book->font_names.push_back(name);
+    }
+    return ins.first->second;
+}
+
+// Give font_list[font_canonical.size()] its canonical id.
+// key is the raw FONT record ("" for the dummy font 4), decoded the font.
+inline void
+_intern_font(FormattingDelegate* book, const std::string& key, const Font* decoded)
+{
+    auto it = book->_font_intern.find(key);
+    if (it == book->_font_intern.end()) {
+        PackedFont pf = PackedFont();
+        pf.height = decoded->height;
+        pf.colour_index = decoded->colour_index;
+        pf.weight = decoded->weight;
+        pf.name_id = _intern_font_name(book, decoded->name);
+        pf.escapement = decoded->escapement;
+        pf.underline_type = decoded->underline_type;
+        pf.family = decoded->family;
+        pf.character_set = decoded->character_set;
+        pf.bold = decoded->bold;
+        pf.italic = decoded->italic;
+        pf.underlined = decoded->underlined;
+        pf.struck_out = decoded->struck_out;
+        pf.outline = decoded->outline;
+        pf.shadow = decoded->shadow;
+        it = book->_font_intern.emplace(key, uint16_t(book->font_table.size())).first;
+        book->font_table.push_back(pf);
+    }
+    book->font_canonical.push_back(it->second);
+}
+
+inline void
+handle_font(FormattingDelegate* book,
+            const std::vector<uint8_t>& data)
+{
+    if (not book->formatting_info)
+        return;
+    bool lazy = book->lazy_formatting_info;
+    int k = book->font_list.size();
+    if (k == 4) {
+        Font dummy;
+        dummy.name = "Dummy Font";
+        dummy.font_index = k;
+        book->font_list.push_back(dummy);
+        if (!lazy) {
+            _intern_font(book, "", &dummy);
+        } else {
+            book->_font_refs.push_back(FormattingRecordRef{0, 0});
+            book->_font_decoded.push_back(1);
+        }
+        k += 1;
+    }
+    book->font_list.push_back(Font());
+    Font& f = book->font_list.back();
+    f.font_index = k;
+    if (lazy) {
+        book->_font_refs.push_back(_defer_record(book, data));
+        book->_font_decoded.push_back(0);
+        return;
+    }
+    _decode_font(book, data, f);
+    _intern_font(book, std::string(data.begin(), data.end()), &f);
+}
+
+inline void _build_packed_tables(FormattingDelegate* book);
+inline void _check_font_colours(FormattingDelegate* book);
+
+////
+// The packed form of Book.font_list[font_index]; its name is
+// Book.font_names[packed_font(...).name_id].
+// With lazy_formatting_info, the first call builds the packed tables.
+EXPORT
+const PackedFont&
+packed_font(FormattingDelegate* book, int font_index)
+{
+    _build_packed_tables(book);
+    return book->font_table[book->font_canonical.at(font_index)];
+}
+
+////
+// Book.font_list[font_index], decoding its FONT record first if
+// lazy_formatting_info deferred it.
+EXPORT
+const Font&
+font_at(FormattingDelegate* book, int font_index)
+{
+    Font& f = book->font_list.at(font_index);
+    if (book->lazy_formatting_info && !book->_font_decoded.at(font_index)) {
+        _decode_font(book, _deferred_record(book, book->_font_refs[font_index]), f);
+        book->_font_decoded[font_index] = 1;
+    }
+    return f;
+}
+
+// The format key of an XF record, all that is needed to classify cells.
+inline int
+_xf_format_key(int bv, const std::vector<uint8_t>& data)
+{
+    if (bv >= 50) return as_uint16(data, 2);
+    if (bv >= 30) return as_uint8(data, 1);
+    return as_uint8(data, 2) & 0x3F;  // BIFF2: '<BxBB'
+}
+
+// Every attribute of an XF record, as in the handle_xf transcript below.
+inline PackedXF
+_decode_packed_xf(int bv, const std::vector<uint8_t>& data)
+{
+    static const uint8_t rotations[4] = {0, 255, 90, 180};
+    PackedXF x = PackedXF();
+    int reg;
+    if (bv >= 50) {
+        x.font_index = as_uint16(data, 0);
+        x.format_key = as_uint16(data, 2);
+        int pkd_type_par = as_uint16(data, 4);
+        x.cell_locked = pkd_type_par & 0x01;
+        x.formula_hidden = (pkd_type_par & 0x02) >> 1;
+        x.is_style = (pkd_type_par & 0x0004) >> 2;
+        x.lotus_123_prefix = (pkd_type_par & 0x0008) >> 3; // Meaning is not known.
+        x.parent_style_index = (pkd_type_par & 0xFFF0) >> 4;
+        int pkd_align1 = as_uint8(data, 6);
+        x.hor_align = pkd_align1 & 0x07;
+        x.text_wrapped = (pkd_align1 & 0x08) >> 3;
+        x.vert_align = (pkd_align1 & 0x70) >> 4;
+    }
+    if (bv >= 80) {
+        // '<HHHBBBBIiH'
+        x.rotation = as_uint8(data, 7);
+        int pkd_align2 = as_uint8(data, 8);
+        x.indent_level = pkd_align2 & 0x0f;
+        x.shrink_to_fit = (pkd_align2 & 0x10) >> 4;
+        x.text_direction = (pkd_align2 & 0xC0) >> 6;
+        reg = as_uint8(data, 9) >> 2;
+        uint32_t pkd_brdbkg1 = utils::as_uint32(data, 10);
+        uint32_t pkd_brdbkg2 = utils::as_uint32(data, 14);
+        int pkd_brdbkg3 = as_uint16(data, 18);
+        x.left_line_style    =  pkd_brdbkg1 & 0x0000000f;
+        x.right_line_style   = (pkd_brdbkg1 & 0x000000f0) >> 4;
+        x.top_line_style     = (pkd_brdbkg1 & 0x00000f00) >> 8;
+        x.bottom_line_style  = (pkd_brdbkg1 & 0x0000f000) >> 12;
+        x.left_colour_index  = (pkd_brdbkg1 & 0x007f0000) >> 16;
+        x.right_colour_index = (pkd_brdbkg1 & 0x3f800000) >> 23;
+        x.diag_down          = (pkd_brdbkg1 & 0x40000000) >> 30;
+        x.diag_up            = (pkd_brdbkg1 & 0x80000000) >> 31;
+        x.top_colour_index    =  pkd_brdbkg2 & 0x0000007F;
+        x.bottom_colour_index = (pkd_brdbkg2 & 0x00003F80) >> 7;
+        x.diag_colour_index   = (pkd_brdbkg2 & 0x001FC000) >> 14;
+        x.diag_line_style     = (pkd_brdbkg2 & 0x01E00000) >> 21;
+        x.fill_pattern        = (pkd_brdbkg2 & 0xFC000000) >> 26;
+        x.pattern_colour_index    =  pkd_brdbkg3 & 0x007F;
+        x.background_colour_index = (pkd_brdbkg3 & 0x3F80) >> 7;
+    } else if (bv >= 50) {
+        // '<HHHBBIi'
+        int pkd_orient_used = as_uint8(data, 7);
+        x.rotation = rotations[pkd_orient_used & 0x03];
+        reg = pkd_orient_used >> 2;
+        uint32_t pkd_brdbkg1 = utils::as_uint32(data, 8);
+        uint32_t pkd_brdbkg2 = utils::as_uint32(data, 12);
+        x.pattern_colour_index    =  pkd_brdbkg1 & 0x0000007F;
+        x.background_colour_index = (pkd_brdbkg1 & 0x00003F80) >> 7;
+        x.fill_pattern            = (pkd_brdbkg1 & 0x003F0000) >> 16;
+        x.bottom_line_style       = (pkd_brdbkg1 & 0x01C00000) >> 22;
+        x.bottom_colour_index     = (pkd_brdbkg1 & 0xFE000000) >> 25;
+        x.top_line_style     =  pkd_brdbkg2 & 0x00000007;
+        x.left_line_style    = (pkd_brdbkg2 & 0x00000038) >> 3;
+        x.right_line_style   = (pkd_brdbkg2 & 0x000001C0) >> 6;
+        x.top_colour_index   = (pkd_brdbkg2 & 0x0000FE00) >> 9;
+        x.left_colour_index  = (pkd_brdbkg2 & 0x007F0000) >> 16;
+        x.right_colour_index = (pkd_brdbkg2 & 0x3F800000) >> 23;
+    } else if (bv >= 30) {
+        x.font_index = as_uint8(data, 0);
+        x.format_key = as_uint8(data, 1);
+        if (bv >= 40) {
+            // '<BBHBBHI'
+            int pkd_type_par = as_uint16(data, 2);
+            x.cell_locked = pkd_type_par & 0x01;
+            x.formula_hidden = (pkd_type_par & 0x02) >> 1;
+            x.is_style = (pkd_type_par & 0x0004) >> 2;
+            x.lotus_123_prefix = (pkd_type_par & 0x0008) >> 3;
+            x.parent_style_index = (pkd_type_par & 0xFFF0) >> 4;
+            int pkd_align_orient = as_uint8(data, 4);
+            x.hor_align = pkd_align_orient & 0x07;
+            x.text_wrapped = (pkd_align_orient & 0x08) >> 3;
+            x.vert_align = (pkd_align_orient & 0x30) >> 4;
+            x.rotation = rotations[(pkd_align_orient & 0xC0) >> 6];
+            reg = as_uint8(data, 5) >> 2;
+        } else {
+            // '<BBBBHHI'
+            int pkd_type_prot = as_uint8(data, 2);
+            x.cell_locked = pkd_type_prot & 0x01;
+            x.formula_hidden = (pkd_type_prot & 0x02) >> 1;
+            x.is_style = (pkd_type_prot & 0x04) >> 2;
+            x.lotus_123_prefix = (pkd_type_prot & 0x08) >> 3;
+            reg = as_uint8(data, 3) >> 2;
+            int pkd_align_par = as_uint16(data, 4);
+            x.hor_align = pkd_align_par & 0x07;
+            x.text_wrapped = (pkd_align_par & 0x08) >> 3;
+            x.parent_style_index = (pkd_align_par & 0xFFF0) >> 4;
+            x.vert_align = 2; // bottom
+            x.rotation = 0;
+        }
+        int pkd_bkg_34 = as_uint16(data, 6);
+        uint32_t pkd_brd_34 = utils::as_uint32(data, 8);
+        x.fill_pattern            =  pkd_bkg_34 & 0x003F;
+        x.pattern_colour_index    = (pkd_bkg_34 & 0x07C0) >> 6;
+        x.background_colour_index = (pkd_bkg_34 & 0xF800) >> 11;
+        x.top_line_style      =  pkd_brd_34 & 0x00000007;
+        x.top_colour_index    = (pkd_brd_34 & 0x000000F8) >> 3;
+        x.left_line_style     = (pkd_brd_34 & 0x00000700) >> 8;
+        x.left_colour_index   = (pkd_brd_34 & 0x0000F800) >> 11;
+        x.bottom_line_style   = (pkd_brd_34 & 0x00070000) >> 16;
+        x.bottom_colour_index = (pkd_brd_34 & 0x00F80000) >> 19;
+        x.right_line_style    = (pkd_brd_34 & 0x07000000) >> 24;
+        x.right_colour_index  = (pkd_brd_34 & 0xF8000000) >> 27;
+    } else if (bv == 21) {
+        //////// Warning: incomplete treatment; formatting_info not fully supported.
+        // '<BxBB'
+        x.font_index = as_uint8(data, 0);
+        int format_etc = as_uint8(data, 2);
+        int halign_etc = as_uint8(data, 3);
+        x.format_key = format_etc & 0x3F;
+        x.cell_locked = (format_etc & 0x40) >> 6;
+        x.formula_hidden = (format_etc & 0x80) >> 7;
+        x.hor_align = halign_etc & 0x07;
+        // black thin line if the side's bit is set, else none
+        if (halign_etc & 0x08) { x.left_colour_index = 8; x.left_line_style = 1; }
+        if (halign_etc & 0x10) { x.right_colour_index = 8; x.right_line_style = 1; }
+        if (halign_etc & 0x20) { x.top_colour_index = 8; x.top_line_style = 1; }
+        if (halign_etc & 0x40) { x.bottom_colour_index = 8; x.bottom_line_style = 1; }
+        x.fill_pattern = (halign_etc & 0x80) ? 17 : 0;
+        x.background_colour_index = 9; // white
+        x.pattern_colour_index = 8; // black
+        x.parent_style_index = 0; // ???????????
+        x.vert_align = 2; // bottom
+        x.rotation = 0;
+        reg = 0x3F;
+    } else {
+        throw biffh::XLRDError(std::string("programmer stuff-up: bv=") + std::to_string(bv));
+    }
+    // "format font alignment border background protection"
+    x._format_flag     = reg & 1;
+    x._font_flag       = (reg >> 1) & 1;
+    x._alignment_flag  = (reg >> 2) & 1;
+    x._border_flag     = (reg >> 3) & 1;
+    x._background_flag = (reg >> 4) & 1;
+    x._protection_flag = (reg >> 5) & 1;
+    return x;
+}
+
+// Fill in the attributes that xf_list entries carry.
+inline void
+_unpack_xf(const PackedXF& x, Format& xf)
+{
+    xf.font_index = x.font_index;
+    xf.format_key = x.format_key;
+    xf.is_style = x.is_style;
+    xf.parent_style_index = x.parent_style_index;
+    xf._format_flag = x._format_flag;
+    xf._font_flag = x._font_flag;
+    xf._alignment_flag = x._alignment_flag;
+    xf._border_flag = x._border_flag;
+    xf._background_flag = x._background_flag;
+    xf._protection_flag = x._protection_flag;
+}
+
+inline void
+_intern_xf(FormattingDelegate* book, const PackedXF& x)
+{
+    // XFs pointing at identical fonts are the same XF
+    PackedXF key = x;
+    if (key.font_index < book->font_canonical.size()) {
+        key.font_index = book->font_canonical[key.font_index];
+    }
+    auto ins = book->_xf_intern.emplace(key, uint16_t(book->xf_table.size()));
+    if (ins.second) {
+        book->xf_table.push_back(x);
+    }
+    book->xf_canonical.push_back(ins.first->second);
+}
+
+inline void
+handle_xf(FormattingDelegate* book,
+          const std::vector<uint8_t>& data)
+{
+    int bv = book->get_biff_version();
+    book->xf_list.push_back(Format());
+    Format& xf = book->xf_list.back();
+    xf.xf_index = int(book->xf_list.size()) - 1;
+    if (!book->formatting_info || book->lazy_formatting_info) {
+        // xf_epilogue only needs the format key
+        xf.format_key = _xf_format_key(bv, data);
+        xf.font_index = xf.is_style = xf.parent_style_index = 0;
+        xf._format_flag = xf._font_flag = xf._alignment_flag = 0;
+        xf._border_flag = xf._background_flag = xf._protection_flag = 0;
+        if (book->formatting_info) {
+            book->_xf_refs.push_back(_defer_record(book, data));
+            book->_xf_decoded.push_back(0);
+        }
+        return;
+    }
+    PackedXF packed = _decode_packed_xf(bv, data);
+    _intern_xf(book, packed);
+    _unpack_xf(packed, xf);
+}
+
+// Fills in the deferred xf_list[xf_index] from its packed form.
+inline void
+_unpack_deferred_xf(FormattingDelegate* book, int xf_index, const PackedXF& packed)
+{
+    Format& xf = book->xf_list[xf_index];
+    int format_key = xf.format_key;
+    _unpack_xf(packed, xf);
+    // keep the key xf_epilogue classified the cell type by
+    xf.format_key = format_key;
+    if (!(0 <= xf.parent_style_index && xf.parent_style_index < int(book->xf_list.size()))) {
+        // xf_epilogue makes it conform when decoding eagerly
+        if (!xf.is_style) xf.parent_style_index = 0;
+    }
+    book->_xf_decoded[xf_index] = 1;
+}
+
+////
+// lazy_formatting_info: interns the FONT and XF records not interned yet,
+// decoding each one once; font_at() and xf_at() then find them decoded.
+// Called by packed_font() and packed_xf(), so the tables cost nothing
+// until they are used.
+inline void
+_build_packed_tables(FormattingDelegate* book)
+{
+    if (!book->lazy_formatting_info) {
+        return;
+    }
+    size_t nfonts_interned = book->font_canonical.size();
+    for (size_t k = nfonts_interned; k < book->font_list.size(); ++k) {
+        const Font& f = font_at(book, int(k));
+        const FormattingRecordRef& ref = book->_font_refs[k];
+        auto first = book->_formatting_records.begin() + ref.pos;
+        _intern_font(book, std::string(first, first + ref.length), &f);
+    }
+    int bv = book->get_biff_version();
+    for (size_t x = book->xf_canonical.size(); x < book->xf_list.size(); ++x) {
+        PackedXF packed = _decode_packed_xf(bv, _deferred_record(book, book->_xf_refs[x]));
+        _intern_xf(book, packed);
+        if (!book->_xf_decoded[x]) {
+            _unpack_deferred_xf(book, int(x), packed);
+        }
+    }
+    if (nfonts_interned < book->font_list.size()) {
+        // palette_epilogue left this to now
+        _check_font_colours(book);
+    }
+}
+
+////
+// The packed form of Book.xf_list[xf_index] (shared with every XF
+// that has the same canonical id).
+// With lazy_formatting_info, the first call builds the packed tables.
+EXPORT
+const PackedXF&
+packed_xf(FormattingDelegate* book, int xf_index)
+{
+    _build_packed_tables(book);
+    return book->xf_table[book->xf_canonical.at(xf_index)];
+}
+
+////
+// Book.xf_list[xf_index], decoding its XF record first if
+// lazy_formatting_info deferred it.
+EXPORT
+const Format&
+xf_at(FormattingDelegate* book, int xf_index)
+{
+    Format& xf = book->xf_list.at(xf_index);
+    if (book->lazy_formatting_info && !book->_xf_decoded.at(xf_index)) {
+        auto data = _deferred_record(book, book->_xf_refs[xf_index]);
+        _unpack_deferred_xf(book, xf_index, _decode_packed_xf(book->get_biff_version(), data));
+    }
+    return xf;
+}
+
+inline void
+_decode_style(FormattingDelegate* book, const std::vector<uint8_t>& data)
+{
+    int blah = DEBUG or book->verbosity >= 2;
+    int bv = book->get_biff_version();
+    int flag_and_xfx = as_uint16(data, 0);
+    int built_in_id = as_uint8(data, 2);
+    int level = as_uint8(data, 3);
+    int xf_index = flag_and_xfx & 0x0fff;
+    int built_in;
+    std::string name;
+    bool all_zero = data.size() == 4
+        && data[0] == 0 && data[1] == 0 && data[2] == 0 && data[3] == 0;
+    if (all_zero && book->style_name_map.count("Normal") == 0) {
+        // Erroneous record (doesn't have built-in bit set).
+        // Example file supplied by Jeff Bell.
+        built_in = 1;
+        built_in_id = 0;
+        xf_index = 0;
+        name = "Normal";
+        level = 255;
+    } else if (flag_and_xfx & 0x8000) {
+        // built-in style
+        built_in = 1;
+        name = built_in_style_names.at(built_in_id);
+        if (1 <= built_in_id && built_in_id <= 2) {
+            name += std::to_string(level + 1);
+        }
+    } else {
+        // user-defined style
+        built_in = 0;
+        built_in_id = 0;
+        level = 0;
+        if (bv >= 80) {
+            name = unpack_unicode(data, 2, 2);
+        } else {
+            name = unpack_string(data, 2, book->encoding, 1);
+        }
+        if (blah && name.empty()) {
+            pprint("WARNING *** A user-defined style has a zero-length name\n");
+        }
+    }
+    book->style_name_map[name] = std::make_pair(built_in, xf_index);
+    if (blah) {
+        pprint("STYLE: built_in=%d xf_index=%d built_in_id=%d level=%d name=%s\n",
+            built_in, xf_index, built_in_id, level, name);
+    }
+}
+
+inline void
+handle_style(FormattingDelegate* book, const std::vector<uint8_t>& data)
+{
+    if (!book->formatting_info)
+        return;
+    if (book->lazy_formatting_info) {
+        book->_style_refs.push_back(_defer_record(book, data));
+        return;
+    }
+    _decode_style(book, data);
+}
+
+////
+// Book.style_name_map, decoding any STYLE records that
+// lazy_formatting_info deferred.
+EXPORT
+const std::map<std::string, std::pair<int, int>>&
+get_style_name_map(FormattingDelegate* book)
+{
+    // in file order, so later duplicates still win
+    for (auto& ref: book->_style_refs) {
+        _decode_style(book, _deferred_record(book, ref));
+    }
+    book->_style_refs.clear();
+    return book->style_name_map;
+}
+
+inline void
+_decode_palette(FormattingDelegate* book, const std::vector<uint8_t>& data)
+{
+    int blah = DEBUG or book->verbosity >= 2;
+    int n_colours = as_uint16(data, 0);
+    int expected_n_colours = book->get_biff_version() >= 50 ? 56 : 16;
+    if ((DEBUG or book->verbosity >= 1) and n_colours != expected_n_colours) {
+        pprint("NOTE *** Expected %d colours in PALETTE record, found %d\n",
+            expected_n_colours, n_colours);
+    } else if (blah) {
+        pprint("PALETTE record with %d colours\n", n_colours);
+    }
+    int expected_size = 4 * n_colours + 2;
+    int actual_size = data.size();
+    int tolerance = 4;
+    if (!(expected_size <= actual_size && actual_size <= expected_size + tolerance)) {
+        throw biffh::XLRDError("PALETTE record: expected size " + std::to_string(expected_size)
+                               + ", actual size " + std::to_string(actual_size));
+    }
+    ASSERT(book->palette_record.empty()); // There should be only 1 PALETTE record
+    // a colour will be 0xbbggrr
+    // IOW, red is at the little end
+    for (int i = 0; i < n_colours; ++i) {
+        int pos = 2 + 4 * i;
+        color new_rgb = {{data[pos], data[pos + 1], data[pos + 2]}};
+        book->palette_record.push_back(new_rgb);
+        book->colour_map[8 + i] = new_rgb;
+        book->palette.set(8 + i, pack_rgba(new_rgb));
+    }
+}
+
+inline void
+handle_palette(FormattingDelegate* book, const std::vector<uint8_t>& data)
+{
+    if (!book->formatting_info)
+        return;
+    if (book->lazy_formatting_info) {
+        book->_palette_refs.push_back(_defer_record(book, data));
+        return;
+    }
+    _decode_palette(book, data);
+}
+
+////
+// Book.colour_map, applying a PALETTE record that
+// lazy_formatting_info deferred.
+EXPORT
+const MAP<int, color>&
+get_colour_map(FormattingDelegate* book)
+{
+    for (auto& ref: book->_palette_refs) {
+        _decode_palette(book, _deferred_record(book, ref));
+    }
+    book->_palette_refs.clear();
+    return book->colour_map;
+}
+
+////
+// Book.palette, applying a PALETTE record that
+// lazy_formatting_info deferred.
+EXPORT
+const Palette&
+get_palette(FormattingDelegate* book)
+{
+    get_colour_map(book);
+    return book->palette;
+}
+
+// Notes the colour indexes the fonts use in colour_indexes_used.
+inline void
+_check_font_colours(FormattingDelegate* book)
+{
+    const Palette& palette = get_palette(book);
+    int nfonts = book->font_canonical.size();
+    for (int font_index = 0; font_index < nfonts; ++font_index) {
+        if (font_index == 4) // the missing font record
+            continue;
+        const PackedFont& font = packed_font(book, font_index);
+        int cx = font.colour_index;
+        if (cx == 0x7fff) // system window text colour
+            continue;
+        if (palette.is_defined(cx)) {
+            book->colour_indexes_used[cx] = 1;
+        } else if (book->verbosity) {
+            pprint("Size of colour table: %d\n", int(book->colour_map.size()));
+            pprint("*** Font #%d (%s): colour index 0x%04x is unknown\n",
+                font_index, book->font_names[font.name_id], cx);
+        }
+    }
+    if (book->verbosity >= 1) {
+        std::vector<int> used;
+        for (auto& it: book->colour_indexes_used) {
+            used.push_back(it.first);
+        }
+        std::sort(used.begin(), used.end());
+        std::string s;
+        for (int cx: used) {
+            s += (s.empty() ? "" : ", ") + std::to_string(cx);
+        }
+        pprint("\nColour indexes used:\n[%s]\n\n", s);
+    }
+}
+
+inline void
+palette_epilogue(FormattingDelegate* book)
+{
+    // Check colour indexes in fonts etc.
+    // This must be done here as FONT records
+    // come *before* the PALETTE record :-(
+    // With lazy_formatting_info, _build_packed_tables() does it.
+    if (!book->formatting_info || book->lazy_formatting_info)
+        return;
+    _check_font_colours(book);
+}
+
 /*
 std_format_strings = {
     // "std" == "standard for US English locale"
@@ -537,101 +1484,165 @@ for lo, hi, ty in fmt_code_ranges:
         std_format_code_types[x] = ty
 del lo, hi, ty, x
 
-date_chars = UNICODE_LITERAL('ymdhs') // year, month/minute, day, hour, second
-date_char_dict = {}
-for _c in date_chars + date_chars.upper():
-    date_char_dict[_c] = 5
-del _c, date_chars
+*/
 
-skip_char_dict = {}
-for _c in UNICODE_LITERAL('$-+/(): '):
-    skip_char_dict[_c] = 1
+// Character classes for is_date_format_string; one table lookup per char
+// instead of the date_char_dict/skip_char_dict/num_char_dict lookups.
+enum {
+    _FMT_KEEP   = 0,
+    _FMT_QUOTE  = 1,  // '"' starts/ends "text"
+    _FMT_ESCAPE = 2,  // \ _ * : ignore the next char
+    _FMT_SKIP   = 4,  // $-+/(): and space
+    _FMT_DATE   = 8,  // ymdhs, either case: year, month/minute, day, hour, second
+    _FMT_NUM    = 16, // 0 # ?
+    _FMT_SEP    = 32, // ; section separator
+};
 
-num_char_dict = {
-    UNICODE_LITERAL('0'): 5,
-    UNICODE_LITERAL('//'): 5,
-    UNICODE_LITERAL('?'): 5,
-    }
+constexpr uint8_t
+_fmt_char_class(int c) {
+    return c == '"' ? _FMT_QUOTE
+        : (c == '\\' || c == '_' || c == '*') ? _FMT_ESCAPE
+        : (c == '$' || c == '-' || c == '+' || c == '/' || c == '(' || c == ')'
+           || c == ':' || c == ' ') ? _FMT_SKIP
+        : (c == 'y' || c == 'm' || c == 'd' || c == 'h' || c == 's'
+           || c == 'Y' || c == 'M' || c == 'D' || c == 'H' || c == 'S') ? _FMT_DATE
+        : (c == '0' || c == '#' || c == '?') ? _FMT_NUM
+        : c == ';' ? _FMT_SEP
+        : _FMT_KEEP;
+}
 
-non_date_formats = {
-    UNICODE_LITERAL('0.00E+00'):1,
-    UNICODE_LITERAL('////0.0E+0'):1,
-    UNICODE_LITERAL('General') :1,
-    UNICODE_LITERAL('GENERAL') :1, // OOo Calc 1.1.4 does this.
-    UNICODE_LITERAL('general') :1,  // pyExcelerator 0.6.3 does this.
-    UNICODE_LITERAL('@')       :1,
-    }
+template<int... i>
+constexpr std::array<uint8_t, sizeof...(i)>
+_make_fmt_char_table(utils::str::index_seq<i...>) {
+    return std::array<uint8_t, sizeof...(i)>{{_fmt_char_class(i)...}};
+}
 
-fmt_bracketed_sub = re.compile(r'\[[^]]*\]').sub
+static constexpr std::array<uint8_t, 256>
+_fmt_char_table = _make_fmt_char_table(utils::str::make_seq<255>());
+
+const std::vector<std::string>
+non_date_formats = {
+    "0.00E+00",
+    "##0.0E+0",
+    "General",
+    "GENERAL", // OOo Calc 1.1.4 does this.
+    "general", // pyExcelerator 0.6.3 does this.
+    "@",
+};
 
 // Boolean format strings (actual cases)
 // u'"Yes";"Yes";"No"'
 // u'"True";"True";"False"'
 // u'"On";"On";"Off"'
 
-def is_date_format_string(book, fmt):
+inline bool
+_is_date_format_string(const std::string& fmt, int verbosity) {
     // Heuristics:
     // Ignore "text" and [stuff in square brackets (aarrgghh -- see below)].
     // Handle backslashed-escaped chars properly.
     // E.g. hh\hmm\mss\s should produce a display like 23h59m59s
     // Date formats have one or more of ymdhs (caseless) in them.
-    // Numeric formats have // and 0.
+    // Numeric formats have # and 0.
     // N.B. u'General"."' hence get rid of "text" first.
-    // TODO: Find where formats are interpreted in Gnumeric
-    // TODO: u'[h]\\ \\h\\o\\u\\r\\s' ([h] means don't care about hours > 23)
-    state = 0
-    s = ''
-    
-    for c in fmt:
-        if state == 0:
-            if c == UNICODE_LITERAL('"'):
-                state = 1
-            elif c in UNICODE_LITERAL(r"\_*"):
-                state = 2
-            elif c in skip_char_dict:
-                pass
-            else:
-                s += c
-        elif state == 1:
-            if c == UNICODE_LITERAL('"'):
-                state = 0
-        elif state == 2:
+    std::string s;
+    s.reserve(fmt.size());
+    int state = 0;
+    for (char c: fmt) {
+        uint8_t cls = _fmt_char_table[(uint8_t)c];
+        if (state == 0) {
+            if (cls & _FMT_QUOTE) {
+                state = 1;
+            } else if (cls & _FMT_ESCAPE) {
+                state = 2;
+            } else if (!(cls & _FMT_SKIP)) {
+                s.push_back(c);
+            }
+        } else if (state == 1) {
+            if (cls & _FMT_QUOTE) {
+                state = 0;
+            }
+        } else {
             // Ignore char after backslash, underscore or asterisk
-            state = 0
-        assert 0 <= state <= 2
-    if book.verbosity >= 4:
-        print("is_date_format_string: reduced format is %s" % REPR(s), file=book.logfile)
-    s = fmt_bracketed_sub('', s)
-    if s in non_date_formats:
-        return False
-    state = 0
-    separator = ";"
-    got_sep = 0
-    date_count = num_count = 0
-    for c in s:
-        if c in date_char_dict:
-            date_count += date_char_dict[c]
-        elif c in num_char_dict:
-            num_count += num_char_dict[c]
-        elif c == separator:
-            got_sep = 1
-    // print num_count, date_count, repr(fmt)
-    if date_count and not num_count:
-        return True
-    if num_count and not date_count:
-        return False
-    if date_count:
-        if book.verbosity:
-            pprint(book.logfile,
-                'WARNING *** is_date_format: ambiguous d=%d n=%d fmt=%s\n',
-                date_count, num_count, fmt)
-    elif not got_sep:
-        if book.verbosity:
-            pprint(book.logfile,
-                "WARNING *** format %s produces constant result\n",
-                fmt)
-    return date_count > num_count
+            state = 0;
+        }
+    }
+    if (verbosity >= 4) {
+        pprint("is_date_format_string: reduced format is %s", utils::str::repr(s));
+    }
+    // drop [bracketed] parts, i.e. re.sub(r'\[[^]]*\]', '', s)
+    size_t out = 0;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '[') {
+            size_t close = s.find(']', i + 1);
+            if (close != std::string::npos) {
+                i = close;
+                continue;
+            }
+        }
+        s[out++] = s[i];
+    }
+    s.resize(out);
+    for (const auto& non_date: non_date_formats) {
+        if (s == non_date) {
+            return false;
+        }
+    }
+    int date_count = 0;
+    int num_count = 0;
+    bool got_sep = false;
+    for (char c: s) {
+        uint8_t cls = _fmt_char_table[(uint8_t)c];
+        date_count += (cls & _FMT_DATE) ? 5 : 0;
+        num_count += (cls & _FMT_NUM) ? 5 : 0;
+        got_sep |= (cls & _FMT_SEP) != 0;
+    }
+    if (date_count && !num_count) {
+        return true;
+    }
+    if (num_count && !date_count) {
+        return false;
+    }
+    if (date_count) {
+        if (verbosity) {
+            pprint("WARNING *** is_date_format: ambiguous d=%d n=%d fmt=%s\n",
+                   date_count, num_count, fmt);
+        }
+    } else if (!got_sep) {
+        if (verbosity) {
+            pprint("WARNING *** format %s produces constant result\n", fmt);
+        }
+    }
+    return date_count > num_count;
+}
+
+////
+// Whether fmt (a FORMAT record's format string) shows numbers as dates.
+// <p>Results are memoized in a cache shared by every Book in the process,
+// since the same handful of custom formats turn up in file after file.
+// The cache is bounded; formats seen after it fills are still classified,
+// just not remembered. Warnings (verbosity) are only given the first time
+// a format is classified.</p>
+inline bool
+is_date_format_string(FormattingDelegate* book, const std::string& fmt) {
+    static std::mutex cache_mutex;
+    static std::unordered_map<std::string, bool> cache;
+    const size_t max_cache_size = 4096;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto it = cache.find(fmt);
+        if (it != cache.end()) {
+            return it->second;
+        }
+    }
+    bool is_date = _is_date_format_string(fmt, book->verbosity);
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (cache.size() < max_cache_size) {
+        cache.emplace(fmt, is_date);
+    }
+    return is_date;
+}
 
+/*
 def handle_format(self, data, rectype=XL_FORMAT):
     DEBUG = 0
     bv = self.biff_version
@@ -1105,6 +2116,12 @@ void xf_epilogue(FormattingDelegate* self) {
         pprint("xf_epilogue called ...\n");
     }
 
+    int max_xf_index = -1;
+    for (auto& xf: self->xf_list) {
+        max_xf_index = std::max(max_xf_index, xf.xf_index);
+    }
+    self->_xf_index_to_xl_type_map.assign(max_xf_index + 1, XL_CELL_NUMBER);
+
     for (int xfx = 0; xfx < num_xfs; ++xfx) {
         auto& xf = self->xf_list[xfx];
 
@@ -1113,14 +2130,19 @@ void xf_epilogue(FormattingDelegate* self) {
         try {
             fmt = self->format_map.at(xf.format_key);
             cellty = int(_cellty_from_fmtty.at(fmt.type));
-        } catch(std::range_error exc) {
-            cellty = biffh::XL_CELL_TEXT;
+        } catch(const std::out_of_range&) {
+            // unknown format key: a number, as in xlrd
+            cellty = biffh::XL_CELL_NUMBER;
         }
-        self->_xf_index_to_xl_type_map[xf.xf_index] = cellty;
+        self->_xf_index_to_xl_type_map[xf.xf_index] = (uint8_t)cellty;
         // Now for some assertions etc
         if (!self->formatting_info) {
             continue;
         }
+        if (self->lazy_formatting_info) {
+            // xf_at() does the checks that matter when the XF is decoded
+            continue;
+        }
         if (xf.is_style) {
             continue;
         }
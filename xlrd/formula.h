@@ -13,9 +13,11 @@
 // No part of the content of this file was derived from the works of David Giffin.
 
 #include <set>
+#include <algorithm>
 #include <cmath>
 #include <array>
 #include <vector>
+#include <utility>
 
 #include "./biffh.h"
 //  unpack_unicode_update_pos, unpack_string_update_pos,
@@ -33,7 +35,6 @@ using u8 = uint8_t;
 namespace strutil = utils::str;
 USING_FUNC(strutil, format);
 USING_FUNC(utils, pprint);
-using any = utils::any;
 
 auto& unpack_unicode_update_pos = biffh::unpack_unicode_update_pos;
 auto& unpack_string_update_pos = biffh::unpack_string_update_pos;
@@ -572,6 +573,95 @@ get_cell_range_addr(const std::vector<uint8_t>& data, int pos, int bv,
     }
 }
 
+////
+// <p>Represents an absolute or relative 3-dimensional reference to a box
+// of one or more cells.<br />
+// -- New in version 0.6.0
+// </p>
+//
+// <p>The <i>coords</i> attribute is a tuple of the form:<br />
+// (shtxlo, shtxhi, rowxlo, rowxhi, colxlo, colxhi)<br />
+// where 0 <= thingxlo <= thingx < thingxhi.<br />
+// Note that it is quite possible to have thingx > nthings; for example
+// Print_Titles could have colxhi == 256 and/or rowxhi == 65536
+// irrespective of how many columns/rows are actually used in the worksheet.
+// The caller will need to decide how to handle this situation.
+// Keyword) { IndexError :-)
+// </p>
+//
+// <p>The components of the coords attribute are also available as individual
+// attributes) { shtxlo, shtxhi, rowxlo, rowxhi, colxlo, and colxhi.</p>
+//
+// <p>The <i>relflags</i> attribute is a 6-tuple of flags which indicate whether
+// the corresponding (sheet|row|col)(lo|hi) is relative (1) or absolute (0).<br>
+// Note that there is necessarily no information available as to what cell(s)
+// the reference could possibly be relative to. The caller must decide what if
+// any use to make of oREL operands. Note also that a partially relative
+// reference may well be a typo.
+// For example, define name A1Z10 as $a$1:$z10 (missing $ after z)
+// while the cursor is on cell Sheet3!A27.<br>
+// The resulting Ref3D instance will have coords = (2, 3, 0, -16, 0, 26)
+// and relflags = (0, 0, 0, 1, 0, 0).<br>
+// So far, only one possibility of a sheet-relative component in
+// a reference has been noticed) { a 2D reference located in the "current sheet".
+// <br /> This will appear as coords = (0, 1, ...) and relflags = (1, 1, ...).
+class Ref3D
+{
+public:
+    int shtxlo;
+    int shtxhi;
+    int rowxlo;
+    int rowxhi;
+    int colxlo;
+    int colxhi;
+    std::array<int, 6> coords;
+    std::array<int, 6> relflags;
+
+    // inline
+    // Ref3D(int c1, int c2, int c3, int c4, int c5, int c6,
+    //       int r1=0, int r2=0, int r3=0, int r4=0, int r5=0, int r6=0)
+    // {
+    //     this->coords = {{c1, c2, c3, c4, c5, c6}};
+    //     this->relflags = {{r1, r2, r3, r4, r5, r6}};
+    //     this->shtxlo = c1;
+    //     this->shtxhi = c2;
+    //     this->rowxlo = c3;
+    //     this->rowxhi = c4;
+    //     this->colxlo = c5;
+    //     this->colxhi = c6;
+    // };
+
+    inline
+    Ref3D(const std::array<int, 6>& coords_, const std::array<int, 6>& relflags_)
+    {
+        this->coords = coords_;
+        this->relflags = relflags_;
+        this->shtxlo = coords_[0];
+        this->shtxhi = coords_[1];
+        this->rowxlo = coords_[2];
+        this->rowxhi = coords_[3];
+        this->colxlo = coords_[4];
+        this->colxhi = coords_[5];
+    };
+
+    inline
+    Ref3D(const std::array<int, 6>& coords_)
+    : Ref3D(coords_, {{0, 0, 0, 0, 0, 0}})
+    {};
+
+    inline
+    Ref3D()
+    : Ref3D({{0, 0, 0, 0, 0, 0}}, {{0, 0, 0, 0, 0, 0}})
+    {};
+
+    // def __repr__(self):
+    //     if not self.relflags or self.relflags == (0, 0, 0, 0, 0, 0):
+    //         return "Ref3D(coords=%s)" % (self.coords, )
+    //     } else {
+    //         return "Ref3D(coords=%s, relflags=%s)"
+    //             % (self.coords, self.relflags)
+};
+
 ////
 // Used in evaluating formulas.
 // The following table describes the kinds and how their values
@@ -586,59 +676,178 @@ get_cell_range_addr(const std::vector<uint8_t>& data, int pos, int bv,
 // <tr>
 // <td>oBOOL</td>
 // <td align="center">3</td>
-// <td>integer:0 => False; 1 => True</td>
+// <td>BOOLEAN:0 => False; 1 => True</td>
 // </tr>
 // <tr>
 // <td>oERR</td>
 // <td align="center">4</td>
-// <td>nullptr, or an int error code (same as XL_CELL_ERROR in the Cell class).
+// <td>NONE, or an ERROR code (same as XL_CELL_ERROR in the Cell class).
 // </td>
 // </tr>
 // <tr>
 // <td>oMSNG</td>
 // <td align="center">5</td>
 // <td>Used by Excel as a placeholder for a missing (not supplied) function
-// argument. Should *not* appear as a final formula result. Value is nullptr.</td>
+// argument. Should *not* appear as a final formula result. Value is NONE.</td>
 // </tr>
 // <tr>
 // <td>oNUM</td>
 // <td align="center">2</td>
-// <td>A float. Note that there is no way of distinguishing dates.</td>
+// <td>A NUMBER, or an INT for integral constants.
+// Note that there is no way of distinguishing dates.</td>
 // </tr>
 // <tr>
 // <td>oREF</td>
 // <td align="center">-1</td>
-// <td>The value is either nullptr or a non-empty list of
+// <td>The value is either NONE or a REF to a non-empty list of
 // absolute Ref3D instances.<br>
 // </td>
 // </tr>
 // <tr>
 // <td>oREL</td>
 // <td align="center">-2</td>
-// <td>The value is nullptr or a non-empty list of
+// <td>The value is NONE or a REF to a non-empty list of
 // fully or partially relative Ref3D instances.
 // </td>
 // </tr>
 // <tr>
 // <td>oSTRG</td>
 // <td align="center">1</td>
-// <td>A Unicode string.</td>
+// <td>A STRING id of a UTF-8 string.</td>
 // </tr>
 // <tr>
 // <td>oUNK</td>
 // <td align="center">0</td>
-// <td>The kind is unknown or ambiguous. The value is nullptr</td>
+// <td>The kind is unknown or ambiguous. The value is NONE</td>
 // </tr>
 // </table>
 //<p></p>
+//
+// <p>Values are OperandValue instances; STRING and REF values are ids into
+// the book's OperandPool.</p>
+
+////
+// The value of an Operand: a tag and 8 bytes, so that operands are copied
+// and combined on the evaluation stack without allocating.
+// Numbers, booleans and error codes are held inline; strings and Ref3D
+// lists are held by an OperandPool and referred to by id.
+class OperandValue
+{
+public:
+    enum Tag : uint8_t { NONE, INT, NUMBER, STRING, BOOLEAN, ERROR, REF };
+    uint8_t tag = NONE;
+    union {
+        int32_t i;       // INT, BOOLEAN, ERROR
+        double number;   // NUMBER
+        uint32_t id;     // STRING, REF
+    };
+
+    inline OperandValue() : number(0.0) {};
+    inline OperandValue(std::nullptr_t) : number(0.0) {};
+    inline OperandValue(int v) : tag(INT), i(v) {};
+    inline OperandValue(double v) : tag(NUMBER), number(v) {};
+
+    inline static OperandValue
+    boolean(bool v) {
+        OperandValue res(v ? 1 : 0);
+        res.tag = BOOLEAN;
+        return res;
+    }
+
+    inline static OperandValue
+    error(int code) {
+        OperandValue res(code);
+        res.tag = ERROR;
+        return res;
+    }
+
+    inline static OperandValue
+    pooled(Tag tag, uint32_t id) {
+        OperandValue res;
+        res.tag = tag;
+        res.id = id;
+        return res;
+    }
+
+    inline bool
+    is_null() const { return tag == NONE; }
+
+    inline int
+    to_int() const {
+        if (tag == NUMBER) return (int)number;
+        if (tag == INT || tag == BOOLEAN || tag == ERROR) return i;
+        return 0;
+    }
+
+    inline double
+    to_double() const {
+        if (tag == NUMBER) return number;
+        if (tag == INT || tag == BOOLEAN || tag == ERROR) return i;
+        return 0.0;
+    }
+
+    inline std::string
+    repr() const {
+        static const char* names[] = {"NONE", "INT", "NUMBER", "STRING",
+                                      "BOOLEAN", "ERROR", "REF"};
+        char buf[48];
+        if (tag == NUMBER) {
+            snprintf(buf, sizeof(buf), "%s:%.17g", names[tag], number);
+        } else {
+            snprintf(buf, sizeof(buf), "%s:%d", names[tag], i);
+        }
+        return buf;
+    }
+};
+
+////
+// Storage for the strings and Ref3D lists that OperandValue ids refer to.
+// One per book, so a NAME's result can be copied into the formula of
+// another NAME that uses it.
+class OperandPool
+{
+public:
+    std::vector<std::string> strings;
+    std::vector<std::vector<Ref3D>> refs;
+
+    inline OperandValue
+    add_string(std::string s) {
+        strings.push_back(std::move(s));
+        return OperandValue::pooled(OperandValue::STRING, strings.size()-1);
+    }
+
+    inline OperandValue
+    add_refs(std::vector<Ref3D> r) {
+        refs.push_back(std::move(r));
+        return OperandValue::pooled(OperandValue::REF, refs.size()-1);
+    }
+
+    inline const std::string&
+    text(const OperandValue& v) const {
+        ASSERT(v.tag == OperandValue::STRING);
+        return strings[v.id];
+    }
+
+    inline const std::vector<Ref3D>&
+    refs_of(const OperandValue& v) const {
+        ASSERT(v.tag == OperandValue::REF);
+        return refs[v.id];
+    }
+
+    inline void
+    clear() {
+        strings.clear();
+        refs.clear();
+    }
+};
 
 class Operand
 {
 public:
     ////
-    // nullptr means that the actual value of the operand is a variable
+    // NONE means that the actual value of the operand is a variable
     // (depends on cell data), not a constant.
-    utils::any value;
+    OperandValue value;
     ////
     // oUNK means that the kind of operand is not known unambiguously.
     int kind = oUNK;
@@ -651,7 +860,7 @@ public:
     int rank = 0;
 
     inline
-    Operand(int akind=-1, utils::any avalue=nullptr,
+    Operand(int akind=-1, OperandValue avalue=OperandValue(),
             int arank=0, std::string atext="?")
     {
         if (akind != -1) {
@@ -661,7 +870,7 @@ public:
         this->rank = arank;
         // rank is an internal gizmo (operator precedence);
         // it's used in reconstructing formula text.
-        this->text = atext;
+        this->text = std::move(atext);
     };
 
     inline std::string
@@ -669,7 +878,7 @@ public:
         auto kind_text = utils::getelse(okind_dict, this->kind, "?Unknown kind?");
         return strutil::format(
             "Operand(kind=%s, value=%s, text=%s)",
-            kind_text, this->value, this->text
+            kind_text, this->value.repr(), this->text
         );
     };
 };
@@ -679,7 +888,9 @@ public:
     std::string name;
     std::vector<uint8_t> raw_formula;  // fixme:
     int basic_formula_len;
-    int evaluated;
+    // 1 once evaluated (result and stack are then final), -1 while
+    // evaluate_name_formula() is working on it, 0 before.
+    int evaluated = 0;
     int macro;
     int binary;
     int any_err;
@@ -690,17 +901,215 @@ public:
     Operand result;
 };
 
+////
+// Hash index of a book's defined names by (lower-cased name, scope).
+// <p>It stands for the name_and_scope_map and name_map dicts of xlrd:
+// find() gives the index of the name with a given scope, find_all() the
+// indexes of all the names spelt alike, in scope order. A lookup folds the
+// case of the name as it hashes and compares it, so it takes the name as
+// written and allocates nothing. As with utils::str::lower(), only ASCII
+// letters are folded.</p>
+// <p>The folded names are copied into one buffer; the index does not
+// refer to the name objects, so they may move after build().</p>
+class NameIndex
+{
+public:
+    ////
+    // Indexes names (FormulaNameDelegate or a subclass), replacing what
+    // was there; returns the number of (name, scope) pairs given more than
+    // once, of which the index keeps the last, as xlrd does.
+    template<class N>
+    size_t build(const std::vector<N>& names) {
+        _groups.clear();
+        _keys.clear();
+        _slots.assign(_capacity_for(names.size()), 0);
+        // one pass: the group (lower-cased name) of every name
+        std::vector<uint32_t> group_of(names.size());
+        for (size_t namex = 0; namex < names.size(); ++namex) {
+            const std::string& name = names[namex].name;
+            uint64_t hash = _hash(name.data(), name.size());
+            uint32_t& slot = _probe(name.data(), name.size(), hash);
+            if (!slot) {
+                Group g;
+                g.hash = hash;
+                g.key_begin = _keys.size();
+                g.key_len = name.size();
+                g.first = 0;
+                g.count = 0;
+                for (char c : name) {
+                    _keys.push_back(utils::str::lowerchar(c));
+                }
+                _groups.push_back(g);
+                slot = _groups.size();
+            }
+            group_of[namex] = slot - 1;
+            _groups[slot - 1].count += 1;
+        }
+        // members of a group are contiguous in _order, in (scope, namex) order
+        uint32_t first = 0;
+        for (auto& g : _groups) {
+            g.first = first;
+            first += g.count;
+            g.count = 0;
+        }
+        _order.resize(names.size());
+        _scopes.resize(names.size());
+        for (size_t namex = 0; namex < names.size(); ++namex) {
+            Group& g = _groups[group_of[namex]];
+            _order[g.first + g.count++] = namex;
+        }
+        size_t duplicates = 0;
+        for (const auto& g : _groups) {
+            int* b = &_order[g.first];
+            std::sort(b, b + g.count, [&](int x, int y) {
+                return names[x].scope != names[y].scope ?
+                       names[x].scope < names[y].scope : x < y;
+            });
+            for (uint32_t i = 0; i < g.count; ++i) {
+                _scopes[g.first + i] = names[b[i]].scope;
+                duplicates += i && _scopes[g.first + i] == _scopes[g.first + i - 1];
+            }
+        }
+        return duplicates;
+    }
+
+    ////
+    // The index of the name with the given scope, or -1.
+    int find(const char* name, size_t len, int scope) const {
+        const Group* g = _find(name, len);
+        if (!g) {
+            return -1;
+        }
+        int found = -1;
+        for (uint32_t i = g->first; i < g->first + g->count; ++i) {
+            if (_scopes[i] == scope) {
+                found = _order[i];  // the last of duplicates wins
+            } else if (_scopes[i] > scope) {
+                break;
+            }
+        }
+        return found;
+    }
+
+    int find(const std::string& name, int scope) const {
+        return find(name.data(), name.size(), scope);
+    }
+
+    ////
+    // [first, second) are the indexes of the names spelt like name (in any
+    // case), in scope order; empty if there are none.
+    std::pair<const int*, const int*>
+    find_all(const char* name, size_t len) const {
+        const Group* g = _find(name, len);
+        if (!g) {
+            return std::make_pair(nullptr, nullptr);
+        }
+        const int* b = _order.data() + g->first;
+        return std::make_pair(b, b + g->count);
+    }
+
+    std::pair<const int*, const int*>
+    find_all(const std::string& name) const {
+        return find_all(name.data(), name.size());
+    }
+
+    size_t size() const { return _order.size(); }
+
+private:
+    struct Group {
+        uint64_t hash;
+        uint32_t key_begin;  // the lower-cased name is _keys[key_begin, +key_len)
+        uint32_t key_len;
+        uint32_t first;      // the names are _order[first, first+count)
+        uint32_t count;
+    };
+
+    std::vector<Group> _groups;
+    std::vector<int> _order;
+    std::vector<int> _scopes;     // of _order[i]
+    std::vector<uint32_t> _slots; // 1 + index into _groups; 0 is empty
+    std::string _keys;
+
+    static size_t _capacity_for(size_t n) {
+        size_t cap = 16;
+        while (cap < 2 * n) {
+            cap <<= 1;
+        }
+        return cap;
+    }
+
+    // FNV-1a of the lower-cased bytes
+    static uint64_t _hash(const char* s, size_t len) {
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < len; ++i) {
+            h ^= (uint8_t)utils::str::lowerchar(s[i]);
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    bool _equal(const Group& g, const char* s, size_t len) const {
+        if (g.key_len != len) {
+            return false;
+        }
+        const char* key = _keys.data() + g.key_begin;
+        for (size_t i = 0; i < len; ++i) {
+            if (key[i] != utils::str::lowerchar(s[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // The slot of name: its group's, or the empty one where it would go.
+    uint32_t& _probe(const char* s, size_t len, uint64_t hash) {
+        size_t mask = _slots.size() - 1;
+        for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+            uint32_t slot = _slots[i];
+            if (!slot || (_groups[slot - 1].hash == hash &&
+                          _equal(_groups[slot - 1], s, len))) {
+                return _slots[i];
+            }
+        }
+    }
+
+    const Group* _find(const char* s, size_t len) const {
+        if (_slots.empty()) {
+            return nullptr;
+        }
+        uint64_t hash = _hash(s, len);
+        size_t mask = _slots.size() - 1;
+        for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+            uint32_t slot = _slots[i];
+            if (!slot) {
+                return nullptr;
+            }
+            const Group& g = _groups[slot - 1];
+            if (g.hash == hash && _equal(g, s, len)) {
+                return &g;
+            }
+        }
+    }
+};
+
 class FormulaBookDelegate {
 public:
     std::vector<std::tuple<int, int, int>> _externsheet_info;
     std::vector<int> _all_sheets_map;
     MAP<int, std::string> _sheet_names;
-    virtual std::vector<std::string> sheet_names();
+    std::vector<std::string> addin_func_names;
     int _supbook_addins_inx;
     int _supbook_locals_inx;
     int biff_version;
     std::string encoding;
     vector<int> _externsheet_type_b57;
+    ////
+    // Strings and Ref3D lists of the NAME formula results.
+    OperandPool operand_pool;
+
+    virtual std::vector<std::string> sheet_names() {
+        throw std::logic_error("NotImplemented");
+    }
 
     virtual FormulaNameDelegate* get_name_obj(int index) {
         throw std::logic_error("NotImplemented");
@@ -811,95 +1220,6 @@ public:
 };
 
 
-////
-// <p>Represents an absolute or relative 3-dimensional reference to a box
-// of one or more cells.<br />
-// -- New in version 0.6.0
-// </p>
-//
-// <p>The <i>coords</i> attribute is a tuple of the form:<br />
-// (shtxlo, shtxhi, rowxlo, rowxhi, colxlo, colxhi)<br />
-// where 0 <= thingxlo <= thingx < thingxhi.<br />
-// Note that it is quite possible to have thingx > nthings; for example
-// Print_Titles could have colxhi == 256 and/or rowxhi == 65536
-// irrespective of how many columns/rows are actually used in the worksheet.
-// The caller will need to decide how to handle this situation.
-// Keyword) { IndexError :-)
-// </p>
-//
-// <p>The components of the coords attribute are also available as individual
-// attributes) { shtxlo, shtxhi, rowxlo, rowxhi, colxlo, and colxhi.</p>
-//
-// <p>The <i>relflags</i> attribute is a 6-tuple of flags which indicate whether
-// the corresponding (sheet|row|col)(lo|hi) is relative (1) or absolute (0).<br>
-// Note that there is necessarily no information available as to what cell(s)
-// the reference could possibly be relative to. The caller must decide what if
-// any use to make of oREL operands. Note also that a partially relative
-// reference may well be a typo.
-// For example, define name A1Z10 as $a$1:$z10 (missing $ after z)
-// while the cursor is on cell Sheet3!A27.<br>
-// The resulting Ref3D instance will have coords = (2, 3, 0, -16, 0, 26)
-// and relflags = (0, 0, 0, 1, 0, 0).<br>
-// So far, only one possibility of a sheet-relative component in
-// a reference has been noticed) { a 2D reference located in the "current sheet".
-// <br /> This will appear as coords = (0, 1, ...) and relflags = (1, 1, ...).
-class Ref3D
-{
-public:
-    int shtxlo;
-    int shtxhi;
-    int rowxlo;
-    int rowxhi;
-    int colxlo;
-    int colxhi;
-    std::array<int, 6> coords;
-    std::array<int, 6> relflags;
-
-    // inline
-    // Ref3D(int c1, int c2, int c3, int c4, int c5, int c6,
-    //       int r1=0, int r2=0, int r3=0, int r4=0, int r5=0, int r6=0)
-    // {
-    //     this->coords = {{c1, c2, c3, c4, c5, c6}};
-    //     this->relflags = {{r1, r2, r3, r4, r5, r6}};
-    //     this->shtxlo = c1;
-    //     this->shtxhi = c2;
-    //     this->rowxlo = c3;
-    //     this->rowxhi = c4;
-    //     this->colxlo = c5;
-    //     this->colxhi = c6;
-    // };
-
-    inline
-    Ref3D(const std::array<int, 6>& coords_, const std::array<int, 6>& relflags_)
-    {
-        this->coords = coords_;
-        this->relflags = relflags_;
-        this->shtxlo = coords_[0];
-        this->shtxhi = coords_[1];
-        this->rowxlo = coords_[2];
-        this->rowxhi = coords_[3];
-        this->colxlo = coords_[4];
-        this->colxhi = coords_[5];
-    };
-
-    inline
-    Ref3D(const std::array<int, 6>& coords_)
-    : Ref3D(coords_, {{0, 0, 0, 0, 0, 0}})
-    {};
-
-    inline
-    Ref3D()
-    : Ref3D({{0, 0, 0, 0, 0, 0}}, {{0, 0, 0, 0, 0, 0}})
-    {};
-
-    // def __repr__(self):
-    //     if not self.relflags or self.relflags == (0, 0, 0, 0, 0, 0):
-    //         return "Ref3D(coords=%s)" % (self.coords, )
-    //     } else {
-    //         return "Ref3D(coords=%s, relflags=%s)"
-    //             % (self.coords, self.relflags)
-};
-
 const MAP<int, std::string>
 shname_dict_ = {
     {-1, "?internal; any sheet?"},
@@ -1136,180 +1456,180 @@ enum {
   // = range(0x09, 0x0F)
 };
 
-inline
-any nop(const any& a) {
-    return a;
+// Python's str() of a float, as used by xlrd when a number meets "&":
+// integral values lose their ".0".
+inline std::string
+num2strg(double num) {
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%.15g", num);
+    if (strtod(buf, nullptr) != num) {
+        n = snprintf(buf, sizeof(buf), "%.17g", num);
+    }
+    return std::string(buf, n);
 }
 
-double tod(const utils::any& a) {
-    if (a.is<double>()) {
-        return a.cast<double>();
-    } else if (a.is<float>()) {
-        return a.cast<float>();
-    } else if (a.is<int>()) {
-        return a.cast<int>();
-    } else if (a.is<std::string>()) {
-        return std::stod(a.cast<std::string>());
-    } else if (a.is<bool>()) {
-        return a.cast<bool>()? 1.0: 0.0;
-    }
-    return 0.0;
+////
+// The numeric value of a constant operand. Text that reads as a number
+// converts (to INT if it has no "." or exponent); other text gives #VALUE!.
+inline OperandValue
+strg2num(const OperandValue& v, const OperandPool& pool) {
+    if (v.tag != OperandValue::STRING) {
+        return v;
+    }
+    const std::string& s = pool.text(v);
+    size_t b = s.find_first_not_of(' ');
+    size_t e = s.find_last_not_of(' ');
+    double num;
+    if (b == std::string::npos ||
+        !utils::parse::parse_double(s.data() + b, s.data() + e + 1, &num)) {
+        return OperandValue::error(0x0F); // #VALUE!
+    }
+    if (s.find_first_of(".eE", b) == std::string::npos &&
+        num >= INT32_MIN && num <= INT32_MAX) {
+        return OperandValue((int)num);
+    }
+    return OperandValue(num);
 }
 
-inline any
-_opr_add(const any& x, const any& y) {
-    if (x.is<int>() && y.is<int>()) {
-        return x.cast<int>() + y.cast<int>();
-    }
-    return tod(x) + tod(y);
-}
-inline any
-_opr_sub(const any& x, const any& y) {
-    if (x.is<int>() && y.is<int>()) {
-        return x.cast<int>() - y.cast<int>();
-    }
-    return tod(x) - tod(y);
-}
-inline any
-_opr_mul(const any& x, const any& y) {
-    if (x.is<int>() && y.is<int>()) {
-        return x.cast<int>() * y.cast<int>();
-    }
-    return tod(x) * tod(y);
-}
-inline any
-_opr_div(const any& x, const any& y) {
-    return tod(x) / tod(y);
-}
-inline any
-_opr_pow(const any& x, const any& y) {
-    return std::pow(tod(x), tod(y));
-}
-inline any
-_opr_concat(const any& x, const any& y) {
-    return x.to_str() + y.to_str();
-}
-inline any
-_opr_lt(const any& x, const any& y) {
-    if (x.is_str() && y.is_str()) {
-        return x.to_str() < y.to_str();
-    }
-    return tod(x) < tod(y);
-}
-inline any
-_opr_le(const any& x, const any& y) {
-    if (x.is_str() && y.is_str()) {
-        return x.to_str() <= y.to_str();
+inline std::string
+_operand_text(const OperandValue& v, const OperandPool& pool) {
+    switch (v.tag) {
+    case OperandValue::STRING:  return pool.text(v);
+    case OperandValue::INT:     return std::to_string(v.i);
+    case OperandValue::BOOLEAN: return v.i ? "TRUE" : "FALSE";
+    case OperandValue::NUMBER:  return num2strg(v.number);
+    default:                    return "";
     }
-    return tod(x) <= tod(y);
 }
-inline any
-_opr_eq(const any& x, const any& y) {
-    if (x.is_str() && y.is_str()) {
-        return x.to_str() <= y.to_str();
-    }
-    return tod(x) <= tod(y);
+
+////
+// Compares two constant operands for tLT ... tNE.
+// No conversions are done on relops; in Excel, "1" > 9 produces TRUE:
+// numbers sort before strings, strings before booleans.
+inline int
+_operand_cmp(const OperandValue& a, const OperandValue& b,
+             const OperandPool& pool) {
+    auto order = [](const OperandValue& v) {
+        return v.tag == OperandValue::STRING ? 1 :
+               v.tag == OperandValue::BOOLEAN ? 2 : 0;
+    };
+    int oa = order(a);
+    int ob = order(b);
+    if (oa != ob) {
+        return oa < ob ? -1 : 1;
+    }
+    if (oa == 1) {
+        int c = pool.text(a).compare(pool.text(b));
+        return c < 0 ? -1 : c > 0;
+    }
+    double x = a.to_double();
+    double y = b.to_double();
+    return x < y ? -1 : x > y;
 }
-inline any
-_opr_ge(const any& x, const any& y) {
-    if (x.is_str() && y.is_str()) {
-        return x.to_str() <= y.to_str();
+
+////
+// The value of aop (opcd) bop, where both are constant oNUM or oSTRG
+// operands. One switch per operator class; only concatenation allocates.
+inline OperandValue
+binop_value(int opcd, const OperandValue& aop, const OperandValue& bop,
+            OperandPool& pool) {
+    switch (opcd) {
+    case tAdd: case tSub: case tMul: case tDiv: case tPower: {
+        OperandValue a = strg2num(aop, pool);
+        OperandValue b = strg2num(bop, pool);
+        if (a.tag == OperandValue::ERROR) return a;
+        if (b.tag == OperandValue::ERROR) return b;
+        if (a.tag == OperandValue::INT && b.tag == OperandValue::INT &&
+            opcd <= tMul) {
+            int64_t r = opcd == tAdd ? (int64_t)a.i + b.i :
+                        opcd == tSub ? (int64_t)a.i - b.i :
+                                       (int64_t)a.i * b.i;
+            if (r >= INT32_MIN && r <= INT32_MAX) {
+                return OperandValue((int)r);
+            }
+        }
+        double x = a.to_double();
+        double y = b.to_double();
+        switch (opcd) {
+        case tAdd: return OperandValue(x + y);
+        case tSub: return OperandValue(x - y);
+        case tMul: return OperandValue(x * y);
+        case tDiv:
+            if (y == 0) return OperandValue::error(0x07); // #DIV/0!
+            return OperandValue(x / y);
+        default: {
+            double r = std::pow(x, y);
+            if (!std::isfinite(r)) return OperandValue::error(0x24); // #NUM!
+            return OperandValue(r);
+        }
+        }
     }
-    return tod(x) <= tod(y);
-}
-inline any
-_opr_gt(const any& x, const any& y) {
-    if (x.is_str() && y.is_str()) {
-        return x.to_str() <= y.to_str();
+    case tConcat:
+        return pool.add_string(_operand_text(aop, pool) +
+                               _operand_text(bop, pool));
+    default: {
+        int c = _operand_cmp(aop, bop, pool);
+        switch (opcd) {
+        case tLT: return OperandValue::boolean(c < 0);
+        case tLE: return OperandValue::boolean(c <= 0);
+        case tEQ: return OperandValue::boolean(c == 0);
+        case tGE: return OperandValue::boolean(c >= 0);
+        case tGT: return OperandValue::boolean(c > 0);
+        default:  return OperandValue::boolean(c != 0);
+        }
     }
-    return tod(x) <= tod(y);
-}
-inline any
-_opr_ne(const any& x, const any& y) {
-    if (x.is_str() && y.is_str()) {
-        return x.to_str() <= y.to_str();
     }
-    return tod(x) <= tod(y);
 }
 
-any num2strg(const any& a) {
-    // """Attempt to emulate Excel's default conversion
-    //    from number to string.
-    // """
-    if (a.is_int()) {
-        return a.to_str();
-    }
-    double num = a.to_double();
-    double v = num - (int)num;
-    if (std::abs(v) < 0.0000001) {
-        return strutil::format("%d", (int)num);
-    }
-    return strutil::format("%f", num);
-}
-any strg2num(const utils::any& a) {
-    if (a.is_str()) {
-        auto s = a.to_str();
-        if (s.find('.') == std::string::npos) {
-          return std::stoi(s);
+////
+// The value of a unary operator (tUplus, tUminus, tPercent) applied to
+// a constant oNUM or oSTRG operand.
+inline OperandValue
+unop_value(int opcode, const OperandValue& aop, const OperandPool& pool) {
+    if (opcode == 0x12) { // tUplus
+        return aop;
+    }
+    OperandValue a = strg2num(aop, pool);
+    if (a.tag == OperandValue::ERROR) {
+        return a;
+    }
+    switch (opcode) {
+    case 0x13: // tUminus
+        if (a.tag == OperandValue::INT && a.i != INT32_MIN) {
+            return OperandValue(-a.i);
         }
-        return std::stod(s);
-    } else if (a.is_int() || a.is<bool>()) {
-        return a.to_int();
+        return OperandValue(-a.to_double());
+    default:   // tPercent
+        return OperandValue(a.to_double() / 100.0);
     }
-    return a.to_double();
 }
 
-
-const MAP<int, decltype(nop)*>
-_arith_argdict = {{oNUM, &nop},
-                  {oSTRG, &strg2num}};
-
-const MAP<int, decltype(nop)*>
-_cmp_argdict =   {{oNUM, &nop},
-                  {oSTRG, &nop}};
-// Seems no conversions done on relops; in Excel, "1" > 9 produces TRUE.
-const MAP<int, decltype(nop)*>
-_strg_argdict = {{oNUM, &num2strg},
-                 {oSTRG, &nop}};
-
 #define T std::make_tuple
-const MAP<int,
-          std::tuple<decltype(_arith_argdict),
-                     int, decltype(_opr_add)*,
-                     int, std::string>>
+////
+// opcode => (result kind, rank, symbol)
+const MAP<int, std::tuple<int, int, std::string>>
 binop_rules = {
-    {tAdd,   T(_arith_argdict, oNUM, &_opr_add,  30, "+")},
-    {tSub,   T(_arith_argdict, oNUM, &_opr_sub,  30, "-")},
-    {tMul,   T(_arith_argdict, oNUM, &_opr_mul,  40, "*")},
-    {tDiv,   T(_arith_argdict, oNUM, &_opr_div,  40, "/")},
-    {tPower, T(_arith_argdict, oNUM, &_opr_pow, 50, "^")},
-    {tConcat,T(_strg_argdict, oSTRG, &_opr_add,  20, "&")},
-    {tLT,    T(_cmp_argdict, oBOOL, &_opr_lt,   10, "<")},
-    {tLE,    T(_cmp_argdict, oBOOL, &_opr_le,   10, "<=")},
-    {tEQ,    T(_cmp_argdict, oBOOL, &_opr_eq,   10, "=")},
-    {tGE,    T(_cmp_argdict, oBOOL, &_opr_ge,   10, ">=")},
-    {tGT,    T(_cmp_argdict, oBOOL, &_opr_gt,   10, ">")},
-    {tNE,    T(_cmp_argdict, oBOOL, &_opr_ne,   10, "<>")},
+    {tAdd,   T(oNUM,  30, "+")},
+    {tSub,   T(oNUM,  30, "-")},
+    {tMul,   T(oNUM,  40, "*")},
+    {tDiv,   T(oNUM,  40, "/")},
+    {tPower, T(oNUM,  50, "^")},
+    {tConcat,T(oSTRG, 20, "&")},
+    {tLT,    T(oBOOL, 10, "<")},
+    {tLE,    T(oBOOL, 10, "<=")},
+    {tEQ,    T(oBOOL, 10, "=")},
+    {tGE,    T(oBOOL, 10, ">=")},
+    {tGT,    T(oBOOL, 10, ">")},
+    {tNE,    T(oBOOL, 10, "<>")},
 };
 
-any _unm_minus(const utils::any& a) {
-    if (a.is_int() || a.is<bool>()) {
-        return -a.to_int();
-    }
-    return -a.to_double();
-}
-
-any _unm_percent(const utils::any& a) {
-    return a.to_double() / 100.0;
-}
-
-const MAP<int,
-               std::tuple<decltype(nop)*,
-                          int, char, char>>
+////
+// opcode => (rank, prefix symbol, suffix symbol)
+const MAP<int, std::tuple<int, char, char>>
 unop_rules = {
-    {0x13, T(*_unm_minus,   70, '-', '\0')}, // unary minus
-    {0x12, T(*nop,          70, '+', '\0')}, // unary plus
-    {0x14, T(*_unm_percent, 60, '\0',  '%')},// percent
+    {0x13, T(70, '-', '\0')}, // unary minus
+    {0x12, T(70, '+', '\0')}, // unary plus
+    {0x14, T(60, '\0', '%')}, // percent
 };
 #undef T
 
@@ -1320,21 +1640,23 @@ const int FUNC_RANK = 90;
 const int STACK_ALARM_LEVEL = 5;
 const int STACK_PANIC_LEVEL = 10;
 
+inline bool
+_is_constant(const Operand& op) {
+    return (op.kind == oNUM || op.kind == oSTRG) && !op.value.is_null();
+}
 
 inline void
-do_binop(int opcd, std::vector<Operand>& stk) {
+do_binop(int opcd, std::vector<Operand>& stk, OperandPool& pool) {
     //assert len(stk) >= 2
     auto bop = std::move(stk.back());
     stk.pop_back();
     auto aop = std::move(stk.back());
     stk.pop_back();
 
-    auto& tup = binop_rules.at(opcd);
-    decltype(_arith_argdict) argdict = std::get<0>(tup);
-    int result_kind                  = std::get<1>(tup);
-    decltype(_opr_add)* func         = std::get<2>(tup);
-    int rank                         = std::get<3>(tup);
-    std::string sym                  = std::get<4>(tup);
+    const auto& rule = binop_rules.at(opcd);
+    int result_kind        = std::get<0>(rule);
+    int rank               = std::get<1>(rule);
+    const std::string& sym = std::get<2>(rule);
 
     std::string otext;
     otext.append(aop.rank < rank?
@@ -1345,52 +1667,42 @@ do_binop(int opcd, std::vector<Operand>& stk) {
                  format("(%s)", bop.text):
                  bop.text);
     auto resop = Operand(result_kind, nullptr,
-                         rank, otext);
-    const auto& b_it = argdict.find(bop.kind);
-    const auto& a_it = argdict.find(aop.kind);
-    if (b_it == argdict.end() ||
-        a_it == argdict.end()) {
-        stk.push_back(std::move(resop));
-        return;
-    }
-    if (bop.value.is_null() ||aop.value.is_null()) {
-        stk.push_back(std::move(resop));
-        return;
-    }
-    auto bval = (*b_it->second)(bop.value);
-    auto aval = (*a_it->second)(aop.value);
-    any result = (*func)(aval, bval);
-    if (result_kind == oBOOL) {
-        result = result.cast<bool>()? 1: 0;
-    }
-    resop.value = result;
+                         rank, std::move(otext));
+    if (_is_constant(aop) && _is_constant(bop)) {
+        resop.value = binop_value(opcd, aop.value, bop.value, pool);
+        if (resop.value.tag == OperandValue::ERROR) {
+            resop.kind = oERR;
+        }
+    }
     stk.push_back(std::move(resop));
 };
 
 inline void
 do_unaryop(int opcode, int result_kind,
-           std::vector<Operand>& stk) {
+           std::vector<Operand>& stk, OperandPool& pool) {
     //assert len(stk) >= 1
     auto aop = std::move(stk.back());
     stk.pop_back();
-    auto& val = aop.value;
 
-    auto tup = unop_rules.at(opcode);
-    decltype(nop)* func = std::get<0>(tup);
-    int rank = std::get<1>(tup);
-    char sym1 = std::get<2>(tup);
-    char sym2 = std::get<3>(tup);
+    const auto& rule = unop_rules.at(opcode);
+    int rank  = std::get<0>(rule);
+    char sym1 = std::get<1>(rule);
+    char sym2 = std::get<2>(rule);
 
     std::string otext;
     if (sym1) otext.push_back(sym1);
     otext.append(aop.rank < rank?
-                 aop.text:
-                 format("(%s)", aop.text));
+                 format("(%s)", aop.text):
+                 aop.text);
     if (sym2) otext.push_back(sym2);
-    if (!val.is_null()) {
-        val = func(val);
+    auto resop = Operand(result_kind, nullptr, rank, std::move(otext));
+    if (_is_constant(aop)) {
+        resop.value = unop_value(opcode, aop.value, pool);
+        if (resop.value.tag == OperandValue::ERROR) {
+            resop.kind = oERR;
+        }
     }
-    stk.push_back(Operand(result_kind, std::move(val), rank, otext));
+    stk.push_back(std::move(resop));
 }
 
 inline void
@@ -1400,6 +1712,14 @@ not_in_name_formula(int op_arg, std::string oname_arg) {
                op_arg, oname_arg));
 }
 
+////
+// Evaluates the formula of nobj, first evaluating any name it refers to
+// that has not been evaluated yet; the result of each name is kept, so
+// every name is evaluated once. A reference back to a name whose
+// evaluation is still in progress (a cycle) evaluates to an unknown
+// operand and sets any_err, which the names on the cycle then inherit.
+// names_epilogue() uses name_evaluation_order() so that the targets are
+// normally evaluated already and nothing recurses.
 inline
 void evaluate_name_formula(FormulaBookDelegate* bk,
                            FormulaNameDelegate* nobj,
@@ -1419,10 +1739,9 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
                namex, nobj->name, fmlalen, bv, data, level);
         biffh::hex_char_dump(data, 0, fmlalen);
     }
-    if (level > STACK_PANIC_LEVEL) {
-        throw XLRDError("Excessive indirect references in NAME formula");
-    }
+    nobj->evaluated = -1;  // on the chain being evaluated; see tName
     auto& sztab = szdict.at(bv);
+    auto& pool = bk->operand_pool;
     int pos = 0;
     std::vector<Operand> stack = {};
     int any_rel = 0;
@@ -1465,7 +1784,7 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
                 // Add, Sub, Mul, Div, Power
                 // tConcat
                 // tLT, ..., tNE
-                do_binop(opcode, stack);
+                do_binop(opcode, stack, pool);
             } else if (opcode == 0x0F) { // tIsect
                 if (blah) { pprint("tIsect pre", stack); }
                 ASSERT(stack.size() >= 2);
@@ -1497,34 +1816,34 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
                     //pass
                 } else if (bop.kind == oREF && oREF == aop.kind) {
                     if (!aop.value.is_null() && !bop.value.is_null()) {
-                        ASSERT(aop.value.is<std::vector<Ref3D>>());
-                        ASSERT(bop.value.is<std::vector<Ref3D>>());
-                        auto aref = aop.value.cast<std::vector<Ref3D>>();
-                        auto bref = bop.value.cast<std::vector<Ref3D>>();
+                        ASSERT(aop.value.tag == OperandValue::REF);
+                        ASSERT(bop.value.tag == OperandValue::REF);
+                        const auto& aref = pool.refs_of(aop.value);
+                        const auto& bref = pool.refs_of(bop.value);
                         ASSERT(aref.size() == 1);
                         ASSERT(bref.size() == 1);
                         auto coords = do_box_funcs(tIsectFuncs,
                                                    aref[0].coords,
                                                    bref[0].coords);
-                        res.value = std::vector<Ref3D>{Ref3D(coords)};
+                        res.value = pool.add_refs(std::vector<Ref3D>{Ref3D(coords)});
                     }
                 } else if (bop.kind == oREL && oREL == aop.kind) {
                     res.kind = oREL;
                     if (!aop.value.is_null() and !bop.value.is_null()) {
-                        ASSERT(aop.value.is<std::vector<Ref3D>>());
-                        ASSERT(bop.value.is<std::vector<Ref3D>>());
-                        auto aref = aop.value.cast<std::vector<Ref3D>>();
-                        auto bref = bop.value.cast<std::vector<Ref3D>>();
+                        ASSERT(aop.value.tag == OperandValue::REF);
+                        ASSERT(bop.value.tag == OperandValue::REF);
+                        const auto& aref = pool.refs_of(aop.value);
+                        const auto& bref = pool.refs_of(bop.value);
                         ASSERT(aref.size() == 1);
                         ASSERT(bref.size() == 1);
-                        ASSERT(bop.value.is<std::vector<Ref3D>>());
+                        ASSERT(bop.value.tag == OperandValue::REF);
                         auto coords = do_box_funcs(tIsectFuncs,
                                                    aref[0].coords,
                                                    bref[0].coords);
                         auto& relfa = aref[0].relflags;
                         auto& relfb = aref[0].relflags;
                         if (relfa == relfb) {
-                            res.value = std::vector<Ref3D>{Ref3D(coords, relfa)};
+                            res.value = pool.add_refs(std::vector<Ref3D>{Ref3D(coords, relfa)});
                         }
                     }
                 } else {
@@ -1557,13 +1876,14 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
                         res.kind = oREL;
                     }
                     if (!aop.value.is_null() and !bop.value.is_null()) {
-                        ASSERT(aop.value.is<std::vector<Ref3D>>());
-                        ASSERT(bop.value.is<std::vector<Ref3D>>());
-                        auto aref = aop.value.cast<std::vector<Ref3D>>();
-                        auto bref = bop.value.cast<std::vector<Ref3D>>();
+                        ASSERT(aop.value.tag == OperandValue::REF);
+                        ASSERT(bop.value.tag == OperandValue::REF);
+                        auto aref = pool.refs_of(aop.value);
+                        const auto& bref = pool.refs_of(bop.value);
                         ASSERT(aref.size() >= 1);
                         ASSERT(bref.size() == 1);
                         aref.push_back(bref[0]);
+                        res.value = pool.add_refs(std::move(aref));
                     }
                 } else {
                     //pass
@@ -1590,23 +1910,23 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
                     res = oERR;
                 } else if (bop.kind == oREF and oREF == aop.kind) {
                     if (!aop.value.is_null() and !bop.value.is_null()) {
-                        ASSERT(aop.value.is<std::vector<Ref3D>>());
-                        ASSERT(bop.value.is<std::vector<Ref3D>>());
-                        auto aref = aop.value.cast<std::vector<Ref3D>>();
-                        auto bref = bop.value.cast<std::vector<Ref3D>>();
+                        ASSERT(aop.value.tag == OperandValue::REF);
+                        ASSERT(bop.value.tag == OperandValue::REF);
+                        const auto& aref = pool.refs_of(aop.value);
+                        const auto& bref = pool.refs_of(bop.value);
                         ASSERT(aref.size() == 1);
                         ASSERT(bref.size() == 1);
                         auto coords = do_box_funcs(tRangeFuncs, aref[0].coords,
                                                    bref[0].coords);
-                        res.value = std::vector<Ref3D>{Ref3D(coords)};
+                        res.value = pool.add_refs(std::vector<Ref3D>{Ref3D(coords)});
                     }
                 } else if (bop.kind == oREL and oREL == aop.kind) {
                     res.kind = oREL;
                     if (!aop.value.is_null() and !bop.value.is_null()) {
-                        ASSERT(aop.value.is<std::vector<Ref3D>>());
-                        ASSERT(bop.value.is<std::vector<Ref3D>>());
-                        auto aref = aop.value.cast<std::vector<Ref3D>>();
-                        auto bref = bop.value.cast<std::vector<Ref3D>>();
+                        ASSERT(aop.value.tag == OperandValue::REF);
+                        ASSERT(bop.value.tag == OperandValue::REF);
+                        const auto& aref = pool.refs_of(aop.value);
+                        const auto& bref = pool.refs_of(bop.value);
                         ASSERT(aref.size() == 1);
                         ASSERT(bref.size() == 1);
                         auto coords = do_box_funcs(tRangeFuncs,
@@ -1614,7 +1934,7 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
                         auto& relfa = aref[0].relflags;
                         auto& relfb = bref[0].relflags;
                         if (relfa == relfb) {
-                            res.value = std::vector<Ref3D>{Ref3D(coords, relfa)};
+                            res.value = pool.add_refs(std::vector<Ref3D>{Ref3D(coords, relfa)});
                         }
                     }
                 } else {
@@ -1623,7 +1943,7 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
                 stack.push_back(res);
                 if (blah) { pprint("tRange post", stack); }
             } else if (0x12 <= opcode && opcode <= 0x14) { // tUplus, tUminus, tPercent
-                do_unaryop(opcode, oNUM, stack);
+                do_unaryop(opcode, oNUM, stack, pool);
             } else if (opcode == 0x15) { // tParen
                 // source cosmetics
                 //pass
@@ -1639,11 +1959,11 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
                     tie(strg, newpos) = unpack_unicode_update_pos(
                                             data, pos+1, 1, -1);
                 }
-                int sz = newpos - pos;
+                sz = newpos - pos;
                 if (blah) { pprint("   sz=%d strg=%s", sz, strg); }
                 // text = '"' + strg.replace('"', '""') + '"';
                 auto text = format("\"%s\"", strutil::replace(strg, "\"", "\"\""));
-                stack.push_back(Operand(oSTRG, strg, LEAF_RANK, text));
+                stack.push_back(Operand(oSTRG, pool.add_string(strg), LEAF_RANK, text));
             } else if (opcode == 0x18) { // tExtended
                 // new with BIFF 8
                 ASSERT(bv >= 80);
@@ -1655,7 +1975,6 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
                 int nc = utils::as_uint16(data, pos+2);
                 auto subname = utils::getelse(tAttrNames,
                                               subop, "??Unknown??");
-                int sz;
                 if (subop == 0x04) { // Choose
                     sz = nc * 2 + 6;
                 } else if (subop == 0x10) { // Sum (single arg)
@@ -1691,12 +2010,12 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
                     int kind = oBOOL;
                     int value = utils::as_uint8(data, pos+1);
                     std::string text = value ? "TRUE": "FALSE";
-                    stack.push_back(Operand(kind, value, LEAF_RANK, text));
+                    stack.push_back(Operand(kind, OperandValue::boolean(value), LEAF_RANK, text));
                 } else {
                     int kind = oERR;
                     int value = utils::as_uint8(data, pos+1);
                     auto text = format("\"%s\"", error_text_from_code.at(value));
-                    stack.push_back(Operand(kind, value, LEAF_RANK, text));
+                    stack.push_back(Operand(kind, OperandValue::error(value), LEAF_RANK, text));
                 }
             } else {
                 throw FormulaError(format("Unhandled opcode: 0x%02x", opcode));
@@ -1806,7 +2125,7 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
                         if (nargs == 2 and !testarg.value.is_null()) {
                             // IF(FALSE, tv) => FALSE
                             res.kind = oBOOL;
-                            res.value = 0;
+                            res.value = OperandValue::boolean(false);
                         } else {
                             int respos = -nargs + 2 - ivalue;
                             const auto& chosen = stack[respos];
@@ -1854,7 +2173,12 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
                 evaluate_name_formula(bk, tgtobj, tgtnamex, blah, level+1);
             }
             Operand res;
-            if (tgtobj->macro or tgtobj->binary or tgtobj->any_err) {
+            if (tgtobj->evaluated < 0) {
+                // circular: tgtobj is still being evaluated further up
+                if (blah) { pprint("   tName: circular reference to %s", tgtobj->name); }
+                res = Operand(oUNK, nullptr);
+                any_err = 1;
+            } else if (tgtobj->macro or tgtobj->binary or tgtobj->any_err) {
                 if (blah) {
                     // tgtobj.dump(
                     //     bk->logfile,
@@ -1899,7 +2223,7 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
             if (optype == 1) {
                 std::array<int, 6> relflags = {{1, 1, row_rel,
                                                 row_rel, col_rel, col_rel}};
-                res = Operand(oREL, std::vector<Ref3D>{{Ref3D(coords, relflags)}});
+                res = Operand(oREL, pool.add_refs(std::vector<Ref3D>{{Ref3D(coords, relflags)}}));
             }
             stack.push_back(res);
         } else if (opcode == 0x05) { // tArea
@@ -1923,7 +2247,7 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
             auto res = Operand(oUNK, nullptr);
             if (optype == 1) {
                 auto relflags = std::array<int, 6>{{1, 1, row_rel1, row_rel2, col_rel1, col_rel2}};
-                res = Operand(oREL, vector<Ref3D>{Ref3D(coords, relflags)});
+                res = Operand(oREL, pool.add_refs(vector<Ref3D>{Ref3D(coords, relflags)}));
             }
             stack.push_back(std::move(res));
         } else if (opcode == 0x06) { // tMemArea
@@ -1995,7 +2319,7 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
             }
             res.rank = LEAF_RANK;
             if (optype == 1) {
-                res.value = vector<Ref3D>{{ref3d}};
+                res.value = pool.add_refs(vector<Ref3D>{{ref3d}});
             }
             stack.push_back(res);;
         } else if (opcode == 0x1B) { // tArea3d
@@ -2047,7 +2371,7 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
             }
             res.rank = LEAF_RANK;
             if (optype == 1) {
-                res.value = vector<Ref3D>{ref3d};
+                res.value = pool.add_refs(vector<Ref3D>{ref3d});
             }
             stack.push_back(res);
         } else if (opcode == 0x19) { // tNameX
@@ -2109,7 +2433,12 @@ void evaluate_name_formula(FormulaBookDelegate* bk,
                     ////// recursive //////
                     evaluate_name_formula(bk, tgtobj, tgtnamex, blah, level+1);
                 }
-                if (tgtobj->macro || tgtobj->binary || tgtobj->any_err) {
+                if (tgtobj->evaluated < 0) {
+                    // circular: tgtobj is still being evaluated further up
+                    if (blah) { pprint("   tNameX: circular reference to %s", tgtobj->name); }
+                    res = Operand(oUNK, nullptr);
+                    any_err = 1;
+                } else if (tgtobj->macro || tgtobj->binary || tgtobj->any_err) {
                     if (blah) {
                         // tgtobj.dump(
                         //     bk.logfile,
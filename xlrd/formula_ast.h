@@ -0,0 +1,1609 @@
+#pragma once
+
+////
+// Arena-allocated syntax trees for Excel formulas.
+//
+// <p>decompile_formula_ast() walks the same token stream as the Python
+// decompile_formula(), but instead of building an Operand (with its own
+// std::string and any) per token it appends fixed-size FormulaNode records
+// to a FormulaArena. One arena is meant to serve a whole book: the nodes of
+// a formula are a contiguous run of FormulaArena::nodes and refer to each
+// other by index, so once the arena has grown to its working size nothing
+// is allocated per token.</p>
+//
+// <p>Formula text is only produced on request, by formula_text().</p>
+////
+
+#include <cctype>
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "./formula.h"
+
+namespace xlrd {
+namespace formula {
+
+////
+// FormulaNode kinds. index and extra are interpreted as noted.
+const int nUNK    = 0;  // an operand that could not be decoded; prints as "?"
+const int nMSNG   = 1;  // tMissArg
+const int nNUM    = 2;  // tInt, tNum; index into FormulaArena::numbers
+const int nBOOL   = 3;  // tBool; index is 0 or 1
+const int nERR    = 4;  // tErr, tRefErr, tAreaErr, ...; index is the error code
+const int nSTR    = 5;  // tStr, add-in tNameX; extra bytes of FormulaArena::strings at index
+const int nREF    = 6;  // tRef, tArea, tRefN, tAreaN, tRef3d, tArea3d; index into FormulaArena::refs
+const int nNAME   = 7;  // tName, tNameX; index is the name index, extra the tNameX refx
+const int nBINOP  = 8;  // tAdd ... tNE, tIsect, tList, tRange; two children
+const int nUNOP   = 9;  // tUplus, tUminus, tPercent; one child
+const int nFUNC   = 10; // tFunc, tFuncVar, tAttrSum; aux is the function index
+const int nSHARED = 11; // tExp; index and extra are the rowx and colx of the base cell
+
+////
+// FormulaRef::relflags bits.
+const uint8_t REF_ROW1_REL = 0x01;
+const uint8_t REF_ROW2_REL = 0x02;
+const uint8_t REF_COL1_REL = 0x04;
+const uint8_t REF_COL2_REL = 0x08;
+const uint8_t REF_3D       = 0x10;
+const uint8_t REF_AREA     = 0x20;
+
+const uint32_t NO_FORMULA_NODE = 0xFFFFFFFF;
+
+////
+// A cell or area reference decoded from a tRef* or tArea* token.
+// <p>The coordinates are those of Ref3D: lo <= x < hi. A relative component
+// holds an offset from the cell the formula is applied to, an absolute one
+// an index, whatever the formula type; so the same reference decodes to the
+// same FormulaRef wherever its formula lives.</p>
+// <p>2D references refer to the current sheet and have shtxlo = 0,
+// shtxhi = 1. 3D references hold the sheet range given by
+// get_externsheet_local_range(), negative codes included.</p>
+struct FormulaRef {
+    int shtxlo;
+    int shtxhi;
+    int rowxlo;
+    int rowxhi;
+    int colxlo;
+    int colxhi;
+    uint8_t relflags;
+};
+
+////
+// One node of a formula tree. Children are children[child, child+nargs)
+// of the arena, in argument order.
+struct FormulaNode {
+    uint8_t kind;     // nUNK ... nSHARED
+    int8_t okind;     // oUNK, oNUM, oREF, ... as Operand::kind
+    uint8_t rank;     // operator precedence, as Operand::rank
+    uint8_t opx;      // token; opcode + 32 for operand class tokens
+    uint16_t nargs;
+    int16_t aux;      // nFUNC: funcx; nNAME: first sheet of a tNameX target
+    uint32_t child;
+    uint32_t index;
+    uint32_t extra;
+};
+
+////
+// Storage shared by the formulas of a book.
+class FormulaArena {
+public:
+    std::vector<FormulaNode> nodes;
+    std::vector<uint32_t> children;
+    std::vector<FormulaRef> refs;
+    std::vector<double> numbers;
+    std::string strings;  // UTF-8
+    // operand stack, kept here so its capacity is reused
+    std::vector<uint32_t> stack;
+
+    ////
+    // Forgets every tree but keeps the memory.
+    inline void clear() {
+        nodes.clear();
+        children.clear();
+        refs.clear();
+        numbers.clear();
+        strings.clear();
+        stack.clear();
+    }
+};
+
+// Sheet limits of the formats formulas come from. Relative references
+// wrap around them, and whole rows or columns span them.
+const int BIFF_MAX_ROWS = 65536;
+const int BIFF_MAX_COLS = 256;
+const int XLSX_MAX_ROWS = 1048576;
+const int XLSX_MAX_COLS = 16384;
+
+////
+// A decompiled formula: its nodes are nodes[node_begin, node_end) of the
+// arena. root is NO_FORMULA_NODE when the tokens did not reduce to a single
+// operand (decompile_formula() returns None for those).
+// max_rows and max_cols are the sheet limits of the format it came from.
+struct FormulaAst {
+    uint32_t root = NO_FORMULA_NODE;
+    uint32_t node_begin = 0;
+    uint32_t node_end = 0;
+    int fmlatype = FMLA_TYPE_CELL;
+    int max_rows = BIFF_MAX_ROWS;
+    int max_cols = BIFF_MAX_COLS;
+    int any_rel = 0;
+    int any_err = 0;
+    int any_external = 0;
+};
+
+inline void
+_ast_append_utf8(std::string& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out.push_back((char)cp);
+    } else if (cp < 0x800) {
+        out.push_back((char)(0xC0 | (cp >> 6)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back((char)(0xE0 | (cp >> 12)));
+        out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back((char)(0xF0 | (cp >> 18)));
+        out.push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+inline std::string
+_ast_token_error(const char* what, int op, int bv) {
+    char buf[96];
+    snprintf(buf, sizeof(buf), "ERROR *** %s 0x%02x (%s); biff_version=%d",
+             what, op, onames.at((op & 0x1f) + (op & 0x60 ? 32 : 0)).c_str(), bv);
+    return buf;
+}
+
+////
+// Pops nargs operands off arena.stack as the children of a new node and
+// pushes that node.
+inline uint32_t
+_ast_push(FormulaArena& arena, int kind, int okind, int rank, int opx,
+          uint32_t index=0, uint32_t extra=0, int nargs=0, int aux=0)
+{
+    auto& stack = arena.stack;
+    if ((int)stack.size() < nargs) {
+        throw FormulaError("decompile_formula_ast: operand stack underflow");
+    }
+    FormulaNode node;
+    node.kind = kind;
+    node.okind = okind;
+    node.rank = rank;
+    node.opx = opx;
+    node.nargs = nargs;
+    node.aux = aux;
+    node.child = arena.children.size();
+    node.index = index;
+    node.extra = extra;
+    if (nargs) {
+        auto first = stack.end() - nargs;
+        arena.children.insert(arena.children.end(), first, stack.end());
+        stack.erase(first, stack.end());
+    }
+    uint32_t nodex = arena.nodes.size();
+    arena.nodes.push_back(node);
+    stack.push_back(nodex);
+    return nodex;
+}
+
+inline void
+_ast_push_ref(FormulaArena& arena, FormulaAst& ast, int opx,
+              int shx1, int shx2,
+              const std::array<int, 4>& addr1, const std::array<int, 4>& addr2,
+              uint8_t flags)
+{
+    FormulaRef ref;
+    ref.shtxlo = shx1;
+    ref.shtxhi = shx2 + 1;
+    ref.rowxlo = addr1[0];
+    ref.rowxhi = addr2[0] + 1;
+    ref.colxlo = addr1[1];
+    ref.colxhi = addr2[1] + 1;
+    ref.relflags = flags
+                 | (addr1[2] ? REF_ROW1_REL : 0) | (addr2[2] ? REF_ROW2_REL : 0)
+                 | (addr1[3] ? REF_COL1_REL : 0) | (addr2[3] ? REF_COL2_REL : 0);
+    int is_rel = (ref.relflags & 0x0F) != 0;
+    ast.any_rel |= is_rel;
+    if (flags & REF_3D) {
+        ast.any_err |= shx1 < -1;
+        ast.any_external |= shx1 == -4;
+    }
+    arena.refs.push_back(ref);
+    _ast_push(arena, nREF, is_rel ? oREL : oREF, LEAF_RANK, opx,
+              arena.refs.size() - 1);
+}
+
+////
+// Decodes the tStr payload at data[pos] (its length byte) onto the end of
+// arena.strings, returning the position after it. BIFF 8 strings are
+// converted in place; earlier versions go through unpack_string_update_pos().
+inline int
+_ast_unpack_str(FormulaArena& arena, const std::vector<uint8_t>& data,
+                int pos, int bv, const std::string& encoding)
+{
+    if (bv <= 70) {
+        std::string strg;
+        int newpos;
+        std::tie(strg, newpos) = unpack_string_update_pos(data, pos, encoding, 1, -1);
+        arena.strings.append(strg);
+        return newpos;
+    }
+    int size = data.size();
+    int nchars = data[pos];
+    pos += 1;
+    if (nchars == 0 && pos >= size) {
+        // Zero-length string with no options byte
+        return pos;
+    }
+    uint8_t options = data[pos];
+    pos += 1;
+    int rt = 0;
+    int sz = 0;
+    if (options & 0x08) { // richtext
+        rt = utils::as_uint16(data, pos);
+        pos += 2;
+    }
+    if (options & 0x04) { // phonetic
+        sz = utils::as_int32(data, pos);
+        pos += 4;
+    }
+    int nbytes = (options & 0x01) ? 2 * nchars : nchars;
+    if (pos + nbytes > size) {
+        throw FormulaError("tStr runs past the end of the formula");
+    }
+    if (options & 0x01) {
+        // Uncompressed UTF-16-LE
+        for (int i = 0; i < nchars; ++i, pos += 2) {
+            uint32_t cp = data[pos] | (data[pos+1] << 8);
+            if (0xD800 <= cp && cp < 0xDC00 && i + 1 < nchars) {
+                uint32_t lo = data[pos+2] | (data[pos+3] << 8);
+                if (0xDC00 <= lo && lo < 0xE000) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    pos += 2;
+                    ++i;
+                }
+            }
+            _ast_append_utf8(arena.strings, cp);
+        }
+    }
+    else {
+        // "Compressed": latin_1, one byte per character
+        for (int i = 0; i < nchars; ++i, ++pos) {
+            _ast_append_utf8(arena.strings, data[pos]);
+        }
+    }
+    return pos + 4 * rt + sz;
+}
+
+////
+// Decompiles the formula whose tokens are data[pos, pos+fmlalen) into arena.
+// <p>fmlatype is one of the FMLA_TYPE_* constants. Cell and array formulas
+// store relative references as plain addresses, so for those browx and bcolx
+// must give the cell the formula belongs to; the other types store offsets
+// and ignore them.</p>
+// <p>Unlike decompile_formula(), tMemArea and the other tMem* tokens, which
+// only prefix a sub-expression, leave the stack alone, and relative 3D areas
+// are resolved against browx/bcolx like any other reference.</p>
+inline FormulaAst
+decompile_formula_ast(FormulaBookDelegate* bk, FormulaArena& arena,
+                      const std::vector<uint8_t>& data, int fmlalen,
+                      int fmlatype=FMLA_TYPE_CELL,
+                      int browx=-1, int bcolx=-1, int pos=0)
+{
+    const int reldelta_types = FMLA_TYPE_SHARED | FMLA_TYPE_NAME
+                             | FMLA_TYPE_COND_FMT | FMLA_TYPE_DATA_VAL;
+    int reldelta = (fmlatype & reldelta_types) != 0;
+    int bv = bk->biff_version;
+    if (!reldelta && (browx < 0 || bcolx < 0)) {
+        throw FormulaError("decompile_formula_ast: cell and array formulas need browx and bcolx");
+    }
+    if (pos < 0 || fmlalen < 0 || pos + fmlalen > (int)data.size()) {
+        throw FormulaError("decompile_formula_ast: formula runs past the end of its data");
+    }
+    const auto& sztab = szdict.at(bv);
+    auto& nodes = arena.nodes;
+    auto& stack = arena.stack;
+    stack.clear();
+
+    FormulaAst ast;
+    ast.fmlatype = fmlatype;
+    ast.node_begin = nodes.size();
+    if (fmlalen == 0) {
+        _ast_push(arena, nUNK, oUNK, 0, 0);
+    }
+
+    int end = pos + fmlalen;
+    while (pos < end) {
+        int op = data[pos];
+        int opcode = op & 0x1f;
+        int optype = (op & 0x60) >> 5;
+        int opx = optype ? opcode + 32 : opcode;
+        int sz = sztab[opx];
+        if (sz == -2) {
+            throw FormulaError(_ast_token_error("Unexpected token", op, bv));
+        }
+        if (!optype) {
+            if (opcode <= 0x01) { // tExp
+                ASSERT(stack.empty());
+                int rowx = utils::as_uint16(data, pos+1);
+                int colx = bv >= 30 ? utils::as_uint16(data, pos+3) : data[pos+3];
+                _ast_push(arena, nSHARED, oUNK, LEAF_RANK, opx, rowx, colx);
+            } else if (0x03 <= opcode && opcode <= 0x0E) {
+                // tAdd, tSub, tMul, tDiv, tPower, tConcat, tLT, ..., tNE
+                const auto& rule = binop_rules.at(opcode);
+                _ast_push(arena, nBINOP, std::get<0>(rule), std::get<1>(rule),
+                          opx, 0, 0, 2);
+            } else if (0x0F <= opcode && opcode <= 0x11) { // tIsect, tList, tRange
+                ASSERT(stack.size() >= 2);
+                int akind = nodes[stack[stack.size()-2]].okind;
+                int bkind = nodes[stack[stack.size()-1]].okind;
+                int okind = oREF;
+                if (akind == oERR || bkind == oERR) {
+                    okind = oERR;
+                } else if (opcode == 0x0F) {
+                    if (akind == oREL && bkind == oREL) {
+                        okind = oREL;
+                    }
+                } else if (opcode == 0x10) {
+                    if ((akind == oREF || akind == oREL) &&
+                        (bkind == oREF || bkind == oREL) &&
+                        (akind == oREL || bkind == oREL)) {
+                        okind = oREL;
+                    }
+                }
+                _ast_push(arena, nBINOP, okind, 80, opx, 0, 0, 2);
+            } else if (0x12 <= opcode && opcode <= 0x14) { // tUplus, tUminus, tPercent
+                _ast_push(arena, nUNOP, oNUM, std::get<0>(unop_rules.at(opcode)),
+                          opx, 0, 0, 1);
+            } else if (opcode == 0x15) { // tParen
+                // source cosmetics
+            } else if (opcode == 0x16) { // tMissArg
+                _ast_push(arena, nMSNG, oMSNG, LEAF_RANK, opx);
+            } else if (opcode == 0x17) { // tStr
+                uint32_t begin = arena.strings.size();
+                int newpos = _ast_unpack_str(arena, data, pos+1, bv, bk->encoding);
+                sz = newpos - pos;
+                _ast_push(arena, nSTR, oSTRG, LEAF_RANK, opx,
+                          begin, arena.strings.size() - begin);
+            } else if (opcode == 0x18) { // tExtended
+                // new with BIFF 8; not in OOo docs
+                ASSERT(bv >= 80);
+                throw FormulaError("tExtended token not implemented");
+            } else if (opcode == 0x19) { // tAttr
+                int subop = data[pos+1];
+                int nc = utils::as_uint16(data, pos+2);
+                if (subop == 0x04) { // Choose
+                    sz = nc * 2 + 6;
+                } else {
+                    sz = 4;
+                }
+                if (subop == 0x10) { // Sum (single arg)
+                    _ast_push(arena, nFUNC, oNUM, FUNC_RANK, opx, 0, 0, 1, 4);
+                }
+            } else if (0x1A <= opcode && opcode <= 0x1B) { // tSheet, tEndSheet
+                ASSERT(bv < 50);
+                throw FormulaError("tSheet & tEndsheet tokens not implemented");
+            } else if (opcode == 0x1C) { // tErr
+                _ast_push(arena, nERR, oERR, LEAF_RANK, opx, data[pos+1]);
+            } else if (opcode == 0x1D) { // tBool
+                _ast_push(arena, nBOOL, oBOOL, LEAF_RANK, opx, data[pos+1] != 0);
+            } else if (opcode == 0x1E) { // tInt
+                arena.numbers.push_back(utils::as_uint16(data, pos+1));
+                _ast_push(arena, nNUM, oNUM, LEAF_RANK, opx, arena.numbers.size() - 1);
+            } else if (opcode == 0x1F) { // tNum
+                arena.numbers.push_back(utils::as_double(data, pos+1));
+                _ast_push(arena, nNUM, oNUM, LEAF_RANK, opx, arena.numbers.size() - 1);
+            } else {
+                throw FormulaError(_ast_token_error("Unhandled opcode", op, bv));
+            }
+            if (sz <= 0) {
+                throw FormulaError(_ast_token_error("Size not set for opcode", op, bv));
+            }
+            pos += sz;
+            continue;
+        }
+        if (opcode == 0x00) { // tArray
+            _ast_push(arena, nUNK, oUNK, 0, opx);
+        } else if (opcode == 0x01) { // tFunc
+            int funcx = bv >= 40 ? utils::as_uint16(data, pos+1) : data[pos+1];
+            const auto& it = func_defs.find(funcx);
+            if (it == func_defs.end()) {
+                _ast_push(arena, nUNK, oUNK, 0, opx);
+            } else {
+                int nargs = std::get<1>(it->second);
+                _ast_push(arena, nFUNC, oUNK, FUNC_RANK, opx, 0, 0, nargs, funcx);
+            }
+        } else if (opcode == 0x02) { // tFuncVar
+            int nargs = data[pos+1] & 0x7f;  // high bit: prompt
+            int funcx = (bv >= 40 ? utils::as_uint16(data, pos+2) : data[pos+2]) & 0x7fff;
+            int minargs = 1;
+            int maxargs = 30;
+            if (funcx != 255) { // 255: CALL_ADDIN
+                const auto& it = func_defs.find(funcx);
+                if (it == func_defs.end()) {
+                    _ast_push(arena, nUNK, oUNK, 0, opx);
+                    pos += sz;
+                    continue;
+                }
+                minargs = std::get<1>(it->second);
+                maxargs = std::get<2>(it->second);
+            }
+            ASSERT(minargs <= nargs && nargs <= maxargs);
+            _ast_push(arena, nFUNC, oUNK, FUNC_RANK, opx, 0, 0, nargs, funcx);
+        } else if (opcode == 0x03) { // tName
+            // Only change with BIFF version is number of trailing UNUSED bytes!
+            int tgtnamex = utils::as_uint16(data, pos+1) - 1;
+            _ast_push(arena, nNAME, oUNK, LEAF_RANK, opx, tgtnamex, 0, 0, -1);
+        } else if (opcode == 0x04 || opcode == 0x0C) { // tRef, tRefN
+            auto addr = get_cell_addr(data, pos+1, bv, reldelta, browx, bcolx);
+            _ast_push_ref(arena, ast, opx, 0, 0, addr, addr, 0);
+            if (opcode == 0x0C) {
+                // note *ALL* tRefN usage has signed offset for relative addresses
+                ast.any_rel = 1;
+            }
+        } else if (opcode == 0x05 || opcode == 0x0D) { // tArea, tAreaN
+            std::array<int, 4> addr1, addr2;
+            std::tie(addr1, addr2) = get_cell_range_addr(data, pos+1, bv, reldelta,
+                                                         browx, bcolx);
+            _ast_push_ref(arena, ast, opx, 0, 0, addr1, addr2, REF_AREA);
+            if (opcode == 0x0D) {
+                ast.any_rel = 1;
+            }
+        } else if ((0x06 <= opcode && opcode <= 0x09) ||
+                   (0x0E <= opcode && opcode <= 0x0F)) {
+            // tMemArea, tMemErr, tMemNoMem, tMemFunc, tMemAreaN, tMemNoMemN:
+            // the sub-expression follows as ordinary tokens; no effect on stack
+            if (opcode == 0x07) {
+                ast.any_err = 1;
+            }
+        } else if (opcode == 0x1A || opcode == 0x1B) { // tRef3d, tArea3d
+            int shx1, shx2;
+            int addrpos;
+            if (bv >= 80) {
+                int refx = utils::as_uint16(data, pos+1);
+                std::tie(shx1, shx2) = get_externsheet_local_range(bk, refx);
+                addrpos = pos + 3;
+            } else {
+                int raw_extshtx = utils::as_int16(data, pos+1);
+                int raw_shx1    = utils::as_int16(data, pos+11);
+                int raw_shx2    = utils::as_int16(data, pos+13);
+                std::tie(shx1, shx2) = get_externsheet_local_range_b57(
+                                            bk, raw_extshtx, raw_shx1, raw_shx2);
+                addrpos = pos + 15;
+            }
+            if (opcode == 0x1A) {
+                auto addr = get_cell_addr(data, addrpos, bv, reldelta, browx, bcolx);
+                _ast_push_ref(arena, ast, opx, shx1, shx2, addr, addr, REF_3D);
+            } else {
+                std::array<int, 4> addr1, addr2;
+                std::tie(addr1, addr2) = get_cell_range_addr(data, addrpos, bv, reldelta,
+                                                             browx, bcolx);
+                _ast_push_ref(arena, ast, opx, shx1, shx2, addr1, addr2,
+                              REF_3D | REF_AREA);
+            }
+        } else if (opcode == 0x19) { // tNameX
+            int dodgy = 0;
+            int refx, tgtnamex, origrefx;
+            if (bv >= 80) {
+                refx = utils::as_uint16(data, pos+1);
+                tgtnamex = utils::as_uint16(data, pos+3) - 1;
+                origrefx = refx;
+            } else {
+                refx = utils::as_int16(data, pos+1);
+                tgtnamex = utils::as_uint16(data, pos+11) - 1;
+                origrefx = refx;
+                if (refx > 0) {
+                    refx -= 1;
+                } else if (refx < 0) {
+                    refx = -refx - 1;
+                } else {
+                    dodgy = 1;
+                }
+            }
+            int shx1 = -666;
+            int shx2 = -666;
+            if (!dodgy) {
+                if (bv >= 80) {
+                    std::tie(shx1, shx2) = get_externsheet_local_range(bk, refx);
+                } else if (origrefx > 0) {
+                    shx1 = shx2 = -4; // external ref
+                } else if (refx < (int)bk->_externsheet_type_b57.size() &&
+                           bk->_externsheet_type_b57[refx] == 4) {
+                    // non-specific sheet in own doc't
+                    shx1 = shx2 = -1; // internal, any sheet
+                }
+            }
+            ast.any_external |= shx1 == -4;
+            if (shx1 == -5 && 0 <= tgtnamex &&
+                tgtnamex < (int)bk->addin_func_names.size()) { // addin func name
+                const auto& addin = bk->addin_func_names[tgtnamex];
+                uint32_t begin = arena.strings.size();
+                arena.strings.append(addin);
+                _ast_push(arena, nSTR, oSTRG, LEAF_RANK, opx, begin, addin.size());
+            } else {
+                _ast_push(arena, nNAME, oUNK, LEAF_RANK, opx,
+                          tgtnamex, origrefx, 0, shx1);
+            }
+        } else if (opcode == 0x0A || opcode == 0x0B ||
+                   opcode == 0x1C || opcode == 0x1D) {
+            // tRefErr, tAreaErr, tRefErr3d, tAreaErr3d
+            ast.any_err = 1;
+            _ast_push(arena, nERR, oERR, LEAF_RANK, opx, 0x17); // #REF!
+        } else {
+            // Not handled yet
+            ast.any_err = 1;
+        }
+        if (sz <= 0) {
+            throw FormulaError("Fatal: token size is not positive");
+        }
+        pos += sz;
+    }
+    if (stack.size() == 1) {
+        ast.root = stack[0];
+    }
+    ast.node_end = nodes.size();
+    return ast;
+}
+
+// === Shared formulas ===
+
+////
+// The shared formulas (SHRFMLA records) of a sheet, each decompiled once.
+// <p>A SHRFMLA body is decompiled as FMLA_TYPE_SHARED, so its relative
+// references -- tRefN and tAreaN, decoded by adjust_cell_addr_biff8() --
+// become offsets from whatever cell the formula is applied to. That tree
+// is the template for every cell of the range: the FORMULA record of such
+// a cell holds only tExp(rowx, colx), naming the first cell of the range,
+// and is evaluated or printed by applying the template at its own cell
+// (e.g. formula_text(bk, arena, *table.find(...), rowx, colx)). Nothing is
+// decompiled per cell, and bodies with the same tokens, as in a column
+// split over several SHRFMLA records, share one template.</p>
+class SharedFormulaTable {
+public:
+    struct Entry {
+        int rowxlo;
+        int rowxhi;  // exclusive
+        int colxlo;
+        int colxhi;  // exclusive
+        uint32_t tmpl;  // index into templates
+    };
+
+    std::vector<FormulaAst> templates;
+    // key of the first cell of the range => entry
+    MAP<uint64_t, Entry> entries;
+    // token bytes => index into templates
+    MAP<std::string, uint32_t> _by_tokens;
+
+    static uint64_t key(int rowx, int colx) {
+        return ((uint64_t)(uint32_t)rowx << 32) | (uint32_t)colx;
+    }
+
+    ////
+    // Decodes the SHRFMLA record body at data[pos]; returns its template.
+    const FormulaAst& add(FormulaBookDelegate* bk, FormulaArena& arena,
+                          const std::vector<uint8_t>& data, int pos=0)
+    {
+        if (pos + 10 > (int)data.size()) {
+            throw FormulaError("SHRFMLA record too short");
+        }
+        Entry entry;
+        entry.rowxlo = utils::as_uint16(data, pos);
+        entry.rowxhi = utils::as_uint16(data, pos + 2) + 1;
+        entry.colxlo = data[pos + 4];
+        entry.colxhi = data[pos + 5] + 1;
+        int fmlalen = utils::as_uint16(data, pos + 8);
+        if (pos + 10 + fmlalen > (int)data.size()) {
+            throw FormulaError("SHRFMLA formula runs past the end of the record");
+        }
+        std::string tokens(data.begin() + pos + 10, data.begin() + pos + 10 + fmlalen);
+        const auto& it = _by_tokens.find(tokens);
+        if (it != _by_tokens.end()) {
+            entry.tmpl = it->second;
+        } else {
+            entry.tmpl = templates.size();
+            templates.push_back(decompile_formula_ast(bk, arena, data, fmlalen,
+                                                      FMLA_TYPE_SHARED, -1, -1, pos + 10));
+            _by_tokens.emplace(std::move(tokens), entry.tmpl);
+        }
+        entries[key(entry.rowxlo, entry.colxlo)] = entry;
+        return templates[entry.tmpl];
+    }
+
+    ////
+    // The template of the shared formula whose first cell is (rowx, colx),
+    // or nullptr if no such SHRFMLA has been added.
+    const FormulaAst* find(int rowx, int colx) const {
+        const auto& it = entries.find(key(rowx, colx));
+        return it == entries.end() ? nullptr : &templates[it->second.tmpl];
+    }
+
+    ////
+    // If data[pos, pos+fmlalen) is a lone tExp token, sets rowx and colx to
+    // the cell it names and returns true. FORMULA records of shared (and
+    // array) formula cells are like that.
+    static bool
+    is_instance(const std::vector<uint8_t>& data, int fmlalen, int pos,
+                int& rowx, int& colx)
+    {
+        if (fmlalen != 5 || pos + 5 > (int)data.size() || data[pos] != 0x01) {
+            return false;
+        }
+        rowx = utils::as_uint16(data, pos + 1);
+        colx = utils::as_uint16(data, pos + 3);
+        return true;
+    }
+
+    ////
+    // ast itself, or the template it stands for if it is a decompiled
+    // tExp naming a known shared formula.
+    const FormulaAst& resolve(const FormulaArena& arena, const FormulaAst& ast) const {
+        if (ast.root == NO_FORMULA_NODE) {
+            return ast;
+        }
+        const FormulaNode& n = arena.nodes[ast.root];
+        if (n.kind != nSHARED) {
+            return ast;
+        }
+        const FormulaAst* tmpl = find(n.index, n.extra);
+        return tmpl ? *tmpl : ast;
+    }
+};
+
+// === Formula text ===
+// xlsx files keep formulas as A1-style text (the contents of <f>) rather
+// than tokens. parse_formula_text() reads that text into the same nodes
+// as decompile_formula_ast(), so one evaluator serves both formats.
+
+////
+// Reverse of func_defs: upper-case function name => function index.
+inline const MAP<std::string, int>&
+_func_index() {
+    static const MAP<std::string, int> index = [] {
+        MAP<std::string, int> m;
+        for (const auto& it: func_defs) {
+            m[std::get<0>(it.second)] = it.first;
+        }
+        return m;
+    }();
+    return index;
+}
+
+inline bool
+_ast_iequal(const char* a, size_t alen, const std::string& b) {
+    if (alen != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < alen; ++i) {
+        if (std::toupper((unsigned char)a[i]) != std::toupper((unsigned char)b[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+class _FormulaTextParser {
+public:
+    FormulaArena& arena;
+    FormulaAst& ast;
+    const std::vector<std::string>& sheet_names;
+    const MAP<std::string, int>* names;
+    int browx;
+    int bcolx;
+    const char* begin;
+    const char* p;
+    const char* end;
+    bool sheet_seen = false; // a sheet prefix was read for the next reference
+
+    _FormulaTextParser(FormulaArena& arena_, FormulaAst& ast_,
+                       const std::vector<std::string>& sheet_names_,
+                       const MAP<std::string, int>* names_,
+                       int browx_, int bcolx_, const std::string& text)
+    : arena(arena_), ast(ast_), sheet_names(sheet_names_), names(names_),
+      browx(browx_), bcolx(bcolx_),
+      begin(text.data()), p(text.data()), end(text.data() + text.size())
+    {}
+
+    [[noreturn]] void fail(const char* what) {
+        char buf[96];
+        snprintf(buf, sizeof(buf), "parse_formula_text: %s at offset %d",
+                 what, (int)(p - begin));
+        throw FormulaError(buf);
+    }
+
+    void skip_space() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+            ++p;
+        }
+    }
+
+    bool accept(char c) {
+        skip_space();
+        if (p < end && *p == c) {
+            ++p;
+            return true;
+        }
+        return false;
+    }
+
+    void binop(int opcode) {
+        const auto& rule = binop_rules.at(opcode);
+        _ast_push(arena, nBINOP, std::get<0>(rule), std::get<1>(rule), opcode, 0, 0, 2);
+    }
+
+    void unop(int opcode) {
+        _ast_push(arena, nUNOP, oNUM, std::get<0>(unop_rules.at(opcode)), opcode, 0, 0, 1);
+    }
+
+    void error(int code) {
+        ast.any_err = 1;
+        _ast_push(arena, nERR, oERR, LEAF_RANK, 0x1C, code);
+    }
+
+    // Operators from lowest to highest precedence: comparisons, &, + -,
+    // * /, ^, %, unary + -, and the reference operators.
+    void expr() {
+        concat();
+        for (;;) {
+            skip_space();
+            int opcode;
+            if (end - p >= 2 && p[0] == '<' && p[1] == '=') {
+                opcode = tLE;
+            } else if (end - p >= 2 && p[0] == '>' && p[1] == '=') {
+                opcode = tGE;
+            } else if (end - p >= 2 && p[0] == '<' && p[1] == '>') {
+                opcode = tNE;
+            } else if (p < end && *p == '<') {
+                opcode = tLT;
+            } else if (p < end && *p == '>') {
+                opcode = tGT;
+            } else if (p < end && *p == '=') {
+                opcode = tEQ;
+            } else {
+                return;
+            }
+            p += (opcode == tLT || opcode == tGT || opcode == tEQ) ? 1 : 2;
+            concat();
+            binop(opcode);
+        }
+    }
+
+    void concat() {
+        additive();
+        while (accept('&')) {
+            additive();
+            binop(tConcat);
+        }
+    }
+
+    void additive() {
+        term();
+        for (;;) {
+            if (accept('+')) {
+                term();
+                binop(tAdd);
+            } else if (accept('-')) {
+                term();
+                binop(tSub);
+            } else {
+                return;
+            }
+        }
+    }
+
+    void term() {
+        power();
+        for (;;) {
+            if (accept('*')) {
+                power();
+                binop(tMul);
+            } else if (accept('/')) {
+                power();
+                binop(tDiv);
+            } else {
+                return;
+            }
+        }
+    }
+
+    void power() {
+        percent();
+        while (accept('^')) {
+            percent();
+            binop(tPower);
+        }
+    }
+
+    void percent() {
+        unary();
+        while (accept('%')) {
+            unop(0x14);
+        }
+    }
+
+    void unary() {
+        if (accept('-')) {
+            unary();
+            unop(0x13);
+        } else if (accept('+')) {
+            unary();
+            unop(0x12);
+        } else {
+            range();
+        }
+    }
+
+    void range() {
+        primary();
+        for (;;) {
+            bool space = p < end && *p == ' ';
+            if (accept(':')) {
+                primary();
+                _ast_push(arena, nBINOP, oREF, 80, 0x11, 0, 0, 2);
+                continue;
+            }
+            // a space before another reference is the intersection operator
+            if (space && p < end &&
+                (std::isalpha((unsigned char)*p) || *p == '$' || *p == '\'')) {
+                primary();
+                _ast_push(arena, nBINOP, oREF, 80, 0x0F, 0, 0, 2);
+                continue;
+            }
+            return;
+        }
+    }
+
+    static bool is_name_char(char c) {
+        return std::isalnum((unsigned char)c) || c == '_' || c == '.' || c == '\\' ||
+               (unsigned char)c >= 0x80;
+    }
+
+    void primary() {
+        skip_space();
+        if (p >= end) {
+            fail("unexpected end of formula");
+        }
+        char c = *p;
+        if (c == '(') {
+            ++p;
+            expr();
+            while (accept(',')) {
+                expr();
+                _ast_push(arena, nBINOP, oREF, 80, 0x10, 0, 0, 2);
+            }
+            if (!accept(')')) {
+                fail("expected ')'");
+            }
+        } else if (c == '"') {
+            string();
+        } else if (c == '#') {
+            error_literal();
+        } else if (c == '{') {
+            fail("array constants are not supported");
+        } else if (c == '\'') {
+            int shx1, shx2;
+            sheet_prefix(shx1, shx2);
+            reference(shx1, shx2, true);
+        } else if (std::isdigit((unsigned char)c) || c == '.') {
+            if (!reference(0, 0, false)) {
+                number();
+            }
+        } else if (c == '$' || is_name_char(c)) {
+            if (!reference(0, 0, false)) {
+                identifier();
+            }
+        } else {
+            fail("unexpected character");
+        }
+    }
+
+    void string() {
+        ++p;
+        uint32_t strbegin = arena.strings.size();
+        for (;;) {
+            if (p >= end) {
+                fail("unterminated string");
+            }
+            if (*p == '"') {
+                if (p + 1 < end && p[1] == '"') {
+                    arena.strings.push_back('"');
+                    p += 2;
+                    continue;
+                }
+                ++p;
+                break;
+            }
+            arena.strings.push_back(*p++);
+        }
+        _ast_push(arena, nSTR, oSTRG, LEAF_RANK, 0x17,
+                  strbegin, arena.strings.size() - strbegin);
+    }
+
+    void error_literal() {
+        for (const auto& it: error_text_from_code) {
+            const std::string& text = it.second;
+            if ((size_t)(end - p) >= text.size() &&
+                _ast_iequal(p, text.size(), text)) {
+                p += text.size();
+                error(it.first);
+                return;
+            }
+        }
+        fail("unknown error literal");
+    }
+
+    void number() {
+        const char* start = p;
+        while (p < end && (std::isdigit((unsigned char)*p) || *p == '.')) {
+            ++p;
+        }
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            const char* q = p + 1;
+            if (q < end && (*q == '+' || *q == '-')) ++q;
+            if (q < end && std::isdigit((unsigned char)*q)) {
+                p = q;
+                while (p < end && std::isdigit((unsigned char)*p)) ++p;
+            }
+        }
+        double value;
+        if (!utils::parse::parse_double(start, p, &value)) {
+            p = start;
+            fail("bad number");
+        }
+        arena.numbers.push_back(value);
+        _ast_push(arena, nNUM, oNUM, LEAF_RANK, 0x1F, arena.numbers.size() - 1);
+    }
+
+    // Column letters, optionally absolute; false (with q untouched) if none.
+    static bool col_part(const char*& q, const char* end, int& colx, int& rel) {
+        const char* s = q;
+        rel = 1;
+        if (s < end && *s == '$') {
+            rel = 0;
+            ++s;
+        }
+        int n = 0;
+        int value = 0;
+        while (s < end && std::isalpha((unsigned char)*s) && n < 4) {
+            value = value * 26 + (std::toupper((unsigned char)*s) - 'A' + 1);
+            ++s;
+            ++n;
+        }
+        if (n == 0 || n > 3 || value > XLSX_MAX_COLS) {
+            return false;
+        }
+        colx = value - 1;
+        q = s;
+        return true;
+    }
+
+    static bool row_part(const char*& q, const char* end, int& rowx, int& rel) {
+        const char* s = q;
+        rel = 1;
+        if (s < end && *s == '$') {
+            rel = 0;
+            ++s;
+        }
+        long value = 0;
+        int n = 0;
+        while (s < end && std::isdigit((unsigned char)*s) && n < 8) {
+            value = value * 10 + (*s - '0');
+            ++s;
+            ++n;
+        }
+        if (n == 0 || value < 1 || value > XLSX_MAX_ROWS) {
+            return false;
+        }
+        rowx = value - 1;
+        q = s;
+        return true;
+    }
+
+    // Parses A1, A1:B2, A:C or 1:3 at p and pushes it. Unless must is set,
+    // gives up without consuming anything when the text there is not a
+    // reference (e.g. a number, a name or a function such as LOG10).
+    bool reference(int shx1, int shx2, bool must) {
+        const char* q = p;
+        std::array<int, 4> addr1 = {{0, 0, 0, 0}};
+        std::array<int, 4> addr2 = {{0, 0, 0, 0}};
+        int kind = 0; // 1: cell, 2: whole columns, 3: whole rows
+        if (col_part(q, end, addr1[1], addr1[3])) {
+            if (row_part(q, end, addr1[0], addr1[2])) {
+                kind = 1;
+            } else if (q < end && *q == ':') {
+                ++q;
+                if (col_part(q, end, addr2[1], addr2[3])) {
+                    kind = 2;
+                }
+            }
+        }
+        if (!kind) {
+            q = p;
+            if (row_part(q, end, addr1[0], addr1[2]) && q < end && *q == ':') {
+                ++q;
+                if (row_part(q, end, addr2[0], addr2[2])) {
+                    kind = 3;
+                }
+            }
+        }
+        if (kind && q < end && (is_name_char(*q) || *q == '(' || *q == '!')) {
+            kind = 0;
+        }
+        if (!kind) {
+            if (must) {
+                fail("expected a reference");
+            }
+            return false;
+        }
+        uint8_t flags = REF_AREA;
+        if (kind == 1) {
+            addr2 = addr1;
+            flags = 0;
+            const char* r = q;
+            if (r < end && *r == ':') {
+                ++r;
+                std::array<int, 4> a2;
+                if (col_part(r, end, a2[1], a2[3]) && row_part(r, end, a2[0], a2[2]) &&
+                    !(r < end && (is_name_char(*r) || *r == '('))) {
+                    addr2 = a2;
+                    flags = REF_AREA;
+                    q = r;
+                }
+            }
+        } else if (kind == 2) {
+            addr1[0] = 0;
+            addr2[0] = XLSX_MAX_ROWS - 1;
+            addr1[2] = addr2[2] = 0;
+        } else {
+            addr1[1] = 0;
+            addr2[1] = XLSX_MAX_COLS - 1;
+            addr1[3] = addr2[3] = 0;
+        }
+        p = q;
+        if (shx1 < 0) {
+            error(0x17); // #REF!: a sheet we do not know
+            return true;
+        }
+        // Relative components become offsets from the base cell.
+        for (auto* a: {&addr1, &addr2}) {
+            if ((*a)[2]) (*a)[0] -= browx;
+            if ((*a)[3]) (*a)[1] -= bcolx;
+        }
+        int is3d = sheet_seen;
+        sheet_seen = false;
+        int opx = (flags & REF_AREA) ? (is3d ? 0x3B : 0x25) : (is3d ? 0x3A : 0x24);
+        _ast_push_ref(arena, ast, opx, shx1, shx2, addr1, addr2,
+                      flags | (is3d ? REF_3D : 0));
+        return true;
+    }
+
+    int sheet_index(const char* s, size_t n) {
+        for (size_t i = 0; i < sheet_names.size(); ++i) {
+            if (_ast_iequal(s, n, sheet_names[i])) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // 'Quoted Name'! or 'First:Last'!
+    void sheet_prefix(int& shx1, int& shx2) {
+        ++p;
+        std::string name;
+        for (;;) {
+            if (p >= end) {
+                fail("unterminated sheet name");
+            }
+            if (*p == '\'') {
+                if (p + 1 < end && p[1] == '\'') {
+                    name.push_back('\'');
+                    p += 2;
+                    continue;
+                }
+                ++p;
+                break;
+            }
+            name.push_back(*p++);
+        }
+        if (p >= end || *p != '!') {
+            fail("expected '!'");
+        }
+        ++p;
+        shx1 = shx2 = sheet_index(name.data(), name.size());
+        size_t colon = name.find(':');
+        if (shx1 < 0 && colon != std::string::npos) {
+            shx1 = sheet_index(name.data(), colon);
+            shx2 = sheet_index(name.data() + colon + 1, name.size() - colon - 1);
+            if (shx2 < 0) shx1 = -1;
+        }
+        sheet_seen = true;
+    }
+
+    void identifier() {
+        const char* start = p;
+        while (p < end && is_name_char(*p)) {
+            ++p;
+        }
+        if (p == start) {
+            fail("unexpected character");
+        }
+        const char* stop = p;
+        if (p < end && (*p == '!' || *p == ':')) {
+            // Sheet!A1 or Sheet1:Sheet3!A1
+            const char* q = p;
+            const char* last = nullptr;
+            const char* last_end = nullptr;
+            if (*q == ':') {
+                last = ++q;
+                while (q < end && is_name_char(*q)) ++q;
+                last_end = q;
+            }
+            if (q < end && *q == '!') {
+                int shx1 = sheet_index(start, stop - start);
+                int shx2 = shx1;
+                if (last) {
+                    shx2 = sheet_index(last, last_end - last);
+                    if (shx2 < 0) shx1 = -1;
+                }
+                p = q + 1;
+                sheet_seen = true;
+                reference(shx1, shx2, true);
+                return;
+            }
+        }
+        skip_space();
+        if (p < end && *p == '(') {
+            ++p;
+            function(start, stop);
+            return;
+        }
+        if (_ast_iequal(start, stop - start, "TRUE") ||
+            _ast_iequal(start, stop - start, "FALSE")) {
+            _ast_push(arena, nBOOL, oBOOL, LEAF_RANK, 0x1D, (*start | 0x20) == 't');
+            return;
+        }
+        if (names) {
+            std::string key(start, stop);
+            for (auto& ch: key) ch = std::tolower((unsigned char)ch);
+            const auto& it = names->find(key);
+            if (it != names->end()) {
+                _ast_push(arena, nNAME, oUNK, LEAF_RANK, 0x23, it->second, 0, 0, -1);
+                return;
+            }
+        }
+        error(0x1D); // #NAME?
+    }
+
+    void function(const char* start, const char* stop) {
+        if (stop - start > 6 && _ast_iequal(start, 6, "_xlfn.")) {
+            start += 6;
+        }
+        std::string fname(start, stop);
+        for (auto& ch: fname) ch = std::toupper((unsigned char)ch);
+        int nargs = 0;
+        skip_space();
+        if (p < end && *p == ')') {
+            ++p;
+        } else {
+            for (;;) {
+                skip_space();
+                if (p < end && (*p == ',' || *p == ')')) {
+                    _ast_push(arena, nMSNG, oMSNG, LEAF_RANK, 0x16);
+                } else {
+                    expr();
+                }
+                ++nargs;
+                if (accept(',')) {
+                    continue;
+                }
+                if (accept(')')) {
+                    break;
+                }
+                fail("expected ',' or ')'");
+            }
+        }
+        const auto& index = _func_index();
+        const auto& it = index.find(fname);
+        if (it == index.end()) {
+            // Keep the arguments so the tree stays whole; evaluates to #NAME?
+            _ast_push(arena, nUNK, oUNK, 0, 0x42, 0, 0, nargs);
+        } else {
+            _ast_push(arena, nFUNC, oUNK, FUNC_RANK, 0x42, 0, 0, nargs, it->second);
+        }
+    }
+};
+
+////
+// Parses the A1-style text of an xlsx formula (the contents of an <f>
+// element, with or without a leading '=') into arena, as if it were the
+// formula of the cell (browx, bcolx); relative references become offsets
+// from that cell, as decompile_formula_ast() makes them.
+// <p>Sheet names are matched against sheet_names, ignoring case; a
+// reference to any other sheet (another workbook, say) becomes #REF!.
+// Defined names are looked up in names, keyed by lower-case name; unknown
+// ones become #NAME?. Functions are looked up in func_defs, "_xlfn."
+// prefix or not; unknown ones become an nUNK node over their arguments.
+// Array constants are not supported.</p>
+EXPORT FormulaAst
+parse_formula_text(FormulaArena& arena, const std::string& text,
+                   const std::vector<std::string>& sheet_names,
+                   int browx=0, int bcolx=0,
+                   const MAP<std::string, int>* names=nullptr)
+{
+    FormulaAst ast;
+    ast.node_begin = arena.nodes.size();
+    ast.max_rows = XLSX_MAX_ROWS;
+    ast.max_cols = XLSX_MAX_COLS;
+    arena.stack.clear();
+    _FormulaTextParser parser(arena, ast, sheet_names, names, browx, bcolx, text);
+    parser.accept('=');
+    parser.expr();
+    parser.skip_space();
+    if (parser.p != parser.end) {
+        parser.fail("unexpected character");
+    }
+    if (arena.stack.size() == 1) {
+        ast.root = arena.stack[0];
+    }
+    ast.node_end = arena.nodes.size();
+    return ast;
+}
+
+// === Text rendering ===
+// These mirror colname(), cellnameabs(), cellnamerel() and rangename2drel(),
+// appending to out instead of returning a new string. A base of -1 stands
+// for Python's None and flips relative components into R1C1 notation.
+
+////
+// Utility function: 7 => 'H', 27 => 'AB', 16383 => 'XFD'
+inline void
+append_colname(std::string& out, int colx) {
+    if (colx < 0 || colx >= XLSX_MAX_COLS) {
+        throw std::logic_error("IndexError");
+    }
+    char buf[3];
+    char* end = buf + sizeof(buf);
+    char* p = end;
+    for (int n = colx + 1; n > 0; n = (n - 1) / 26) {
+        *--p = (char)('A' + (n - 1) % 26);
+    }
+    out.append(p, end - p);
+}
+
+inline void
+_ast_append_int(std::string& out, long long value) {
+    // by hand: snprintf() costs more than the rest of a cell name
+    char buf[24];
+    char* end = buf + sizeof(buf);
+    char* p = end;
+    unsigned long long u = value < 0 ? 0ULL - value : value;
+    do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (value < 0) {
+        *--p = '-';
+    }
+    out.append(p, end - p);
+}
+
+////
+// Utility function: (5, 7) => '$H$6' or 'R6C8'
+inline void
+append_cellnameabs(std::string& out, int rowx, int colx, int r1c1=0) {
+    if (r1c1) {
+        out.push_back('R');
+        _ast_append_int(out, rowx + 1);
+        out.push_back('C');
+        _ast_append_int(out, colx + 1);
+        return;
+    }
+    out.push_back('$');
+    append_colname(out, colx);
+    out.push_back('$');
+    _ast_append_int(out, rowx + 1);
+}
+
+inline void
+_ast_append_relpart(std::string& out, char axis, int x) {
+    out.push_back(axis);
+    if (x) {
+        out.push_back('[');
+        _ast_append_int(out, x);
+        out.push_back(']');
+    }
+}
+
+////
+// Utility function: a cell name with relative components applied to
+// (browx, bcolx), wrapping around max_rows and max_cols as the sheets of
+// the formula's format do.
+EXPORT void
+append_cellnamerel(std::string& out, int rowx, int colx, int rowxrel, int colxrel,
+                   int browx=-1, int bcolx=-1, int r1c1=0,
+                   int max_rows=BIFF_MAX_ROWS, int max_cols=BIFF_MAX_COLS)
+{
+    if (!rowxrel && !colxrel) {
+        append_cellnameabs(out, rowx, colx, r1c1);
+        return;
+    }
+    if ((rowxrel && browx < 0) || (colxrel && bcolx < 0)) {
+        // must flip the whole cell into R1C1 mode
+        r1c1 = 1;
+    }
+    if (r1c1) {
+        if (rowxrel) {
+            _ast_append_relpart(out, 'R', rowx);
+        } else {
+            out.push_back('R');
+            _ast_append_int(out, rowx + 1);
+        }
+        if (colxrel) {
+            _ast_append_relpart(out, 'C', colx);
+        } else {
+            out.push_back('C');
+            _ast_append_int(out, colx + 1);
+        }
+        return;
+    }
+    if (colxrel) {
+        append_colname(out, ((bcolx + colx) % max_cols + max_cols) % max_cols);
+    } else {
+        out.push_back('$');
+        append_colname(out, colx);
+    }
+    if (rowxrel) {
+        _ast_append_int(out, ((browx + rowx) % max_rows + max_rows) % max_rows + 1);
+    } else {
+        out.push_back('$');
+        _ast_append_int(out, rowx + 1);
+    }
+}
+
+////
+// Utility function: the 2D part of a FormulaRef, e.g. 'A1', '$H$6:$J$20',
+// 'R[-1]C:R[2]C[3]'. Single cells print as one cell, areas always as two.
+EXPORT void
+append_rangename2drel(std::string& out, const FormulaRef& ref,
+                      int browx=-1, int bcolx=-1, int r1c1=0,
+                      int max_rows=BIFF_MAX_ROWS, int max_cols=BIFF_MAX_COLS)
+{
+    int rf = ref.relflags;
+    if (!(rf & REF_AREA)) {
+        append_cellnamerel(out, ref.rowxlo, ref.colxlo,
+                           rf & REF_ROW1_REL, rf & REF_COL1_REL, browx, bcolx, r1c1,
+                           max_rows, max_cols);
+        return;
+    }
+    if ((rf & (REF_ROW1_REL | REF_ROW2_REL)) && browx < 0) {
+        r1c1 = 1;
+    }
+    if ((rf & (REF_COL1_REL | REF_COL2_REL)) && bcolx < 0) {
+        r1c1 = 1;
+    }
+    append_cellnamerel(out, ref.rowxlo, ref.colxlo,
+                       rf & REF_ROW1_REL, rf & REF_COL1_REL, browx, bcolx, r1c1,
+                       max_rows, max_cols);
+    out.push_back(':');
+    append_cellnamerel(out, ref.rowxhi - 1, ref.colxhi - 1,
+                       rf & REF_ROW2_REL, rf & REF_COL2_REL, browx, bcolx, r1c1,
+                       max_rows, max_cols);
+}
+
+class _FormulaTextWriter {
+public:
+    FormulaBookDelegate* bk;
+    const FormulaArena& arena;
+    std::string& out;
+    int browx;
+    int bcolx;
+    int r1c1;
+    int max_rows = BIFF_MAX_ROWS;
+    int max_cols = BIFF_MAX_COLS;
+    std::vector<std::string> shnames;
+    bool have_shnames = false;
+    // If set, the 2D part of each reference is not printed but recorded
+    // here with its position in out (see FormulaTextCache).
+    std::vector<std::pair<uint32_t, FormulaRef>>* holes = nullptr;
+
+    _FormulaTextWriter(FormulaBookDelegate* bk_, const FormulaArena& arena_,
+                       std::string& out_, int browx_, int bcolx_, int r1c1_)
+    : bk(bk_), arena(arena_), out(out_), browx(browx_), bcolx(bcolx_), r1c1(r1c1_)
+    {}
+
+    void sheetname(int shx) {
+        if (!have_shnames) {
+            shnames = bk->sheet_names();
+            have_shnames = true;
+        }
+        if (shx < 0 || shx >= (int)shnames.size()) {
+            const auto& it = shname_dict_.find(shx);
+            if (it != shname_dict_.end()) {
+                out.append(it->second);
+            } else {
+                out.append("?error ");
+                _ast_append_int(out, shx);
+                out.push_back('?');
+            }
+            return;
+        }
+        const auto& shname = shnames[shx];
+        if (shname.find_first_of("' ") == std::string::npos) {
+            out.append(shname);
+            return;
+        }
+        out.push_back('\'');
+        for (char c: shname) {
+            if (c == '\'') {
+                out.push_back('\'');
+            }
+            out.push_back(c);
+        }
+        out.push_back('\'');
+    }
+
+    void ref(const FormulaRef& r) {
+        if (r.relflags & REF_3D) {
+            sheetname(r.shtxlo);
+            if (r.shtxlo != r.shtxhi - 1) {
+                out.push_back(':');
+                sheetname(r.shtxhi - 1);
+            }
+            out.push_back('!');
+        }
+        if (holes) {
+            holes->emplace_back(out.size(), r);
+            return;
+        }
+        append_rangename2drel(out, r, browx, bcolx, r1c1, max_rows, max_cols);
+    }
+
+    void name(const FormulaNode& n) {
+        if (n.opx == 0x39 && n.aux < -1) { // tNameX outside this book
+            out.append("<<Name #");
+            _ast_append_int(out, (int)n.index);
+            out.append(" in external(?) file #");
+            _ast_append_int(out, (int)n.extra);
+            out.append(">>");
+            return;
+        }
+        FormulaNameDelegate* tgtobj = bk->get_name_obj(n.index);
+        if (tgtobj->scope != -1) {
+            out.append(bk->_sheet_names[tgtobj->scope]);
+            out.push_back('!');
+        }
+        out.append(tgtobj->name);
+    }
+
+    void operand(uint32_t nodex, int rank) {
+        bool paren = arena.nodes[nodex].rank < rank;
+        if (paren) out.push_back('(');
+        node(nodex);
+        if (paren) out.push_back(')');
+    }
+
+    void node(uint32_t nodex) {
+        const FormulaNode& n = arena.nodes[nodex];
+        const uint32_t* kids = arena.children.data() + n.child;
+        switch (n.kind) {
+        case nMSNG:
+            break;
+        case nNUM: {
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "%.15g", arena.numbers[n.index]);
+            out.append(buf, len);
+            break;
+        }
+        case nBOOL:
+            out.append(n.index ? "TRUE" : "FALSE");
+            break;
+        case nERR: {
+            const auto& it = error_text_from_code.find(n.index);
+            out.append(it != error_text_from_code.end() ? it->second : "#ERR?");
+            break;
+        }
+        case nSTR:
+            out.push_back('"');
+            for (uint32_t i = n.index; i < n.index + n.extra; ++i) {
+                char c = arena.strings[i];
+                if (c == '"') {
+                    out.push_back('"');
+                }
+                out.push_back(c);
+            }
+            out.push_back('"');
+            break;
+        case nREF:
+            ref(arena.refs[n.index]);
+            break;
+        case nNAME:
+            name(n);
+            break;
+        case nBINOP: {
+            int opcode = n.opx & 0x1f;
+            operand(kids[0], n.rank);
+            if (opcode == 0x0F) {
+                out.push_back(' ');
+            } else if (opcode == 0x10) {
+                out.push_back(',');
+            } else if (opcode == 0x11) {
+                out.push_back(':');
+            } else {
+                out.append(std::get<2>(binop_rules.at(opcode)));
+            }
+            operand(kids[1], n.rank);
+            break;
+        }
+        case nUNOP: {
+            const auto& rule = unop_rules.at(n.opx & 0x1f);
+            if (std::get<1>(rule)) out.push_back(std::get<1>(rule));
+            operand(kids[0], n.rank);
+            if (std::get<2>(rule)) out.push_back(std::get<2>(rule));
+            break;
+        }
+        case nFUNC:
+            if (n.aux == 255) {
+                out.append("CALL_ADDIN");
+            } else {
+                out.append(std::get<0>(func_defs.at(n.aux)));
+            }
+            out.push_back('(');
+            for (int i = 0; i < n.nargs; ++i) {
+                if (i) out.push_back(listsep);
+                node(kids[i]);
+            }
+            out.push_back(')');
+            break;
+        case nSHARED:
+            out.append("SHARED FMLA at rowx=");
+            _ast_append_int(out, n.index);
+            out.append(" colx=");
+            _ast_append_int(out, n.extra);
+            break;
+        default:
+            out.push_back('?');
+            break;
+        }
+    }
+};
+
+////
+// Appends the text of the subtree at nodex to out. browx and bcolx give the
+// cell the formula is applied to; -1 prints relative references in R1C1
+// notation, as does a true r1c1. max_rows and max_cols are the sheet
+// limits of the formula's format (FormulaAst::max_rows and max_cols).
+EXPORT void
+append_formula_text(std::string& out, FormulaBookDelegate* bk,
+                    const FormulaArena& arena, uint32_t nodex,
+                    int browx=-1, int bcolx=-1, int r1c1=0,
+                    int max_rows=BIFF_MAX_ROWS, int max_cols=BIFF_MAX_COLS)
+{
+    _FormulaTextWriter writer(bk, arena, out, browx, bcolx, r1c1);
+    writer.max_rows = max_rows;
+    writer.max_cols = max_cols;
+    writer.node(nodex);
+}
+
+////
+// The text of a decompiled formula, as decompile_formula() would give it;
+// empty if it did not reduce to a single operand.
+EXPORT std::string
+formula_text(FormulaBookDelegate* bk, const FormulaArena& arena,
+             const FormulaAst& ast, int browx=-1, int bcolx=-1, int r1c1=0)
+{
+    std::string out;
+    if (ast.root != NO_FORMULA_NODE) {
+        append_formula_text(out, bk, arena, ast.root, browx, bcolx, r1c1,
+                            ast.max_rows, ast.max_cols);
+    }
+    return out;
+}
+
+}
+}
@@ -0,0 +1,231 @@
+#pragma once
+
+////
+// Formula text from templates.
+//
+// <p>Most formulas of a sheet are copies of a few: filled down a column, a
+// formula keeps its tokens and only the addresses of its references move
+// with the cell. FormulaTextCache decompiles each distinct formula once, as
+// decompile_formula_ast() and formula_text() would, and keeps its text as a
+// template with holes where the references go. The text of any other cell
+// with the same formula is then the template with its references printed
+// by append_rangename2drel(), relative to that cell.</p>
+////
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "./formula_ast.h"
+#include "./formula_refs.h"
+
+namespace xlrd {
+namespace formula {
+
+////
+// The text of formulas, decompiled once per distinct formula.
+// <p>Two formulas share a template when they have the same type and the
+// same tokens once their references are decoded as FormulaRef holds them:
+// relative components as offsets from the cell the formula is applied to,
+// absolute ones as indexes. So C2's =A2+B2 and C3's =A3+B3 share one, but
+// not C3's =A2+B2.</p>
+// <p>Names, sheet names and the external sheet table go into the template
+// text, so the cache is only good for the book it was filled from, once
+// those have been read; clear() it if they change.</p>
+class FormulaTextCache {
+public:
+    struct Template {
+        std::string text;
+        // (position in text, reference printed there)
+        std::vector<std::pair<uint32_t, FormulaRef>> holes;
+    };
+
+    std::vector<Template> templates;
+    // normalized tokens => index into templates
+    MAP<std::string, uint32_t> _by_key;
+    size_t hits = 0;
+    size_t misses = 0;
+
+    ////
+    // Appends the text of the formula data[pos, pos+fmlalen) applied to
+    // (browx, bcolx) to out: the same text as formula_text() of
+    // decompile_formula_ast() with those arguments.
+    void append_text(std::string& out, FormulaBookDelegate* bk,
+                     const std::vector<uint8_t>& data, int fmlalen,
+                     int fmlatype=FMLA_TYPE_CELL,
+                     int browx=-1, int bcolx=-1, int pos=0, int r1c1=0)
+    {
+        if (!_make_key(bk, data, fmlalen, fmlatype, browx, bcolx, pos)) {
+            // not a formula the key can be made of; decompile_formula_ast()
+            // reports any error
+            _arena.clear();
+            FormulaAst ast = decompile_formula_ast(bk, _arena, data, fmlalen,
+                                                   fmlatype, browx, bcolx, pos);
+            if (ast.root != NO_FORMULA_NODE) {
+                append_formula_text(out, bk, _arena, ast.root, browx, bcolx, r1c1);
+            }
+            return;
+        }
+        uint32_t tmplx;
+        const auto& it = _by_key.find(_key);
+        if (it != _by_key.end()) {
+            tmplx = it->second;
+            ++hits;
+        } else {
+            tmplx = _add(bk, data, fmlalen, fmlatype, browx, bcolx, pos);
+            ++misses;
+        }
+        const Template& tmpl = templates[tmplx];
+        uint32_t done = 0;
+        for (const auto& hole: tmpl.holes) {
+            out.append(tmpl.text, done, hole.first - done);
+            append_rangename2drel(out, hole.second, browx, bcolx, r1c1);
+            done = hole.first;
+        }
+        out.append(tmpl.text, done, std::string::npos);
+    }
+
+    ////
+    // As append_text(), returning the text.
+    std::string text(FormulaBookDelegate* bk,
+                     const std::vector<uint8_t>& data, int fmlalen,
+                     int fmlatype=FMLA_TYPE_CELL,
+                     int browx=-1, int bcolx=-1, int pos=0, int r1c1=0)
+    {
+        std::string out;
+        append_text(out, bk, data, fmlalen, fmlatype, browx, bcolx, pos, r1c1);
+        return out;
+    }
+
+    size_t size() const {
+        return templates.size();
+    }
+
+    void clear() {
+        templates.clear();
+        _by_key.clear();
+        hits = misses = 0;
+    }
+
+private:
+    std::string _key;
+    FormulaArena _arena;
+
+    // Writes the components of addr at p: the row as 4 bytes, the column
+    // as 2 and the relative flags as 1.
+    static inline char* _key_addr(char* p, const std::array<int, 4>& addr) {
+        int32_t rowx = addr[0];
+        int16_t colx = addr[1];
+        memcpy(p, &rowx, 4);
+        memcpy(p + 4, &colx, 2);
+        p[6] = (char)(addr[2] | (addr[3] << 1));
+        return p + 7;
+    }
+
+    ////
+    // Sets _key to fmlatype and the tokens, with the address bytes of each
+    // reference replaced by its decoded components. False if the tokens
+    // hold something the walk does not size (decompile_formula_ast() will
+    // say what).
+    inline bool _make_key(FormulaBookDelegate* bk,
+                          const std::vector<uint8_t>& data, int fmlalen,
+                          int fmlatype, int browx, int bcolx, int pos)
+    {
+        const int reldelta_types = FMLA_TYPE_SHARED | FMLA_TYPE_NAME
+                                 | FMLA_TYPE_COND_FMT | FMLA_TYPE_DATA_VAL;
+        int reldelta = (fmlatype & reldelta_types) != 0;
+        int bv = bk->biff_version;
+        if (!reldelta && (browx < 0 || bcolx < 0)) {
+            return false;
+        }
+        if (pos < 0 || fmlalen < 0 || pos + fmlalen > (int)data.size()) {
+            return false;
+        }
+        const auto& sztab = szdict.at(bv);
+        const int cellsz = bv >= 80 ? 4 : 3;
+        // an address of cellsz bytes takes 7 in the key
+        _key.resize(1 + 3 * fmlalen);
+        char* p = &_key[0];
+        *p++ = (char)fmlatype;
+
+        int end = pos + fmlalen;
+        while (pos < end) {
+            int op = data[pos];
+            int opcode = op & 0x1f;
+            int optype = (op & 0x60) >> 5;
+            int opx = optype ? opcode + 32 : opcode;
+            int sz = sztab[opx];
+            int addrpos = -1;
+            if (!optype) {
+                if (opcode == 0x17) { // tStr
+                    sz = _refs_str_size(data, pos, bv);
+                } else if (opcode == 0x19) { // tAttr
+                    int subop = data[pos+1];
+                    int nc = utils::as_uint16(data, pos+2);
+                    sz = subop == 0x04 ? nc * 2 + 6 : 4; // Choose has a jump table
+                } else if (opcode == 0x18 || opcode == 0x1A || opcode == 0x1B) {
+                    return false; // tExtended, tSheet, tEndSheet
+                }
+            } else if (opcode == 0x04 || opcode == 0x0C ||
+                       opcode == 0x05 || opcode == 0x0D) {
+                addrpos = pos + 1;
+            } else if (opcode == 0x1A || opcode == 0x1B) {
+                addrpos = pos + (bv >= 80 ? 3 : 15);
+            }
+            if (sz <= 0 || pos + sz > end) {
+                return false;
+            }
+            if (addrpos < 0) {
+                memcpy(p, &data[pos], sz);
+                p += sz;
+            } else {
+                // the token up to its address, then the address decoded
+                memcpy(p, &data[pos], addrpos - pos);
+                p += addrpos - pos;
+                if (opcode == 0x05 || opcode == 0x0D || opcode == 0x1B) {
+                    std::array<int, 4> addr1, addr2;
+                    std::tie(addr1, addr2) = get_cell_range_addr(
+                        data, addrpos, bv, reldelta, browx, bcolx);
+                    p = _key_addr(p, addr1);
+                    p = _key_addr(p, addr2);
+                    addrpos += 2 * cellsz;
+                } else {
+                    p = _key_addr(p, get_cell_addr(data, addrpos, bv, reldelta,
+                                                   browx, bcolx));
+                    addrpos += cellsz;
+                }
+                memcpy(p, &data[addrpos], pos + sz - addrpos);
+                p += pos + sz - addrpos;
+            }
+            pos += sz;
+        }
+        _key.resize(p - &_key[0]);
+        return true;
+    }
+
+    inline uint32_t _add(FormulaBookDelegate* bk,
+                         const std::vector<uint8_t>& data, int fmlalen,
+                         int fmlatype, int browx, int bcolx, int pos)
+    {
+        _arena.clear();
+        FormulaAst ast = decompile_formula_ast(bk, _arena, data, fmlalen,
+                                               fmlatype, browx, bcolx, pos);
+        Template tmpl;
+        if (ast.root != NO_FORMULA_NODE) {
+            _FormulaTextWriter writer(bk, _arena, tmpl.text, browx, bcolx, 0);
+            writer.holes = &tmpl.holes;
+            writer.node(ast.root);
+        }
+        uint32_t tmplx = templates.size();
+        templates.push_back(std::move(tmpl));
+        _by_key.emplace(_key, tmplx);
+        return tmplx;
+    }
+};
+
+}
+}
@@ -0,0 +1,3079 @@
+#pragma once
+
+////
+// Recalculation of cell formulas.
+//
+// <p>A FormulaEngine holds the values and formulas of a workbook's cells.
+// Formulas are trees in the engine's FormulaArena, decompiled from BIFF
+// tokens by decompile_formula_ast() or parsed from xlsx text by
+// parse_formula_text(). build() works out once which cells each formula
+// reads and puts the formulas in dependency order; after that, set_value()
+// marks only the formulas downstream of the cell it changes, and
+// recalculate() evaluates just those, in order.</p>
+//
+// <p>Formulas are also grouped into levels: a formula's level is one more
+// than the highest level among the formulas it reads, so the formulas of
+// a level never read each other. Given several threads, recalculate()
+// spreads each large level over them; since evaluation only reads the
+// cells of earlier levels, the results are those of a serial run.</p>
+//
+// <p>Operators follow Excel's coercion rules. The functions evaluated are
+// those in _FormulaEvaluator::function(). Formulas on a circular chain, and
+// those the engine cannot evaluate (other functions, external names, array
+// formulas), are not evaluated and keep their cached values; they are
+// listed in FormulaEngine::circular and FormulaEngine::unsupported.</p>
+//
+// <p>For formulas recalculated many times, compile() flattens each tree
+// into a CompiledFormula: instructions with the cells they read already
+// looked up, run over a fixed-size stack. Formulas it cannot compile are
+// still walked. The arithmetic cells of a shared formula are grouped into
+// FormulaBlocks and evaluated a column of rows at a time.</p>
+////
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "./biffh.h"
+#include "./formula_ast.h"
+
+namespace xlrd {
+namespace formula {
+
+using biffh::XL_CELL_EMPTY;
+using biffh::XL_CELL_TEXT;
+using biffh::XL_CELL_NUMBER;
+using biffh::XL_CELL_BOOLEAN;
+using biffh::XL_CELL_ERROR;
+
+////
+// Error codes, as keys of error_text_from_code.
+const int XL_ERR_NULL  = 0x00;
+const int XL_ERR_DIV0  = 0x07;
+const int XL_ERR_VALUE = 0x0F;
+const int XL_ERR_REF   = 0x17;
+const int XL_ERR_NAME  = 0x1D;
+const int XL_ERR_NUM   = 0x24;
+const int XL_ERR_NA    = 0x2A;
+
+////
+// A cell value as the evaluator sees it.
+// <p>ctype is XL_CELL_EMPTY, XL_CELL_NUMBER, XL_CELL_TEXT, XL_CELL_BOOLEAN
+// (number is 0 or 1) or XL_CELL_ERROR (number is the error code). Dates
+// are numbers.</p>
+struct FormulaValue {
+    int ctype = XL_CELL_EMPTY;
+    double number = 0.0;
+    std::string text;
+
+    FormulaValue() {}
+    explicit FormulaValue(double x) : ctype(XL_CELL_NUMBER), number(x) {}
+    explicit FormulaValue(const std::string& s) : ctype(XL_CELL_TEXT), text(s) {}
+
+    static FormulaValue boolean(bool b) {
+        FormulaValue v;
+        v.ctype = XL_CELL_BOOLEAN;
+        v.number = b;
+        return v;
+    }
+    static FormulaValue error(int code) {
+        FormulaValue v;
+        v.ctype = XL_CELL_ERROR;
+        v.number = code;
+        return v;
+    }
+
+    bool is_error() const { return ctype == XL_CELL_ERROR; }
+    int error_code() const { return (int)number; }
+
+    bool operator==(const FormulaValue& other) const {
+        return ctype == other.ctype && number == other.number && text == other.text;
+    }
+    bool operator!=(const FormulaValue& other) const { return !(*this == other); }
+};
+
+////
+// An absolute block of cells: sheets, rows and columns lo <= x < hi.
+struct FormulaArea {
+    int shtxlo;
+    int shtxhi;
+    int rowxlo;
+    int rowxhi;
+    int colxlo;
+    int colxhi;
+};
+
+// Function indexes (keys of func_defs) the evaluator implements.
+enum {
+    fCOUNT = 0, fIF = 1, fISNA = 2, fISERROR = 3, fSUM = 4, fAVERAGE = 5,
+    fMIN = 6, fMAX = 7, fROW = 8, fCOLUMN = 9, fNA = 10, fPI = 19,
+    fSQRT = 20, fEXP = 21, fLN = 22, fLOG10 = 23, fABS = 24, fINT = 25,
+    fSIGN = 26, fROUND = 27, fINDEX = 29, fMID = 31, fLEN = 32, fVALUE = 33,
+    fTRUE = 34, fFALSE = 35, fAND = 36, fOR = 37, fNOT = 38, fMOD = 39,
+    fMATCH = 64, fROWS = 76, fCOLUMNS = 77, fCHOOSE = 100, fHLOOKUP = 101,
+    fVLOOKUP = 102, fLOWER = 112, fUPPER = 113, fLEFT = 115, fRIGHT = 116,
+    fTRIM = 118, fISERR = 126, fISTEXT = 127, fISNUMBER = 128,
+    fISBLANK = 129, fCOUNTA = 169, fPRODUCT = 183, fISLOGICAL = 198,
+    fROUNDUP = 212, fROUNDDOWN = 213, fSUMPRODUCT = 228,
+    fCONCATENATE = 336, fPOWER = 337, fSUMIF = 345, fCOUNTIF = 346,
+};
+
+////
+// Whether _FormulaEvaluator::function() implements function funcx.
+inline bool
+_engine_function(int funcx) {
+    switch (funcx) {
+    case fCOUNT: case fIF: case fISNA: case fISERROR: case fSUM: case fAVERAGE:
+    case fMIN: case fMAX: case fROW: case fCOLUMN: case fNA: case fPI:
+    case fSQRT: case fEXP: case fLN: case fLOG10: case fABS: case fINT:
+    case fSIGN: case fROUND: case fINDEX: case fMID: case fLEN: case fVALUE:
+    case fTRUE: case fFALSE: case fAND: case fOR: case fNOT: case fMOD:
+    case fMATCH: case fROWS: case fCOLUMNS: case fCHOOSE: case fHLOOKUP:
+    case fVLOOKUP: case fLOWER: case fUPPER: case fLEFT: case fRIGHT:
+    case fTRIM: case fISERR: case fISTEXT: case fISNUMBER:
+    case fISBLANK: case fCOUNTA: case fPRODUCT: case fISLOGICAL:
+    case fROUNDUP: case fROUNDDOWN: case fSUMPRODUCT:
+    case fCONCATENATE: case fPOWER: case fSUMIF: case fCOUNTIF:
+        return true;
+    default:
+        return false;
+    }
+}
+
+inline uint64_t
+_cell_key(int sheetx, int rowx, int colx) {
+    return ((uint64_t)(uint32_t)sheetx << 48) | ((uint64_t)(uint32_t)rowx << 16) |
+           (uint32_t)colx;
+}
+
+inline uint64_t
+_column_key(int sheetx, int colx) {
+    return ((uint64_t)(uint32_t)sheetx << 32) | (uint32_t)colx;
+}
+
+// === Coercions ===
+
+////
+// Text of a number as Excel converts it in a formula: up to 15
+// significant digits, no trailing zeros.
+inline std::string
+number_text(double x) {
+    char buf[32];
+    if (x == 0) {
+        return "0";
+    }
+    int n;
+    if (x == std::floor(x) && std::fabs(x) < 1e15) {
+        n = snprintf(buf, sizeof(buf), "%.0f", x);
+    } else {
+        n = snprintf(buf, sizeof(buf), "%.15G", x);
+    }
+    return std::string(buf, n);
+}
+
+inline int
+_text_number(const std::string& text, double& out) {
+    size_t b = text.find_first_not_of(' ');
+    size_t e = text.find_last_not_of(' ');
+    if (b == std::string::npos ||
+        !utils::parse::parse_double(text.data() + b, text.data() + e + 1, &out)) {
+        return XL_ERR_VALUE;
+    }
+    return -1;
+}
+
+////
+// v as a number: 0 for empty, 0 or 1 for booleans, text if it reads as a
+// number. Returns -1, or the error code if there is no such number.
+inline int
+to_number(const FormulaValue& v, double& out) {
+    switch (v.ctype) {
+    case XL_CELL_EMPTY:
+        out = 0;
+        return -1;
+    case XL_CELL_TEXT:
+        return _text_number(v.text, out);
+    case XL_CELL_ERROR:
+        return v.error_code();
+    default:
+        out = v.number;
+        return -1;
+    }
+}
+
+inline int
+to_text(const FormulaValue& v, std::string& out) {
+    switch (v.ctype) {
+    case XL_CELL_EMPTY:
+        out.clear();
+        return -1;
+    case XL_CELL_TEXT:
+        out = v.text;
+        return -1;
+    case XL_CELL_NUMBER:
+        out = number_text(v.number);
+        return -1;
+    case XL_CELL_BOOLEAN:
+        out = v.number ? "TRUE" : "FALSE";
+        return -1;
+    default:
+        return v.error_code();
+    }
+}
+
+inline int
+to_boolean(const FormulaValue& v, bool& out) {
+    switch (v.ctype) {
+    case XL_CELL_EMPTY:
+        out = false;
+        return -1;
+    case XL_CELL_TEXT:
+        if (_ast_iequal(v.text.data(), v.text.size(), "TRUE")) {
+            out = true;
+        } else if (_ast_iequal(v.text.data(), v.text.size(), "FALSE")) {
+            out = false;
+        } else {
+            return XL_ERR_VALUE;
+        }
+        return -1;
+    case XL_CELL_ERROR:
+        return v.error_code();
+    default:
+        out = v.number != 0;
+        return -1;
+    }
+}
+
+inline int
+_icompare(const std::string& a, const std::string& b) {
+    size_t n = std::min(a.size(), b.size());
+    for (size_t i = 0; i < n; ++i) {
+        int ca = std::tolower((unsigned char)a[i]);
+        int cb = std::tolower((unsigned char)b[i]);
+        if (ca != cb) {
+            return ca < cb ? -1 : 1;
+        }
+    }
+    return a.size() < b.size() ? -1 : a.size() > b.size() ? 1 : 0;
+}
+
+////
+// Compares two numbers as Excel does, at 15 significant digits: so
+// 0.1+0.2 equals 0.3, and 1-1e-16 equals 1.
+inline int
+compare_numbers(double a, double b) {
+    if (a == b) {
+        return 0;
+    }
+    // rounding moves a number by less than 1e-14 of itself, so numbers
+    // further apart than that keep their order
+    double m = std::max(std::fabs(a), std::fabs(b));
+    if (std::fabs(a - b) > m * 1e-13 || !(m < DBL_MAX)) {
+        return a < b ? -1 : 1;
+    }
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.14e", a);
+    double ra = std::strtod(buf, nullptr);
+    std::snprintf(buf, sizeof(buf), "%.14e", b);
+    double rb = std::strtod(buf, nullptr);
+    return ra < rb ? -1 : ra > rb ? 1 : 0;
+}
+
+////
+// Excel's ordering for comparison operators and lookups: numbers before
+// text before booleans, text ignoring case. An empty value compares as
+// 0, "" or FALSE, whichever matches the other side. Numbers compare by
+// compare_numbers().
+inline int
+compare_values(const FormulaValue& a, const FormulaValue& b) {
+    int ta = a.ctype;
+    int tb = b.ctype;
+    if (ta == XL_CELL_EMPTY && tb == XL_CELL_EMPTY) {
+        return 0;
+    }
+    if (ta == XL_CELL_EMPTY) {
+        return -compare_values(b, a);
+    }
+    if (tb == XL_CELL_EMPTY) {
+        if (ta == XL_CELL_TEXT) {
+            return a.text.empty() ? 0 : 1;
+        }
+        return a.number < 0 ? -1 : a.number > 0 ? 1 : 0;
+    }
+    int ra = ta == XL_CELL_TEXT ? 1 : ta == XL_CELL_BOOLEAN ? 2 : 0;
+    int rb = tb == XL_CELL_TEXT ? 1 : tb == XL_CELL_BOOLEAN ? 2 : 0;
+    if (ra != rb) {
+        return ra < rb ? -1 : 1;
+    }
+    if (ra == 1) {
+        return _icompare(a.text, b.text);
+    }
+    return compare_numbers(a.number, b.number);
+}
+
+////
+// Case-insensitive match of text against pattern, where '?' matches one
+// character, '*' any run of them, and '~' escapes the next character.
+inline bool
+wildcard_match(const char* t, const char* tend, const char* p, const char* pend) {
+    const char* star = nullptr;
+    const char* resume = nullptr;
+    while (t < tend) {
+        if (p < pend && *p == '*') {
+            star = ++p;
+            resume = t;
+            continue;
+        }
+        if (p < pend) {
+            char pc = *p;
+            const char* next = p + 1;
+            bool any = pc == '?';
+            if (pc == '~' && next < pend) {
+                pc = *next++;
+                any = false;
+            }
+            if (any || std::tolower((unsigned char)pc) == std::tolower((unsigned char)*t)) {
+                p = next;
+                ++t;
+                continue;
+            }
+        }
+        if (!star) {
+            return false;
+        }
+        p = star;
+        t = ++resume;
+    }
+    while (p < pend && *p == '*') {
+        ++p;
+    }
+    return p == pend;
+}
+
+// Byte offset of the nchars'th UTF-8 character of s (or s.size()).
+inline size_t
+_utf8_offset(const std::string& s, double nchars) {
+    size_t i = 0;
+    for (double n = 0; i < s.size() && n < nchars; ++n) {
+        ++i;
+        while (i < s.size() && ((unsigned char)s[i] & 0xC0) == 0x80) {
+            ++i;
+        }
+    }
+    return i;
+}
+
+inline size_t
+_utf8_length(const std::string& s) {
+    size_t n = 0;
+    for (char c: s) {
+        n += ((unsigned char)c & 0xC0) != 0x80;
+    }
+    return n;
+}
+
+////
+// A SUMIF/COUNTIF criterion: "5", ">=5", "<>x", "a*", or a plain value.
+struct FormulaCriterion {
+    int op = tEQ;
+    FormulaValue operand;
+    bool wild = false;
+
+    explicit FormulaCriterion(const FormulaValue& crit) {
+        if (crit.ctype != XL_CELL_TEXT) {
+            operand = crit;
+            return;
+        }
+        const std::string& s = crit.text;
+        size_t skip = 0;
+        if (s.compare(0, 2, "<=") == 0) { op = tLE; skip = 2; }
+        else if (s.compare(0, 2, ">=") == 0) { op = tGE; skip = 2; }
+        else if (s.compare(0, 2, "<>") == 0) { op = tNE; skip = 2; }
+        else if (s.compare(0, 1, "<") == 0) { op = tLT; skip = 1; }
+        else if (s.compare(0, 1, ">") == 0) { op = tGT; skip = 1; }
+        else if (s.compare(0, 1, "=") == 0) { op = tEQ; skip = 1; }
+        std::string rest = s.substr(skip);
+        double x;
+        if (_text_number(rest, x) < 0) {
+            operand = FormulaValue(x);
+        } else if (_ast_iequal(rest.data(), rest.size(), "TRUE") ||
+                   _ast_iequal(rest.data(), rest.size(), "FALSE")) {
+            operand = FormulaValue::boolean((rest[0] | 0x20) == 't');
+        } else {
+            operand = FormulaValue(rest);
+            wild = (op == tEQ || op == tNE) &&
+                   rest.find_first_of("*?~") != std::string::npos;
+        }
+    }
+
+    bool matches(const FormulaValue& v) const {
+        if (operand.ctype == XL_CELL_TEXT && operand.text.empty() &&
+            (op == tEQ || op == tNE)) {
+            bool blank = v.ctype == XL_CELL_EMPTY ||
+                         (v.ctype == XL_CELL_TEXT && v.text.empty());
+            return (op == tEQ) == blank;
+        }
+        bool same = v.ctype == operand.ctype;
+        if (op == tNE) {
+            if (!same) return true;
+        } else if (!same) {
+            return false;
+        }
+        int c;
+        if (wild) {
+            bool m = wildcard_match(v.text.data(), v.text.data() + v.text.size(),
+                                    operand.text.data(),
+                                    operand.text.data() + operand.text.size());
+            c = m ? 0 : 1;
+        } else {
+            c = compare_values(v, operand);
+        }
+        switch (op) {
+        case tLT: return c < 0;
+        case tLE: return c <= 0;
+        case tGT: return c > 0;
+        case tGE: return c >= 0;
+        case tNE: return c != 0;
+        default: return c == 0;
+        }
+    }
+};
+
+// === Engine ===
+
+////
+// Levels with fewer formulas than this are evaluated on the calling
+// thread, as waking the others costs more than it saves.
+const size_t FORMULA_PARALLEL_MIN_LEVEL = 512;
+
+////
+// Formulas a thread takes from its share of a level at a time.
+const uint32_t FORMULA_PARALLEL_CHUNK = 32;
+
+class FormulaEngine;
+class _FormulaPool;
+
+////
+// The result of evaluating a node: a value, or a reference to cells.
+struct _EvalResult {
+    FormulaValue value;
+    int is_ref = 0;
+    FormulaArea area;
+};
+
+////
+// A cell known to the engine.
+struct EngineCell {
+    int sheetx;
+    int rowx;
+    int colx;
+    FormulaValue value;
+    uint32_t formula;  // index into FormulaEngine::formulas, or NO_FORMULA_NODE
+};
+
+////
+// A formula known to the engine: the tree at root, applied to cell.
+struct EngineFormula {
+    uint32_t cell;
+    uint32_t root;
+};
+
+////
+// Evaluates one formula against the engine's cells. It only reads the
+// engine, so any number of evaluators can run at once.
+class _FormulaEvaluator {
+public:
+    const FormulaEngine& engine;
+    const FormulaArena& arena;
+    int sheetx;
+    int browx;
+    int bcolx;
+    std::vector<int> names_open;  // names being evaluated, innermost last
+
+    inline _FormulaEvaluator(const FormulaEngine& engine_, int sheetx_, int browx_, int bcolx_);
+
+    inline const FormulaValue& cell(int shx, int rowx, int colx) const;
+    template<class F> inline void each_cell(const FormulaArea& a, F fn) const;
+    template<class F> inline bool each_value(uint32_t nodex, F fn);
+
+    static _EvalResult value(FormulaValue v) {
+        _EvalResult r;
+        r.value = std::move(v);
+        return r;
+    }
+    static _EvalResult error(int code) {
+        return value(FormulaValue::error(code));
+    }
+    static _EvalResult number(double x) {
+        if (std::isnan(x) || std::isinf(x)) {
+            return error(XL_ERR_NUM);
+        }
+        return value(FormulaValue(x));
+    }
+
+    ////
+    // A reference resolved against the base cell; false if it falls off
+    // the sheet or names a sheet outside the book.
+    bool resolve(const FormulaRef& r, FormulaArea& a) const {
+        int rf = r.relflags;
+        if (rf & REF_3D) {
+            if (r.shtxlo < 0) {
+                return false;
+            }
+            a.shtxlo = r.shtxlo;
+            a.shtxhi = r.shtxhi;
+        } else {
+            a.shtxlo = sheetx;
+            a.shtxhi = sheetx + 1;
+        }
+        int row1 = r.rowxlo + ((rf & REF_ROW1_REL) ? browx : 0);
+        int row2 = r.rowxhi - 1 + ((rf & REF_ROW2_REL) ? browx : 0);
+        int col1 = r.colxlo + ((rf & REF_COL1_REL) ? bcolx : 0);
+        int col2 = r.colxhi - 1 + ((rf & REF_COL2_REL) ? bcolx : 0);
+        if (row1 < 0 || row2 < 0 || col1 < 0 || col2 < 0) {
+            return false;
+        }
+        a.rowxlo = std::min(row1, row2);
+        a.rowxhi = std::max(row1, row2) + 1;
+        a.colxlo = std::min(col1, col2);
+        a.colxhi = std::max(col1, col2) + 1;
+        return true;
+    }
+
+    ////
+    // The value of a result where a single value is wanted: a one-cell
+    // reference gives that cell, a one-column (one-row) reference the cell
+    // in the formula's row (column), as Excel's implicit intersection does.
+    FormulaValue deref(const _EvalResult& r) const {
+        if (!r.is_ref) {
+            return r.value;
+        }
+        const FormulaArea& a = r.area;
+        if (a.shtxhi - a.shtxlo != 1) {
+            return FormulaValue::error(XL_ERR_VALUE);
+        }
+        int rowx = a.rowxlo;
+        int colx = a.colxlo;
+        if (a.rowxhi - a.rowxlo != 1) {
+            if (a.colxhi - a.colxlo != 1 || browx < a.rowxlo || browx >= a.rowxhi ||
+                sheetx != a.shtxlo) {
+                return FormulaValue::error(XL_ERR_VALUE);
+            }
+            rowx = browx;
+        } else if (a.colxhi - a.colxlo != 1) {
+            if (bcolx < a.colxlo || bcolx >= a.colxhi || sheetx != a.shtxlo) {
+                return FormulaValue::error(XL_ERR_VALUE);
+            }
+            colx = bcolx;
+        }
+        return cell(a.shtxlo, rowx, colx);
+    }
+
+    FormulaValue scalar(uint32_t nodex) {
+        return deref(eval(nodex));
+    }
+
+    int scalar_number(uint32_t nodex, double& out) {
+        return to_number(scalar(nodex), out);
+    }
+
+    inline _EvalResult eval(uint32_t nodex);
+    inline _EvalResult binop(const FormulaNode& n, const uint32_t* kids);
+    inline _EvalResult function(const FormulaNode& n, const uint32_t* kids);
+    inline _EvalResult aggregate(int funcx, const uint32_t* kids, int nargs);
+    inline _EvalResult lookup(int funcx, const uint32_t* kids, int nargs);
+    inline _EvalResult match(const uint32_t* kids, int nargs);
+    inline _EvalResult index(const uint32_t* kids, int nargs);
+    inline _EvalResult conditional(int funcx, const uint32_t* kids, int nargs);
+    inline _EvalResult sumproduct(const uint32_t* kids, int nargs);
+};
+
+////
+// Operations of a compiled formula. Each takes n values from the stack
+// (none unless noted) and puts back one.
+enum : uint8_t {
+    cNUMBER,    // number
+    cVALUE,     // consts[arg]
+    cCELL,      // the value of cells[arg]
+    cAREA,      // areas[arg]; only as an argument of cAGGREGATE
+    cNEG, cPERCENT,
+    cADD, cSUB, cMUL, cDIV, cPOWER,
+    cLT, cLE, cEQ, cGE, cGT, cNE,
+    cIF,        // n is 2 or 3; every argument has been computed
+    cCHOOSE,    // n arguments
+    cNOT,
+    cIS,        // arg is fISNA, fISERROR, ...
+    cMATH1,     // arg is fABS, fINT, fSIGN, fSQRT, fEXP, fLN or fLOG10
+    cMATH2,     // arg is fROUND, fROUNDUP, fROUNDDOWN, fMOD or fPOWER
+    cVALUEOF,   // VALUE()
+    cAGGREGATE, // arg is fSUM, fCOUNT, ...; n arguments
+    cRETURN,
+};
+
+////
+// One instruction of a compiled formula.
+struct FormulaInstr {
+    uint8_t op;
+    uint16_t n;
+    uint32_t arg;
+    double number;
+};
+
+////
+// Operand stack slots a compiled formula may use; formulas needing more
+// are not compiled.
+const int FORMULA_COMPILED_STACK = 64;
+
+// _Slot::ctype of an area
+const int _SLOT_AREA = -1;
+
+////
+// A value on the stack of a compiled formula: a FormulaValue whose text
+// stays where it is (in a cell or in consts), or an area.
+struct _Slot {
+    int ctype;
+    uint32_t area;
+    double number;
+    const std::string* text;
+
+    static _Slot of(const FormulaValue& v) {
+        _Slot s;
+        s.ctype = v.ctype;
+        s.number = v.number;
+        s.text = &v.text;
+        return s;
+    }
+    static _Slot num(double x) {
+        _Slot s;
+        if (std::isnan(x) || std::isinf(x)) {
+            s.ctype = XL_CELL_ERROR;
+            s.number = XL_ERR_NUM;
+        } else {
+            s.ctype = XL_CELL_NUMBER;
+            s.number = x;
+        }
+        return s;
+    }
+    static _Slot boolean(bool b) {
+        _Slot s;
+        s.ctype = XL_CELL_BOOLEAN;
+        s.number = b;
+        return s;
+    }
+    static _Slot error(int code) {
+        _Slot s;
+        s.ctype = XL_CELL_ERROR;
+        s.number = code;
+        return s;
+    }
+};
+
+////
+// A formula turned into a flat list of instructions by compile_formula():
+// the tree is walked once, references are resolved to the cells they
+// read and the stack depth is known, so run() only dispatches on op.
+class CompiledFormula {
+public:
+    std::vector<FormulaInstr> code;  // ends with cRETURN; empty if not compiled
+    std::vector<FormulaValue> consts;
+    // areas[i] is area_cells[areas[i].first, areas[i].second), in the
+    // order each_cell() visits them
+    std::vector<std::pair<uint32_t, uint32_t>> areas;
+    std::vector<uint32_t> area_cells;
+    int max_depth = 0;
+
+    bool empty() const { return code.empty(); }
+
+    ////
+    // The formula's value given the cell values; as FormulaEngine::compute().
+    inline FormulaValue run(const EngineCell* cells) const;
+};
+
+////
+// Rows evaluated at a time by FormulaEngine::_eval_block(); shared
+// formula blocks shorter than FORMULA_BLOCK_MIN are not formed.
+const uint32_t FORMULA_BLOCK_ROWS = 1024;
+const uint32_t FORMULA_BLOCK_MIN = 8;
+
+// A cell index meaning "no cell": reads as empty.
+const uint32_t NO_ENGINE_CELL = 0xFFFFFFFF;
+
+////
+// Formulas of consecutive rows of one column that share a tree (the cells
+// of a shared formula) and whose programs only do arithmetic, evaluated
+// together a column of rows at a time; see FormulaEngine::compile().
+// <p>code is the members' common program; each cCELL reads, for member i,
+// cell gathers[arg * formulas.size() + i].</p>
+struct FormulaBlock {
+    std::vector<uint32_t> formulas;  // in row order
+    std::vector<uint32_t> cells;     // their cells
+    std::vector<FormulaInstr> code;
+    std::vector<FormulaValue> consts;
+    std::vector<uint32_t> gathers;
+    int max_depth = 0;
+};
+
+class FormulaEngine {
+public:
+    ////
+    // Formula trees: those added with add_formula() and set_name() must
+    // live here.
+    FormulaArena arena;
+
+    std::vector<EngineCell> cells;
+    std::vector<EngineFormula> formulas;
+
+    ////
+    // Defined names: name index => root node. Formulas that use a name are
+    // evaluated through it, relative references resolved against the cell
+    // using the name.
+    MAP<int, uint32_t> names;
+
+    ////
+    // Shared formulas of each sheet: sheetx => table. Cells whose formula
+    // is a tExp get the template's tree, applied at their own position.
+    MAP<int, SharedFormulaTable> shared_formulas;
+
+    ////
+    // Set by build(): formulas in evaluation order, level by level; those
+    // on circular chains; and those using what the engine cannot evaluate
+    // (functions _FormulaEvaluator::function() lacks, names not given to
+    // set_name() or in other workbooks, tExp cells with no SHRFMLA, such
+    // as array formulas). The last two are left out of order and keep
+    // their cached values, which the formulas reading them then use.
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> circular;
+    std::vector<uint32_t> unsupported;
+
+    // cell key => index into cells
+    MAP<uint64_t, uint32_t> _cell_index;
+    // column key => (rowx, cell) sorted by rowx; valid after build()
+    MAP<uint64_t, std::vector<std::pair<int, uint32_t>>> _columns;
+    bool _columns_sorted = true;
+    // cell key => formulas reading that single cell
+    MAP<uint64_t, std::vector<uint32_t>> _point_deps;
+    // column key => (rowxlo, rowxhi, formula) for formulas reading a block
+    MAP<uint64_t, std::vector<std::array<int, 3>>> _range_deps;
+    // formula => formulas reading its cell: _deps[_dep_begin[f], _dep_begin[f+1])
+    std::vector<uint32_t> _dep_begin;
+    std::vector<uint32_t> _deps;
+    // formula => its position in order; circular formulas get UINT32_MAX
+    std::vector<uint32_t> _rank;
+    // formula => its level
+    std::vector<uint32_t> _level;
+    std::vector<uint8_t> _dirty;
+    std::vector<uint32_t> _dirty_list;
+    bool _built = false;
+
+    ////
+    // Set by compile(): formula => its program, empty for formulas left
+    // to the tree walker.
+    std::vector<CompiledFormula> programs;
+    // cells.size() when programs were compiled
+    size_t _programs_ncells = 0;
+
+    ////
+    // Set by compile(): shared formula blocks, and formula => its block
+    // (or UINT32_MAX).
+    std::vector<FormulaBlock> blocks;
+    std::vector<uint32_t> _block_of;
+    std::vector<uint32_t> _block_hits;  // scratch for _run()
+
+    ////
+    // The value of a cell; empty for a cell the engine does not know.
+    const FormulaValue& value(int sheetx, int rowx, int colx) const {
+        static const FormulaValue empty;
+        const auto& it = _cell_index.find(_cell_key(sheetx, rowx, colx));
+        return it == _cell_index.end() ? empty : cells[it->second].value;
+    }
+
+    uint32_t _cell(int sheetx, int rowx, int colx) {
+        uint64_t key = _cell_key(sheetx, rowx, colx);
+        const auto& it = _cell_index.find(key);
+        if (it != _cell_index.end()) {
+            return it->second;
+        }
+        uint32_t cellx = cells.size();
+        cells.push_back(EngineCell{sheetx, rowx, colx, FormulaValue(), NO_FORMULA_NODE});
+        _cell_index[key] = cellx;
+        auto& column = _columns[_column_key(sheetx, colx)];
+        if (!column.empty() && column.back().first > rowx) {
+            _columns_sorted = false;
+        }
+        column.emplace_back(rowx, cellx);
+        return cellx;
+    }
+
+    ////
+    // Sets a constant cell. Once the graph is built, the formulas that
+    // depend on the cell are marked for recalculate(). A formula in the
+    // cell is dropped.
+    void set_value(int sheetx, int rowx, int colx, const FormulaValue& value) {
+        uint32_t cellx = _cell(sheetx, rowx, colx);
+        EngineCell& c = cells[cellx];
+        c.value = value;
+        if (c.formula != NO_FORMULA_NODE) {
+            c.formula = NO_FORMULA_NODE;
+        }
+        if (_built) {
+            if (!_columns_sorted) {
+                _sort_columns();
+            }
+            _mark_dependents(sheetx, rowx, colx);
+        }
+    }
+
+    ////
+    // Puts a formula in a cell, with the value cached for it in the file.
+    // ast must have been built in arena. The graph is rebuilt on the next
+    // recalculate().
+    void add_formula(int sheetx, int rowx, int colx, const FormulaAst& ast,
+                     const FormulaValue& cached=FormulaValue())
+    {
+        if (ast.root == NO_FORMULA_NODE) {
+            set_value(sheetx, rowx, colx, cached);
+            return;
+        }
+        uint32_t cellx = _cell(sheetx, rowx, colx);
+        cells[cellx].value = cached;
+        cells[cellx].formula = formulas.size();
+        formulas.push_back(EngineFormula{cellx, ast.root});
+        _built = false;
+    }
+
+    ////
+    // Convenience for xlsx: parses text as the formula of the cell.
+    void add_formula_text(int sheetx, int rowx, int colx, const std::string& text,
+                          const std::vector<std::string>& sheet_names,
+                          const FormulaValue& cached=FormulaValue(),
+                          const MAP<std::string, int>* name_map=nullptr)
+    {
+        auto ast = parse_formula_text(arena, text, sheet_names, rowx, colx, name_map);
+        add_formula(sheetx, rowx, colx, ast, cached);
+    }
+
+    ////
+    // Convenience for BIFF 8: decompiles the FORMULA record tokens of the
+    // cell. A tExp naming a shared formula already added with
+    // add_shrfmla() takes its template without decompiling anything; one
+    // whose SHRFMLA comes later (as it does for the first cell of the
+    // range) is resolved by build().
+    void add_formula_bytes(FormulaBookDelegate* bk, int sheetx, int rowx, int colx,
+                           const std::vector<uint8_t>& data, int fmlalen,
+                           const FormulaValue& cached=FormulaValue(), int pos=0)
+    {
+        int baserowx, basecolx;
+        if (SharedFormulaTable::is_instance(data, fmlalen, pos, baserowx, basecolx)) {
+            const auto& it = shared_formulas.find(sheetx);
+            const FormulaAst* tmpl = it == shared_formulas.end() ? nullptr
+                                   : it->second.find(baserowx, basecolx);
+            if (tmpl) {
+                add_formula(sheetx, rowx, colx, *tmpl, cached);
+                return;
+            }
+        }
+        auto ast = decompile_formula_ast(bk, arena, data, fmlalen, FMLA_TYPE_CELL,
+                                         rowx, colx, pos);
+        add_formula(sheetx, rowx, colx, ast, cached);
+    }
+
+    ////
+    // Decodes a SHRFMLA record body of the sheet.
+    void add_shrfmla(FormulaBookDelegate* bk, int sheetx,
+                     const std::vector<uint8_t>& data, int pos=0)
+    {
+        shared_formulas[sheetx].add(bk, arena, data, pos);
+        _built = false;
+    }
+
+    void set_name(int namex, const FormulaAst& ast) {
+        names[namex] = ast.root;
+        _built = false;
+        programs.clear();  // they have the old tree inlined
+        blocks.clear();
+    }
+
+    ////
+    // Builds the dependency graph and the evaluation order.
+    void build() {
+        if (!_columns_sorted) {
+            _sort_columns();
+        }
+        _point_deps.clear();
+        _range_deps.clear();
+        int nf = formulas.size();
+        _resolve_shared();
+        std::vector<uint8_t> can_eval(nf, 1);
+        std::vector<int> names_open;
+        for (int f = 0; f < nf; ++f) {
+            const EngineCell& c = cells[formulas[f].cell];
+            if (c.formula != (uint32_t)f) {
+                continue; // replaced by a constant
+            }
+            _FormulaEvaluator ev(*this, c.sheetx, c.rowx, c.colx);
+            bool ok = true;
+            names_open.clear();
+            _collect(ev, formulas[f].root, f, names_open, ok);
+            can_eval[f] = ok;
+        }
+        // formula => formulas reading its cell, as CSR
+        _dep_begin.assign(nf + 1, 0);
+        _deps.clear();
+        std::vector<uint32_t> scratch;
+        for (int f = 0; f < nf; ++f) {
+            _dep_begin[f] = _deps.size();
+            const EngineCell& c = cells[formulas[f].cell];
+            if (c.formula == (uint32_t)f) {
+                scratch.clear();
+                _dependents(c.sheetx, c.rowx, c.colx, scratch);
+                _deps.insert(_deps.end(), scratch.begin(), scratch.end());
+            }
+        }
+        _dep_begin[nf] = _deps.size();
+        // Kahn's algorithm; what is left over is on a cycle
+        std::vector<uint32_t> indeg(nf, 0);
+        for (uint32_t g: _deps) {
+            ++indeg[g];
+        }
+        order.clear();
+        circular.clear();
+        unsupported.clear();
+        for (int f = 0; f < nf; ++f) {
+            if (indeg[f] == 0) {
+                order.push_back(f);
+            }
+        }
+        for (size_t i = 0; i < order.size(); ++i) {
+            uint32_t f = order[i];
+            for (uint32_t j = _dep_begin[f]; j < _dep_begin[f + 1]; ++j) {
+                if (--indeg[_deps[j]] == 0) {
+                    order.push_back(_deps[j]);
+                }
+            }
+        }
+        // Levels, then order regrouped level by level (a counting sort,
+        // so it stays in Kahn order within a level)
+        _level.assign(nf, 0);
+        uint32_t nlevels = 0;
+        for (uint32_t f: order) {
+            uint32_t next = _level[f] + 1;
+            for (uint32_t j = _dep_begin[f]; j < _dep_begin[f + 1]; ++j) {
+                _level[_deps[j]] = std::max(_level[_deps[j]], next);
+            }
+            nlevels = std::max(nlevels, next);
+        }
+        std::vector<uint32_t> level_begin(nlevels + 1, 0);
+        for (uint32_t f: order) {
+            ++level_begin[_level[f] + 1];
+        }
+        for (uint32_t i = 0; i < nlevels; ++i) {
+            level_begin[i + 1] += level_begin[i];
+        }
+        std::vector<uint32_t> by_level(order.size());
+        for (uint32_t f: order) {
+            by_level[level_begin[_level[f]]++] = f;
+        }
+        // formulas that cannot be evaluated keep their place in the graph,
+        // so what reads them is still ordered after them, but not in order
+        _rank.assign(nf, UINT32_MAX);
+        order.clear();
+        for (uint32_t f: by_level) {
+            if (can_eval[f]) {
+                _rank[f] = order.size();
+                order.push_back(f);
+            } else if (_live(f)) {
+                unsupported.push_back(f);
+            }
+        }
+        std::sort(unsupported.begin(), unsupported.end());
+        for (int f = 0; f < nf; ++f) {
+            if (indeg[f] != 0) { // never reached by Kahn's algorithm
+                circular.push_back(f);
+            }
+        }
+        _dirty.assign(nf, 0);
+        _dirty_list.clear();
+        _built = true;
+    }
+
+    ////
+    // Evaluates formula f and stores its value in its cell.
+    void evaluate(uint32_t f) {
+        cells[formulas[f].cell].value = compute(f);
+    }
+
+    ////
+    // The value of formula f given the current cell values; pure.
+    FormulaValue compute(uint32_t f) const {
+        if (f < programs.size() && !programs[f].empty() &&
+            _programs_ncells == cells.size()) {
+            return programs[f].run(cells.data());
+        }
+        const EngineCell& c = cells[formulas[f].cell];
+        _FormulaEvaluator ev(*this, c.sheetx, c.rowx, c.colx);
+        FormulaValue v = ev.scalar(formulas[f].root);
+        if (v.ctype == XL_CELL_EMPTY) {
+            v = FormulaValue(0.0);
+        }
+        return v;
+    }
+
+    ////
+    // Evaluates every formula, in dependency order. Returns the number
+    // evaluated. With nthreads != 1 (0 means one per hardware thread)
+    // large levels are evaluated concurrently.
+    int recalculate_all(int nthreads=1) {
+        if (!_built) {
+            build();
+        }
+        std::vector<uint32_t> todo;
+        todo.reserve(order.size());
+        for (uint32_t f: order) {
+            if (_live(f)) {
+                todo.push_back(f);
+            }
+        }
+        for (uint32_t f: _dirty_list) {
+            _dirty[f] = 0;
+        }
+        _dirty_list.clear();
+        _run(todo, nthreads);
+        return todo.size();
+    }
+
+    ////
+    // Evaluates the formulas marked by set_value() since the last call,
+    // in dependency order. Returns the number evaluated. Without a graph
+    // (first call, or after add_formula()) it builds one and evaluates
+    // everything. nthreads is as for recalculate_all().
+    int recalculate(int nthreads=1) {
+        if (!_built) {
+            return recalculate_all(nthreads);
+        }
+        std::vector<uint32_t> todo;
+        todo.reserve(_dirty_list.size());
+        for (uint32_t f: _dirty_list) {
+            _dirty[f] = 0;
+            if (_rank[f] != UINT32_MAX && _live(f)) {
+                todo.push_back(f);
+            }
+        }
+        _dirty_list.clear();
+        std::sort(todo.begin(), todo.end(), [this](uint32_t a, uint32_t b) {
+            return _rank[a] < _rank[b];
+        });
+        _run(todo, nthreads);
+        return todo.size();
+    }
+
+    ////
+    // Compiles what formulas compile_formula() can, so that compute()
+    // runs their programs instead of walking their trees; worth it when
+    // the same formulas are recalculated many times. Returns the number
+    // compiled. Programs hold the indexes of the cells they read, so they
+    // stop being used once a cell is added (set_value() or add_formula()
+    // on a new cell) and are dropped by set_name(); compile again then.
+    // <p>It also forms the FormulaBlocks of shared formulas doing only
+    // + - * / and negation: when a level holds a whole block, _run()
+    // evaluates it column-wise, and rows with anything but numbers (or a
+    // zero divisor) are redone by their own program.</p>
+    inline int compile();
+
+    inline void _form_blocks();
+    inline void _eval_block(const FormulaBlock& b);
+    inline void _run_blocks(const uint32_t* items, size_t n, std::vector<uint32_t>& rest);
+
+    inline void _run(const std::vector<uint32_t>& todo, int nthreads);
+
+    // Points formulas that are still a bare tExp at their template.
+    void _resolve_shared() {
+        for (auto& fm: formulas) {
+            const FormulaNode& n = arena.nodes[fm.root];
+            if (n.kind != nSHARED) {
+                continue;
+            }
+            const auto& it = shared_formulas.find(cells[fm.cell].sheetx);
+            if (it == shared_formulas.end()) {
+                continue;
+            }
+            const FormulaAst* tmpl = it->second.find(n.index, n.extra);
+            if (tmpl && tmpl->root != NO_FORMULA_NODE) {
+                fm.root = tmpl->root;
+            }
+        }
+    }
+
+    bool _live(uint32_t f) const {
+        return cells[formulas[f].cell].formula == f;
+    }
+
+    void _sort_columns() {
+        for (auto& it: _columns) {
+            std::sort(it.second.begin(), it.second.end());
+        }
+        _columns_sorted = true;
+    }
+
+    // Registers formula f as reading whatever nodex refers to; clears ok
+    // if the engine cannot evaluate it. names_open holds the names being
+    // expanded, so a name that refers to itself is caught.
+    void _collect(_FormulaEvaluator& ev, uint32_t nodex, uint32_t f,
+                  std::vector<int>& names_open, bool& ok) {
+        const FormulaNode& n = arena.nodes[nodex];
+        if (n.kind == nREF) {
+            FormulaArea a;
+            if (ev.resolve(arena.refs[n.index], a)) {
+                _add_dep(a, f);
+            }
+        } else if (n.kind == nNAME) {
+            const auto& it = names.find(n.index);
+            if (n.aux < -1 || it == names.end() ||
+                std::find(names_open.begin(), names_open.end(), (int)n.index)
+                    != names_open.end()) {
+                ok = false;
+            } else {
+                names_open.push_back(n.index);
+                _collect(ev, it->second, f, names_open, ok);
+                names_open.pop_back();
+            }
+        } else if (n.kind == nUNK || n.kind == nSHARED ||
+                   (n.kind == nFUNC && !_engine_function(n.aux))) {
+            ok = false;
+        }
+        const uint32_t* kids = arena.children.data() + n.child;
+        for (int i = 0; i < n.nargs; ++i) {
+            _collect(ev, kids[i], f, names_open, ok);
+        }
+    }
+
+    void _add_dep(const FormulaArea& a, uint32_t f) {
+        for (int shx = a.shtxlo; shx < a.shtxhi; ++shx) {
+            if (a.rowxhi - a.rowxlo == 1 && a.colxhi - a.colxlo == 1) {
+                _point_deps[_cell_key(shx, a.rowxlo, a.colxlo)].push_back(f);
+                continue;
+            }
+            for (int colx = a.colxlo; colx < a.colxhi; ++colx) {
+                _range_deps[_column_key(shx, colx)].push_back(
+                    std::array<int, 3>{{a.rowxlo, a.rowxhi, (int)f}});
+            }
+        }
+    }
+
+    // Appends the formulas that read the cell.
+    void _dependents(int sheetx, int rowx, int colx, std::vector<uint32_t>& out) const {
+        const auto& pit = _point_deps.find(_cell_key(sheetx, rowx, colx));
+        if (pit != _point_deps.end()) {
+            out.insert(out.end(), pit->second.begin(), pit->second.end());
+        }
+        const auto& rit = _range_deps.find(_column_key(sheetx, colx));
+        if (rit != _range_deps.end()) {
+            for (const auto& r: rit->second) {
+                if (r[0] <= rowx && rowx < r[1]) {
+                    out.push_back(r[2]);
+                }
+            }
+        }
+    }
+
+    void _mark_dependents(int sheetx, int rowx, int colx) {
+        std::vector<uint32_t> queue;
+        _dependents(sheetx, rowx, colx, queue);
+        for (size_t i = 0; i < queue.size(); ++i) {
+            uint32_t f = queue[i];
+            if (_dirty[f]) {
+                continue;
+            }
+            _dirty[f] = 1;
+            _dirty_list.push_back(f);
+            for (uint32_t j = _dep_begin[f]; j < _dep_begin[f + 1]; ++j) {
+                if (!_dirty[_deps[j]]) {
+                    queue.push_back(_deps[j]);
+                }
+            }
+        }
+    }
+};
+
+// === Parallel recalculation ===
+
+////
+// Threads that evaluate the formulas of one level at a time.
+// <p>run() splits the level into one contiguous share per thread. A
+// thread takes FORMULA_PARALLEL_CHUNK formulas at a time from the front
+// of its share; once that is used up it steals the back half of the
+// largest share left. A share is a [begin, end) pair packed into one
+// atomic word, so taking and stealing are each a single compare-and-swap.
+// The calling thread works as thread 0; the others are started on the
+// first run() and stopped by the destructor.</p>
+class _FormulaPool {
+public:
+    FormulaEngine& engine;
+    int nthreads;
+    std::vector<std::thread> workers;
+    std::unique_ptr<std::atomic<uint64_t>[]> shares;
+    std::mutex mu;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const uint32_t* items = nullptr;
+    unsigned generation = 0;
+    int busy = 0;
+    bool stop = false;
+    std::exception_ptr error;
+
+    _FormulaPool(FormulaEngine& engine_, int nthreads_)
+    : engine(engine_), nthreads(nthreads_),
+      shares(new std::atomic<uint64_t>[nthreads_])
+    {}
+
+    ~_FormulaPool() {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto& worker: workers) {
+            worker.join();
+        }
+    }
+
+    static uint64_t pack(uint32_t begin, uint32_t end) {
+        return ((uint64_t)begin << 32) | end;
+    }
+
+    ////
+    // Evaluates items[0, n) across the threads; returns when all are done.
+    void run(const uint32_t* items_, size_t n) {
+        if (workers.empty()) {
+            for (int id = 1; id < nthreads; ++id) {
+                workers.emplace_back([this, id]() { worker(id); });
+            }
+        }
+        for (int id = 0; id < nthreads; ++id) {
+            shares[id].store(pack(n * id / nthreads, n * (id + 1) / nthreads));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            items = items_;
+            busy = nthreads - 1;
+            ++generation;
+        }
+        wake.notify_all();
+        work(0);
+        std::unique_lock<std::mutex> lock(mu);
+        done.wait(lock, [this]() { return busy == 0; });
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    void worker(int id) {
+        unsigned seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mu);
+                wake.wait(lock, [&]() { return stop || generation != seen; });
+                if (stop) {
+                    return;
+                }
+                seen = generation;
+            }
+            work(id);
+            std::lock_guard<std::mutex> lock(mu);
+            if (--busy == 0) {
+                done.notify_one();
+            }
+        }
+    }
+
+    void work(int id) {
+        uint32_t begin, end;
+        while (take(id, begin, end) || steal(id, begin, end)) {
+            try {
+                for (uint32_t i = begin; i < end; ++i) {
+                    engine.evaluate(items[i]);
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mu);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+    }
+
+    bool take(int id, uint32_t& begin, uint32_t& end) {
+        auto& share = shares[id];
+        uint64_t cur = share.load();
+        for (;;) {
+            uint32_t lo = cur >> 32;
+            uint32_t hi = (uint32_t)cur;
+            if (lo >= hi) {
+                return false;
+            }
+            uint32_t next = std::min(hi, lo + FORMULA_PARALLEL_CHUNK);
+            if (share.compare_exchange_weak(cur, pack(next, hi))) {
+                begin = lo;
+                end = next;
+                return true;
+            }
+        }
+    }
+
+    bool steal(int id, uint32_t& begin, uint32_t& end) {
+        for (;;) {
+            int victim = -1;
+            uint64_t cur = 0;
+            uint32_t most = 0;
+            for (int v = 0; v < nthreads; ++v) {
+                uint64_t s = shares[v].load();
+                uint32_t lo = s >> 32;
+                uint32_t hi = (uint32_t)s;
+                if (v != id && hi > lo && hi - lo > most) {
+                    victim = v;
+                    cur = s;
+                    most = hi - lo;
+                }
+            }
+            if (victim < 0) {
+                return false;
+            }
+            uint32_t lo = cur >> 32;
+            uint32_t hi = (uint32_t)cur;
+            uint32_t mid = hi - (hi - lo + 1) / 2;
+            if (shares[victim].compare_exchange_strong(cur, pack(lo, mid))) {
+                // our own share is empty, so nobody else is changing it
+                shares[id].store(pack(mid, hi));
+                return take(id, begin, end);
+            }
+        }
+    }
+};
+
+////
+// Evaluates todo, which is in order's order, level by level.
+inline void
+FormulaEngine::_run(const std::vector<uint32_t>& todo, int nthreads) {
+    if (nthreads <= 0) {
+        nthreads = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    bool use_blocks = !blocks.empty() && _programs_ncells == cells.size();
+    if (!use_blocks && (nthreads == 1 || todo.size() < FORMULA_PARALLEL_MIN_LEVEL)) {
+        for (uint32_t f: todo) {
+            evaluate(f);
+        }
+        return;
+    }
+    std::unique_ptr<_FormulaPool> pool;
+    std::vector<uint32_t> rest;
+    size_t i = 0;
+    while (i < todo.size()) {
+        uint32_t level = _level[todo[i]];
+        size_t j = i + 1;
+        while (j < todo.size() && _level[todo[j]] == level) {
+            ++j;
+        }
+        const uint32_t* items = todo.data() + i;
+        size_t n = j - i;
+        if (use_blocks) {
+            _run_blocks(items, n, rest);
+            items = rest.data();
+            n = rest.size();
+        }
+        if (nthreads == 1 || n < FORMULA_PARALLEL_MIN_LEVEL) {
+            for (size_t k = 0; k < n; ++k) {
+                evaluate(items[k]);
+            }
+        } else {
+            if (!pool) {
+                pool.reset(new _FormulaPool(*this, nthreads));
+            }
+            pool->run(items, n);
+        }
+        i = j;
+    }
+}
+
+// === Evaluation ===
+
+inline
+_FormulaEvaluator::_FormulaEvaluator(const FormulaEngine& engine_,
+                                     int sheetx_, int browx_, int bcolx_)
+: engine(engine_), arena(engine_.arena), sheetx(sheetx_), browx(browx_), bcolx(bcolx_)
+{}
+
+inline const FormulaValue&
+_FormulaEvaluator::cell(int shx, int rowx, int colx) const {
+    return engine.value(shx, rowx, colx);
+}
+
+////
+// Calls fn(value) for each cell of a that the engine knows, column by
+// column; empty cells are skipped.
+template<class F> inline void
+_FormulaEvaluator::each_cell(const FormulaArea& a, F fn) const {
+    for (int shx = a.shtxlo; shx < a.shtxhi; ++shx) {
+        for (int colx = a.colxlo; colx < a.colxhi; ++colx) {
+            const auto& it = engine._columns.find(_column_key(shx, colx));
+            if (it == engine._columns.end()) {
+                continue;
+            }
+            const auto& column = it->second;
+            auto p = std::lower_bound(column.begin(), column.end(),
+                                      std::make_pair(a.rowxlo, (uint32_t)0));
+            for (; p != column.end() && p->first < a.rowxhi; ++p) {
+                const FormulaValue& v = engine.cells[p->second].value;
+                if (v.ctype != XL_CELL_EMPTY) {
+                    fn(v, true);
+                }
+            }
+        }
+    }
+}
+
+////
+// Calls fn(value, from_ref) for each value an argument supplies: one for
+// a plain value, one per non-empty cell for a reference, each item of a
+// (a, b) list. Stops, returning false, when fn does.
+template<class F> inline bool
+_FormulaEvaluator::each_value(uint32_t nodex, F fn) {
+    const FormulaNode& n = arena.nodes[nodex];
+    if (n.kind == nBINOP && (n.opx & 0x1f) == 0x10) {
+        const uint32_t* kids = arena.children.data() + n.child;
+        return each_value(kids[0], fn) && each_value(kids[1], fn);
+    }
+    if (n.kind == nMSNG) {
+        return true;
+    }
+    _EvalResult r = eval(nodex);
+    if (!r.is_ref) {
+        return fn(r.value, false);
+    }
+    bool go = true;
+    each_cell(r.area, [&](const FormulaValue& v, bool) {
+        if (go) go = fn(v, true);
+    });
+    return go;
+}
+
+inline _EvalResult
+_FormulaEvaluator::eval(uint32_t nodex) {
+    const FormulaNode& n = arena.nodes[nodex];
+    const uint32_t* kids = arena.children.data() + n.child;
+    switch (n.kind) {
+    case nMSNG:
+        return value(FormulaValue());
+    case nNUM:
+        return value(FormulaValue(arena.numbers[n.index]));
+    case nBOOL:
+        return value(FormulaValue::boolean(n.index != 0));
+    case nERR:
+        return error(n.index);
+    case nSTR:
+        return value(FormulaValue(arena.strings.substr(n.index, n.extra)));
+    case nREF: {
+        _EvalResult r;
+        if (!resolve(arena.refs[n.index], r.area)) {
+            return error(XL_ERR_REF);
+        }
+        r.is_ref = 1;
+        return r;
+    }
+    case nNAME: {
+        if (n.aux < -1) {
+            return error(XL_ERR_REF); // another workbook
+        }
+        const auto& it = engine.names.find(n.index);
+        if (it == engine.names.end() ||
+            std::find(names_open.begin(), names_open.end(), (int)n.index)
+                != names_open.end()) {
+            return error(XL_ERR_NAME); // unknown, or refers to itself
+        }
+        names_open.push_back(n.index);
+        _EvalResult r = eval(it->second);
+        names_open.pop_back();
+        return r;
+    }
+    case nBINOP:
+        return binop(n, kids);
+    case nUNOP: {
+        FormulaValue v = scalar(kids[0]);
+        int opcode = n.opx & 0x1f;
+        if (opcode == 0x12) {
+            return value(v);
+        }
+        double x;
+        int err = to_number(v, x);
+        if (err >= 0) {
+            return error(err);
+        }
+        return number(opcode == 0x13 ? -x : x / 100.0);
+    }
+    case nFUNC:
+        return function(n, kids);
+    case nUNK:
+        // an unknown function (tFunc, tFuncVar or parsed), or tArray
+        if ((n.opx & 0x1f) == 0x01 || (n.opx & 0x1f) == 0x02) {
+            return error(XL_ERR_NAME);
+        }
+        return error(XL_ERR_VALUE);
+    default:
+        // nSHARED: a tExp whose SHRFMLA (or ARRAY) record was never added
+        return error(XL_ERR_VALUE);
+    }
+}
+
+inline _EvalResult
+_FormulaEvaluator::binop(const FormulaNode& n, const uint32_t* kids) {
+    int opcode = n.opx & 0x1f;
+    if (opcode == 0x0F || opcode == 0x11) { // tIsect, tRange
+        _EvalResult a = eval(kids[0]);
+        _EvalResult b = eval(kids[1]);
+        if (!a.is_ref) return a.value.is_error() ? a : error(XL_ERR_VALUE);
+        if (!b.is_ref) return b.value.is_error() ? b : error(XL_ERR_VALUE);
+        if (a.area.shtxlo != b.area.shtxlo || a.area.shtxhi != b.area.shtxhi) {
+            return error(XL_ERR_VALUE);
+        }
+        FormulaArea& x = a.area;
+        const FormulaArea& y = b.area;
+        if (opcode == 0x11) {
+            x.rowxlo = std::min(x.rowxlo, y.rowxlo);
+            x.rowxhi = std::max(x.rowxhi, y.rowxhi);
+            x.colxlo = std::min(x.colxlo, y.colxlo);
+            x.colxhi = std::max(x.colxhi, y.colxhi);
+        } else {
+            x.rowxlo = std::max(x.rowxlo, y.rowxlo);
+            x.rowxhi = std::min(x.rowxhi, y.rowxhi);
+            x.colxlo = std::max(x.colxlo, y.colxlo);
+            x.colxhi = std::min(x.colxhi, y.colxhi);
+            if (x.rowxlo >= x.rowxhi || x.colxlo >= x.colxhi) {
+                return error(XL_ERR_NULL);
+            }
+        }
+        return a;
+    }
+    if (opcode == 0x10) { // tList outside a function
+        return error(XL_ERR_VALUE);
+    }
+    FormulaValue a = scalar(kids[0]);
+    FormulaValue b = scalar(kids[1]);
+    if (a.is_error()) return value(std::move(a));
+    if (b.is_error()) return value(std::move(b));
+    if (opcode == tConcat) {
+        std::string sa, sb;
+        to_text(a, sa);
+        to_text(b, sb);
+        return value(FormulaValue(sa + sb));
+    }
+    if (opcode >= tLT) {
+        int c = compare_values(a, b);
+        bool r;
+        switch (opcode) {
+        case tLT: r = c < 0; break;
+        case tLE: r = c <= 0; break;
+        case tEQ: r = c == 0; break;
+        case tGE: r = c >= 0; break;
+        case tGT: r = c > 0; break;
+        default: r = c != 0; break;
+        }
+        return value(FormulaValue::boolean(r));
+    }
+    double x, y;
+    int err = to_number(a, x);
+    if (err < 0) err = to_number(b, y);
+    if (err >= 0) return error(err);
+    switch (opcode) {
+    case tAdd: return number(x + y);
+    case tSub: return number(x - y);
+    case tMul: return number(x * y);
+    case tDiv:
+        if (y == 0) return error(XL_ERR_DIV0);
+        return number(x / y);
+    default: // tPower
+        if (x == 0 && y == 0) return error(XL_ERR_NUM);
+        if (x == 0 && y < 0) return error(XL_ERR_DIV0);
+        return number(std::pow(x, y));
+    }
+}
+
+inline double
+_round_digits(double x, double digits, int mode) {
+    // mode 0: half away from zero, 1: away from zero, -1: toward zero.
+    // The scaled value is nudged a few ulps so that 2.675 * 100, say,
+    // rounds as the decimal it stands for.
+    double scale = std::pow(10.0, std::trunc(digits));
+    double y = std::fabs(x) * scale;
+    double r;
+    if (mode == 0) {
+        r = std::floor(y * (1 + 4 * DBL_EPSILON) + 0.5);
+    } else if (mode > 0) {
+        r = std::ceil(y * (1 - 4 * DBL_EPSILON));
+    } else {
+        r = std::floor(y * (1 + 4 * DBL_EPSILON));
+    }
+    r /= scale;
+    return x < 0 ? -r : r;
+}
+
+inline _EvalResult
+_FormulaEvaluator::function(const FormulaNode& n, const uint32_t* kids) {
+    int funcx = n.aux;
+    int nargs = n.nargs;
+    switch (funcx) {
+    case fSUM: case fCOUNT: case fCOUNTA: case fAVERAGE: case fMIN: case fMAX:
+    case fPRODUCT: case fAND: case fOR:
+        return aggregate(funcx, kids, nargs);
+    case fVLOOKUP: case fHLOOKUP:
+        return lookup(funcx, kids, nargs);
+    case fMATCH:
+        return match(kids, nargs);
+    case fINDEX:
+        return index(kids, nargs);
+    case fSUMIF: case fCOUNTIF:
+        return conditional(funcx, kids, nargs);
+    case fSUMPRODUCT:
+        return sumproduct(kids, nargs);
+    case fIF: {
+        bool cond;
+        int err = to_boolean(scalar(kids[0]), cond);
+        if (err >= 0) return error(err);
+        if (cond) {
+            if (arena.nodes[kids[1]].kind == nMSNG) return number(0);
+            return eval(kids[1]);
+        }
+        if (nargs < 3) return value(FormulaValue::boolean(false));
+        if (arena.nodes[kids[2]].kind == nMSNG) return number(0);
+        return eval(kids[2]);
+    }
+    case fCHOOSE: {
+        double x;
+        int err = scalar_number(kids[0], x);
+        if (err >= 0) return error(err);
+        int i = (int)x;
+        if (i < 1 || i >= nargs) return error(XL_ERR_VALUE);
+        return eval(kids[i]);
+    }
+    case fNOT: {
+        bool b;
+        int err = to_boolean(scalar(kids[0]), b);
+        if (err >= 0) return error(err);
+        return value(FormulaValue::boolean(!b));
+    }
+    case fTRUE:
+        return value(FormulaValue::boolean(true));
+    case fFALSE:
+        return value(FormulaValue::boolean(false));
+    case fNA:
+        return error(XL_ERR_NA);
+    case fPI:
+        return number(3.14159265358979323846);
+    case fISNA: case fISERROR: case fISERR: case fISNUMBER: case fISTEXT:
+    case fISLOGICAL: {
+        FormulaValue v = scalar(kids[0]);
+        bool r;
+        switch (funcx) {
+        case fISNA: r = v.is_error() && v.error_code() == XL_ERR_NA; break;
+        case fISERROR: r = v.is_error(); break;
+        case fISERR: r = v.is_error() && v.error_code() != XL_ERR_NA; break;
+        case fISNUMBER: r = v.ctype == XL_CELL_NUMBER; break;
+        case fISTEXT: r = v.ctype == XL_CELL_TEXT; break;
+        default: r = v.ctype == XL_CELL_BOOLEAN; break;
+        }
+        return value(FormulaValue::boolean(r));
+    }
+    case fISBLANK: {
+        _EvalResult r = eval(kids[0]);
+        return value(FormulaValue::boolean(
+            r.is_ref && deref(r).ctype == XL_CELL_EMPTY));
+    }
+    case fROW: case fCOLUMN: case fROWS: case fCOLUMNS: {
+        if (nargs == 0) {
+            if (funcx == fROW) return number(browx + 1);
+            if (funcx == fCOLUMN) return number(bcolx + 1);
+        }
+        _EvalResult r = eval(kids[0]);
+        if (!r.is_ref) {
+            if (r.value.is_error()) return r;
+            if (funcx == fROWS || funcx == fCOLUMNS) return number(1);
+            return error(XL_ERR_VALUE);
+        }
+        switch (funcx) {
+        case fROW: return number(r.area.rowxlo + 1);
+        case fCOLUMN: return number(r.area.colxlo + 1);
+        case fROWS: return number(r.area.rowxhi - r.area.rowxlo);
+        default: return number(r.area.colxhi - r.area.colxlo);
+        }
+    }
+    case fABS: case fINT: case fSIGN: case fSQRT: case fEXP: case fLN: case fLOG10: {
+        double x;
+        int err = scalar_number(kids[0], x);
+        if (err >= 0) return error(err);
+        switch (funcx) {
+        case fABS: return number(std::fabs(x));
+        case fINT: return number(std::floor(x));
+        case fSIGN: return number(x > 0 ? 1 : x < 0 ? -1 : 0);
+        case fSQRT: return x < 0 ? error(XL_ERR_NUM) : number(std::sqrt(x));
+        case fEXP: return number(std::exp(x));
+        case fLN: return x <= 0 ? error(XL_ERR_NUM) : number(std::log(x));
+        default: return x <= 0 ? error(XL_ERR_NUM) : number(std::log10(x));
+        }
+    }
+    case fROUND: case fROUNDUP: case fROUNDDOWN: case fMOD: case fPOWER: {
+        double x, y;
+        int err = scalar_number(kids[0], x);
+        if (err < 0) err = scalar_number(kids[1], y);
+        if (err >= 0) return error(err);
+        switch (funcx) {
+        case fROUND: return number(_round_digits(x, y, 0));
+        case fROUNDUP: return number(_round_digits(x, y, 1));
+        case fROUNDDOWN: return number(_round_digits(x, y, -1));
+        case fMOD:
+            if (y == 0) return error(XL_ERR_DIV0);
+            return number(x - y * std::floor(x / y));
+        default:
+            if (x == 0 && y == 0) return error(XL_ERR_NUM);
+            if (x == 0 && y < 0) return error(XL_ERR_DIV0);
+            return number(std::pow(x, y));
+        }
+    }
+    case fVALUE: {
+        FormulaValue v = scalar(kids[0]);
+        if (v.ctype == XL_CELL_BOOLEAN) return error(XL_ERR_VALUE);
+        double x;
+        int err = to_number(v, x);
+        if (err >= 0) return error(err);
+        return number(x);
+    }
+    case fLEN: case fUPPER: case fLOWER: case fTRIM: {
+        std::string s;
+        int err = to_text(scalar(kids[0]), s);
+        if (err >= 0) return error(err);
+        if (funcx == fLEN) return number(_utf8_length(s));
+        if (funcx == fTRIM) {
+            std::string t;
+            for (char c: s) {
+                if (c != ' ' || (!t.empty() && t.back() != ' ')) t.push_back(c);
+            }
+            if (!t.empty() && t.back() == ' ') t.pop_back();
+            return value(FormulaValue(t));
+        }
+        // ASCII letters only
+        for (auto& c: s) {
+            c = funcx == fUPPER ? std::toupper((unsigned char)c)
+                                : std::tolower((unsigned char)c);
+        }
+        return value(FormulaValue(s));
+    }
+    case fLEFT: case fRIGHT: case fMID: {
+        std::string s;
+        int err = to_text(scalar(kids[0]), s);
+        if (err >= 0) return error(err);
+        double a = 1, b = 0;
+        if (funcx == fMID) {
+            err = scalar_number(kids[1], a);
+            if (err < 0) err = scalar_number(kids[2], b);
+            if (err >= 0) return error(err);
+            if (a < 1 || b < 0) return error(XL_ERR_VALUE);
+            size_t from = _utf8_offset(s, std::trunc(a) - 1);
+            size_t to = from + _utf8_offset(s.substr(from), std::trunc(b));
+            return value(FormulaValue(s.substr(from, to - from)));
+        }
+        if (nargs > 1 && arena.nodes[kids[1]].kind != nMSNG) {
+            err = scalar_number(kids[1], a);
+            if (err >= 0) return error(err);
+        }
+        if (a < 0) return error(XL_ERR_VALUE);
+        if (funcx == fLEFT) {
+            return value(FormulaValue(s.substr(0, _utf8_offset(s, std::trunc(a)))));
+        }
+        size_t len = _utf8_length(s);
+        double skip = std::max(0.0, (double)len - std::trunc(a));
+        return value(FormulaValue(s.substr(_utf8_offset(s, skip))));
+    }
+    case fCONCATENATE: {
+        std::string out, s;
+        for (int i = 0; i < nargs; ++i) {
+            int err = to_text(scalar(kids[i]), s);
+            if (err >= 0) return error(err);
+            out += s;
+        }
+        return value(FormulaValue(out));
+    }
+    default:
+        return error(XL_ERR_NAME);
+    }
+}
+
+////
+// SUM, COUNT, COUNTA, AVERAGE, MIN, MAX, PRODUCT, AND, OR. Values from
+// references count only as what they are (text is skipped, except by
+// COUNTA); values given directly are coerced.
+inline _EvalResult
+_FormulaEvaluator::aggregate(int funcx, const uint32_t* kids, int nargs) {
+    double acc = funcx == fPRODUCT ? 1 : funcx == fAND ? 1 : 0;
+    double count = 0;
+    bool any = false;
+    int err = -1;
+    for (int i = 0; i < nargs && err < 0; ++i) {
+        each_value(kids[i], [&](const FormulaValue& v, bool from_ref) {
+            if (funcx == fCOUNTA) {
+                count += v.ctype != XL_CELL_EMPTY || !from_ref;
+                return true;
+            }
+            double x;
+            if (v.is_error()) {
+                if (funcx == fCOUNT) return true;
+                err = v.error_code();
+                return false;
+            }
+            if (from_ref) {
+                if (v.ctype == XL_CELL_NUMBER ||
+                    (v.ctype == XL_CELL_BOOLEAN && (funcx == fAND || funcx == fOR))) {
+                    x = v.number;
+                } else {
+                    return true;
+                }
+            } else if (funcx == fAND || funcx == fOR) {
+                bool b;
+                int e = to_boolean(v, b);
+                if (e >= 0) {
+                    err = e;
+                    return false;
+                }
+                x = b;
+            } else {
+                int e = to_number(v, x);
+                if (e >= 0) {
+                    if (funcx == fCOUNT) return true;
+                    err = e;
+                    return false;
+                }
+            }
+            ++count;
+            switch (funcx) {
+            case fMIN: acc = any ? std::min(acc, x) : x; break;
+            case fMAX: acc = any ? std::max(acc, x) : x; break;
+            case fPRODUCT: acc *= x; break;
+            case fAND: acc = acc && x != 0; break;
+            case fOR: acc = acc || x != 0; break;
+            default: acc += x; break;
+            }
+            any = true;
+            return true;
+        });
+    }
+    if (err >= 0) return error(err);
+    switch (funcx) {
+    case fCOUNT: case fCOUNTA:
+        return number(count);
+    case fAVERAGE:
+        return count ? number(acc / count) : error(XL_ERR_DIV0);
+    case fAND: case fOR:
+        return any ? value(FormulaValue::boolean(acc != 0)) : error(XL_ERR_VALUE);
+    case fPRODUCT:
+        return number(any ? acc : 0);
+    default:
+        return number(acc);
+    }
+}
+
+////
+// VLOOKUP(value, table, index, [approximate]) and HLOOKUP.
+inline _EvalResult
+_FormulaEvaluator::lookup(int funcx, const uint32_t* kids, int nargs) {
+    FormulaValue key = scalar(kids[0]);
+    if (key.is_error()) return value(key);
+    _EvalResult table = eval(kids[1]);
+    if (!table.is_ref) {
+        return table.value.is_error() ? table : error(XL_ERR_NA);
+    }
+    double idx;
+    int err = scalar_number(kids[2], idx);
+    if (err >= 0) return error(err);
+    bool approx = true;
+    if (nargs > 3 && arena.nodes[kids[3]].kind != nMSNG) {
+        err = to_boolean(scalar(kids[3]), approx);
+        if (err >= 0) return error(err);
+    }
+    const FormulaArea& a = table.area;
+    bool vertical = funcx == fVLOOKUP;
+    int offset = (int)idx - 1;
+    int width = vertical ? a.colxhi - a.colxlo : a.rowxhi - a.rowxlo;
+    if (offset < 0) return error(XL_ERR_VALUE);
+    if (offset >= width) return error(XL_ERR_REF);
+    int lo = vertical ? a.rowxlo : a.colxlo;
+    int hi = vertical ? a.rowxhi : a.colxhi;
+    bool wild = !approx && key.ctype == XL_CELL_TEXT &&
+                key.text.find_first_of("*?~") != std::string::npos;
+    auto at = [&](int x) -> const FormulaValue& {
+        return vertical ? cell(a.shtxlo, x, a.colxlo) : cell(a.shtxlo, a.rowxlo, x);
+    };
+    int found = -1;
+    if (vertical) {
+        // walk the cells the first column actually has
+        const auto& it = engine._columns.find(_column_key(a.shtxlo, a.colxlo));
+        if (it != engine._columns.end()) {
+            const auto& column = it->second;
+            auto first = std::lower_bound(column.begin(), column.end(),
+                                          std::make_pair(lo, (uint32_t)0));
+            auto last = std::lower_bound(first, column.end(),
+                                         std::make_pair(hi, (uint32_t)0));
+            if (approx) {
+                // binary search, as Excel does: the last cell <= key
+                auto p = std::upper_bound(first, last, key,
+                    [this](const FormulaValue& k, const std::pair<int, uint32_t>& e) {
+                        const FormulaValue& v = engine.cells[e.second].value;
+                        return compare_values(k, v) < 0;
+                    });
+                for (; p != first; --p) {
+                    const FormulaValue& v = engine.cells[(p - 1)->second].value;
+                    if (v.ctype == key.ctype) {
+                        found = (p - 1)->first;
+                        break;
+                    }
+                }
+            } else {
+                for (auto p = first; p != last; ++p) {
+                    const FormulaValue& v = engine.cells[p->second].value;
+                    if (v.ctype == key.ctype &&
+                        (wild ? wildcard_match(v.text.data(), v.text.data() + v.text.size(),
+                                               key.text.data(),
+                                               key.text.data() + key.text.size())
+                              : compare_values(v, key) == 0)) {
+                        found = p->first;
+                        break;
+                    }
+                }
+            }
+        }
+    } else {
+        for (int x = lo; x < hi; ++x) {
+            const FormulaValue& v = at(x);
+            if (v.ctype != key.ctype) {
+                continue;
+            }
+            int c = compare_values(v, key);
+            if (approx) {
+                if (c > 0) break;
+                found = x;
+            } else if (wild ? wildcard_match(v.text.data(), v.text.data() + v.text.size(),
+                                             key.text.data(),
+                                             key.text.data() + key.text.size())
+                            : c == 0) {
+                found = x;
+                break;
+            }
+        }
+    }
+    if (found < 0) return error(XL_ERR_NA);
+    if (vertical) return value(cell(a.shtxlo, found, a.colxlo + offset));
+    return value(cell(a.shtxlo, a.rowxlo + offset, found));
+}
+
+////
+// MATCH(value, range, [type]) over one row or one column.
+inline _EvalResult
+_FormulaEvaluator::match(const uint32_t* kids, int nargs) {
+    FormulaValue key = scalar(kids[0]);
+    if (key.is_error()) return value(key);
+    _EvalResult r = eval(kids[1]);
+    if (!r.is_ref) {
+        return r.value.is_error() ? r : error(XL_ERR_NA);
+    }
+    double type = 1;
+    if (nargs > 2 && arena.nodes[kids[2]].kind != nMSNG) {
+        int err = scalar_number(kids[2], type);
+        if (err >= 0) return error(err);
+    }
+    const FormulaArea& a = r.area;
+    bool vertical = a.colxhi - a.colxlo == 1;
+    if (!vertical && a.rowxhi - a.rowxlo != 1) return error(XL_ERR_NA);
+    int lo = vertical ? a.rowxlo : a.colxlo;
+    int hi = vertical ? a.rowxhi : a.colxhi;
+    bool wild = type == 0 && key.ctype == XL_CELL_TEXT &&
+                key.text.find_first_of("*?~") != std::string::npos;
+    int found = -1;
+    for (int x = lo; x < hi; ++x) {
+        const FormulaValue& v = vertical ? cell(a.shtxlo, x, a.colxlo)
+                                         : cell(a.shtxlo, a.rowxlo, x);
+        if (v.ctype != key.ctype) {
+            continue;
+        }
+        int c = compare_values(v, key);
+        if (type == 0) {
+            if (wild ? wildcard_match(v.text.data(), v.text.data() + v.text.size(),
+                                      key.text.data(), key.text.data() + key.text.size())
+                     : c == 0) {
+                found = x;
+                break;
+            }
+        } else if (type > 0) {
+            if (c > 0) break;
+            found = x;
+        } else {
+            if (c < 0) break;
+            found = x;
+        }
+    }
+    if (found < 0) return error(XL_ERR_NA);
+    return number(found - lo + 1);
+}
+
+////
+// INDEX(reference, row, [column]); a reference to the cell, or to the
+// whole row or column when the other index is 0.
+inline _EvalResult
+_FormulaEvaluator::index(const uint32_t* kids, int nargs) {
+    _EvalResult r = eval(kids[0]);
+    if (!r.is_ref) {
+        return r.value.is_error() ? r : error(XL_ERR_VALUE);
+    }
+    double rown = 0, coln = 0;
+    int err = -1;
+    if (nargs > 1 && arena.nodes[kids[1]].kind != nMSNG) err = scalar_number(kids[1], rown);
+    if (err < 0 && nargs > 2 && arena.nodes[kids[2]].kind != nMSNG) {
+        err = scalar_number(kids[2], coln);
+    }
+    if (err >= 0) return error(err);
+    FormulaArea& a = r.area;
+    int height = a.rowxhi - a.rowxlo;
+    int width = a.colxhi - a.colxlo;
+    if (nargs < 3 && height == 1 && width > 1) {
+        std::swap(rown, coln);
+    }
+    int i = (int)rown;
+    int j = (int)coln;
+    if (i < 0 || j < 0 || i > height || j > width) return error(XL_ERR_REF);
+    if (i) {
+        a.rowxlo += i - 1;
+        a.rowxhi = a.rowxlo + 1;
+    }
+    if (j) {
+        a.colxlo += j - 1;
+        a.colxhi = a.colxlo + 1;
+    }
+    return r;
+}
+
+////
+// SUMIF(range, criterion, [sum_range]) and COUNTIF(range, criterion).
+inline _EvalResult
+_FormulaEvaluator::conditional(int funcx, const uint32_t* kids, int nargs) {
+    _EvalResult r = eval(kids[0]);
+    if (!r.is_ref) {
+        return r.value.is_error() ? r : error(XL_ERR_VALUE);
+    }
+    FormulaValue crit = scalar(kids[1]);
+    if (crit.is_error()) return value(crit);
+    FormulaCriterion criterion(crit);
+    FormulaArea sum = r.area;
+    if (funcx == fSUMIF && nargs > 2) {
+        _EvalResult s = eval(kids[2]);
+        if (!s.is_ref) {
+            return s.value.is_error() ? s : error(XL_ERR_VALUE);
+        }
+        sum = s.area;
+    }
+    const FormulaArea& a = r.area;
+    double total = 0;
+    int err = -1;
+    for (int shx = a.shtxlo; shx < a.shtxhi && err < 0; ++shx) {
+        for (int colx = a.colxlo; colx < a.colxhi && err < 0; ++colx) {
+            const auto& it = engine._columns.find(_column_key(shx, colx));
+            if (it == engine._columns.end()) {
+                continue;
+            }
+            const auto& column = it->second;
+            auto p = std::lower_bound(column.begin(), column.end(),
+                                      std::make_pair(a.rowxlo, (uint32_t)0));
+            for (; p != column.end() && p->first < a.rowxhi; ++p) {
+                if (!criterion.matches(engine.cells[p->second].value)) {
+                    continue;
+                }
+                if (funcx == fCOUNTIF) {
+                    total += 1;
+                    continue;
+                }
+                const FormulaValue& v = cell(sum.shtxlo + (shx - a.shtxlo),
+                                             sum.rowxlo + (p->first - a.rowxlo),
+                                             sum.colxlo + (colx - a.colxlo));
+                if (v.ctype == XL_CELL_NUMBER) {
+                    total += v.number;
+                } else if (v.is_error()) {
+                    err = v.error_code();
+                    break;
+                }
+            }
+        }
+    }
+    if (err >= 0) return error(err);
+    return number(total);
+}
+
+////
+// SUMPRODUCT(range, ...): ranges of one shape; non-numbers count as 0.
+inline _EvalResult
+_FormulaEvaluator::sumproduct(const uint32_t* kids, int nargs) {
+    std::vector<FormulaArea> areas;
+    for (int i = 0; i < nargs; ++i) {
+        _EvalResult r = eval(kids[i]);
+        if (!r.is_ref) {
+            if (r.value.is_error()) return r;
+            double x;
+            int err = to_number(r.value, x);
+            if (err >= 0) return error(err);
+            if (nargs == 1) return number(x);
+            return error(XL_ERR_VALUE);
+        }
+        if (!areas.empty() &&
+            (r.area.rowxhi - r.area.rowxlo != areas[0].rowxhi - areas[0].rowxlo ||
+             r.area.colxhi - r.area.colxlo != areas[0].colxhi - areas[0].colxlo)) {
+            return error(XL_ERR_VALUE);
+        }
+        areas.push_back(r.area);
+    }
+    if (areas.empty()) return error(XL_ERR_VALUE);
+    double total = 0;
+    int height = areas[0].rowxhi - areas[0].rowxlo;
+    int width = areas[0].colxhi - areas[0].colxlo;
+    for (int i = 0; i < height; ++i) {
+        for (int j = 0; j < width; ++j) {
+            double prod = 1;
+            for (const auto& a: areas) {
+                const FormulaValue& v = cell(a.shtxlo, a.rowxlo + i, a.colxlo + j);
+                if (v.is_error()) return error(v.error_code());
+                prod *= v.ctype == XL_CELL_NUMBER ? v.number : 0;
+            }
+            total += prod;
+        }
+    }
+    return number(total);
+}
+
+// === Compilation ===
+
+inline int
+_slot_number(const _Slot& s, double& out) {
+    switch (s.ctype) {
+    case XL_CELL_EMPTY:
+        out = 0;
+        return -1;
+    case XL_CELL_TEXT:
+        return _text_number(*s.text, out);
+    case XL_CELL_ERROR:
+        return (int)s.number;
+    default:
+        out = s.number;
+        return -1;
+    }
+}
+
+inline int
+_slot_boolean(const _Slot& s, bool& out) {
+    switch (s.ctype) {
+    case XL_CELL_EMPTY:
+        out = false;
+        return -1;
+    case XL_CELL_TEXT:
+        if (_ast_iequal(s.text->data(), s.text->size(), "TRUE")) {
+            out = true;
+        } else if (_ast_iequal(s.text->data(), s.text->size(), "FALSE")) {
+            out = false;
+        } else {
+            return XL_ERR_VALUE;
+        }
+        return -1;
+    case XL_CELL_ERROR:
+        return (int)s.number;
+    default:
+        out = s.number != 0;
+        return -1;
+    }
+}
+
+// compare_values() for slots.
+inline int
+_slot_compare(const _Slot& a, const _Slot& b) {
+    int ta = a.ctype;
+    int tb = b.ctype;
+    if (ta == XL_CELL_EMPTY && tb == XL_CELL_EMPTY) {
+        return 0;
+    }
+    if (ta == XL_CELL_EMPTY) {
+        return -_slot_compare(b, a);
+    }
+    if (tb == XL_CELL_EMPTY) {
+        if (ta == XL_CELL_TEXT) {
+            return a.text->empty() ? 0 : 1;
+        }
+        return a.number < 0 ? -1 : a.number > 0 ? 1 : 0;
+    }
+    int ra = ta == XL_CELL_TEXT ? 1 : ta == XL_CELL_BOOLEAN ? 2 : 0;
+    int rb = tb == XL_CELL_TEXT ? 1 : tb == XL_CELL_BOOLEAN ? 2 : 0;
+    if (ra != rb) {
+        return ra < rb ? -1 : 1;
+    }
+    if (ra == 1) {
+        return _icompare(*a.text, *b.text);
+    }
+    return compare_numbers(a.number, b.number);
+}
+
+// _FormulaEvaluator::aggregate() over the n slots at args.
+inline _Slot
+_slot_aggregate(int funcx, const _Slot* args, int n, const CompiledFormula& fm,
+                const EngineCell* cells)
+{
+    double acc = funcx == fPRODUCT ? 1 : funcx == fAND ? 1 : 0;
+    double count = 0;
+    bool any = false;
+    int err = -1;
+    auto add = [&](const _Slot& v, bool from_ref) {
+        if (funcx == fCOUNTA) {
+            count += v.ctype != XL_CELL_EMPTY || !from_ref;
+            return true;
+        }
+        double x;
+        if (v.ctype == XL_CELL_ERROR) {
+            if (funcx == fCOUNT) return true;
+            err = (int)v.number;
+            return false;
+        }
+        if (from_ref) {
+            if (v.ctype == XL_CELL_NUMBER ||
+                (v.ctype == XL_CELL_BOOLEAN && (funcx == fAND || funcx == fOR))) {
+                x = v.number;
+            } else {
+                return true;
+            }
+        } else if (funcx == fAND || funcx == fOR) {
+            bool b;
+            int e = _slot_boolean(v, b);
+            if (e >= 0) {
+                err = e;
+                return false;
+            }
+            x = b;
+        } else {
+            int e = _slot_number(v, x);
+            if (e >= 0) {
+                if (funcx == fCOUNT) return true;
+                err = e;
+                return false;
+            }
+        }
+        ++count;
+        switch (funcx) {
+        case fMIN: acc = any ? std::min(acc, x) : x; break;
+        case fMAX: acc = any ? std::max(acc, x) : x; break;
+        case fPRODUCT: acc *= x; break;
+        case fAND: acc = acc && x != 0; break;
+        case fOR: acc = acc || x != 0; break;
+        default: acc += x; break;
+        }
+        any = true;
+        return true;
+    };
+    for (int i = 0; i < n && err < 0; ++i) {
+        if (args[i].ctype != _SLOT_AREA) {
+            add(args[i], false);
+            continue;
+        }
+        const auto& range = fm.areas[args[i].area];
+        for (uint32_t j = range.first; j < range.second; ++j) {
+            const FormulaValue& v = cells[fm.area_cells[j]].value;
+            if (v.ctype != XL_CELL_EMPTY && !add(_Slot::of(v), true)) {
+                break;
+            }
+        }
+    }
+    if (err >= 0) return _Slot::error(err);
+    switch (funcx) {
+    case fCOUNT: case fCOUNTA:
+        return _Slot::num(count);
+    case fAVERAGE:
+        return count ? _Slot::num(acc / count) : _Slot::error(XL_ERR_DIV0);
+    case fAND: case fOR:
+        return any ? _Slot::boolean(acc != 0) : _Slot::error(XL_ERR_VALUE);
+    case fPRODUCT:
+        return _Slot::num(any ? acc : 0);
+    default:
+        return _Slot::num(acc);
+    }
+}
+
+inline FormulaValue
+CompiledFormula::run(const EngineCell* cells) const {
+    _Slot stack[FORMULA_COMPILED_STACK];
+    _Slot* sp = stack;  // the next free slot
+    for (const FormulaInstr* ip = code.data(); ; ++ip) {
+        switch (ip->op) {
+        case cNUMBER:
+            sp->ctype = XL_CELL_NUMBER;
+            sp->number = ip->number;
+            ++sp;
+            break;
+        case cVALUE:
+            *sp++ = _Slot::of(consts[ip->arg]);
+            break;
+        case cCELL:
+            *sp++ = _Slot::of(cells[ip->arg].value);
+            break;
+        case cAREA:
+            sp->ctype = _SLOT_AREA;
+            sp->area = ip->arg;
+            ++sp;
+            break;
+        case cNEG: case cPERCENT: {
+            double x;
+            int err = _slot_number(sp[-1], x);
+            sp[-1] = err >= 0 ? _Slot::error(err)
+                   : _Slot::num(ip->op == cNEG ? -x : x / 100.0);
+            break;
+        }
+        case cADD: case cSUB: case cMUL: case cDIV: case cPOWER: {
+            _Slot& a = sp[-2];
+            const _Slot& b = sp[-1];
+            --sp;
+            double x, y;
+            if (a.ctype == XL_CELL_NUMBER && b.ctype == XL_CELL_NUMBER) {
+                x = a.number;
+                y = b.number;
+            } else {
+                if (a.ctype == XL_CELL_ERROR) break;
+                if (b.ctype == XL_CELL_ERROR) {
+                    a = b;
+                    break;
+                }
+                int err = _slot_number(a, x);
+                if (err < 0) err = _slot_number(b, y);
+                if (err >= 0) {
+                    a = _Slot::error(err);
+                    break;
+                }
+            }
+            switch (ip->op) {
+            case cADD: a = _Slot::num(x + y); break;
+            case cSUB: a = _Slot::num(x - y); break;
+            case cMUL: a = _Slot::num(x * y); break;
+            case cDIV: a = y == 0 ? _Slot::error(XL_ERR_DIV0) : _Slot::num(x / y); break;
+            default:
+                a = x == 0 && y == 0 ? _Slot::error(XL_ERR_NUM)
+                  : x == 0 && y < 0 ? _Slot::error(XL_ERR_DIV0)
+                  : _Slot::num(std::pow(x, y));
+                break;
+            }
+            break;
+        }
+        case cLT: case cLE: case cEQ: case cGE: case cGT: case cNE: {
+            _Slot& a = sp[-2];
+            const _Slot& b = sp[-1];
+            --sp;
+            if (a.ctype == XL_CELL_ERROR) break;
+            if (b.ctype == XL_CELL_ERROR) {
+                a = b;
+                break;
+            }
+            int c = _slot_compare(a, b);
+            bool r;
+            switch (ip->op) {
+            case cLT: r = c < 0; break;
+            case cLE: r = c <= 0; break;
+            case cEQ: r = c == 0; break;
+            case cGE: r = c >= 0; break;
+            case cGT: r = c > 0; break;
+            default: r = c != 0; break;
+            }
+            a = _Slot::boolean(r);
+            break;
+        }
+        case cIF: {
+            _Slot* args = sp - ip->n;
+            sp = args + 1;
+            bool cond;
+            int err = _slot_boolean(args[0], cond);
+            if (err >= 0) {
+                args[0] = _Slot::error(err);
+            } else if (cond) {
+                args[0] = args[1];
+            } else {
+                args[0] = ip->n < 3 ? _Slot::boolean(false) : args[2];
+            }
+            break;
+        }
+        case cCHOOSE: {
+            _Slot* args = sp - ip->n;
+            sp = args + 1;
+            double x;
+            int err = _slot_number(args[0], x);
+            if (err >= 0) {
+                args[0] = _Slot::error(err);
+            } else if ((int)x < 1 || (int)x >= ip->n) {
+                args[0] = _Slot::error(XL_ERR_VALUE);
+            } else {
+                args[0] = args[(int)x];
+            }
+            break;
+        }
+        case cNOT: {
+            bool b;
+            int err = _slot_boolean(sp[-1], b);
+            sp[-1] = err >= 0 ? _Slot::error(err) : _Slot::boolean(!b);
+            break;
+        }
+        case cIS: {
+            const _Slot& v = sp[-1];
+            bool iserr = v.ctype == XL_CELL_ERROR;
+            bool r;
+            switch (ip->arg) {
+            case fISNA: r = iserr && (int)v.number == XL_ERR_NA; break;
+            case fISERROR: r = iserr; break;
+            case fISERR: r = iserr && (int)v.number != XL_ERR_NA; break;
+            case fISNUMBER: r = v.ctype == XL_CELL_NUMBER; break;
+            case fISTEXT: r = v.ctype == XL_CELL_TEXT; break;
+            default: r = v.ctype == XL_CELL_BOOLEAN; break;
+            }
+            sp[-1] = _Slot::boolean(r);
+            break;
+        }
+        case cMATH1: {
+            double x;
+            int err = _slot_number(sp[-1], x);
+            _Slot& r = sp[-1];
+            if (err >= 0) {
+                r = _Slot::error(err);
+                break;
+            }
+            switch (ip->arg) {
+            case fABS: r = _Slot::num(std::fabs(x)); break;
+            case fINT: r = _Slot::num(std::floor(x)); break;
+            case fSIGN: r = _Slot::num(x > 0 ? 1 : x < 0 ? -1 : 0); break;
+            case fSQRT: r = x < 0 ? _Slot::error(XL_ERR_NUM) : _Slot::num(std::sqrt(x)); break;
+            case fEXP: r = _Slot::num(std::exp(x)); break;
+            case fLN: r = x <= 0 ? _Slot::error(XL_ERR_NUM) : _Slot::num(std::log(x)); break;
+            default: r = x <= 0 ? _Slot::error(XL_ERR_NUM) : _Slot::num(std::log10(x)); break;
+            }
+            break;
+        }
+        case cMATH2: {
+            _Slot& r = sp[-2];
+            double x, y;
+            int err = _slot_number(sp[-2], x);
+            if (err < 0) err = _slot_number(sp[-1], y);
+            --sp;
+            if (err >= 0) {
+                r = _Slot::error(err);
+                break;
+            }
+            switch (ip->arg) {
+            case fROUND: r = _Slot::num(_round_digits(x, y, 0)); break;
+            case fROUNDUP: r = _Slot::num(_round_digits(x, y, 1)); break;
+            case fROUNDDOWN: r = _Slot::num(_round_digits(x, y, -1)); break;
+            case fMOD:
+                r = y == 0 ? _Slot::error(XL_ERR_DIV0) : _Slot::num(x - y * std::floor(x / y));
+                break;
+            default:
+                r = x == 0 && y == 0 ? _Slot::error(XL_ERR_NUM)
+                  : x == 0 && y < 0 ? _Slot::error(XL_ERR_DIV0)
+                  : _Slot::num(std::pow(x, y));
+                break;
+            }
+            break;
+        }
+        case cVALUEOF: {
+            double x;
+            _Slot& r = sp[-1];
+            if (r.ctype == XL_CELL_BOOLEAN) {
+                r = _Slot::error(XL_ERR_VALUE);
+                break;
+            }
+            int err = _slot_number(r, x);
+            r = err >= 0 ? _Slot::error(err) : _Slot::num(x);
+            break;
+        }
+        case cAGGREGATE: {
+            _Slot* args = sp - ip->n;
+            _Slot r = _slot_aggregate(ip->arg, args, ip->n, *this, cells);
+            sp = args;
+            *sp++ = r;
+            break;
+        }
+        default: { // cRETURN
+            const _Slot& r = sp[-1];
+            switch (r.ctype) {
+            case XL_CELL_EMPTY: return FormulaValue(0.0);
+            case XL_CELL_TEXT: return FormulaValue(*r.text);
+            case XL_CELL_NUMBER: return FormulaValue(r.number);
+            case XL_CELL_BOOLEAN: return FormulaValue::boolean(r.number != 0);
+            default: return FormulaValue::error((int)r.number);
+            }
+        }
+        }
+    }
+}
+
+////
+// Turns formula trees into CompiledFormula programs; see compile_formula().
+class _FormulaCompiler {
+public:
+    const FormulaEngine& engine;
+    const FormulaArena& arena;
+    _FormulaEvaluator ev;  // for resolve()
+    CompiledFormula& out;
+    int depth = 0;
+    std::vector<int> names_open;  // as _FormulaEvaluator::names_open
+
+    _FormulaCompiler(const FormulaEngine& engine_, const EngineCell& c, CompiledFormula& out_)
+    : engine(engine_), arena(engine_.arena), ev(engine_, c.sheetx, c.rowx, c.colx), out(out_)
+    {}
+
+    bool emit(uint8_t op, int n=0, uint32_t arg=0, double number=0) {
+        FormulaInstr ins;
+        ins.op = op;
+        ins.n = n;
+        ins.arg = arg;
+        ins.number = number;
+        out.code.push_back(ins);
+        depth += 1 - n;
+        out.max_depth = std::max(out.max_depth, depth);
+        return depth <= FORMULA_COMPILED_STACK;
+    }
+
+    bool constant(const FormulaValue& v) {
+        if (v.ctype == XL_CELL_NUMBER) {
+            return emit(cNUMBER, 0, 0, v.number);
+        }
+        out.consts.push_back(v);
+        return emit(cVALUE, 0, out.consts.size() - 1);
+    }
+
+    bool error(int code) {
+        return constant(FormulaValue::error(code));
+    }
+
+    // Code for the target of nNAME n: sets root, or emits an error.
+    bool name(const FormulaNode& n, uint32_t& root) {
+        root = NO_FORMULA_NODE;
+        if (n.aux < -1) {
+            return error(XL_ERR_REF); // another workbook
+        }
+        const auto& it = engine.names.find(n.index);
+        if (it == engine.names.end() ||
+            std::find(names_open.begin(), names_open.end(), (int)n.index)
+                != names_open.end()) {
+            return error(XL_ERR_NAME); // unknown, or refers to itself
+        }
+        root = it->second;
+        return true;
+    }
+
+    // Code leaving the value of nodex on the stack, as
+    // _FormulaEvaluator::scalar() gives it; false if it cannot be compiled.
+    bool scalar(uint32_t nodex) {
+        const FormulaNode& n = arena.nodes[nodex];
+        const uint32_t* kids = arena.children.data() + n.child;
+        switch (n.kind) {
+        case nMSNG:
+            return constant(FormulaValue());
+        case nNUM:
+            return emit(cNUMBER, 0, 0, arena.numbers[n.index]);
+        case nBOOL:
+            return constant(FormulaValue::boolean(n.index != 0));
+        case nERR:
+            return error(n.index);
+        case nSTR:
+            return constant(FormulaValue(arena.strings.substr(n.index, n.extra)));
+        case nREF:
+            return cell(arena.refs[n.index]);
+        case nNAME: {
+            uint32_t root;
+            if (!name(n, root)) return false;
+            if (root == NO_FORMULA_NODE) return true;
+            names_open.push_back(n.index);
+            bool ok = scalar(root);
+            names_open.pop_back();
+            return ok;
+        }
+        case nUNOP: {
+            int opcode = n.opx & 0x1f;
+            if (!scalar(kids[0])) return false;
+            if (opcode == 0x12) return true; // tUplus
+            return emit(opcode == 0x13 ? cNEG : cPERCENT, 1);
+        }
+        case nBINOP: {
+            int opcode = n.opx & 0x1f;
+            uint8_t op;
+            switch (opcode) {
+            case tAdd: op = cADD; break;
+            case tSub: op = cSUB; break;
+            case tMul: op = cMUL; break;
+            case tDiv: op = cDIV; break;
+            case tPower: op = cPOWER; break;
+            case tLT: op = cLT; break;
+            case tLE: op = cLE; break;
+            case tEQ: op = cEQ; break;
+            case tGE: op = cGE; break;
+            case tGT: op = cGT; break;
+            case tNE: op = cNE; break;
+            default: return false; // tConcat builds text; references
+            }
+            return scalar(kids[0]) && scalar(kids[1]) && emit(op, 2);
+        }
+        case nFUNC:
+            return function(n, kids);
+        case nUNK:
+            if ((n.opx & 0x1f) == 0x01 || (n.opx & 0x1f) == 0x02) {
+                return error(XL_ERR_NAME);
+            }
+            return error(XL_ERR_VALUE);
+        default:
+            return error(XL_ERR_VALUE);
+        }
+    }
+
+    // The cell _FormulaEvaluator::deref() would read for r.
+    bool cell(const FormulaRef& r) {
+        FormulaArea a;
+        if (!ev.resolve(r, a)) {
+            return error(XL_ERR_REF);
+        }
+        if (a.shtxhi - a.shtxlo != 1) {
+            return error(XL_ERR_VALUE);
+        }
+        int rowx = a.rowxlo;
+        int colx = a.colxlo;
+        if (a.rowxhi - a.rowxlo != 1) {
+            if (a.colxhi - a.colxlo != 1 || ev.browx < a.rowxlo || ev.browx >= a.rowxhi ||
+                ev.sheetx != a.shtxlo) {
+                return error(XL_ERR_VALUE);
+            }
+            rowx = ev.browx;
+        } else if (a.colxhi - a.colxlo != 1) {
+            if (ev.bcolx < a.colxlo || ev.bcolx >= a.colxhi || ev.sheetx != a.shtxlo) {
+                return error(XL_ERR_VALUE);
+            }
+            colx = ev.bcolx;
+        }
+        const auto& it = engine._cell_index.find(_cell_key(a.shtxlo, rowx, colx));
+        if (it == engine._cell_index.end()) {
+            return constant(FormulaValue()); // until a cell is added there
+        }
+        return emit(cCELL, 0, it->second);
+    }
+
+    // Code for an argument of an aggregate, as each_value() sees it: adds
+    // to nargs the number of stack slots it leaves.
+    bool aggregate_arg(uint32_t nodex, int& nargs) {
+        const FormulaNode& n = arena.nodes[nodex];
+        const uint32_t* kids = arena.children.data() + n.child;
+        switch (n.kind) {
+        case nMSNG:
+            return true;
+        case nBINOP: {
+            int opcode = n.opx & 0x1f;
+            if (opcode == 0x10) { // tList
+                return aggregate_arg(kids[0], nargs) && aggregate_arg(kids[1], nargs);
+            }
+            if (opcode == 0x0F || opcode == 0x11) { // tIsect, tRange
+                return false;
+            }
+            break;
+        }
+        case nREF: {
+            ++nargs;
+            FormulaArea a;
+            if (!ev.resolve(arena.refs[n.index], a)) {
+                return error(XL_ERR_REF);
+            }
+            uint32_t first = out.area_cells.size();
+            _known_cells(a);
+            out.areas.emplace_back(first, out.area_cells.size());
+            return emit(cAREA, 0, out.areas.size() - 1);
+        }
+        case nNAME: {
+            uint32_t root;
+            if (!name(n, root)) return false;
+            if (root == NO_FORMULA_NODE) {
+                ++nargs;
+                return true;
+            }
+            names_open.push_back(n.index);
+            bool ok = aggregate_arg(root, nargs);
+            names_open.pop_back();
+            return ok;
+        }
+        case nFUNC:
+            if (n.aux == fIF || n.aux == fCHOOSE || n.aux == fINDEX) {
+                return false; // may give a reference
+            }
+            break;
+        }
+        ++nargs;
+        return scalar(nodex);
+    }
+
+    // Appends the cells of a the engine knows, in each_cell() order but
+    // empty ones included, as they may be given values later.
+    void _known_cells(const FormulaArea& a) {
+        for (int shx = a.shtxlo; shx < a.shtxhi; ++shx) {
+            for (int colx = a.colxlo; colx < a.colxhi; ++colx) {
+                const auto& it = engine._columns.find(_column_key(shx, colx));
+                if (it == engine._columns.end()) {
+                    continue;
+                }
+                const auto& column = it->second;
+                auto p = std::lower_bound(column.begin(), column.end(),
+                                          std::make_pair(a.rowxlo, (uint32_t)0));
+                for (; p != column.end() && p->first < a.rowxhi; ++p) {
+                    out.area_cells.push_back(p->second);
+                }
+            }
+        }
+    }
+
+    bool function(const FormulaNode& n, const uint32_t* kids) {
+        int funcx = n.aux;
+        int nargs = n.nargs;
+        switch (funcx) {
+        case fSUM: case fCOUNT: case fCOUNTA: case fAVERAGE: case fMIN: case fMAX:
+        case fPRODUCT: case fAND: case fOR: {
+            int nslots = 0;
+            for (int i = 0; i < nargs; ++i) {
+                if (!aggregate_arg(kids[i], nslots)) return false;
+            }
+            return nslots < 0x10000 && emit(cAGGREGATE, nslots, funcx);
+        }
+        case fIF:
+            for (int i = 0; i < nargs; ++i) {
+                bool ok = i && arena.nodes[kids[i]].kind == nMSNG
+                        ? emit(cNUMBER, 0, 0, 0.0) : scalar(kids[i]);
+                if (!ok) return false;
+            }
+            return emit(cIF, nargs);
+        case fCHOOSE:
+            for (int i = 0; i < nargs; ++i) {
+                if (!scalar(kids[i])) return false;
+            }
+            return emit(cCHOOSE, nargs);
+        case fNOT:
+            return scalar(kids[0]) && emit(cNOT, 1);
+        case fTRUE: case fFALSE:
+            return constant(FormulaValue::boolean(funcx == fTRUE));
+        case fNA:
+            return error(XL_ERR_NA);
+        case fPI:
+            return emit(cNUMBER, 0, 0, 3.14159265358979323846);
+        case fISNA: case fISERROR: case fISERR: case fISNUMBER: case fISTEXT:
+        case fISLOGICAL:
+            return scalar(kids[0]) && emit(cIS, 1, funcx);
+        case fABS: case fINT: case fSIGN: case fSQRT: case fEXP: case fLN: case fLOG10:
+            return scalar(kids[0]) && emit(cMATH1, 1, funcx);
+        case fROUND: case fROUNDUP: case fROUNDDOWN: case fMOD: case fPOWER:
+            return scalar(kids[0]) && scalar(kids[1]) && emit(cMATH2, 2, funcx);
+        case fVALUE:
+            return scalar(kids[0]) && emit(cVALUEOF, 1);
+        default:
+            return false; // text, lookups, ...: left to the tree walker
+        }
+    }
+};
+
+////
+// Compiles formula f of engine into out. Returns false, leaving out
+// empty, for formulas with operations it does not compile (text results
+// other than constants and cell values, lookups, references as values)
+// or needing more than FORMULA_COMPILED_STACK stack slots; those are
+// left to the tree walker. Names are compiled into the formula. The
+// engine's columns must be sorted, as build() leaves them.
+EXPORT bool
+compile_formula(const FormulaEngine& engine, uint32_t f, CompiledFormula& out)
+{
+    out = CompiledFormula();
+    const EngineFormula& fm = engine.formulas[f];
+    _FormulaCompiler c(engine, engine.cells[fm.cell], out);
+    if (!c.scalar(fm.root) || !c.emit(cRETURN, 1)) {
+        out = CompiledFormula();
+        return false;
+    }
+    out.code.shrink_to_fit();
+    return true;
+}
+
+inline int
+FormulaEngine::compile() {
+    if (!_built) {
+        build();
+    }
+    if (!_columns_sorted) {
+        _sort_columns();
+    }
+    int nf = formulas.size();
+    programs.clear();
+    programs.resize(nf);
+    blocks.clear();
+    int ncompiled = 0;
+    for (int f = 0; f < nf; ++f) {
+        if (_live(f)) {
+            ncompiled += compile_formula(*this, f, programs[f]);
+        }
+    }
+    _programs_ncells = cells.size();
+    _form_blocks();
+    return ncompiled;
+}
+
+// Whether a compiled program may be part of a FormulaBlock: arithmetic
+// on loads and numeric constants, ending in arithmetic.
+inline bool
+_block_program(const CompiledFormula& p) {
+    size_t n = p.code.size();
+    if (n < 2 || p.code[n - 2].op < cNEG || p.code[n - 2].op > cDIV) {
+        return false;
+    }
+    for (const auto& ins: p.code) {
+        switch (ins.op) {
+        case cNUMBER: case cCELL: case cNEG: case cPERCENT:
+        case cADD: case cSUB: case cMUL: case cDIV: case cRETURN:
+            break;
+        case cVALUE:
+            if (p.consts[ins.arg].ctype != XL_CELL_EMPTY &&
+                p.consts[ins.arg].ctype != XL_CELL_BOOLEAN) {
+                return false;
+            }
+            break;
+        default: // cPOWER has error cases of its own; the rest is not arithmetic
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whether instruction k reads a cell: cCELL, or an empty constant
+// standing for a cell the engine does not know.
+inline bool
+_block_load(const CompiledFormula& p, size_t k) {
+    const FormulaInstr& ins = p.code[k];
+    return ins.op == cCELL ||
+           (ins.op == cVALUE && p.consts[ins.arg].ctype == XL_CELL_EMPTY);
+}
+
+inline bool
+_block_same_shape(const CompiledFormula& a, const CompiledFormula& b) {
+    if (a.code.size() != b.code.size()) {
+        return false;
+    }
+    for (size_t k = 0; k < a.code.size(); ++k) {
+        bool load = _block_load(a, k);
+        if (load != _block_load(b, k)) {
+            return false;
+        }
+        if (load) {
+            continue;
+        }
+        const FormulaInstr& x = a.code[k];
+        const FormulaInstr& y = b.code[k];
+        if (x.op != y.op || (x.op == cNUMBER && x.number != y.number) ||
+            (x.op == cVALUE && a.consts[x.arg] != b.consts[y.arg])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline void
+FormulaEngine::_form_blocks() {
+    blocks.clear();
+    _block_of.assign(formulas.size(), UINT32_MAX);
+    std::vector<uint32_t> fs;
+    for (uint32_t f = 0; f < programs.size(); ++f) {
+        if (!programs[f].empty() && _rank[f] != UINT32_MAX && _block_program(programs[f])) {
+            fs.push_back(f);
+        }
+    }
+    // by tree, then position; runs of rows of one column are then adjacent
+    std::sort(fs.begin(), fs.end(), [this](uint32_t a, uint32_t b) {
+        const EngineCell& x = cells[formulas[a].cell];
+        const EngineCell& y = cells[formulas[b].cell];
+        return std::make_tuple(formulas[a].root, x.sheetx, x.colx, x.rowx) <
+               std::make_tuple(formulas[b].root, y.sheetx, y.colx, y.rowx);
+    });
+    size_t i = 0;
+    while (i < fs.size()) {
+        const EngineCell& c = cells[formulas[fs[i]].cell];
+        size_t j = i + 1;
+        while (j < fs.size()) {
+            const EngineCell& d = cells[formulas[fs[j]].cell];
+            if (formulas[fs[j]].root != formulas[fs[i]].root || d.sheetx != c.sheetx ||
+                d.colx != c.colx || d.rowx != c.rowx + (int)(j - i) ||
+                _level[fs[j]] != _level[fs[i]] ||
+                !_block_same_shape(programs[fs[i]], programs[fs[j]])) {
+                break;
+            }
+            ++j;
+        }
+        if (j - i >= FORMULA_BLOCK_MIN) {
+            uint32_t bx = blocks.size();
+            blocks.emplace_back();
+            FormulaBlock& b = blocks.back();
+            const CompiledFormula& first = programs[fs[i]];
+            b.formulas.assign(fs.begin() + i, fs.begin() + j);
+            b.code = first.code;
+            b.max_depth = first.max_depth;
+            uint32_t nloads = 0;
+            for (size_t k = 0; k < b.code.size(); ++k) {
+                if (_block_load(first, k)) {
+                    for (uint32_t f: b.formulas) {
+                        const FormulaInstr& ins = programs[f].code[k];
+                        b.gathers.push_back(ins.op == cCELL ? ins.arg : NO_ENGINE_CELL);
+                    }
+                    b.code[k].op = cCELL;
+                    b.code[k].arg = nloads++;
+                } else if (b.code[k].op == cVALUE) {
+                    b.consts.push_back(first.consts[b.code[k].arg]);
+                    b.code[k].arg = b.consts.size() - 1;
+                }
+            }
+            for (uint32_t f: b.formulas) {
+                b.cells.push_back(formulas[f].cell);
+                _block_of[f] = bx;
+            }
+        }
+        i = j;
+    }
+    _block_hits.assign(blocks.size(), 0);
+}
+
+////
+// Evaluates the formulas of b, FORMULA_BLOCK_ROWS rows at a time: each
+// instruction is one loop over a column of doubles, which the compiler
+// can vectorize. Rows reading anything but a number, boolean or empty
+// cell, dividing by zero or giving an infinite or NaN result are redone
+// by their own program, which gives the error.
+inline void
+FormulaEngine::_eval_block(const FormulaBlock& b) {
+    const uint32_t R = FORMULA_BLOCK_ROWS;
+    uint32_t nrows = b.formulas.size();
+    std::vector<double> columns(b.max_depth * R);
+    std::vector<uint8_t> bad(R);
+    for (uint32_t r0 = 0; r0 < nrows; r0 += R) {
+        uint32_t m = std::min(R, nrows - r0);
+        std::fill(bad.begin(), bad.begin() + m, 0);
+        double* sp = columns.data();  // the next free column
+        for (const auto& ins: b.code) {
+            double* x = nullptr;  // the operand, and the result
+            double* y = nullptr;
+            if (ins.op >= cADD && ins.op <= cDIV) {
+                sp -= R;
+                x = sp - R;
+                y = sp;
+            } else if (ins.op == cNEG || ins.op == cPERCENT || ins.op == cRETURN) {
+                x = sp - R;
+            }
+            switch (ins.op) {
+            case cNUMBER:
+                std::fill(sp, sp + m, ins.number);
+                sp += R;
+                break;
+            case cVALUE:
+                std::fill(sp, sp + m, b.consts[ins.arg].number);
+                sp += R;
+                break;
+            case cCELL: {
+                const uint32_t* idx = &b.gathers[(size_t)ins.arg * nrows + r0];
+                for (uint32_t i = 0; i < m; ++i) {
+                    if (idx[i] == NO_ENGINE_CELL) {
+                        sp[i] = 0;
+                        continue;
+                    }
+                    const FormulaValue& v = cells[idx[i]].value;
+                    int t = v.ctype;
+                    sp[i] = t == XL_CELL_EMPTY ? 0.0 : v.number;
+                    bad[i] |= t != XL_CELL_EMPTY && t != XL_CELL_NUMBER && t != XL_CELL_BOOLEAN;
+                }
+                sp += R;
+                break;
+            }
+            case cNEG:
+                for (uint32_t i = 0; i < m; ++i) x[i] = -x[i];
+                break;
+            case cPERCENT:
+                for (uint32_t i = 0; i < m; ++i) x[i] = x[i] / 100.0;
+                break;
+            case cADD:
+                for (uint32_t i = 0; i < m; ++i) x[i] = x[i] + y[i];
+                break;
+            case cSUB:
+                for (uint32_t i = 0; i < m; ++i) x[i] = x[i] - y[i];
+                break;
+            case cMUL:
+                for (uint32_t i = 0; i < m; ++i) x[i] = x[i] * y[i];
+                break;
+            case cDIV:
+                for (uint32_t i = 0; i < m; ++i) bad[i] |= y[i] == 0;
+                for (uint32_t i = 0; i < m; ++i) x[i] = x[i] / y[i];
+                break;
+            default: // cRETURN
+                for (uint32_t i = 0; i < m; ++i) {
+                    FormulaValue& v = cells[b.cells[r0 + i]].value;
+                    if (bad[i] || std::isnan(x[i]) || std::isinf(x[i])) {
+                        v = programs[b.formulas[r0 + i]].run(cells.data());
+                    } else {
+                        v.ctype = XL_CELL_NUMBER;
+                        v.number = x[i];
+                        v.text.clear();
+                    }
+                }
+                break;
+            }
+        }
+    }
+}
+
+////
+// Evaluates the blocks all of whose formulas are in items (one level of
+// a run); the other formulas of items are put in rest.
+inline void
+FormulaEngine::_run_blocks(const uint32_t* items, size_t n, std::vector<uint32_t>& rest) {
+    const uint32_t DONE = UINT32_MAX;
+    rest.clear();
+    for (size_t k = 0; k < n; ++k) {
+        uint32_t f = items[k];
+        if (f < _block_of.size() && _block_of[f] != UINT32_MAX) {
+            ++_block_hits[_block_of[f]];
+        }
+    }
+    for (size_t k = 0; k < n; ++k) {
+        uint32_t f = items[k];
+        uint32_t bx = f < _block_of.size() ? _block_of[f] : UINT32_MAX;
+        if (bx == UINT32_MAX) {
+            rest.push_back(f);
+        } else if (_block_hits[bx] == blocks[bx].formulas.size()) {
+            _eval_block(blocks[bx]);
+            _block_hits[bx] = DONE;
+        } else if (_block_hits[bx] != DONE) {
+            rest.push_back(f); // the block is only partly out of date
+        }
+    }
+    for (size_t k = 0; k < n; ++k) {
+        uint32_t f = items[k];
+        if (f < _block_of.size() && _block_of[f] != UINT32_MAX) {
+            _block_hits[_block_of[f]] = 0;
+        }
+    }
+}
+
+}
+}
@@ -0,0 +1,491 @@
+#pragma once
+
+////
+// Reference extraction for formula lineage.
+//
+// <p>extract_formula_refs() walks a formula's tokens, using szdict for
+// their sizes, and reports only what the formula refers to: cells and areas
+// (with the sheet range of 3D references, external and deleted sheets
+// included), defined names, add-in and external names, and the shared or
+// array formula a tExp stands for. It builds no operand stack and no text,
+// so it is much cheaper than decompile_formula() or decompile_formula_ast()
+// when only the dependencies of a formula are wanted.</p>
+//
+// <p>FormulaLineage collects the references of every formula of a book in
+// one pass, in the order the records are read, and expands the cells of
+// shared formulas once the SHRFMLA records have been seen.</p>
+////
+
+#include <array>
+#include <cstdint>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "./formula_ast.h"
+
+namespace xlrd {
+namespace formula {
+
+////
+// FormulaReference kinds.
+const int rfAREA   = 0; // tRef, tArea, tRefN, tAreaN, tRef3d, tArea3d
+const int rfNAME   = 1; // tName; namex is the index of the NAME record
+const int rfNAMEX  = 2; // tNameX; namex as rfNAME, the sheet range tells where
+const int rfSHARED = 3; // tExp, tTbl; rowxlo and colxlo are the base cell
+const int rfERROR  = 4; // tRefErr, tAreaErr, tRefErr3d, tAreaErr3d
+
+////
+// A reference made by a formula, with Ref3D-style coordinates:
+// lo <= x < hi.
+// <p>2D references are to the formula's own sheet: shtxlo = 0, shtxhi = 1
+// and the REF_3D bit of relflags is clear. 3D references and tNameX hold
+// the sheet range given by get_externsheet_local_range(), so -4 marks an
+// external workbook, -5 an add-in and -1 "any sheet".</p>
+// <p>relflags has the REF_*_REL bits of formula_ast.h for the components
+// written without "$". Whether those components are cell indexes or
+// offsets depends on the formula: see extract_formula_refs().</p>
+struct FormulaReference {
+    uint8_t kind;     // rfAREA ... rfERROR
+    uint8_t opx;      // token; opcode + 32 for operand class tokens
+    uint8_t relflags; // REF_ROW1_REL ... REF_AREA
+    int namex;        // rfNAME, rfNAMEX; -1 otherwise
+    int shtxlo;
+    int shtxhi;
+    int rowxlo;
+    int rowxhi;
+    int colxlo;
+    int colxhi;
+};
+
+////
+// Size of the tStr token at data[pos], without decoding the string.
+inline int
+_refs_str_size(const std::vector<uint8_t>& data, int pos, int bv) {
+    int nchars = data[pos+1];
+    if (bv <= 70) {
+        return 2 + nchars;
+    }
+    if (nchars == 0 && pos + 2 >= (int)data.size()) {
+        return 2;
+    }
+    uint8_t options = data[pos+2];
+    int sz = 3;
+    int rt = 0;
+    int phonetic = 0;
+    if (options & 0x08) {
+        rt = utils::as_uint16(data, pos + sz);
+        sz += 2;
+    }
+    if (options & 0x04) {
+        phonetic = utils::as_int32(data, pos + sz);
+        sz += 4;
+    }
+    return sz + ((options & 0x01) ? 2 * nchars : nchars) + 4 * rt + phonetic;
+}
+
+////
+// Puts the relative components of addr back on the anchor cell, wrapping
+// as Excel does at the edge of the sheet.
+inline int
+_refs_anchor(int x, int base, int is_rel, int limit) {
+    if (!is_rel || base < 0) {
+        return x;
+    }
+    x = (x + base) % limit;
+    return x < 0 ? x + limit : x;
+}
+
+inline void
+_refs_push_area(std::vector<FormulaReference>& out, int kind, int opx,
+                int shx1, int shx2,
+                const std::array<int, 4>& addr1, const std::array<int, 4>& addr2,
+                uint8_t flags, int browx, int bcolx, int bv)
+{
+    const int nrows = bv >= 80 ? 65536 : 16384;
+    const int ncols = 256;
+    FormulaReference ref;
+    ref.kind = kind;
+    ref.opx = opx;
+    ref.namex = -1;
+    ref.shtxlo = shx1;
+    ref.shtxhi = shx2 + 1;
+    ref.rowxlo = _refs_anchor(addr1[0], browx, addr1[2], nrows);
+    ref.rowxhi = _refs_anchor(addr2[0], browx, addr2[2], nrows) + 1;
+    ref.colxlo = _refs_anchor(addr1[1], bcolx, addr1[3], ncols);
+    ref.colxhi = _refs_anchor(addr2[1], bcolx, addr2[3], ncols) + 1;
+    ref.relflags = flags
+                 | (addr1[2] ? REF_ROW1_REL : 0) | (addr2[2] ? REF_ROW2_REL : 0)
+                 | (addr1[3] ? REF_COL1_REL : 0) | (addr2[3] ? REF_COL2_REL : 0);
+    out.push_back(ref);
+}
+
+inline void
+_refs_push(std::vector<FormulaReference>& out, int kind, int opx, int namex,
+           uint8_t flags=0, int shx1=0, int shx2=0, int rowx=0, int colx=0)
+{
+    FormulaReference ref;
+    ref.kind = kind;
+    ref.opx = opx;
+    ref.relflags = flags;
+    ref.namex = namex;
+    ref.shtxlo = shx1;
+    ref.shtxhi = shx2 + 1;
+    ref.rowxlo = rowx;
+    ref.rowxhi = rowx + 1;
+    ref.colxlo = colx;
+    ref.colxhi = colx + 1;
+    out.push_back(ref);
+}
+
+////
+// Appends to out the references made by the formula whose tokens are
+// data[pos, pos+fmlalen); returns how many were appended.
+// <p>fmlatype is one of the FMLA_TYPE_* constants. (browx, bcolx) is the
+// cell the formula belongs to (or the first cell of the range of a
+// conditional format or data validation). Cell and array formulas store
+// relative components as cell indexes, which are reported as they are.
+// The other types store offsets: given an anchor cell they are reported
+// as cell indexes too, otherwise -- for names, and for SHRFMLA bodies
+// read once for a whole range -- as offsets, like FormulaRef.</p>
+// <p>Each token is looked at once, so the formula need not be well formed
+// beyond having tokens of the right sizes.</p>
+EXPORT int
+extract_formula_refs(FormulaBookDelegate* bk,
+                     const std::vector<uint8_t>& data, int fmlalen,
+                     std::vector<FormulaReference>& out,
+                     int fmlatype=FMLA_TYPE_CELL,
+                     int browx=-1, int bcolx=-1, int pos=0)
+{
+    const int reldelta_types = FMLA_TYPE_SHARED | FMLA_TYPE_NAME
+                             | FMLA_TYPE_COND_FMT | FMLA_TYPE_DATA_VAL;
+    int reldelta = (fmlatype & reldelta_types) != 0;
+    int bv = bk->biff_version;
+    if (pos < 0 || fmlalen < 0 || pos + fmlalen > (int)data.size()) {
+        throw FormulaError("extract_formula_refs: formula runs past the end of its data");
+    }
+    // Cell and array formulas: decode as absolute indexes, anchor nothing.
+    int anchor_rowx = reldelta ? browx : -1;
+    int anchor_colx = reldelta ? bcolx : -1;
+    const auto& sztab = szdict.at(bv);
+    size_t count = out.size();
+
+    int end = pos + fmlalen;
+    while (pos < end) {
+        int op = data[pos];
+        int opcode = op & 0x1f;
+        int optype = (op & 0x60) >> 5;
+        int opx = optype ? opcode + 32 : opcode;
+        int sz = sztab[opx];
+        if (sz == -2) {
+            throw FormulaError(_ast_token_error("Unexpected token", op, bv));
+        }
+        if (!optype) {
+            if (opcode == 0x01 || opcode == 0x02) { // tExp, tTbl
+                int rowx = utils::as_uint16(data, pos+1);
+                int colx = bv >= 30 ? utils::as_uint16(data, pos+3) : data[pos+3];
+                _refs_push(out, rfSHARED, opx, -1, 0, 0, 0, rowx, colx);
+            } else if (opcode == 0x17) { // tStr
+                sz = _refs_str_size(data, pos, bv);
+            } else if (opcode == 0x18) { // tExtended
+                throw FormulaError("tExtended token not implemented");
+            } else if (opcode == 0x19) { // tAttr
+                int subop = data[pos+1];
+                int nc = utils::as_uint16(data, pos+2);
+                sz = subop == 0x04 ? nc * 2 + 6 : 4; // Choose has a jump table
+            } else if (opcode == 0x1A || opcode == 0x1B) { // tSheet, tEndSheet
+                throw FormulaError("tSheet & tEndsheet tokens not implemented");
+            }
+            if (sz <= 0) {
+                throw FormulaError(_ast_token_error("Size not set for opcode", op, bv));
+            }
+            pos += sz;
+            continue;
+        }
+        if (opcode == 0x03) { // tName
+            _refs_push(out, rfNAME, opx, utils::as_uint16(data, pos+1) - 1);
+        } else if (opcode == 0x04 || opcode == 0x0C) { // tRef, tRefN
+            auto addr = get_cell_addr(data, pos+1, bv, reldelta, 0, 0);
+            _refs_push_area(out, rfAREA, opx, 0, 0, addr, addr, 0,
+                            anchor_rowx, anchor_colx, bv);
+        } else if (opcode == 0x05 || opcode == 0x0D) { // tArea, tAreaN
+            std::array<int, 4> addr1, addr2;
+            std::tie(addr1, addr2) = get_cell_range_addr(data, pos+1, bv, reldelta, 0, 0);
+            _refs_push_area(out, rfAREA, opx, 0, 0, addr1, addr2, REF_AREA,
+                            anchor_rowx, anchor_colx, bv);
+        } else if (opcode == 0x0A || opcode == 0x0B) { // tRefErr, tAreaErr
+            _refs_push(out, rfERROR, opx, -1);
+        } else if (0x1A <= opcode && opcode <= 0x1D) {
+            // tRef3d, tArea3d, tRefErr3d, tAreaErr3d
+            int shx1, shx2;
+            int addrpos;
+            if (bv >= 80) {
+                int refx = utils::as_uint16(data, pos+1);
+                std::tie(shx1, shx2) = get_externsheet_local_range(bk, refx);
+                addrpos = pos + 3;
+            } else {
+                int raw_extshtx = utils::as_int16(data, pos+1);
+                int raw_shx1    = utils::as_int16(data, pos+11);
+                int raw_shx2    = utils::as_int16(data, pos+13);
+                std::tie(shx1, shx2) = get_externsheet_local_range_b57(
+                                            bk, raw_extshtx, raw_shx1, raw_shx2);
+                addrpos = pos + 15;
+            }
+            if (opcode == 0x1A) {
+                auto addr = get_cell_addr(data, addrpos, bv, reldelta, 0, 0);
+                _refs_push_area(out, rfAREA, opx, shx1, shx2, addr, addr, REF_3D,
+                                anchor_rowx, anchor_colx, bv);
+            } else if (opcode == 0x1B) {
+                std::array<int, 4> addr1, addr2;
+                std::tie(addr1, addr2) = get_cell_range_addr(data, addrpos, bv, reldelta,
+                                                             0, 0);
+                _refs_push_area(out, rfAREA, opx, shx1, shx2, addr1, addr2,
+                                REF_3D | REF_AREA, anchor_rowx, anchor_colx, bv);
+            } else {
+                _refs_push(out, rfERROR, opx, -1, REF_3D, shx1, shx2);
+            }
+        } else if (opcode == 0x19) { // tNameX
+            int refx, tgtnamex, origrefx;
+            int dodgy = 0;
+            if (bv >= 80) {
+                refx = utils::as_uint16(data, pos+1);
+                tgtnamex = utils::as_uint16(data, pos+3) - 1;
+                origrefx = refx;
+            } else {
+                refx = utils::as_int16(data, pos+1);
+                tgtnamex = utils::as_uint16(data, pos+11) - 1;
+                origrefx = refx;
+                if (refx > 0) {
+                    refx -= 1;
+                } else if (refx < 0) {
+                    refx = -refx - 1;
+                } else {
+                    dodgy = 1;
+                }
+            }
+            int shx1 = -666;
+            int shx2 = -666;
+            if (!dodgy) {
+                if (bv >= 80) {
+                    std::tie(shx1, shx2) = get_externsheet_local_range(bk, refx);
+                } else if (origrefx > 0) {
+                    shx1 = shx2 = -4; // external ref
+                } else if (refx < (int)bk->_externsheet_type_b57.size() &&
+                           bk->_externsheet_type_b57[refx] == 4) {
+                    // non-specific sheet in own doc't
+                    shx1 = shx2 = -1; // internal, any sheet
+                }
+            }
+            _refs_push(out, rfNAMEX, opx, tgtnamex, REF_3D, shx1, shx2);
+        }
+        // tArray, tFunc, tFuncVar, tMem*: no reference of their own;
+        // the sub-expression of a tMem* token follows as ordinary tokens.
+        if (sz <= 0) {
+            throw FormulaError("Fatal: token size is not positive");
+        }
+        pos += sz;
+    }
+    return out.size() - count;
+}
+
+////
+// The order in which to evaluate the first num_names names of bk so that
+// each comes after the names its formula refers to (by tName, or by
+// tNameX to this workbook); names on a cycle come in some order, which
+// evaluate_name_formula() then reports. Macro and binary names have no
+// formula and refer to nothing. Linear in the number of names and tokens.
+EXPORT std::vector<int>
+name_evaluation_order(FormulaBookDelegate* bk, int num_names)
+{
+    // targets of name i: edges[first[i], first[i+1])
+    std::vector<int> first(num_names + 1, 0);
+    std::vector<int> edges;
+    std::vector<FormulaReference> refs;
+    for (int namex = 0; namex < num_names; ++namex) {
+        first[namex] = edges.size();
+        FormulaNameDelegate* nobj = bk->get_name_obj(namex);
+        if (nobj->macro || nobj->binary) continue;
+        refs.clear();
+        try {
+            extract_formula_refs(bk, nobj->raw_formula, nobj->basic_formula_len,
+                                 refs, FMLA_TYPE_NAME);
+        } catch (const FormulaError&) {
+            continue;  // evaluate_name_formula() will report it
+        }
+        for (const auto& ref : refs) {
+            bool local = ref.kind == rfNAME ||
+                         (ref.kind == rfNAMEX && ref.shtxlo >= -1);
+            if (local && 0 <= ref.namex && ref.namex < num_names) {
+                edges.push_back(ref.namex);
+            }
+        }
+    }
+    first[num_names] = edges.size();
+
+    // depth-first post-order, with an explicit stack of (namex, next edge)
+    std::vector<int> order;
+    order.reserve(num_names);
+    std::vector<uint8_t> seen(num_names, 0);
+    std::vector<std::pair<int, int>> stack;
+    for (int root = 0; root < num_names; ++root) {
+        if (seen[root]) continue;
+        seen[root] = 1;
+        stack.emplace_back(root, first[root]);
+        while (!stack.empty()) {
+            auto& top = stack.back();
+            if (top.second < first[top.first + 1]) {
+                int tgt = edges[top.second++];
+                if (!seen[tgt]) {
+                    seen[tgt] = 1;
+                    stack.emplace_back(tgt, first[tgt]);
+                }
+            } else {
+                order.push_back(top.first);
+                stack.pop_back();
+            }
+        }
+    }
+    return order;
+}
+
+////
+// The references of all the formulas of a book, read in one pass.
+// <p>Call add() for each FORMULA record (and for NAME, CF, DV, ... records
+// with the matching fmlatype) and add_shared() for each SHRFMLA record, in
+// any order, then expand_shared(). The FORMULA record of a cell in a shared
+// formula range holds just a tExp naming the first cell of the range; once
+// expanded, such a cell has the references of the SHRFMLA body anchored at
+// that cell, as if the body had been stored in the cell itself.</p>
+class FormulaLineage {
+public:
+    struct Formula {
+        int sheetx;
+        int rowx;
+        int colx;
+        int fmlatype;
+        uint32_t begin;  // refs[begin, end)
+        uint32_t end;
+    };
+
+    std::vector<Formula> formulas;
+    std::vector<FormulaReference> refs;
+
+    ////
+    // Reads the formula of (sheetx, rowx, colx); returns its index in
+    // formulas. For names pass the scope as sheetx and -1 for rowx, colx.
+    inline size_t
+    add(FormulaBookDelegate* bk, int sheetx, int rowx, int colx,
+        const std::vector<uint8_t>& data, int fmlalen,
+        int fmlatype=FMLA_TYPE_CELL, int pos=0)
+    {
+        Formula f;
+        f.sheetx = sheetx;
+        f.rowx = rowx;
+        f.colx = colx;
+        f.fmlatype = fmlatype;
+        f.begin = refs.size();
+        extract_formula_refs(bk, data, fmlalen, refs, fmlatype, rowx, colx, pos);
+        f.end = refs.size();
+        formulas.push_back(f);
+        return formulas.size() - 1;
+    }
+
+    ////
+    // Reads the SHRFMLA record body at data[pos] of sheet sheetx.
+    inline void
+    add_shared(FormulaBookDelegate* bk, int sheetx,
+               const std::vector<uint8_t>& data, int pos=0)
+    {
+        if (pos + 10 > (int)data.size()) {
+            throw FormulaError("SHRFMLA record too short");
+        }
+        Shared s;
+        s.rowxlo = utils::as_uint16(data, pos);
+        s.rowxhi = utils::as_uint16(data, pos + 2) + 1;
+        s.colxlo = data[pos + 4];
+        s.colxhi = data[pos + 5] + 1;
+        s.begin = _shared_refs.size();
+        int fmlalen = utils::as_uint16(data, pos + 8);
+        extract_formula_refs(bk, data, fmlalen, _shared_refs,
+                             FMLA_TYPE_SHARED, -1, -1, pos + 10);
+        s.end = _shared_refs.size();
+        _shared[_key(sheetx, s.rowxlo, s.colxlo)] = s;
+        _biff_version = bk->biff_version;
+    }
+
+    ////
+    // Replaces the rfSHARED reference of each cell in a shared formula range
+    // by the references of the range's SHRFMLA body, anchored at the cell.
+    // tExp references to unknown ranges (array formulas, tables) are kept.
+    inline void
+    expand_shared() {
+        if (_shared.empty()) {
+            return;
+        }
+        std::vector<FormulaReference> out;
+        out.reserve(refs.size());
+        for (auto& f : formulas) {
+            uint32_t begin = out.size();
+            for (uint32_t i = f.begin; i < f.end; ++i) {
+                const FormulaReference& r = refs[i];
+                const Shared* s = nullptr;
+                if (r.kind == rfSHARED) {
+                    const auto& it = _shared.find(_key(f.sheetx, r.rowxlo, r.colxlo));
+                    if (it != _shared.end() &&
+                        it->second.rowxlo <= f.rowx && f.rowx < it->second.rowxhi &&
+                        it->second.colxlo <= f.colx && f.colx < it->second.colxhi) {
+                        s = &it->second;
+                    }
+                }
+                if (!s) {
+                    out.push_back(r);
+                    continue;
+                }
+                for (uint32_t j = s->begin; j < s->end; ++j) {
+                    out.push_back(_anchored(_shared_refs[j], f.rowx, f.colx));
+                }
+            }
+            f.begin = begin;
+            f.end = out.size();
+        }
+        refs.swap(out);
+        _shared.clear();
+        _shared_refs.clear();
+    }
+
+private:
+    struct Shared {
+        int rowxlo;
+        int rowxhi;  // exclusive
+        int colxlo;
+        int colxhi;  // exclusive
+        uint32_t begin;  // _shared_refs[begin, end)
+        uint32_t end;
+    };
+
+    MAP<uint64_t, Shared> _shared;
+    std::vector<FormulaReference> _shared_refs;
+    int _biff_version = 80;
+
+    static uint64_t _key(int sheetx, int rowx, int colx) {
+        return ((uint64_t)(uint16_t)sheetx << 48) | ((uint64_t)(uint32_t)rowx << 16) |
+               (uint16_t)colx;
+    }
+
+    inline FormulaReference
+    _anchored(FormulaReference r, int rowx, int colx) const {
+        if (r.kind != rfAREA) {
+            return r;
+        }
+        const int nrows = _biff_version >= 80 ? 65536 : 16384;
+        const int ncols = 256;
+        r.rowxlo = _refs_anchor(r.rowxlo, rowx, r.relflags & REF_ROW1_REL, nrows);
+        r.rowxhi = _refs_anchor(r.rowxhi - 1, rowx, r.relflags & REF_ROW2_REL, nrows) + 1;
+        r.colxlo = _refs_anchor(r.colxlo, colx, r.relflags & REF_COL1_REL, ncols);
+        r.colxhi = _refs_anchor(r.colxhi - 1, colx, r.relflags & REF_COL2_REL, ncols) + 1;
+        return r;
+    }
+};
+
+}
+}
@@ -0,0 +1,1332 @@
+#pragma once
+
+////
+// Rendering of cell values through Excel "number format" strings.
+//
+// <p>Each Format.format_str is compiled once into a Program: the format is
+// split into its sections, every section is tokenised, and the
+// month/minute ambiguity, thousands separators, scaling, fraction and
+// exponent layout are all resolved up front. Rendering a value is then a
+// single pass over a flat instruction list.</p>
+//
+// <p>A Formatter caches one Program per format_key of a Book, so a
+// workbook with a few dozen distinct formats compiles a few dozen
+// programs no matter how many cells are rendered.</p>
+////
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "./formatting.h"
+#include "./xldate.h"
+#include "./utils.h"
+
+namespace xlrd {
+namespace numfmt {
+
+// === Compiled representation ===
+
+enum Opcode : uint8_t {
+    OP_LITERAL,      // pool[arg, arg + n)
+    OP_INT_DIGIT,    // integer placeholder ch ('0', '#', '?'); n = position from the right
+    OP_DECIMAL,      // the decimal point of a number section
+    OP_FRAC_DIGIT,   // fraction placeholder ch; n = position from the left
+    OP_EXP,          // "E+" / "E-"; ch = '+' or '-'
+    OP_EXP_DIGIT,    // exponent placeholder ch; n = position from the right
+    OP_NUM_DIGIT,    // numerator placeholder of "# ?/?"; n = position from the right
+    OP_SLASH,        // the '/' of a fraction
+    OP_DEN_DIGIT,    // denominator placeholder ch; n = position from the left
+    OP_DEN_FIXED,    // fixed denominator digits, pool[arg, arg + n)
+    OP_TEXT,         // '@'
+    OP_GENERAL,      // "General"
+    OP_YEAR2, OP_YEAR4,
+    OP_MONTH, OP_MONTH2, OP_MONTH_ABBR, OP_MONTH_NAME, OP_MONTH_LETTER,
+    OP_DAY, OP_DAY2, OP_WEEKDAY_ABBR, OP_WEEKDAY_NAME,
+    OP_HOUR, OP_HOUR2, OP_MINUTE, OP_MINUTE2, OP_SECOND, OP_SECOND2,
+    OP_ELAPSED_H, OP_ELAPSED_M, OP_ELAPSED_S,   // n = minimum width
+    OP_AMPM,         // ch = 'A' or 'a'; n = 1 for "A/P", 2 for "AM/PM"
+    OP_SUBSEC,       // n = number of digits after the decimal point
+};
+
+struct Instr
+{
+    uint8_t op;
+    char ch;
+    uint16_t n;
+    uint32_t arg;
+};
+
+enum Condition : uint8_t {
+    COND_NONE, COND_LT, COND_LE, COND_GT, COND_GE, COND_EQ, COND_NE,
+};
+
+////
+// One ';'-separated part of a format string.
+struct Section
+{
+    std::vector<Instr> code;
+    ////
+    // Colour index (as used in Book.colour_map) from [Red], [Color12] etc;
+    // -1 if the section names no colour.
+    int colour_index = -1;
+    uint8_t cond = COND_NONE;
+    double cond_value = 0.0;
+
+    bool is_date = false;
+    bool is_text = false;
+    bool is_general = false;
+    bool thousands = false;
+    bool has_exp = false;
+    bool has_fraction = false;
+    bool ampm = false;
+    bool engineering = false;
+
+    int int_digits = 0;
+    int frac_digits = 0;
+    int exp_digits = 0;
+    int num_digits = 0;
+    int den_digits = 0;
+    int den_fixed = 0;
+    int subsec_digits = 0;
+    // power of ten applied before rendering: +2 per '%', -3 per trailing ','
+    int scale = 0;
+    // the placeholder characters of the fraction and denominator, left to right
+    std::string frac_ph;
+    std::string den_ph;
+};
+
+////
+// A compiled format string.
+struct Program
+{
+    std::vector<Section> sections;
+    // literal text referred to by OP_LITERAL / OP_DEN_FIXED
+    std::string pool;
+    bool has_conditions = false;
+};
+
+const int _MAX_FRAC_DIGITS = 30;
+
+const char* const _month_names[12] = {
+    "January", "February", "March", "April", "May", "June",
+    "July", "August", "September", "October", "November", "December",
+};
+
+const char* const _weekday_names[7] = {
+    "Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday",
+};
+
+// === Compiler ===
+
+enum _TokKind : uint8_t {
+    _T_LIT, _T_PH, _T_DOT, _T_COMMA, _T_PERCENT, _T_EXP, _T_SLASH,
+    _T_AT, _T_GENERAL, _T_DATE, _T_ELAPSED, _T_AMPM,
+};
+
+struct _Tok
+{
+    _TokKind kind;
+    char ch;
+    int n;
+    std::string text;
+};
+
+inline char
+_lower(char c)
+{
+    return ('A' <= c && c <= 'Z') ? char(c - 'A' + 'a') : c;
+}
+
+inline bool
+_istarts_with(const std::string& s, size_t i, const char* word)
+{
+    for (; *word; ++word, ++i) {
+        if (i >= s.size() || _lower(s[i]) != _lower(*word)) return false;
+    }
+    return true;
+}
+
+// Split on ';' outside quotes, brackets and backslash escapes.
+inline std::vector<std::string>
+_split_sections(const std::string& fmt)
+{
+    std::vector<std::string> parts(1);
+    for (size_t i = 0; i < fmt.size(); ++i) {
+        char c = fmt[i];
+        if (c == '"') {
+            size_t j = fmt.find('"', i + 1);
+            if (j == std::string::npos) j = fmt.size() - 1;
+            parts.back().append(fmt, i, j - i + 1);
+            i = j;
+        } else if (c == '\\' || c == '_' || c == '*') {
+            parts.back().append(fmt, i, 2);
+            ++i;
+        } else if (c == '[') {
+            size_t j = fmt.find(']', i + 1);
+            if (j == std::string::npos) j = fmt.size() - 1;
+            parts.back().append(fmt, i, j - i + 1);
+            i = j;
+        } else if (c == ';') {
+            parts.emplace_back();
+        } else {
+            parts.back() += c;
+        }
+    }
+    return parts;
+}
+
+inline int
+_colour_index_from_name(const std::string& name)
+{
+    // Colour indexes 8..15 are the first eight entries of the default palette.
+    static const char* const names[8] = {
+        "black", "white", "red", "green", "blue", "yellow", "magenta", "cyan",
+    };
+    for (int i = 0; i < 8; ++i) {
+        if (_istarts_with(name, 0, names[i]) && name.size() == std::strlen(names[i])) {
+            return 8 + i;
+        }
+    }
+    if (_istarts_with(name, 0, "color") && name.size() > 5) {
+        int n = 0;
+        for (size_t i = 5; i < name.size(); ++i) {
+            if (name[i] < '0' || name[i] > '9') return -1;
+            n = n * 10 + (name[i] - '0');
+        }
+        if (1 <= n && n <= 56) return 7 + n;
+    }
+    return -1;
+}
+
+// Handle the contents of a "[...]" in a section.
+inline void
+_compile_bracket(const std::string& inner, Section& sec, std::vector<_Tok>& toks)
+{
+    if (inner.empty()) return;
+    char c0 = _lower(inner[0]);
+    if (c0 == 'h' || c0 == 'm' || c0 == 's') {
+        size_t n = 0;
+        while (n < inner.size() && _lower(inner[n]) == c0) ++n;
+        if (n == inner.size()) {
+            toks.push_back(_Tok{_T_ELAPSED, c0, int(n), ""});
+            return;
+        }
+    }
+    if (c0 == '<' || c0 == '>' || c0 == '=') {
+        size_t i = 1;
+        if (inner.size() > 1 && (inner[1] == '=' || inner[1] == '>')) i = 2;
+        std::string op = inner.substr(0, i);
+        if      (op == "<")  sec.cond = COND_LT;
+        else if (op == "<=") sec.cond = COND_LE;
+        else if (op == ">")  sec.cond = COND_GT;
+        else if (op == ">=") sec.cond = COND_GE;
+        else if (op == "=")  sec.cond = COND_EQ;
+        else if (op == "<>") sec.cond = COND_NE;
+        double v = 0.0;
+        const char* b = inner.data() + i;
+        const char* e = inner.data() + inner.size();
+        while (b < e && *b == ' ') ++b;
+        if (!utils::parse::parse_double(b, e, &v)) {
+            sec.cond = COND_NONE;
+            return;
+        }
+        sec.cond_value = v;
+        return;
+    }
+    if (c0 == '$') {
+        // locale / currency: [$<symbol>-<lcid>]
+        size_t dash = inner.find('-');
+        std::string sym = inner.substr(1, dash == std::string::npos ? std::string::npos : dash - 1);
+        if (!sym.empty()) toks.push_back(_Tok{_T_LIT, 0, 0, sym});
+        return;
+    }
+    int cx = _colour_index_from_name(inner);
+    if (cx >= 0) sec.colour_index = cx;
+}
+
+inline std::vector<_Tok>
+_tokenize(const std::string& s, Section& sec)
+{
+    std::vector<_Tok> toks;
+    auto lit = [&toks](const std::string& text) {
+        if (!toks.empty() && toks.back().kind == _T_LIT) {
+            toks.back().text += text;
+        } else {
+            toks.push_back(_Tok{_T_LIT, 0, 0, text});
+        }
+    };
+    for (size_t i = 0; i < s.size(); ++i) {
+        char c = s[i];
+        char lc = _lower(c);
+        if (c == '"') {
+            size_t j = s.find('"', i + 1);
+            if (j == std::string::npos) j = s.size();
+            lit(s.substr(i + 1, j - i - 1));
+            i = j;
+        } else if (c == '\\') {
+            if (i + 1 < s.size()) lit(s.substr(++i, 1));
+        } else if (c == '_') {
+            // pad with the width of the next character
+            ++i;
+            lit(" ");
+        } else if (c == '*') {
+            // repeat-to-fill; there is no column width here
+            ++i;
+        } else if (c == '[') {
+            size_t j = s.find(']', i + 1);
+            if (j == std::string::npos) j = s.size();
+            _compile_bracket(s.substr(i + 1, j - i - 1), sec, toks);
+            i = j;
+        } else if (c == '0' || c == '#' || c == '?') {
+            toks.push_back(_Tok{_T_PH, c, 1, ""});
+        } else if (c == '.') {
+            toks.push_back(_Tok{_T_DOT, c, 1, ""});
+        } else if (c == ',') {
+            toks.push_back(_Tok{_T_COMMA, c, 1, ""});
+        } else if (c == '%') {
+            toks.push_back(_Tok{_T_PERCENT, c, 1, ""});
+        } else if (c == '@') {
+            toks.push_back(_Tok{_T_AT, c, 1, ""});
+        } else if (lc == 'e' && i + 1 < s.size() && (s[i + 1] == '+' || s[i + 1] == '-')) {
+            toks.push_back(_Tok{_T_EXP, s[i + 1], 1, ""});
+            ++i;
+        } else if (_istarts_with(s, i, "general")) {
+            toks.push_back(_Tok{_T_GENERAL, c, 1, ""});
+            i += 6;
+        } else if (_istarts_with(s, i, "am/pm")) {
+            toks.push_back(_Tok{_T_AMPM, 'A', 2, ""});
+            i += 4;
+        } else if (_istarts_with(s, i, "a/p")) {
+            toks.push_back(_Tok{_T_AMPM, c, 1, ""});
+            i += 2;
+        } else if (lc == 'y' || lc == 'm' || lc == 'd' || lc == 'h' || lc == 's') {
+            int n = 1;
+            while (i + 1 < s.size() && _lower(s[i + 1]) == lc) {
+                ++i;
+                ++n;
+            }
+            toks.push_back(_Tok{_T_DATE, lc, n, ""});
+        } else if (c == '/') {
+            toks.push_back(_Tok{_T_SLASH, c, 1, ""});
+        } else {
+            lit(std::string(1, c));
+        }
+    }
+    return toks;
+}
+
+inline void
+_emit(Section& sec, uint8_t op, char ch = 0, int n = 0)
+{
+    sec.code.push_back(Instr{op, ch, uint16_t(n), 0});
+}
+
+inline void
+_emit_literal(Program& prog, Section& sec, const std::string& text, uint8_t op = OP_LITERAL)
+{
+    if (text.empty()) return;
+    if (op == OP_LITERAL && !sec.code.empty() && sec.code.back().op == OP_LITERAL
+            && sec.code.back().arg + sec.code.back().n == prog.pool.size()) {
+        // extend the previous literal in place
+        prog.pool += text;
+        sec.code.back().n = uint16_t(sec.code.back().n + text.size());
+        return;
+    }
+    sec.code.push_back(Instr{op, 0, uint16_t(text.size()), uint32_t(prog.pool.size())});
+    prog.pool += text;
+}
+
+// Literal spelling of a token that has no meaning in its context.
+inline std::string
+_tok_text(const _Tok& t)
+{
+    switch (t.kind) {
+    case _T_LIT: return t.text;
+    case _T_EXP: return std::string("E") + t.ch;
+    case _T_GENERAL: return "General";
+    case _T_DATE: return std::string(size_t(t.n), t.ch);
+    case _T_AMPM: return t.n == 2 ? "AM/PM" : "A/P";
+    case _T_ELAPSED: return "";
+    default: return std::string(1, t.ch);
+    }
+}
+
+inline void
+_compile_date(Program& prog, Section& sec, std::vector<_Tok>& toks)
+{
+    sec.is_date = true;
+    // "m"/"mm" means minutes right after an hour or right before a second.
+    auto is_time_tok = [](const _Tok& t) {
+        return t.kind == _T_DATE || t.kind == _T_ELAPSED;
+    };
+    for (size_t i = 0; i < toks.size(); ++i) {
+        _Tok& t = toks[i];
+        if (t.kind == _T_AMPM) sec.ampm = true;
+        if (t.kind != _T_DATE || t.ch != 'm' || t.n > 2) continue;
+        bool minute = false;
+        for (size_t j = i; j-- > 0;) {
+            if (is_time_tok(toks[j])) {
+                minute = toks[j].ch == 'h';
+                break;
+            }
+        }
+        for (size_t j = i + 1; !minute && j < toks.size(); ++j) {
+            if (is_time_tok(toks[j])) {
+                minute = toks[j].ch == 's';
+                break;
+            }
+        }
+        if (minute) t.ch = 'M';
+    }
+    static const uint8_t ops_y[] = {OP_YEAR2, OP_YEAR2, OP_YEAR4};
+    static const uint8_t ops_m[] = {OP_MONTH, OP_MONTH2, OP_MONTH_ABBR, OP_MONTH_NAME, OP_MONTH_LETTER};
+    static const uint8_t ops_d[] = {OP_DAY, OP_DAY2, OP_WEEKDAY_ABBR, OP_WEEKDAY_NAME};
+    bool after_second = false;
+    for (size_t i = 0; i < toks.size(); ++i) {
+        const _Tok& t = toks[i];
+        if (t.kind == _T_DATE) {
+            int n = t.n;
+            switch (t.ch) {
+            case 'y': _emit(sec, ops_y[std::min(n, 3) - 1]); break;
+            case 'm': _emit(sec, ops_m[std::min(n, 5) - 1]); break;
+            case 'd': _emit(sec, ops_d[std::min(n, 4) - 1]); break;
+            case 'h': _emit(sec, n >= 2 ? OP_HOUR2 : OP_HOUR); break;
+            case 'M': _emit(sec, n >= 2 ? OP_MINUTE2 : OP_MINUTE); break;
+            case 's': _emit(sec, n >= 2 ? OP_SECOND2 : OP_SECOND); break;
+            }
+            after_second = t.ch == 's';
+            continue;
+        }
+        if (t.kind == _T_ELAPSED) {
+            uint8_t op = t.ch == 'h' ? OP_ELAPSED_H : t.ch == 'm' ? OP_ELAPSED_M : OP_ELAPSED_S;
+            _emit(sec, op, 0, t.n);
+            after_second = t.ch == 's';
+            continue;
+        }
+        if (t.kind == _T_DOT && after_second) {
+            int n = 0;
+            while (i + 1 < toks.size() && toks[i + 1].kind == _T_PH && toks[i + 1].ch == '0') {
+                ++i;
+                ++n;
+            }
+            if (n > 0) {
+                n = std::min(n, 3);
+                sec.subsec_digits = std::max(sec.subsec_digits, n);
+                _emit(sec, OP_SUBSEC, 0, n);
+                continue;
+            }
+        }
+        if (t.kind == _T_AMPM) {
+            _emit(sec, OP_AMPM, t.ch, t.n);
+        } else if (t.kind == _T_AT) {
+            _emit(sec, OP_TEXT);
+        } else {
+            _emit_literal(prog, sec, _tok_text(t));
+        }
+    }
+}
+
+inline void
+_compile_fraction(Program& prog, Section& sec, std::vector<_Tok>& toks, size_t slash)
+{
+    sec.has_fraction = true;
+    // numerator: the placeholders immediately before the slash
+    size_t num_begin = slash;
+    while (num_begin > 0 && toks[num_begin - 1].kind == _T_PH) --num_begin;
+    sec.num_digits = int(slash - num_begin);
+    for (size_t i = 0; i < num_begin; ++i) {
+        if (toks[i].kind == _T_PH) ++sec.int_digits;
+    }
+    size_t den_end = slash + 1;
+    while (den_end < toks.size() && toks[den_end].kind == _T_PH) ++den_end;
+    sec.den_digits = int(den_end - slash - 1);
+
+    int int_pos = sec.int_digits;
+    int num_pos = sec.num_digits;
+    for (size_t i = 0; i < toks.size(); ++i) {
+        const _Tok& t = toks[i];
+        if (i == slash) {
+            _emit(sec, OP_SLASH);
+            if (sec.den_digits == 0) {
+                // fixed denominator, e.g. "# ?/8"
+                const std::string& text = toks[i + 1].text;
+                size_t n = 0;
+                while (n < text.size() && '0' <= text[n] && text[n] <= '9') {
+                    sec.den_fixed = sec.den_fixed * 10 + (text[n] - '0');
+                    ++n;
+                }
+                _emit_literal(prog, sec, text.substr(0, n), OP_DEN_FIXED);
+                _emit_literal(prog, sec, text.substr(n));
+                ++i;
+            }
+        } else if (t.kind == _T_PH && i < num_begin) {
+            _emit(sec, OP_INT_DIGIT, t.ch, --int_pos);
+        } else if (t.kind == _T_PH && i < slash) {
+            _emit(sec, OP_NUM_DIGIT, t.ch, --num_pos);
+        } else if (t.kind == _T_PH && i < den_end) {
+            _emit(sec, OP_DEN_DIGIT, t.ch, int(sec.den_ph.size()));
+            sec.den_ph += t.ch;
+        } else if (t.kind == _T_PERCENT) {
+            sec.scale += 2;
+            _emit_literal(prog, sec, "%");
+        } else {
+            _emit_literal(prog, sec, _tok_text(t));
+        }
+    }
+}
+
+inline void
+_compile_number(Program& prog, Section& sec, std::vector<_Tok>& toks)
+{
+    for (size_t i = 1; i + 1 < toks.size(); ++i) {
+        if (toks[i].kind == _T_SLASH && toks[i - 1].kind == _T_PH
+                && (toks[i + 1].kind == _T_PH
+                    || (toks[i + 1].kind == _T_LIT && '1' <= toks[i + 1].text[0]
+                        && toks[i + 1].text[0] <= '9'))) {
+            _compile_fraction(prog, sec, toks, i);
+            return;
+        }
+    }
+
+    enum { Z_INT, Z_FRAC, Z_EXP };
+    // First pass: decide what each '.', ',' and 'E+' means and count placeholders.
+    std::vector<int> zone(toks.size(), -1);
+    int z = Z_INT;
+    int pending_commas = 0;
+    std::vector<size_t> thousands_commas;
+    for (size_t i = 0; i < toks.size(); ++i) {
+        const _Tok& t = toks[i];
+        if (t.kind == _T_PH) {
+            zone[i] = z;
+            if (z == Z_INT) {
+                ++sec.int_digits;
+                if (pending_commas) sec.thousands = true;
+                pending_commas = 0;
+            } else if (z == Z_FRAC) {
+                ++sec.frac_digits;
+            } else {
+                ++sec.exp_digits;
+            }
+        } else if (t.kind == _T_DOT && z == Z_INT) {
+            zone[i] = Z_FRAC;
+            sec.scale -= 3 * pending_commas;
+            pending_commas = 0;
+            z = Z_FRAC;
+        } else if (t.kind == _T_EXP && z != Z_EXP && (sec.int_digits || sec.frac_digits)) {
+            zone[i] = Z_EXP;
+            sec.scale -= 3 * pending_commas;
+            pending_commas = 0;
+            sec.has_exp = true;
+            z = Z_EXP;
+        } else if (t.kind == _T_COMMA && z != Z_EXP && (sec.int_digits || sec.frac_digits)) {
+            zone[i] = z;
+            ++pending_commas;
+        } else if (t.kind == _T_PERCENT) {
+            sec.scale += 2;
+        }
+    }
+    sec.scale -= 3 * pending_commas;
+    if (sec.frac_digits > _MAX_FRAC_DIGITS) sec.frac_digits = _MAX_FRAC_DIGITS;
+    if (sec.has_exp && sec.int_digits > 1) {
+        for (size_t i = 0; i < toks.size() && zone[i] == Z_INT; ++i) {
+            if (toks[i].kind == _T_PH && toks[i].ch == '#') sec.engineering = true;
+        }
+    }
+
+    // Second pass: emit.
+    int int_pos = sec.int_digits;
+    int exp_pos = sec.exp_digits;
+    for (size_t i = 0; i < toks.size(); ++i) {
+        const _Tok& t = toks[i];
+        if (zone[i] < 0) {
+            if (t.kind == _T_PERCENT) {
+                _emit_literal(prog, sec, "%");
+            } else if (t.kind == _T_AT) {
+                _emit(sec, OP_TEXT);
+            } else if (t.kind == _T_GENERAL) {
+                _emit(sec, OP_GENERAL);
+            } else {
+                _emit_literal(prog, sec, _tok_text(t));
+            }
+        } else if (t.kind == _T_PH) {
+            if (zone[i] == Z_INT) {
+                _emit(sec, OP_INT_DIGIT, t.ch, --int_pos);
+            } else if (zone[i] == Z_FRAC) {
+                if (int(sec.frac_ph.size()) < sec.frac_digits) {
+                    _emit(sec, OP_FRAC_DIGIT, t.ch, int(sec.frac_ph.size()));
+                    sec.frac_ph += t.ch;
+                }
+            } else {
+                _emit(sec, OP_EXP_DIGIT, t.ch, --exp_pos);
+            }
+        } else if (t.kind == _T_DOT) {
+            _emit(sec, OP_DECIMAL);
+        } else if (t.kind == _T_EXP) {
+            _emit(sec, OP_EXP, t.ch);
+        }
+        // commas have been folded into sec.thousands / sec.scale
+    }
+}
+
+////
+// Compile a format string into a Program.
+// Never throws on malformed formats; unknown constructs are rendered literally.
+EXPORT
+Program
+compile(const std::string& format_str)
+{
+    Program prog;
+    std::vector<std::string> parts = _split_sections(format_str);
+    if (parts.size() > 4) parts.resize(4);
+    for (size_t sx = 0; sx < parts.size(); ++sx) {
+        prog.sections.emplace_back();
+        Section& sec = prog.sections.back();
+        std::vector<_Tok> toks = _tokenize(parts[sx], sec);
+        bool has_date = false, has_ph = false, has_at = false, has_general = false;
+        for (auto& t: toks) {
+            has_date |= t.kind == _T_DATE || t.kind == _T_ELAPSED || t.kind == _T_AMPM;
+            has_ph |= t.kind == _T_PH;
+            has_at |= t.kind == _T_AT;
+            has_general |= t.kind == _T_GENERAL;
+        }
+        if (sec.cond != COND_NONE) prog.has_conditions = true;
+        if (has_date) {
+            _compile_date(prog, sec, toks);
+        } else if (has_at && !has_ph) {
+            sec.is_text = true;
+            for (auto& t: toks) {
+                if (t.kind == _T_AT) _emit(sec, OP_TEXT);
+                else _emit_literal(prog, sec, _tok_text(t));
+            }
+        } else if (!has_ph) {
+            sec.is_general = has_general || toks.empty();
+            for (auto& t: toks) {
+                if (t.kind == _T_GENERAL) _emit(sec, OP_GENERAL);
+                else _emit_literal(prog, sec, _tok_text(t));
+            }
+            if (toks.empty() && parts.size() == 1) _emit(sec, OP_GENERAL);
+        } else {
+            _compile_number(prog, sec, toks);
+        }
+    }
+    return prog;
+}
+
+// === Renderer ===
+
+// The 15 significant digits of a = |v| > 0, as Excel keeps them, into
+// digits; returns the decimal exponent of the first one.
+inline int
+_digits15(double a, std::string& digits)
+{
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.14e", a);  // d.dddddddddddddde[+-]x
+    digits.assign(1, buf[0]);
+    digits.append(buf + 2, 14);
+    return std::atoi(buf + 17);
+}
+
+// Cuts digits to its first keep, rounding half away from zero. Returns
+// true if that carried out of the first digit, which is then a new "1".
+inline bool
+_round_digits(std::string& digits, size_t keep)
+{
+    if (digits.size() <= keep) {
+        return false;
+    }
+    bool up = digits[keep] >= '5';
+    digits.resize(keep);
+    for (size_t i = keep; up && i > 0; --i) {
+        up = digits[i - 1] == '9';
+        digits[i - 1] = up ? '0' : char(digits[i - 1] + 1);
+    }
+    if (up) {
+        digits.insert(digits.begin(), '1');
+    }
+    return up;
+}
+
+////
+// Excel's "General" format, as a cell of the standard width shows it: at
+// most 11 characters, the sign included. The value is taken to 15
+// significant digits, then rounded half away from zero to as many decimals
+// as fit, or shown in scientific notation when the integer part does not
+// fit or too little of a small value would show.
+EXPORT
+void
+render_general(double value, std::string& out)
+{
+    if (value == 0.0) {
+        out += '0';
+        return;
+    }
+    bool negative = value < 0;
+    int width = negative ? 10 : 11;
+    std::string digits;
+    int e = _digits15(std::fabs(value), digits);
+    size_t nsig = digits.find_last_not_of('0') + 1;
+    // fixed notation: up to 11 characters, and values below 1e-4 only
+    // when no digit is lost
+    int fixed_len = e >= 0 ? e + 1 : int(nsig) + 1 - e;  // "0." and zeros
+    if (e < width && (e >= -4 || fixed_len <= width)) {
+        int point = e + 1;  // digits before the decimal point
+        if (point <= 0) {
+            digits.insert(0, size_t(1 - point), '0');
+            point = 1;
+        }
+        int decimals = std::max(0, width - point - 1);
+        point += _round_digits(digits, size_t(point + decimals));
+        if (point <= width) {
+            if ((int)digits.size() < point) {
+                digits.append(size_t(point - (int)digits.size()), '0');
+            }
+            size_t end = digits.find_last_not_of('0') + 1;
+            if (negative) out += '-';
+            out.append(digits, 0, size_t(point));
+            if (end > size_t(point)) {
+                out += '.';
+                out.append(digits, size_t(point), end - size_t(point));
+            }
+            return;
+        }
+        // rounding carried into a digit that does not fit
+        e += 1;
+        digits.assign(1, '1');
+    }
+    int exp_len = std::abs(e) >= 100 ? 5 : 4;  // "E+dd" or "E+ddd"
+    if (_round_digits(digits, size_t(width - exp_len - 1))) {
+        e += 1;
+        if (e == -4) {
+            // rounded up into the range shown fixed
+            out.append(negative ? "-0.0001" : "0.0001");
+            return;
+        }
+    }
+    size_t end = digits.find_last_not_of('0') + 1;
+    if (negative) out += '-';
+    out += digits[0];
+    if (end > 1) {
+        out += '.';
+        out.append(digits, 1, std::min(end, size_t(width - exp_len - 1)) - 1);
+    }
+    out += 'E';
+    out += e < 0 ? '-' : '+';
+    int ae = std::abs(e);
+    if (ae < 10) out += '0';
+    out += std::to_string(ae);
+}
+
+struct _DateParts
+{
+    int year, month, day, weekday;
+    int hour, minute, second;
+    long long subsec;          // in units of 10**-subsec_digits seconds
+    long long total_ticks;     // the whole value in the same units, for [h] [m] [s]
+    long long ticks_per_second;
+};
+
+// Calendar fields for display; Excel's phantom 1900-02-29 and
+// 1900-01-00 are reproduced. Returns false if value can't be shown as a date.
+inline bool
+_date_parts(double value, int datemode, int subsec_digits, _DateParts& p)
+{
+    if (!(value >= 0.0) || value >= xldate::_XLDAYS_TOO_LARGE[datemode & 1]) {
+        return false;
+    }
+    long long tps = 1;
+    for (int i = 0; i < subsec_digits; ++i) tps *= 10;
+    long long ticks_per_day = 86400LL * tps;
+    long long total = (long long)(std::floor(value * double(ticks_per_day) + 0.5));
+    int days = int(total / ticks_per_day);
+    long long ticks = total % ticks_per_day;
+    if (days >= xldate::_XLDAYS_TOO_LARGE[datemode & 1]) return false;
+
+    p.total_ticks = total;
+    p.ticks_per_second = tps;
+    p.subsec = ticks % tps;
+    long long secs = ticks / tps;
+    p.second = int(secs % 60);
+    p.minute = int((secs / 60) % 60);
+    p.hour = int(secs / 3600);
+
+    if (datemode == 1) {
+        p.weekday = (days + 5) % 7;
+    } else {
+        p.weekday = (days + 6) % 7;
+        if (days < 61) {
+            p.year = 1900;
+            if (days <= 31) {
+                p.month = 1;
+                p.day = days;
+            } else {
+                p.month = 2;
+                p.day = days - 31;
+            }
+            return true;
+        }
+    }
+    int jdn = days + xldate::_JDN_delta[datemode & 1];
+    int yreg = ((((jdn * 4 + 274277) / 146097) * 3 / 4) + jdn + 1363) * 4 + 3;
+    int mp = ((yreg % 1461) / 4) * 535 + 333;
+    p.day = ((mp % 16384) / 535) + 1;
+    mp >>= 14;
+    if (mp >= 10) {
+        p.year = (yreg / 1461) - 4715;
+        p.month = mp - 9;
+    } else {
+        p.year = (yreg / 1461) - 4716;
+        p.month = mp + 3;
+    }
+    return true;
+}
+
+inline void
+_append_int(std::string& out, long long v, int width)
+{
+    char buf[24];
+    int n = std::snprintf(buf, sizeof(buf), "%0*lld", width, v);
+    out.append(buf, size_t(n));
+}
+
+inline void
+_render_date(const Program& prog, const Section& sec, double value, int datemode, std::string& out)
+{
+    _DateParts p;
+    if (!_date_parts(value, datemode, sec.subsec_digits, p)) {
+        out.append("########");
+        return;
+    }
+    int hour = p.hour;
+    if (sec.ampm) {
+        hour = p.hour % 12;
+        if (hour == 0) hour = 12;
+    }
+    long long tps = p.ticks_per_second;
+    for (const Instr& in: sec.code) {
+        switch (in.op) {
+        case OP_LITERAL: out.append(prog.pool, in.arg, in.n); break;
+        case OP_YEAR2: _append_int(out, p.year % 100, 2); break;
+        case OP_YEAR4: _append_int(out, p.year, 4); break;
+        case OP_MONTH: _append_int(out, p.month, 1); break;
+        case OP_MONTH2: _append_int(out, p.month, 2); break;
+        case OP_MONTH_ABBR: out.append(_month_names[p.month - 1], 3); break;
+        case OP_MONTH_NAME: out.append(_month_names[p.month - 1]); break;
+        case OP_MONTH_LETTER: out += _month_names[p.month - 1][0]; break;
+        case OP_DAY: _append_int(out, p.day, 1); break;
+        case OP_DAY2: _append_int(out, p.day, 2); break;
+        case OP_WEEKDAY_ABBR: out.append(_weekday_names[p.weekday], 3); break;
+        case OP_WEEKDAY_NAME: out.append(_weekday_names[p.weekday]); break;
+        case OP_HOUR: _append_int(out, hour, 1); break;
+        case OP_HOUR2: _append_int(out, hour, 2); break;
+        case OP_MINUTE: _append_int(out, p.minute, 1); break;
+        case OP_MINUTE2: _append_int(out, p.minute, 2); break;
+        case OP_SECOND: _append_int(out, p.second, 1); break;
+        case OP_SECOND2: _append_int(out, p.second, 2); break;
+        case OP_ELAPSED_H: _append_int(out, p.total_ticks / tps / 3600, in.n); break;
+        case OP_ELAPSED_M: _append_int(out, p.total_ticks / tps / 60, in.n); break;
+        case OP_ELAPSED_S: _append_int(out, p.total_ticks / tps, in.n); break;
+        case OP_AMPM: {
+            bool pm = p.hour >= 12;
+            if (in.n == 2) {
+                out.append(pm ? "PM" : "AM");
+            } else {
+                char c = pm ? 'P' : 'A';
+                out += in.ch == 'a' ? _lower(c) : c;
+            }
+            break;
+        }
+        case OP_SUBSEC: {
+            out += '.';
+            long long v = p.subsec;
+            for (int k = sec.subsec_digits; k > in.n; --k) v /= 10;
+            _append_int(out, v, in.n);
+            break;
+        }
+        default: break;
+        }
+    }
+}
+
+// Best p/q approximation of x with q <= max_den (Stern-Brocot walk with
+// the continued fraction steps taken in bulk).
+inline void
+_approx_fraction(double x, long long max_den, long long& num, long long& den)
+{
+    long long a0 = 0, b0 = 1, a1 = 1, b1 = 0;
+    double r = x;
+    for (int iter = 0; iter < 64; ++iter) {
+        double fl = std::floor(r);
+        if (fl > 1e15) break;
+        long long a = (long long)fl;
+        long long a2 = a * a1 + a0, b2 = a * b1 + b0;
+        if (b2 > max_den) {
+            // best semiconvergent within the limit
+            long long k = (max_den - b0) / b1;
+            long long sa = k * a1 + a0, sb = k * b1 + b0;
+            if (std::fabs(x - double(sa) / sb) < std::fabs(x - double(a1) / b1)) {
+                a1 = sa;
+                b1 = sb;
+            }
+            break;
+        }
+        a0 = a1; b0 = b1; a1 = a2; b1 = b2;
+        double f = r - fl;
+        if (f < 1e-12) break;
+        r = 1.0 / f;
+    }
+    num = a1;
+    den = b1;
+}
+
+// Digits of |v| scaled to the section, rounded to frac_digits.
+// int_part gets no leading zeros ("" for zero); frac_part exactly frac_digits.
+// As in Excel, v is first taken to 15 significant digits and that decimal
+// value is rounded, ties away from zero: "0.00" gives 1.005 as "1.01" (the
+// double is 1.00499999999999989...) and "0" gives 123456789012345678 as
+// "123456789012346000".
+inline void
+_split_fixed(double v, int frac_digits, std::string& int_part, std::string& frac_part)
+{
+    static const double p10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+    };
+    if (frac_digits <= 15 && v * p10[frac_digits] < 1e15) {
+        // Common case: the rounded value fits in an integer, and the scaled
+        // value is not so close to a tie that the 15 digit rounding of v
+        // could decide it.
+        double x = v * p10[frac_digits];
+        double fl = std::floor(x);
+        if (std::fabs(x - fl - 0.5) > x * 1e-14) {
+            uint64_t r = uint64_t(fl) + (x - fl > 0.5);
+            char buf[24];
+            const char* end = buf + sizeof(buf);
+            char* p = buf + sizeof(buf);
+            int n = 0;
+            do {
+                *--p = char('0' + r % 10);
+                r /= 10;
+                ++n;
+            } while (r || n <= frac_digits);
+            const char* b = p;
+            const char* dot = end - frac_digits;
+            while (b < dot && *b == '0') ++b;
+            int_part.assign(b, dot);
+            frac_part.assign(dot, end);
+            return;
+        }
+    }
+    // 15 significant digits, then the decimal rounding done on them
+    std::string digits;
+    int point = _digits15(v, digits) + 1; // digits before the decimal point
+    if (point <= 0) {
+        digits.insert(0, size_t(1 - point), '0');
+        point = 1;
+    } else if (point > (int)digits.size()) {
+        digits.append(size_t(point - (int)digits.size()), '0');
+    }
+    size_t keep = size_t(point + frac_digits);
+    if (digits.size() <= keep) {
+        digits.append(keep - digits.size(), '0');
+    } else if (_round_digits(digits, keep)) {
+        ++point;
+    }
+    size_t b = 0;
+    while (b < size_t(point) && digits[b] == '0') ++b;
+    int_part.assign(digits, b, size_t(point) - b);
+    frac_part.assign(digits, size_t(point), std::string::npos);
+}
+
+// One right-aligned placeholder; the leftmost one also takes the digits
+// that don't have a placeholder of their own.
+inline void
+_put_int_digit(std::string& out, const std::string& digits, char ph, int pos,
+               bool leftmost, bool thousands, bool& started)
+{
+    int len = int(digits.size());
+    auto sep = [&](int p) {
+        if (thousands && started && p > 0 && p % 3 == 0) out += ',';
+    };
+    if (leftmost) {
+        for (int p = len - 1; p > pos; --p) {
+            out += digits[size_t(len - 1 - p)];
+            started = true;
+            sep(p);
+        }
+    }
+    if (pos < len) {
+        out += digits[size_t(len - 1 - pos)];
+        started = true;
+    } else if (ph == '0') {
+        out += '0';
+        started = true;
+    } else if (ph == '?') {
+        out += ' ';
+    }
+    sep(pos);
+}
+
+inline void
+_render_number(const Program& prog, const Section& sec, double value, bool negative,
+               std::string& out, std::string& int_part, std::string& frac_part)
+{
+    double a = std::fabs(value);
+    if (sec.scale) a *= std::pow(10.0, sec.scale);
+    std::string exp_part;
+    bool exp_negative = false;
+    long long num = 0, den = 1;
+
+    if (sec.has_exp) {
+        int span = std::max(sec.int_digits, 1);
+        int e = a == 0.0 ? 0 : int(std::floor(std::log10(a)));
+        int shift;
+        if (sec.engineering) {
+            shift = e >= 0 ? (e / span) * span : -(((-e) + span - 1) / span) * span;
+        } else {
+            shift = e - (span - 1);
+        }
+        double m = a == 0.0 ? 0.0 : a / std::pow(10.0, shift);
+        _split_fixed(m, sec.frac_digits, int_part, frac_part);
+        if (!sec.engineering && int(int_part.size()) > span) {
+            // rounding carried into a new digit, 9.99 -> 10.0
+            ++shift;
+            _split_fixed(a / std::pow(10.0, shift), sec.frac_digits, int_part, frac_part);
+        }
+        exp_negative = shift < 0;
+        exp_part = std::to_string(shift < 0 ? -shift : shift);
+        if (exp_part == "0") exp_part.clear();
+    } else if (sec.has_fraction) {
+        double whole = sec.int_digits ? std::floor(a) : 0.0;
+        double f = a - whole;
+        if (sec.den_fixed) {
+            den = sec.den_fixed;
+            num = (long long)std::floor(f * double(den) + 0.5);
+        } else {
+            long long max_den = 1;
+            for (int i = 0; i < std::max(sec.den_digits, 1); ++i) max_den *= 10;
+            _approx_fraction(f, max_den - 1, num, den);
+        }
+        if (sec.int_digits && num == den) {
+            whole += 1.0;
+            num = 0;
+        }
+        _split_fixed(whole, 0, int_part, frac_part);
+        if (int_part.empty() && num == 0) int_part = "0";
+    } else {
+        _split_fixed(a, sec.frac_digits, int_part, frac_part);
+    }
+
+    // Negative values that round to zero are shown without a sign.
+    if (negative) {
+        bool all_zero = int_part.find_first_not_of('0') == std::string::npos
+                     && frac_part.find_first_not_of('0') == std::string::npos
+                     && (!sec.has_fraction || num == 0);
+        if (!all_zero) out += '-';
+    }
+
+    // '#' and '?' placeholders at the end of the fraction swallow zeros
+    int frac_keep = int(frac_part.size());
+    while (frac_keep > 0 && frac_part[size_t(frac_keep - 1)] == '0'
+            && sec.frac_ph[size_t(frac_keep - 1)] != '0') {
+        --frac_keep;
+    }
+
+    std::string num_digits, den_digits;
+    bool fraction_blank = false;
+    if (sec.has_fraction) {
+        fraction_blank = num == 0 && sec.int_digits > 0;
+        if (!fraction_blank) {
+            num_digits = std::to_string(num);
+            den_digits = std::to_string(den);
+        }
+    }
+
+    bool int_started = false, exp_started = false, num_started = false;
+    for (const Instr& in: sec.code) {
+        switch (in.op) {
+        case OP_LITERAL:
+            out.append(prog.pool, in.arg, in.n);
+            break;
+        case OP_INT_DIGIT:
+            _put_int_digit(out, int_part, in.ch, in.n, in.n == sec.int_digits - 1,
+                           sec.thousands, int_started);
+            break;
+        case OP_DECIMAL:
+            out += '.';
+            break;
+        case OP_FRAC_DIGIT:
+            if (int(in.n) < frac_keep) out += frac_part[in.n];
+            else if (in.ch == '?') out += ' ';
+            break;
+        case OP_EXP:
+            out += 'E';
+            if (exp_negative) out += '-';
+            else if (in.ch == '+') out += '+';
+            break;
+        case OP_EXP_DIGIT:
+            _put_int_digit(out, exp_part, in.ch, in.n, in.n == sec.exp_digits - 1,
+                           false, exp_started);
+            break;
+        case OP_NUM_DIGIT:
+            if (fraction_blank) {
+                if (in.ch != '#') out += ' ';
+            } else {
+                _put_int_digit(out, num_digits, in.ch, in.n, in.n == sec.num_digits - 1,
+                               false, num_started);
+            }
+            break;
+        case OP_SLASH:
+            out += fraction_blank ? ' ' : '/';
+            break;
+        case OP_DEN_DIGIT:
+            if (fraction_blank) {
+                if (in.ch != '#') out += ' ';
+            } else if (in.n == 0) {
+                // the denominator is left aligned and may overflow its placeholders
+                out += den_digits;
+            } else if (int(in.n) >= int(den_digits.size())) {
+                if (in.ch == '?') out += ' ';
+                else if (in.ch == '0') out += '0';
+            }
+            break;
+        case OP_DEN_FIXED:
+            if (fraction_blank) out.append(size_t(in.n), ' ');
+            else out.append(prog.pool, in.arg, in.n);
+            break;
+        case OP_GENERAL:
+            render_general(std::fabs(value), out);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+inline bool
+_test_condition(uint8_t cond, double cond_value, double v)
+{
+    switch (cond) {
+    case COND_LT: return v < cond_value;
+    case COND_LE: return v <= cond_value;
+    case COND_GT: return v > cond_value;
+    case COND_GE: return v >= cond_value;
+    case COND_EQ: return v == cond_value;
+    case COND_NE: return v != cond_value;
+    default: return true;
+    }
+}
+
+////
+// Choose the section that renders a number.
+// *drop_sign is set when the section is the implicit "negative" one,
+// whose own literals carry the sign (e.g. "0;(0)").
+EXPORT
+const Section*
+pick_section(const Program& prog, double value, bool* drop_sign)
+{
+    *drop_sign = false;
+    size_t nsec = prog.sections.size();
+    if (nsec == 0) return nullptr;
+    // the fourth section is for text only
+    size_t nnum = std::min<size_t>(nsec, 3);
+    if (nnum > 1 && prog.sections[nnum - 1].is_text) --nnum;
+    const Section* s = prog.sections.data();
+    if (!prog.has_conditions) {
+        if (nnum == 1) return s;
+        if (value > 0.0 || (value == 0.0 && nnum == 2)) return s;
+        if (value < 0.0) {
+            *drop_sign = true;
+            return s + 1;
+        }
+        return s + 2;
+    }
+    if (s[0].cond != COND_NONE && _test_condition(s[0].cond, s[0].cond_value, value)) return s;
+    if (s[0].cond == COND_NONE) return s;
+    if (nnum >= 2) {
+        if (s[1].cond == COND_NONE && nnum == 2) return s + 1;
+        if (_test_condition(s[1].cond, s[1].cond_value, value)) return s + 1;
+    }
+    if (nnum == 3) return s + 2;
+    return nullptr;
+}
+
+////
+// Append the text of one number rendered through prog.
+// @param datemode Book.datemode, used by date sections.
+// @param scratch Buffers reused between calls; pass the same pair
+// to avoid reallocations in loops.
+EXPORT
+void
+render_into(const Program& prog, double value, int datemode, std::string& out,
+            std::string& int_scratch, std::string& frac_scratch)
+{
+    bool drop_sign;
+    const Section* sec = pick_section(prog, value, &drop_sign);
+    if (sec == nullptr || sec->is_text) {
+        if (sec == nullptr && !prog.sections.empty()) {
+            out.append("########");
+        } else {
+            render_general(value, out);
+        }
+        return;
+    }
+    if (sec->is_date) {
+        if (value < 0.0) {
+            out.append("########");
+        } else {
+            _render_date(prog, *sec, value, datemode, out);
+        }
+        return;
+    }
+    if (sec->is_general) {
+        // "General", or a literal-only section such as "General;-General" or "0;;"
+        for (const Instr& in: sec->code) {
+            if (in.op == OP_LITERAL) {
+                out.append(prog.pool, in.arg, in.n);
+            } else if (in.op == OP_GENERAL) {
+                render_general(drop_sign ? std::fabs(value) : value, out);
+            }
+        }
+        return;
+    }
+    if (sec->int_digits + sec->frac_digits + sec->num_digits == 0) {
+        // literals only, e.g. the "zero" section of "0;-0;\"-\""
+        for (const Instr& in: sec->code) {
+            if (in.op == OP_LITERAL) out.append(prog.pool, in.arg, in.n);
+        }
+        return;
+    }
+    _render_number(prog, *sec, value, value < 0.0 && !drop_sign, out, int_scratch, frac_scratch);
+}
+
+EXPORT
+void
+render_into(const Program& prog, double value, int datemode, std::string& out)
+{
+    std::string int_part, frac_part;
+    render_into(prog, value, datemode, out, int_part, frac_part);
+}
+
+EXPORT
+std::string
+render(const Program& prog, double value, int datemode)
+{
+    std::string out;
+    render_into(prog, value, datemode, out);
+    return out;
+}
+
+////
+// Render a text value; only the fourth section (or a lone "@" section) applies.
+EXPORT
+void
+render_text_into(const Program& prog, const std::string& text, std::string& out)
+{
+    const Section* sec = nullptr;
+    if (prog.sections.size() >= 4) {
+        sec = &prog.sections[3];
+    } else if (!prog.sections.empty() && prog.sections.back().is_text) {
+        sec = &prog.sections.back();
+    }
+    if (sec == nullptr) {
+        out += text;
+        return;
+    }
+    for (const Instr& in: sec->code) {
+        if (in.op == OP_LITERAL) out.append(prog.pool, in.arg, in.n);
+        else if (in.op == OP_TEXT) out += text;
+    }
+}
+
+////
+// Render n values through one program.
+// out is resized to n; its strings are cleared and refilled so
+// their capacity carries over from one batch to the next.
+EXPORT
+void
+render_batch(const Program& prog, const double* values, size_t n, int datemode,
+             std::vector<std::string>& out)
+{
+    out.resize(n);
+    std::string int_part, frac_part;
+    for (size_t i = 0; i < n; ++i) {
+        out[i].clear();
+        render_into(prog, values[i], datemode, out[i], int_part, frac_part);
+    }
+}
+
+// === Per-book cache ===
+
+////
+// Compiled programs for the formats of one Book, keyed by format_key.
+// Each format string is compiled the first time a cell needs it.
+// <br />Not thread-safe; use one Formatter per thread.
+class Formatter
+{
+public:
+    Formatter(const formatting::FormattingDelegate& book, int datemode)
+    : _book(book), _datemode(datemode) {}
+
+    const Program& program_for_format_key(int format_key) {
+        auto it = _programs.find(format_key);
+        if (it != _programs.end()) {
+            return it->second;
+        }
+        auto fit = _book.format_map.find(format_key);
+        Program prog = compile(fit == _book.format_map.end() ? "General" : fit->second.format_str);
+        return _programs.emplace(format_key, std::move(prog)).first->second;
+    }
+
+    const Program& program_for_xf_index(int xf_index) {
+        if (xf_index == _last_xf_index && _last_program != nullptr) {
+            return *_last_program;
+        }
+        int format_key = 0;  // "General"
+        if (0 <= xf_index && xf_index < int(_book.xf_list.size())) {
+            format_key = _book.xf_list[size_t(xf_index)].format_key;
+        }
+        _last_program = &this->program_for_format_key(format_key);
+        _last_xf_index = xf_index;
+        return *_last_program;
+    }
+
+    void render_into(double value, int xf_index, std::string& out) {
+        numfmt::render_into(this->program_for_xf_index(xf_index), value, _datemode,
+                            out, _int_part, _frac_part);
+    }
+
+    std::string render(double value, int xf_index) {
+        std::string out;
+        this->render_into(value, xf_index, out);
+        return out;
+    }
+
+    ////
+    // Render a column of numbers with their cell XF indexes.
+    // Runs of equal xf_index (the usual case in a column) share one lookup.
+    void render_column(const double* values, const int* xf_indexes, size_t n,
+                       std::vector<std::string>& out) {
+        out.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            out[i].clear();
+            this->render_into(values[i], xf_indexes[i], out[i]);
+        }
+    }
+
+    int datemode() const { return _datemode; }
+
+private:
+    const formatting::FormattingDelegate& _book;
+    int _datemode;
+    MAP<int, Program> _programs;
+    int _last_xf_index = -1;
+    const Program* _last_program = nullptr;
+    std::string _int_part;
+    std::string _frac_part;
+};
+
+}  // namespace numfmt
+}  // namespace xlrd
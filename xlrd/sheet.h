@@ -28,11 +28,16 @@
 // 2007-07-11 SJM Allow for BIFF2/3-style FORMAT record in BIFF4/8 file
 // 2007-04-22 SJM Remove experimental "trimming" facility.
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
 #include <vector>
 
 #include "./biffh.h"  // __all__
 #include "./formula.h"  // dump_formula, decompile_formula, rangename2d, FMLA_TYPE_CELL, FMLA_TYPE_SHARED
 #include "./formatting.h"  // nearest_colour_index, Format
+#include "./xldate.h"  // xldate_as_epoch_micros
 
 namespace xlrd {
 namespace sheet {
@@ -52,6 +57,23 @@ const auto& XL_CELL_BOOLEAN = biffh::XL_CELL_BOOLEAN;
 const auto& XL_CELL_ERROR = biffh::XL_CELL_ERROR;
 const auto& XL_CELL_BLANK = biffh::XL_CELL_BLANK;
 
+////
+// ctype for Sheet::put_cell meaning "a number; DATE or NUMBER according to
+// its XF" (None in the Python original).
+const int XL_CELL_FROM_XF = -1;
+
+////
+// Sheet::cell_timestamp() of a cell that is not a valid date.
+const int64_t XL_NO_TIMESTAMP = INT64_MIN;
+
+////
+// Storage is preallocated from the declared dimensions only up to this
+// many rows and columns (the BIFF 8 limits). An xlsx <dimension> can claim
+// the whole of A1:XFD1048576; beyond these, storage grows from the cells
+// actually stored.
+const int DIMENSIONS_TRUSTED_ROWS = 65536;
+const int DIMENSIONS_TRUSTED_COLS = 256;
+
 
 const int DEBUG = 0;
 const int OBJ_MSO_DEBUG = 0;
@@ -91,7 +113,21 @@ public:
     int verbosity;
     int formatting_info;
     int ragged_rows;
-    std::map<int, int>* _xf_index_to_xl_type_map;
+    const std::vector<uint8_t>* _xf_index_to_xl_type_map = nullptr;
+    ////
+    // The table Sheet::put_cell classifies number cells by (see
+    // formatting::xl_type_from_xf_index()), looked up when a sheet is made.
+    // Book overrides this to return its own table rather than keep a
+    // pointer to it, which copying or moving the Book would leave dangling.
+    virtual const std::vector<uint8_t>* xf_index_to_xl_type_map() const {
+        return this->_xf_index_to_xl_type_map;
+    }
+    virtual ~SheetOwnerInterface() {}
+    ////
+    // If true, sheets convert their date cells to timestamps while they are
+    // loaded; see Sheet::cell_timestamp(). Set it before loading.
+    int date_timestamps = 0;
+    int datemode = 0; // Book.datemode
     int _maxdatarowx = -1; // highest rowx containing a non-empty cell
     int _maxdatacolx = -1; // highest colx containing a non-empty cell
     int _dimnrows = 0; // as per DIMENSIONS record
@@ -346,14 +382,18 @@ public:
     int verbosity;
     int formatting_info;
     int ragged_rows;
-    std::map<int, int>* _xf_index_to_xl_type_map;
+    const std::vector<uint8_t>* _xf_index_to_xl_type_map = nullptr;
+    int date_timestamps;
+    int datemode;
     int _maxdatarowx = -1; // highest rowx containing a non-empty cell
     int _maxdatacolx = -1; // highest colx containing a non-empty cell
     int _dimnrows = 0; // as per DIMENSIONS record
     int _dimncols = 0;
-    std::vector<utils::any> _cell_values;
-    std::vector<utils::any> _cell_types;
-    std::vector<int> _cell_xf_indexes;
+    int _ncols_allocated = 0; // width of the unragged rows, >= ncols
+    std::vector<std::vector<utils::any>> _cell_values;
+    std::vector<std::vector<int>> _cell_types;
+    std::vector<std::vector<int>> _cell_xf_indexes;
+    std::vector<std::vector<int64_t>> _cell_timestamps; // only if date_timestamps
     std::vector<int> _xf_index_stats;
 
     // _WINDOW2_options
@@ -394,6 +434,13 @@ public:
     int utter_max_rows;
     int utter_max_cols;
     int _first_full_rowx;
+    // The formula cell whose string result is being read: see
+    // put_formula_string(). _string_nchars_left is -1 between strings.
+    int _string_rowx = -1;
+    int _string_colx = -1;
+    int _string_xf_index = -1;
+    int _string_nchars_left = -1;
+    std::string _string_buf;
 
     inline
     Sheet(SheetOwnerInterface& owner, int position, std::string name, int number)
@@ -410,16 +457,20 @@ public:
         this->formatting_info = owner.formatting_info;
         this->ragged_rows = owner.ragged_rows;
 
-        this->_xf_index_to_xl_type_map = owner._xf_index_to_xl_type_map;
+        this->_xf_index_to_xl_type_map = owner.xf_index_to_xl_type_map();
+        this->date_timestamps = owner.date_timestamps;
+        this->datemode = owner.datemode;
         this->nrows = 0; // actual, including possibly empty cells
         this->ncols = 0;
         this->_maxdatarowx = -1; // highest rowx containing a non-empty cell
         this->_maxdatacolx = -1; // highest colx containing a non-empty cell
         this->_dimnrows = 0; // as per DIMENSIONS record
         this->_dimncols = 0;
+        this->_ncols_allocated = 0;
         this->_cell_values = {};
         this->_cell_types = {};
         this->_cell_xf_indexes = {};
+        this->_cell_timestamps = {};
         this->defcolwidth = -1;
         this->standardwidth = -1;
         this->default_row_height = 0;
@@ -577,6 +628,34 @@ public:
     // Returns a slice of the types of the cells in the given column.
     std::vector<int> col_types(int colx, int start_rowx=0, int end_rowx=-1);
 
+    ////
+    // Timestamp of the cell in the given row and column: microseconds since
+    // the Unix epoch, from its value and Book.datemode, if it is an
+    // XL_CELL_DATE cell, else XL_NO_TIMESTAMP.
+    // <br />A time (0.0 <= value < 1.0) gives just the time of day; a value
+    // xldate_as_tuple would reject gives XL_NO_TIMESTAMP.
+    // <br />Populated only if Book.date_timestamps was set before loading;
+    // the conversion is done as each cell is stored.
+    int64_t cell_timestamp(int rowx, int colx) {
+        const auto& row = this->_cell_timestamps.at(rowx);
+        return colx < (int)row.size() ? row[colx] : XL_NO_TIMESTAMP;
+    }
+
+    ////
+    // Returns a slice of the timestamps of the cells in the given column;
+    // see cell_timestamp().
+    std::vector<int64_t> col_timestamps(int colx, int start_rowx=0, int end_rowx=-1) {
+        if (end_rowx < 0) {
+            end_rowx = this->nrows;
+        }
+        std::vector<int64_t> result;
+        result.reserve(std::max(0, end_rowx - start_rowx));
+        for (int rowx = start_rowx; rowx < end_rowx; rowx++) {
+            result.push_back(this->cell_timestamp(rowx, colx));
+        }
+        return result;
+    }
+
     ////
     // Returns a sequence of the {@link //Cell} objects in the given column.
     std::vector<Cell> col(int colx);
@@ -584,35 +663,196 @@ public:
     // === Following methods are used in building the worksheet.
     // === They are not part of the API.
 
-    void tidy_dimensions();
+    inline
+    void tidy_dimensions() {
+        if (!this->ragged_rows && this->_ncols_allocated > this->ncols) {
+            // Drop the spare width left by extend_cells_unragged().
+            for (int rowx = 0; rowx < this->nrows; rowx++) {
+                this->_cell_types[rowx].resize(this->ncols);
+                this->_cell_values[rowx].resize(this->ncols);
+                if (this->formatting_info) {
+                    this->_cell_xf_indexes[rowx].resize(this->ncols);
+                }
+                if (this->date_timestamps) {
+                    this->_cell_timestamps[rowx].resize(this->ncols);
+                }
+            }
+            this->_ncols_allocated = this->ncols;
+        }
+    }
 
     inline
     void put_cell(int rowx, int colx, int ctype, utils::any value, int xf_index) {
+        if (ctype == XL_CELL_FROM_XF) {
+            // we have a number, so look up the cell type
+            ctype = this->_xf_index_to_xl_type_map == nullptr
+                ? (int)XL_CELL_NUMBER
+                : formatting::xl_type_from_xf_index(*this->_xf_index_to_xl_type_map, xf_index);
+        }
         if (this->ragged_rows) {
             this->put_cell_ragged(rowx, colx, ctype, value, xf_index);
         }
         else {
             this->put_cell_unragged(rowx, colx, ctype, value, xf_index);
         }
+        if (this->date_timestamps) {
+            int64_t timestamp = XL_NO_TIMESTAMP;
+            if (ctype == XL_CELL_DATE && value.is<double>()) {
+                int64_t micros;
+                if (xldate::xldate_as_epoch_micros(value.unsafe_cast<double>(), this->datemode, micros)) {
+                    timestamp = micros;
+                }
+            }
+            this->_cell_timestamps[rowx][colx] = timestamp;
+        }
     };
 
     inline
     void put_cell_ragged(int rowx, int colx, int ctype, utils::any value, int xf_index)
     {
-
+        if (rowx >= this->nrows) {
+            ASSERT(rowx < this->utter_max_rows);
+            this->_reserve_rows(rowx + 1);
+            this->_cell_types.resize(rowx + 1);
+            this->_cell_values.resize(rowx + 1);
+            if (this->formatting_info) {
+                this->_cell_xf_indexes.resize(rowx + 1);
+            }
+            if (this->date_timestamps) {
+                this->_cell_timestamps.resize(rowx + 1);
+            }
+            this->nrows = rowx + 1;
+        }
+        auto& types_row = this->_cell_types[rowx];
+        if (colx >= (int)types_row.size()) {
+            ASSERT(colx < this->utter_max_cols);
+            types_row.resize(colx + 1, XL_CELL_EMPTY);
+            this->_cell_values[rowx].resize(colx + 1);
+            if (this->formatting_info) {
+                this->_cell_xf_indexes[rowx].resize(colx + 1, -1);
+            }
+            if (this->date_timestamps) {
+                this->_cell_timestamps[rowx].resize(colx + 1, XL_NO_TIMESTAMP);
+            }
+            if (colx >= this->ncols) {
+                this->ncols = colx + 1;
+            }
+        }
+        types_row[colx] = ctype;
+        this->_cell_values[rowx][colx] = value;
+        if (this->formatting_info) {
+            this->_cell_xf_indexes[rowx][colx] = xf_index;
+        }
     }
 
     inline
     void put_cell_unragged(int rowx, int colx, int ctype, utils::any value, int xf_index)
     {
-        
+        if (rowx >= this->nrows || colx >= this->ncols) {
+            this->extend_cells_unragged(rowx + 1, colx + 1);
+        }
+        this->_cell_types[rowx][colx] = ctype;
+        this->_cell_values[rowx][colx] = value;
+        if (this->formatting_info) {
+            this->_cell_xf_indexes[rowx][colx] = xf_index;
+        }
+    }
+
+    ////
+    // Grows the unragged cell arrays to at least nr rows of nc cells.
+    // <p>Storage is sized from the DIMENSIONS record (_dimnrows/_dimncols)
+    // when it is seen first, capped at DIMENSIONS_TRUSTED_ROWS and
+    // DIMENSIONS_TRUSTED_COLS: the row list is reserved for _dimnrows rows
+    // and every row is allocated _dimncols wide, so loading a sheet whose
+    // DIMENSIONS are honest widens no row and reallocates the row list once.
+    // If a cell lies outside the allocated extent, the allocated width grows
+    // geometrically (every existing row is widened) and the row list grows
+    // as a std::vector does. tidy_dimensions() trims rows back to ncols.
+    // Empty cells hold a null value, which costs no allocation.</p>
+    inline
+    void extend_cells_unragged(int nr, int nc)
+    {
+        ASSERT(1 <= nc && nc <= this->utter_max_cols);
+        ASSERT(1 <= nr && nr <= this->utter_max_rows);
+        if (nc > this->_ncols_allocated) {
+            int alloc = std::max(nc, std::min({this->_dimncols, this->utter_max_cols,
+                                               DIMENSIONS_TRUSTED_COLS}));
+            if (this->_ncols_allocated > 0) {
+                // DIMENSIONS understated the width
+                alloc = std::max(alloc, std::min(2 * this->_ncols_allocated, this->utter_max_cols));
+            }
+            for (int rowx = 0; rowx < this->nrows; rowx++) {
+                this->_cell_types[rowx].resize(alloc, XL_CELL_EMPTY);
+                this->_cell_values[rowx].resize(alloc);
+                if (this->formatting_info) {
+                    this->_cell_xf_indexes[rowx].resize(alloc, -1);
+                }
+                if (this->date_timestamps) {
+                    this->_cell_timestamps[rowx].resize(alloc, XL_NO_TIMESTAMP);
+                }
+            }
+            this->_ncols_allocated = alloc;
+        }
+        if (nc > this->ncols) {
+            this->ncols = nc;
+        }
+        if (nr > this->nrows) {
+            this->_reserve_rows(nr);
+            const int alloc = this->_ncols_allocated;
+            for (int rowx = this->nrows; rowx < nr; rowx++) {
+                this->_cell_types.emplace_back(alloc, (int)XL_CELL_EMPTY);
+                this->_cell_values.emplace_back(alloc);
+                if (this->formatting_info) {
+                    this->_cell_xf_indexes.emplace_back(alloc, -1);
+                }
+                if (this->date_timestamps) {
+                    this->_cell_timestamps.emplace_back(alloc, XL_NO_TIMESTAMP);
+                }
+            }
+            this->nrows = nr;
+        }
+    }
+
+    inline
+    void _reserve_rows(int nr)
+    {
+        if (this->_cell_types.capacity() == 0) {
+            size_t n = std::max(nr, std::min({this->_dimnrows, this->utter_max_rows,
+                                              DIMENSIONS_TRUSTED_ROWS}));
+            this->_cell_types.reserve(n);
+            this->_cell_values.reserve(n);
+            if (this->formatting_info) {
+                this->_cell_xf_indexes.reserve(n);
+            }
+            if (this->date_timestamps) {
+                this->_cell_timestamps.reserve(n);
+            }
+        }
     }
 
     // === Methods after this line neither know nor care about how cells are stored.
 
     int read(void* bk);
 
-    void string_record_contents(std::vector<uint8_t> data);
+    ////
+    // Stores the cached result of the FORMULA record data: the 8-byte
+    // result field is read and the tokens after it are not looked at, so a
+    // formula cell costs about what a NUMBER or BOOLERR cell does.
+    // <p>Returns 1 if the result is a string. The text is in the STRING
+    // record that follows (after an ARRAY, SHRFMLA or TABLE record, if any);
+    // pass it to put_formula_string().</p>
+    inline int put_formula_result(const u8vec& data);
+
+    ////
+    // Stores the text of the STRING record data as the value of the formula
+    // cell last given to put_formula_result(). Returns the number of
+    // characters still to come: while it is not 0, pass each following
+    // CONTINUE record here too; the cell is stored with the last of them.
+    inline int put_formula_string(const u8vec& data);
+
+    ////
+    // The text of a STRING record that has no CONTINUE records.
+    inline std::string string_record_contents(const u8vec& data);
 
     void update_cooked_mag_factors();
 
@@ -813,6 +1053,208 @@ double unpack_RK(u8vec rk_str) {
     }
 }
 
+////
+// The cached result of a FORMULA record; see unpack_formula_result().
+struct FormulaResult {
+    int rowx;
+    int colx;
+    int xf_index;
+    // XL_CELL_FROM_XF for a number, XL_CELL_BOOLEAN, XL_CELL_ERROR, or
+    // XL_CELL_TEXT: empty text, or the contents of the next STRING record
+    // if string_follows
+    int ctype;
+    double number;
+    int code;  // XL_CELL_BOOLEAN, XL_CELL_ERROR: the value
+    int string_follows;
+};
+
+////
+// Reads the cell address, XF index and cached result of the FORMULA
+// record data; the formula tokens are skipped. BIFF 2 records give the XF
+// slot of their cell attributes (_ixfe if it is 63, as for BIFF 2.1).
+inline FormulaResult
+unpack_formula_result(const u8vec& data, int bv, int ixfe=0)
+{
+    if (data.size() < 16) {
+        throw biffh::XLRDError("FORMULA record too short");
+    }
+    FormulaResult res;
+    int pos;
+    if (bv >= 30) {
+        // rowx, colx, xf_index, result_str, flags = unpack('<HHH8sH', data[0:16])
+        res.xf_index = utils::as_uint16(data, 4);
+        pos = 6;
+    } else {
+        // rowx, colx, cell_attr, result_str, flags = unpack('<HH3s8sB', data[0:16])
+        res.xf_index = data[4] & 0x3F;
+        if (res.xf_index == 0x3F) {
+            res.xf_index = ixfe;
+        }
+        pos = 7;
+    }
+    res.rowx = utils::as_uint16(data, 0);
+    res.colx = utils::as_uint16(data, 2);
+    res.number = 0.0;
+    res.code = 0;
+    res.string_follows = 0;
+    if (data[pos+6] != 0xFF || data[pos+7] != 0xFF) {
+        res.ctype = XL_CELL_FROM_XF;
+        memcpy(&res.number, &data[pos], 8);
+        return res;
+    }
+    int first_byte = data[pos];
+    if (first_byte == 0) {
+        // need to read next record (STRING)
+        res.ctype = XL_CELL_TEXT;
+        res.string_follows = 1;
+    } else if (first_byte == 1) { // boolean
+        res.ctype = XL_CELL_BOOLEAN;
+        res.code = data[pos+2];
+    } else if (first_byte == 2) { // error
+        res.ctype = XL_CELL_ERROR;
+        res.code = data[pos+2];
+    } else if (first_byte == 3) { // empty
+        res.ctype = XL_CELL_TEXT;
+    } else {
+        throw biffh::XLRDError("unexpected special case (" + std::to_string(first_byte)
+                               + ") in FORMULA");
+    }
+    return res;
+}
+
+////
+// Appends the characters of a STRING record, or of one of its CONTINUE
+// records if nchars_left >= 0, to out, converting BIFF 8 text to UTF-8
+// straight from the record; earlier versions keep the bytes, as unicode()
+// does. Returns the number of characters still to come.
+inline int
+append_string_record_contents(std::string& out, const u8vec& data, int bv,
+                              int nchars_left=-1)
+{
+    int size = data.size();
+    int pos = 0;
+    if (nchars_left < 0) {
+        // nchars_expected = unpack("<" + "BH"[lenlen - 1], data[:lenlen])[0]
+        int lenlen = (bv >= 30) + 1;
+        if (size < lenlen) {
+            throw biffh::XLRDError("STRING record too short");
+        }
+        nchars_left = lenlen == 1 ? data[0] : utils::as_uint16(data, 0);
+        pos = lenlen;
+    }
+    if (bv < 80) {
+        int n = std::min(nchars_left, size - pos);
+        out.append((const char*)data.data() + pos, n);
+        return nchars_left - n;
+    }
+    if (nchars_left == 0) {
+        return 0;
+    }
+    if (pos >= size) {
+        throw biffh::XLRDError("STRING record too short");
+    }
+    int flag = data[pos] & 1;
+    pos += 1;
+    if (!flag) {
+        // latin_1
+        int n = std::min(nchars_left, size - pos);
+        for (int i = 0; i < n; ++i) {
+            uint8_t c = data[pos+i];
+            if (c < 0x80) {
+                out.push_back((char)c);
+            } else {
+                out.push_back((char)(0xC0 | (c >> 6)));
+                out.push_back((char)(0x80 | (c & 0x3F)));
+            }
+        }
+        return nchars_left - n;
+    }
+    // utf_16_le
+    int n = std::min(nchars_left, (size - pos) / 2);
+    for (int i = 0; i < n; ++i, pos += 2) {
+        uint32_t cp = data[pos] | (data[pos+1] << 8);
+        if (0xD800 <= cp && cp < 0xDC00 && i + 1 < n) {
+            uint32_t lo = data[pos+2] | (data[pos+3] << 8);
+            if (0xDC00 <= lo && lo < 0xE000) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                pos += 2;
+                ++i;
+            }
+        }
+        if (cp < 0x80) {
+            out.push_back((char)cp);
+        } else if (cp < 0x800) {
+            out.push_back((char)(0xC0 | (cp >> 6)));
+            out.push_back((char)(0x80 | (cp & 0x3F)));
+        } else if (cp < 0x10000) {
+            out.push_back((char)(0xE0 | (cp >> 12)));
+            out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back((char)(0x80 | (cp & 0x3F)));
+        } else {
+            out.push_back((char)(0xF0 | (cp >> 18)));
+            out.push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+            out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back((char)(0x80 | (cp & 0x3F)));
+        }
+    }
+    return nchars_left - n;
+}
+
+inline int
+Sheet::put_formula_result(const u8vec& data)
+{
+    FormulaResult res = unpack_formula_result(data, this->biff_version, this->_ixfe);
+    if (res.ctype == XL_CELL_FROM_XF) {
+        this->put_cell(res.rowx, res.colx, XL_CELL_FROM_XF, res.number, res.xf_index);
+        return 0;
+    }
+    if (res.ctype != XL_CELL_TEXT) {
+        // XL_CELL_BOOLEAN, XL_CELL_ERROR
+        this->put_cell(res.rowx, res.colx, res.ctype, res.code, res.xf_index);
+        return 0;
+    }
+    if (!res.string_follows) {
+        this->put_cell(res.rowx, res.colx, XL_CELL_TEXT, std::string(""), res.xf_index);
+        return 0;
+    }
+    this->_string_rowx = res.rowx;
+    this->_string_colx = res.colx;
+    this->_string_xf_index = res.xf_index;
+    this->_string_nchars_left = -1;
+    return 1;
+}
+
+inline int
+Sheet::put_formula_string(const u8vec& data)
+{
+    if (this->_string_rowx < 0) {
+        throw biffh::XLRDError("STRING record without a FORMULA record with a string result");
+    }
+    if (this->_string_nchars_left < 0) {
+        this->_string_buf.clear();
+    }
+    this->_string_nchars_left = append_string_record_contents(
+        this->_string_buf, data, this->biff_version, this->_string_nchars_left);
+    if (this->_string_nchars_left > 0) {
+        return this->_string_nchars_left;
+    }
+    this->put_cell(this->_string_rowx, this->_string_colx, XL_CELL_TEXT,
+                   this->_string_buf, this->_string_xf_index);
+    this->_string_rowx = -1;
+    this->_string_nchars_left = -1;
+    return 0;
+}
+
+inline std::string
+Sheet::string_record_contents(const u8vec& data)
+{
+    std::string result;
+    if (append_string_record_contents(result, data, this->biff_version) > 0) {
+        throw biffh::XLRDError("STRING record continues in a CONTINUE record");
+    }
+    return result;
+}
+
 ////////// =============== Cell ======================================== //////////
 const std::map<int, int>
 cellty_from_fmtty = {
@@ -8,6 +8,7 @@
 
 #include "./utils/types.h"
 #include "./utils/str.h"
+#include "./utils/parse.h"
 
 #define MAP std::unordered_map
 #define TIE std::tie
@@ -120,47 +121,47 @@ public:
     }
 };
 
-uint8_t as_uint8(std::vector<uint8_t> vec, int pos=0) {
+uint8_t as_uint8(const std::vector<uint8_t>& vec, int pos=0) {
     return vec[pos];
 }
 
-uint16_t as_uint16(std::vector<uint8_t> vec, int pos=0) {
+uint16_t as_uint16(const std::vector<uint8_t>& vec, int pos=0) {
     // = unpack("<H", vec[pos:])
     return vec[pos] | (vec[pos+1] << 8);
 }
 
-uint16_t as_uint16be(std::vector<uint8_t> vec, int pos=0) {
+uint16_t as_uint16be(const std::vector<uint8_t>& vec, int pos=0) {
     // = unpack(">H", vec[pos:])
     return (vec[pos] << 8) | vec[pos+1];
 }
 
-int16_t as_int16(std::vector<uint8_t> vec, int pos=0) {
+int16_t as_int16(const std::vector<uint8_t>& vec, int pos=0) {
     // = unpack("<h", vec[pos:])
     return vec[pos] | (vec[pos+1] << 8);
 }
 
-int16_t as_int16be(std::vector<uint8_t> vec, int pos=0) {
+int16_t as_int16be(const std::vector<uint8_t>& vec, int pos=0) {
     // = unpack(">h", vec[pos:])
     return (vec[pos] << 8) | vec[pos+1];
 }
 
-uint32_t as_uint32(std::vector<uint8_t> vec, int pos=0) {
+uint32_t as_uint32(const std::vector<uint8_t>& vec, int pos=0) {
     return vec[pos] | (vec[pos+1] << 8) | (vec[pos+2] << 16) | (vec[pos+3] << 24);
 }
 
-uint32_t as_uint32be(std::vector<uint8_t> vec, int pos=0) {
+uint32_t as_uint32be(const std::vector<uint8_t>& vec, int pos=0) {
     return (vec[pos] << 24) | (vec[pos+1] << 16) | (vec[pos+2] << 8) | vec[pos+3];
 }
 
-int32_t as_int32(std::vector<uint8_t> vec, int pos=0) {
+int32_t as_int32(const std::vector<uint8_t>& vec, int pos=0) {
     return vec[pos] | (vec[pos+1] << 8) | (vec[pos+2] << 16) | (vec[pos+3] << 24);
 }
 
-int32_t as_int32be(std::vector<uint8_t> vec, int pos=0) {
+int32_t as_int32be(const std::vector<uint8_t>& vec, int pos=0) {
     return (vec[pos] << 24) | (vec[pos+1] << 16) | (vec[pos+2] << 8) | vec[pos+3];
 }
 
-double as_double(std::vector<uint8_t> vec, int pos=0) {
+double as_double(const std::vector<uint8_t>& vec, int pos=0) {
     return *(double*)&vec[pos];
 }
 
@@ -143,8 +143,9 @@ template<class ...A>
 inline
 std::string format_(const char* fmt, A...a){
     int n = ::snprintf(nullptr, 0, fmt, a...);
-    std::string buf(0, n + 1);
+    std::string buf(n + 1, '\0');
     ::snprintf(&buf[0], n+1, fmt, a...);
+    buf.resize(n);
     return buf;
 }
 
@@ -213,30 +214,33 @@ std::string repr(std::tuple<T...> t) {
     return repr_tuple_impl(t, make_seq<sizeof...(T)-1>{});
 }
 
-template<class A, class R>
-auto tocharptr(A a) -> R;
-
-template<>
-auto tocharptr(const std::string& a)
--> const char* {
-    return a.c_str();
-};
+// format() arguments go through two steps: containers are rendered with
+// repr() into temporaries that live until format_() returns, then strings
+// are passed on to snprintf as const char*.
+template<class A>
+const A& format_arg(const A& a) {
+    return a;
+}
 
 template<class V>
-auto tocharptr(const std::vector<V>& a)
--> const char* {
-    return repr(a).c_str();
-};
+std::string format_arg(const std::vector<V>& a) {
+    return repr(a);
+}
+
+inline
+const char* tocharptr(const std::string& a) {
+    return a.c_str();
+}
 
 template<class A>
-auto tocharptr(A a) -> A {
+const A& tocharptr(const A& a) {
     return a;
-};
+}
 
 template<class ...A>
 inline
-std::string format(const char* fmt, A...a){
-    return format(fmt, tocharptr(a)...);
+std::string format(const char* fmt, const A&...a){
+    return format_(fmt, tocharptr(format_arg(a))...);
 }
 
 inline
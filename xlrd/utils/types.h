@@ -96,7 +96,7 @@ public:
 
     template<class T>
     const bool is() const {
-        return typeid(T) == m_obj->type();
+        return typeid(T) == this->type();
     }
 
     const std::type_info& type () const {
@@ -111,11 +111,11 @@ public:
     }
 
     const bool is_str() const {
-        return typeid(std::string) == m_obj->type();
+        return typeid(std::string) == this->type();
     }
 
     const bool is_int() const {
-        auto& type = m_obj->type();
+        auto& type = this->type();
         return (
             typeid(int) == type ||
             typeid(uint32_t) == type ||
@@ -129,7 +129,7 @@ public:
     }
 
     const bool is_double() const {
-        auto& type = m_obj->type();
+        auto& type = this->type();
         return (
             typeid(double) == type ||
             typeid(float) == type
@@ -1,105 +1,388 @@
 #pragma once
+// -*- coding: cp1252 -*-
+
+// No part of the content of this file was derived from the works of David Giffin.
+
+////
+// <p>Copyright  2005-2008 Stephen John Machin, Lingfo Pty Ltd</p>
+// <p>This module is part of the xlrd package, which is released under a BSD-style licence.</p>
+//
+// <p>Provides function(s) for dealing with Microsoft Excel  dates.</p>
+////
+
+// 2008-10-18 SJM Fix bug in xldate_from_date_tuple (affected some years after 2099)
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <exception>
+
+#include "./utils.h"
+
+namespace xlrd {
+namespace xldate {
+
+// The conversion from days to (year, month, day) starts with
+// an integral "julian day number" aka JDN.
+// FWIW, JDN 0 corresponds to noon on Monday November 24 in Gregorian year -4713.
+// More importantly:
+//    Noon on Gregorian 1900-03-01 (day 61 in the 1900-based system) is JDN 2415080.0
+//    Noon on Gregorian 1904-01-02 (day  1 in the 1904-based system) is JDN 2416482.0
+
+const int _JDN_delta[2] = {2415080 - 61, 2416482 - 1};
+
+class XLDateError : public std::runtime_error
+{
+public:
+    XLDateError(const char* msg) : std::runtime_error(msg) {};
+    XLDateError(std::string msg) : std::runtime_error(msg.c_str()) {};
+};
+
+class XLDateNegative : public XLDateError { using XLDateError::XLDateError; };
+class XLDateAmbiguous : public XLDateError { using XLDateError::XLDateError; };
+class XLDateTooLarge : public XLDateError { using XLDateError::XLDateError; };
+class XLDateBadDatemode : public XLDateError { using XLDateError::XLDateError; };
+class XLDateBadTuple : public XLDateError { using XLDateError::XLDateError; };
+
+const int _XLDAYS_TOO_LARGE[2] = {2958466, 2958466 - 1462}; // This is equivalent to 10000-01-01
+
+////
+// Convert an Excel number (presumed to represent a date, a datetime or a time) into
+// a tuple suitable for feeding to datetime or mx.DateTime constructors.
+// @param xldate The Excel number
+// @param datemode 0: 1900-based, 1: 1904-based.
+// <br>WARNING: when using this function to
+// interpret the contents of a workbook, you should pass in the Book.datemode
+// attribute of that workbook. Whether
+// the workbook has ever been anywhere near a Macintosh is irrelevant.
+// @return Gregorian (year, month, day, hour, minute, nearest_second).
+// <br>Special case: if 0.0 <= xldate < 1.0, it is assumed to represent a time;
+// (0, 0, 0, hour, minute, second) will be returned.
+// <br>Note: 1904-01-01 is not regarded as a valid date in the datemode 1 system; its "serial number"
+// is zero.
+// @throws XLDateNegative xldate < 0.00
+// @throws XLDateAmbiguous The 1900 leap-year problem (datemode == 0 and 1.0 <= xldate < 61.0)
+// @throws XLDateTooLarge Gregorian year 10000 or later
+// @throws XLDateBadDatemode datemode arg is neither 0 nor 1
+// @throws XLDateError Covers the 4 specific errors
+EXPORT
+std::tuple<int, int, int, int, int, int>
+xldate_as_tuple(double xldate, int datemode)
+{
+    if (datemode != 0 && datemode != 1) {
+        throw XLDateBadDatemode(std::to_string(datemode));
+    }
+    if (xldate == 0.00) {
+        return std::make_tuple(0, 0, 0, 0, 0, 0);
+    }
+    if (xldate < 0.00) {
+        throw XLDateNegative(std::to_string(xldate));
+    }
+    // the int conversion below must not overflow; anything this big is year >= 10000
+    if (!(xldate < _XLDAYS_TOO_LARGE[datemode])) {
+        throw XLDateTooLarge(std::to_string(xldate));
+    }
+    int xldays = int(xldate);
+    double frac = xldate - xldays;
+    int seconds = int(std::round(frac * 86400.0));
+    ASSERT(0 <= seconds && seconds <= 86400);
+    int hour, minute, second;
+    if (seconds == 86400) {
+        hour = minute = second = 0;
+        xldays += 1;
+    } else {
+        // second = seconds % 60; minutes = seconds // 60
+        int minutes = seconds / 60;
+        second = seconds % 60;
+        // minute = minutes % 60; hour    = minutes // 60
+        hour = minutes / 60;
+        minute = minutes % 60;
+    }
+    if (xldays >= _XLDAYS_TOO_LARGE[datemode]) {
+        throw XLDateTooLarge(std::to_string(xldate));
+    }
+
+    if (xldays == 0) {
+        return std::make_tuple(0, 0, 0, hour, minute, second);
+    }
+
+    if (xldays < 61 && datemode == 0) {
+        throw XLDateAmbiguous(std::to_string(xldate));
+    }
+
+    int jdn = xldays + _JDN_delta[datemode];
+    int yreg = ((((jdn * 4 + 274277) / 146097) * 3 / 4) + jdn + 1363) * 4 + 3;
+    int mp = ((yreg % 1461) / 4) * 535 + 333;
+    int d = ((mp % 16384) / 535) + 1;
+    // mp /= 16384
+    mp >>= 14;
+    if (mp >= 10) {
+        return std::make_tuple((yreg / 1461) - 4715, mp - 9, d, hour, minute, second);
+    } else {
+        return std::make_tuple((yreg / 1461) - 4716, mp + 3, d, hour, minute, second);
+    }
+}
+
+// === batch conversions
+
+// Days from 0000-03-01 (proleptic Gregorian) to Excel day 0, valid from
+// 1900-03-01 (day 61) in the 1900-based system.
+const uint32_t _CIVIL_delta[2] = {719468 - 25569, 719468 - 24107};
+// Milliseconds from the Unix epoch to Excel day 0.
+const int64_t _UNIX_delta_ms[2] = {-25569LL * 86400000, -24107LL * 86400000};
+
+////
+// Days since 0000-03-01 -> (year, month, day), after Neri and Schneider,
+// "Euclidean affine functions and their application to calendar algorithms".
+// Only divisions by constants, which compile to multiply-and-shift, and no
+// branches, so loops calling it vectorise.
+inline void
+_civil_from_days(uint32_t n, int& year, int& month, int& day)
+{
+    uint32_t n1 = 4 * n + 3;
+    uint32_t century = n1 / 146097;
+    uint32_t n2 = (n1 % 146097) | 3;
+    uint64_t p2 = uint64_t(2939745) * n2;
+    uint32_t z = uint32_t(p2 >> 32);
+    uint32_t day_of_year = uint32_t(p2) / 2939745 / 4;
+    uint32_t n3 = 2141 * day_of_year + 197913;
+    uint32_t m = n3 >> 16;
+    uint32_t j = day_of_year >= 306;
+    year = int(100 * century + z + j);
+    month = int(j ? m - 12 : m);
+    day = int((n3 & 0xFFFF) / 2141 + 1);
+}
+
+// The batch functions work in blocks of 64 values, one error word each.
+const size_t _BATCH_BLOCK = 64;
+
+// Copy a block to clean with negative, NaN and too large values replaced
+// by 0.0 and flagged in bad. Done apart from the conversion loop because
+// a double -> int conversion that depends on a compare keeps GCC from
+// vectorising that loop.
+inline void
+_sanitise_block(const double* xldates, size_t m, double too_large, double* clean, int* bad)
+{
+    for (size_t i = 0; i < m; ++i) {
+        double xldate = xldates[i];
+        bool ok = (xldate >= 0.0) & (xldate < too_large);
+        clean[i] = ok ? xldate : 0.0;
+        bad[i] = !ok;
+    }
+}
+
+// Per-datemode constants of _epoch_micros.
+struct _EpochMicrosLimits
+{
+    int64_t too_large_ms;
+    int64_t ambiguous_ms;
+    int64_t unix_delta_ms;
+
+    explicit _EpochMicrosLimits(int datemode)
+    : too_large_ms(int64_t(_XLDAYS_TOO_LARGE[datemode]) * 86400000)
+    , ambiguous_ms(datemode == 0 ? 61LL * 86400000 : 0)
+    , unix_delta_ms(_UNIX_delta_ms[datemode])
+    {}
+};
+
+// xldates_as_epoch_micros for one value already known to be >= 0.0 and
+// below _XLDAYS_TOO_LARGE; sets invalid instead of returning 0 for the
+// other values xldate_as_tuple rejects.
+inline int64_t
+_epoch_micros(double xldate, const _EpochMicrosLimits& limits, bool& invalid)
+{
+    // Truncating x + 0.5 rounds like std::round for x >= 0, and
+    // unlike std::round it is inlined.
+    int xldays = int(xldate);
+    int ms_of_day = int((xldate - xldays) * 86400000.0 + 0.5);
+    int64_t ms = int64_t(xldays) * 86400000 + ms_of_day;
+    bool is_time = ms < 86400000;
+    invalid = invalid | (ms >= limits.too_large_ms) | (!is_time & (ms < limits.ambiguous_ms));
+    return invalid ? 0 : (is_time ? ms : ms + limits.unix_delta_ms) * 1000;
+}
+
+////
+// Convert an Excel number to microseconds since the Unix epoch, as
+// xldates_as_epoch_micros does.
+// @param xldate The Excel number
+// @param datemode 0: 1900-based, 1: 1904-based.
+// @param micros Set to the result, or 0 if xldate is invalid.
+// @return false if xldate is one xldate_as_tuple would reject.
+// @throws XLDateBadDatemode datemode arg is neither 0 nor 1
+EXPORT
+bool
+xldate_as_epoch_micros(double xldate, int datemode, int64_t& micros)
+{
+    if (datemode != 0 && datemode != 1) {
+        throw XLDateBadDatemode(std::to_string(datemode));
+    }
+    bool invalid = !(xldate >= 0.0 && xldate < _XLDAYS_TOO_LARGE[datemode]);
+    micros = _epoch_micros(invalid ? 0.0 : xldate, _EpochMicrosLimits(datemode), invalid);
+    return !invalid;
+}
+
+inline int
+_popcount(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    int n = 0;
+    while (x) {
+        x &= x - 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+////
+// Convert n Excel numbers to microseconds since the Unix epoch, in one pass.
+// <p>Values are rounded to Excel's millisecond resolution, as
+// xldate_as_datetime does. A time (0.0 <= xldate < 1.0) gives just the time
+// of day, as in the (0, 0, 0, hour, minute, second) tuple of xldate_as_tuple.</p>
+// <p>Values xldate_as_tuple would reject -- negative or NaN, the 1900
+// leap-year problem (datemode == 0 and 1.0 <= xldate < 61.0), year 10000 or
+// later -- do not throw: their bit is set in errors and their result is 0.</p>
+// @param xldates The Excel numbers
+// @param n How many
+// @param datemode 0: 1900-based, 1: 1904-based.
+// @param out Resized to n.
+// @param errors Resized to (n + 63) / 64 words; bit i % 64 of word i / 64 is
+// set when xldates[i] is invalid.
+// @return The number of invalid values.
+// @throws XLDateBadDatemode datemode arg is neither 0 nor 1
+EXPORT
+size_t
+xldates_as_epoch_micros(const double* xldates, size_t n, int datemode,
+                        std::vector<int64_t>& out, std::vector<uint64_t>& errors)
+{
+    if (datemode != 0 && datemode != 1) {
+        throw XLDateBadDatemode(std::to_string(datemode));
+    }
+    out.resize(n);
+    errors.assign((n + _BATCH_BLOCK - 1) / _BATCH_BLOCK, 0);
+    const double too_large = _XLDAYS_TOO_LARGE[datemode];
+    const _EpochMicrosLimits limits(datemode);
+    double clean[_BATCH_BLOCK];
+    int bad[_BATCH_BLOCK];
+    size_t nbad = 0;
+    for (size_t base = 0; base < n; base += _BATCH_BLOCK) {
+        size_t m = std::min(n - base, _BATCH_BLOCK);
+        _sanitise_block(xldates + base, m, too_large, clean, bad);
+        int64_t* result = out.data() + base;
+        uint64_t word = 0;
+        for (size_t i = 0; i < m; ++i) {
+            bool invalid = bad[i];
+            result[i] = _epoch_micros(clean[i], limits, invalid);
+            word |= uint64_t(invalid) << i;
+        }
+        errors[base / _BATCH_BLOCK] = word;
+        nbad += _popcount(word);
+    }
+    return nbad;
+}
+
+////
+// The fields of xldate_as_tuple, as one array per field.
+struct XLDateFields
+{
+    std::vector<int16_t> year;
+    std::vector<uint8_t> month;
+    std::vector<uint8_t> day;
+    std::vector<uint8_t> hour;
+    std::vector<uint8_t> minute;
+    std::vector<uint8_t> second;
+};
+
+////
+// Convert n Excel numbers as xldate_as_tuple does, in one pass.
+// <p>Invalid values are reported as in xldates_as_epoch_micros; all their
+// fields are 0.</p>
+// @param xldates The Excel numbers
+// @param n How many
+// @param datemode 0: 1900-based, 1: 1904-based.
+// @param out Each array is resized to n.
+// @param errors Resized to (n + 63) / 64 words; bit i % 64 of word i / 64 is
+// set when xldates[i] is invalid.
+// @return The number of invalid values.
+// @throws XLDateBadDatemode datemode arg is neither 0 nor 1
+EXPORT
+size_t
+xldates_as_fields(const double* xldates, size_t n, int datemode,
+                  XLDateFields& out, std::vector<uint64_t>& errors)
+{
+    if (datemode != 0 && datemode != 1) {
+        throw XLDateBadDatemode(std::to_string(datemode));
+    }
+    out.year.resize(n);
+    out.month.resize(n);
+    out.day.resize(n);
+    out.hour.resize(n);
+    out.minute.resize(n);
+    out.second.resize(n);
+    errors.assign((n + _BATCH_BLOCK - 1) / _BATCH_BLOCK, 0);
+    const double too_large = _XLDAYS_TOO_LARGE[datemode];
+    const int too_large_days = _XLDAYS_TOO_LARGE[datemode];
+    const int ambiguous_days = datemode == 0 ? 61 : 1;
+    const uint32_t civil_delta = _CIVIL_delta[datemode];
+    double clean[_BATCH_BLOCK];
+    int bad[_BATCH_BLOCK];
+    int whole_days[_BATCH_BLOCK];
+    int day_seconds[_BATCH_BLOCK];
+    size_t nbad = 0;
+    for (size_t base = 0; base < n; base += _BATCH_BLOCK) {
+        size_t m = std::min(n - base, _BATCH_BLOCK);
+        _sanitise_block(xldates + base, m, too_large, clean, bad);
+        // Split from the loop below: GCC does not vectorise a loop mixing
+        // doubles with uint8_t stores.
+        for (size_t i = 0; i < m; ++i) {
+            int xldays = int(clean[i]);
+            int seconds = int((clean[i] - xldays) * 86400.0 + 0.5);
+            // seconds == 86400 carries into the next day
+            whole_days[i] = xldays + seconds / 86400;
+            day_seconds[i] = seconds % 86400;
+        }
+        // Raw pointers: stores through uint8_t* may alias the vectors themselves.
+        int16_t* years = out.year.data() + base;
+        uint8_t* months = out.month.data() + base;
+        uint8_t* days = out.day.data() + base;
+        uint8_t* hours = out.hour.data() + base;
+        uint8_t* minutes = out.minute.data() + base;
+        uint8_t* secs = out.second.data() + base;
+        uint64_t word = 0;
+        for (size_t i = 0; i < m; ++i) {
+            int xldays = whole_days[i];
+            bool is_time = xldays == 0;
+            bool invalid = bad[i] | (xldays >= too_large_days) | (!is_time & (xldays < ambiguous_days));
+            int year, month, day;
+            _civil_from_days(uint32_t(xldays) + civil_delta, year, month, day);
+            bool no_date = invalid | is_time;
+            years[i] = int16_t(no_date ? 0 : year);
+            months[i] = uint8_t(no_date ? 0 : month);
+            days[i] = uint8_t(no_date ? 0 : day);
+            int seconds = invalid ? 0 : day_seconds[i];
+            hours[i] = uint8_t(seconds / 3600);
+            minutes[i] = uint8_t(seconds / 60 % 60);
+            secs[i] = uint8_t(seconds % 60);
+            word |= uint64_t(invalid) << i;
+        }
+        errors[base / _BATCH_BLOCK] = word;
+        nbad += _popcount(word);
+    }
+    return nbad;
+}
 
 /*
-# -*- coding: cp1252 -*-
-
-# No part of the content of this file was derived from the works of David Giffin.
-
-##
-# <p>Copyright  2005-2008 Stephen John Machin, Lingfo Pty Ltd</p>
-# <p>This module is part of the xlrd package, which is released under a BSD-style licence.</p>
-#
-# <p>Provides function(s) for dealing with Microsoft Excel  dates.</p>
-##
-
-# 2008-10-18 SJM Fix bug in xldate_from_date_tuple (affected some years after 2099)
-
-# The conversion from days to (year, month, day) starts with
-# an integral "julian day number" aka JDN.
-# FWIW, JDN 0 corresponds to noon on Monday November 24 in Gregorian year -4713.
-# More importantly:
-#    Noon on Gregorian 1900-03-01 (day 61 in the 1900-based system) is JDN 2415080.0
-#    Noon on Gregorian 1904-01-02 (day  1 in the 1904-based system) is JDN 2416482.0
 import datetime
 
-_JDN_delta = (2415080 - 61, 2416482 - 1)
-assert _JDN_delta[1] - _JDN_delta[0] == 1462
-
 # Pre-calculate the datetime epochs for efficiency.
 epoch_1904 = datetime.datetime(1904, 1, 1)
 epoch_1900 = datetime.datetime(1899, 12, 31)
 epoch_1900_minus_1 = datetime.datetime(1899, 12, 30)
 
-class XLDateError(ValueError): pass
-
-class XLDateNegative(XLDateError): pass
-class XLDateAmbiguous(XLDateError): pass
-class XLDateTooLarge(XLDateError): pass
-class XLDateBadDatemode(XLDateError): pass
-class XLDateBadTuple(XLDateError): pass
-
-_XLDAYS_TOO_LARGE = (2958466, 2958466 - 1462) # This is equivalent to 10000-01-01
-
-##
-# Convert an Excel number (presumed to represent a date, a datetime or a time) into
-# a tuple suitable for feeding to datetime or mx.DateTime constructors.
-# @param xldate The Excel number
-# @param datemode 0: 1900-based, 1: 1904-based.
-# <br>WARNING: when using this function to
-# interpret the contents of a workbook, you should pass in the Book.datemode
-# attribute of that workbook. Whether
-# the workbook has ever been anywhere near a Macintosh is irrelevant.
-# @return Gregorian (year, month, day, hour, minute, nearest_second).
-# <br>Special case: if 0.0 <= xldate < 1.0, it is assumed to represent a time;
-# (0, 0, 0, hour, minute, second) will be returned.
-# <br>Note: 1904-01-01 is not regarded as a valid date in the datemode 1 system; its "serial number"
-# is zero.
-# @throws XLDateNegative xldate < 0.00
-# @throws XLDateAmbiguous The 1900 leap-year problem (datemode == 0 and 1.0 <= xldate < 61.0)
-# @throws XLDateTooLarge Gregorian year 10000 or later
-# @throws XLDateBadDatemode datemode arg is neither 0 nor 1
-# @throws XLDateError Covers the 4 specific errors
-
-def xldate_as_tuple(xldate, datemode):
-    if datemode not in (0, 1):
-        raise XLDateBadDatemode(datemode)
-    if xldate == 0.00:
-        return (0, 0, 0, 0, 0, 0)
-    if xldate < 0.00:
-        raise XLDateNegative(xldate)
-    xldays = int(xldate)
-    frac = xldate - xldays
-    seconds = int(round(frac * 86400.0))
-    assert 0 <= seconds <= 86400
-    if seconds == 86400:
-        hour = minute = second = 0
-        xldays += 1
-    else:
-        # second = seconds % 60; minutes = seconds // 60
-        minutes, second = divmod(seconds, 60)
-        # minute = minutes % 60; hour    = minutes // 60
-        hour, minute = divmod(minutes, 60)
-    if xldays >= _XLDAYS_TOO_LARGE[datemode]:
-        raise XLDateTooLarge(xldate)
-
-    if xldays == 0:
-        return (0, 0, 0, hour, minute, second)
-
-    if xldays < 61 and datemode == 0:
-        raise XLDateAmbiguous(xldate)
-
-    jdn = xldays + _JDN_delta[datemode]
-    yreg = ((((jdn * 4 + 274277) // 146097) * 3 // 4) + jdn + 1363) * 4 + 3
-    mp = ((yreg % 1461) // 4) * 535 + 333
-    d = ((mp % 16384) // 535) + 1
-    # mp /= 16384
-    mp >>= 14
-    if mp >= 10:
-        return ((yreg // 1461) - 4715, mp - 9, d, hour, minute, second)
-    else:
-        return ((yreg // 1461) - 4716, mp + 3, d, hour, minute, second)
-
-
 ##
 # Convert an Excel date/time number into a datetime.datetime object.
 #
@@ -215,3 +498,6 @@ def xldate_from_datetime_tuple(datetime_tuple, datemode):
         xldate_from_time_tuple(datetime_tuple[3:])
         )
 */
+
+}  // namespace xldate
+}  // namespace xlrd
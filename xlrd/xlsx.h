@@ -8,6 +8,12 @@
 
 // from __future__ import print_function, unicode_literals
 
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iterator>
+#include <thread>
+
 #include "./book.h"
 
 namespace xlrd {
@@ -15,6 +21,16 @@ namespace xlsx {
 
 const int DEBUG = 0;
 
+const int X12_MAX_ROWS = 1 << 20;
+const int X12_MAX_COLS = 1 << 14;
+
+const auto& XL_CELL_TEXT = biffh::XL_CELL_TEXT;
+const auto& XL_CELL_NUMBER = biffh::XL_CELL_NUMBER;
+const auto& XL_CELL_BOOLEAN = biffh::XL_CELL_BOOLEAN;
+const auto& XL_CELL_ERROR = biffh::XL_CELL_ERROR;
+const auto& XL_CELL_BLANK = biffh::XL_CELL_BLANK;
+using XLRDError = biffh::XLRDError;
+
 
 /*
 from .book import Book, Name
@@ -820,3 +836,896 @@ def open_workbook_2007_xml(
 
     return bk
 */
+
+// === Native <sheetData> scanner =============================================
+//
+// The ElementTree based code above walks one sheet element by element. For
+// big sheets we scan the inflated worksheet XML directly instead, and since
+// every <row> normally carries its own r= attribute the rows can be split
+// into byte ranges and scanned on several threads.
+
+////
+// A byte range inside an inflated XML part. begin == nullptr means
+// "not present" (e.g. a missing attribute), as opposed to an empty value.
+struct X12Span
+{
+    const char* begin = nullptr;
+    const char* end = nullptr;
+
+    X12Span() {}
+    X12Span(const char* b, const char* e) : begin(b), end(e) {}
+
+    bool is_null() const { return begin == nullptr; }
+    bool empty() const { return begin == end; }
+    size_t size() const { return end - begin; }
+    std::string str() const { return std::string(begin, end); }
+
+    bool equals(const char* s) const {
+        size_t n = std::strlen(s);
+        return size() == n && std::memcmp(begin, s, n) == 0;
+    }
+};
+
+inline bool
+_is_xml_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+////
+// Position of the '>' closing the tag which starts at p; quoted attribute
+// values may contain '>'.
+inline const char*
+_tag_end(const char* p, const char* end) {
+    char quote = 0;
+    for (; p < end; ++p) {
+        char c = *p;
+        if (quote) {
+            if (c == quote) quote = 0;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+        } else if (c == '>') {
+            return p;
+        }
+    }
+    return end;
+}
+
+////
+// Local name (namespace prefix stripped) of the tag starting at p, which
+// must point at '<'. For an end tag the leading '/' is kept out of the name.
+inline X12Span
+_tag_name(const char* p, const char* tag_end) {
+    const char* q = p + 1;
+    if (q < tag_end && *q == '/') ++q;
+    const char* name = q;
+    while (q < tag_end && !_is_xml_space(*q) && *q != '/' && *q != '>') {
+        if (*q == ':') name = q + 1;
+        ++q;
+    }
+    return X12Span(name, q);
+}
+
+inline bool
+_is_end_tag(const char* p) {
+    return p[1] == '/';
+}
+
+inline bool
+_is_empty_tag(const char* tag_end) {
+    return tag_end[-1] == '/';
+}
+
+////
+// Value of attribute `name` in the tag [tag, tag_end), raw (not unescaped).
+inline X12Span
+_tag_attr(const char* tag, const char* tag_end, const char* name) {
+    size_t n = std::strlen(name);
+    const char* p = _tag_name(tag, tag_end).end;
+    while (p < tag_end) {
+        while (p < tag_end && _is_xml_space(*p)) ++p;
+        const char* key = p;
+        while (p < tag_end && *p != '=' && !_is_xml_space(*p) && *p != '/' && *p != '>') ++p;
+        const char* key_end = p;
+        while (p < tag_end && _is_xml_space(*p)) ++p;
+        if (p >= tag_end || *p != '=') {
+            if (p == key) ++p;
+            continue;
+        }
+        ++p;
+        while (p < tag_end && _is_xml_space(*p)) ++p;
+        if (p >= tag_end) break;
+        char quote = *p++;
+        const char* value = p;
+        while (p < tag_end && *p != quote) ++p;
+        if ((size_t)(key_end - key) == n && std::memcmp(key, name, n) == 0) {
+            return X12Span(value, p);
+        }
+        ++p;
+    }
+    return X12Span();
+}
+
+inline void
+_append_utf8(std::string& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out.push_back((char)cp);
+    } else if (cp < 0x800) {
+        out.push_back((char)(0xC0 | (cp >> 6)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back((char)(0xE0 | (cp >> 12)));
+        out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back((char)(0xF0 | (cp >> 18)));
+        out.push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back((char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+inline int
+_hexval(char c) {
+    if ('0' <= c && c <= '9') return c - '0';
+    if ('a' <= c && c <= 'f') return c - 'a' + 10;
+    if ('A' <= c && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+////
+// Replaces the XML predefined entities and character references.
+inline void
+_append_xml_text(std::string& out, X12Span text) {
+    const char* p = text.begin;
+    while (p < text.end) {
+        const char* amp = (const char*)std::memchr(p, '&', text.end - p);
+        if (amp == nullptr) {
+            out.append(p, text.end);
+            return;
+        }
+        out.append(p, amp);
+        const char* semi = (const char*)std::memchr(amp, ';', text.end - amp);
+        if (semi == nullptr) {
+            out.append(amp, text.end);
+            return;
+        }
+        X12Span ent(amp + 1, semi);
+        if (ent.equals("amp")) out.push_back('&');
+        else if (ent.equals("lt")) out.push_back('<');
+        else if (ent.equals("gt")) out.push_back('>');
+        else if (ent.equals("quot")) out.push_back('"');
+        else if (ent.equals("apos")) out.push_back('\'');
+        else if (ent.size() > 1 && ent.begin[0] == '#') {
+            uint32_t cp = 0;
+            if (ent.begin[1] == 'x' || ent.begin[1] == 'X') {
+                for (const char* q = ent.begin + 2; q < ent.end; ++q) cp = cp * 16 + _hexval(*q);
+            } else {
+                for (const char* q = ent.begin + 1; q < ent.end; ++q) cp = cp * 10 + (*q - '0');
+            }
+            _append_utf8(out, cp);
+        } else {
+            out.append(amp, semi + 1);
+        }
+        p = semi + 1;
+    }
+}
+
+////
+// Replaces the _xHHHH_ escapes which Excel uses for characters that
+// cannot appear in XML (see unescape above).
+inline std::string
+unescape(const std::string& s) {
+    if (s.find('_') == std::string::npos) {
+        return s;
+    }
+    std::string out;
+    out.reserve(s.size());
+    size_t i = 0;
+    while (i < s.size()) {
+        if (s[i] == '_' && i + 7 <= s.size() && s[i+1] == 'x' && s[i+6] == '_'
+            && _hexval(s[i+2]) >= 0 && _hexval(s[i+3]) >= 0
+            && _hexval(s[i+4]) >= 0 && _hexval(s[i+5]) >= 0) {
+            uint32_t cp = (_hexval(s[i+2]) << 12) | (_hexval(s[i+3]) << 8)
+                        | (_hexval(s[i+4]) << 4) | _hexval(s[i+5]);
+            _append_utf8(out, cp);
+            i += 7;
+        } else {
+            out.push_back(s[i++]);
+        }
+    }
+    return out;
+}
+
+////
+// Text of the element whose start tag is [tag, tag_end), as cooked_text()
+// does it: entities replaced, whitespace stripped unless xml:space="preserve",
+// then unescape()d. Returns the position just past the element's end tag.
+inline const char*
+_cooked_text(std::string& out, const char* tag, const char* tag_end, const char* end) {
+    if (_is_empty_tag(tag_end)) {
+        return tag_end + 1;
+    }
+    const char* text_begin = tag_end + 1;
+    const char* text_end = (const char*)std::memchr(text_begin, '<', end - text_begin);
+    if (text_end == nullptr) text_end = end;
+    X12Span text(text_begin, text_end);
+    if (!_tag_attr(tag, tag_end, "xml:space").equals("preserve")) {
+        while (!text.empty() && _is_xml_space(*text.begin)) ++text.begin;
+        while (!text.empty() && _is_xml_space(text.end[-1])) --text.end;
+    }
+    std::string raw;
+    _append_xml_text(raw, text);
+    out.append(unescape(raw));
+    if (text_end < end && _is_end_tag(text_end)) {
+        return _tag_end(text_end, end) + 1;
+    }
+    return text_end;
+}
+
+////
+// Concatenated text of the <t> children of an <si> or <is> element, direct
+// or inside <r> runs, as get_text_from_si_or_is(). Phonetic runs (<rPh>)
+// are skipped. p points just past the start tag; returns the position just
+// past the matching end tag.
+inline const char*
+_text_from_si_or_is(std::string& out, const char* p, const char* end) {
+    int depth = 0;
+    bool in_rph = false;
+    while (p < end) {
+        const char* lt = (const char*)std::memchr(p, '<', end - p);
+        if (lt == nullptr) return end;
+        const char* te = _tag_end(lt, end);
+        X12Span name = _tag_name(lt, te);
+        if (_is_end_tag(lt)) {
+            if (depth == 0) return te + 1;
+            if (name.equals("rPh")) in_rph = false;
+            --depth;
+            p = te + 1;
+            continue;
+        }
+        if (_is_empty_tag(te)) {
+            p = te + 1;
+            continue;
+        }
+        if (name.equals("t") && !in_rph) {
+            p = _cooked_text(out, lt, te, end);
+            continue;
+        }
+        if (name.equals("rPh")) in_rph = true;
+        ++depth;
+        p = te + 1;
+    }
+    return end;
+}
+
+////
+// Value of a number cell's <v> as float() reads it in xlrd: surrounding
+// XML whitespace is ignored, and inf, infinity and nan (any case, signed)
+// are accepted besides the decimal forms parse_double() reads exactly.
+inline bool
+_parse_number(X12Span v, double* out) {
+    while (!v.empty() && _is_xml_space(*v.begin)) ++v.begin;
+    while (!v.empty() && _is_xml_space(v.end[-1])) --v.end;
+    if (utils::parse::parse_double(v.begin, v.end, out)) {
+        return true;
+    }
+    const char* p = v.begin + (!v.empty() && (*v.begin == '-' || *v.begin == '+'));
+    if (p == v.end || (utils::str::lowerchar(*p) != 'i' && utils::str::lowerchar(*p) != 'n')) {
+        return false;
+    }
+    std::string text = v.str();
+    char* text_end;
+    *out = std::strtod(text.c_str(), &text_end);
+    return text_end == text.c_str() + text.size();
+}
+
+inline int
+_parse_int(X12Span s) {
+    int value = 0;
+    for (const char* p = s.begin; p < s.end; ++p) {
+        value = value * 10 + (*p - '0');
+    }
+    return value;
+}
+
+////
+// Value of the len (1 to 8) decimal digits at p, or -1 if any of them is
+// not a digit. The digits are right-aligned in a word padded with '0's and
+// combined pairwise (SWAR), so there is no per-digit loop.
+inline int
+_parse_digits(const char* p, size_t len) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t v = 0x3030303030303030ULL;  // "00000000"
+    std::memcpy(reinterpret_cast<char*>(&v) + (8 - len), p, len);
+    if ((v & 0xF0F0F0F0F0F0F0F0ULL) != 0x3030303030303030ULL
+        || ((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) != 0x3030303030303030ULL) {
+        return -1;
+    }
+    v = ((v & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+    v = ((v & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+    return (int)(((v & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32);
+#else
+    uint32_t value = 0;
+    uint32_t bad = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint32_t d = (uint32_t)(unsigned char)p[i] - '0';
+        bad |= (d > 9);
+        value = value * 10 + d;
+    }
+    return bad ? -1 : (int)value;
+#endif
+}
+
+////
+// Decodes an A1 style reference ("B7", "$AB$12", "XFD1048576") into
+// zero-based rowx and colx. Column letters are converted arithmetically and
+// '$' markers are skipped. Returns false, rather than throwing, if the text
+// is malformed or outside X12_MAX_ROWS / X12_MAX_COLS; this runs once for
+// every &lt;c r="..."&gt;.
+inline bool
+decode_cell_ref(const char* p, const char* end, int* rowx, int* colx) {
+    p += (p < end && *p == '$');
+    int col = 0;
+    int nletters = 0;
+    for (; nletters < 3 && p < end; nletters++, p++) {
+        uint32_t d = (uint32_t)(unsigned char)*p - 'A';
+        if (d >= 26) break;
+        col = col * 26 + (int)d + 1;
+    }
+    p += (p < end && *p == '$');
+    size_t ndigits = end - p;
+    // row number can't start with '0'; 1048576 is 7 digits
+    if (nletters == 0 || ndigits == 0 || ndigits > 7 || *p == '0') {
+        return false;
+    }
+    int row = _parse_digits(p, ndigits);
+    *rowx = row - 1;
+    *colx = col - 1;
+    return row > 0 && row <= X12_MAX_ROWS && col <= X12_MAX_COLS;
+}
+
+inline bool
+decode_cell_ref(X12Span ref, int* rowx, int* colx) {
+    return decode_cell_ref(ref.begin, ref.end, rowx, colx);
+}
+
+////
+// As decode_cell_ref, but raises XLRDError for a bad cell name like
+// cell_name_to_rowx_colx above.
+inline void
+cell_name_to_rowx_colx(X12Span cell_name, int* rowx, int* colx) {
+    if (!decode_cell_ref(cell_name, rowx, colx)) {
+        throw XLRDError(utils::str::format("Bad cell name %s", cell_name.str()));
+    }
+}
+
+const MAP<std::string, int>
+error_code_from_text = {
+    {"#NULL!", 0x00},
+    {"#DIV/0!", 0x07},
+    {"#VALUE!", 0x0F},
+    {"#REF!", 0x17},
+    {"#NAME?", 0x1D},
+    {"#NUM!", 0x24},
+    {"#N/A", 0x2A},
+};
+
+////
+// ctype of a number cell whose type depends on its XF (date or number),
+// resolved by Sheet::put_cell.
+const int X12_CELL_BY_XF = sheet::XL_CELL_FROM_XF;
+
+////
+// One cell as scanned from a <c> element. Shared strings are kept as an
+// index until the cells are stored, so scanning threads never touch the Book.
+struct X12CellRecord
+{
+    int rowx = 0;
+    int colx = 0;
+    int ctype = 0;
+    int xf_index = 0;
+    double number = 0.0;
+    int sst_index = -1;
+    std::string text;
+    ////
+    // The <f> element, only recorded when scanning with want_formulas.
+    // formula_type is one of the X12_FORMULA_* values, X12_FORMULA_NONE
+    // for a cell without <f>. formula is its text, empty for the cells of
+    // a shared formula other than its master; those have only t="shared"
+    // and the si= of their master, which also carries the ref= range.
+    int formula_type = 0;
+    int shared_index = -1;
+    std::string formula;
+    std::string formula_ref;
+};
+
+const int X12_FORMULA_NONE = 0;
+const int X12_FORMULA_NORMAL = 1;
+const int X12_FORMULA_SHARED = 2;
+const int X12_FORMULA_ARRAY = 3;
+const int X12_FORMULA_DATA_TABLE = 4;
+
+////
+// Records the attributes of the <f> start tag [lt, te] in rec.
+inline void
+_scan_formula_attrs(X12CellRecord& rec, const char* lt, const char* te)
+{
+    X12Span t = _tag_attr(lt, te, "t");
+    if (t.is_null() || t.equals("normal")) {
+        rec.formula_type = X12_FORMULA_NORMAL;
+    } else if (t.equals("shared")) {
+        rec.formula_type = X12_FORMULA_SHARED;
+    } else if (t.equals("array")) {
+        rec.formula_type = X12_FORMULA_ARRAY;
+    } else if (t.equals("dataTable")) {
+        rec.formula_type = X12_FORMULA_DATA_TABLE;
+    } else {
+        throw XLRDError(utils::str::format(
+            "Unknown formula type %s in rowx=%d colx=%d", t.str(), rec.rowx, rec.colx));
+    }
+    X12Span si = _tag_attr(lt, te, "si");
+    if (!si.is_null()) rec.shared_index = _parse_int(si);
+    X12Span ref = _tag_attr(lt, te, "ref");
+    if (!ref.is_null()) rec.formula_ref = ref.str();
+}
+
+////
+// Scans the <row> elements in [p, end) into cells, as X12Sheet.do_row does.
+// rowx is the row index preceding the first row, used when a row has no r=.
+// Blank cells are only recorded when want_blanks (formatting_info) is set,
+// or, with want_formulas, when they hold a formula. <f> elements are
+// skipped unless want_formulas is set.
+inline void
+scan_rows(const char* p, const char* end, int rowx, bool want_blanks,
+          std::vector<X12CellRecord>& cells, bool want_formulas=false)
+{
+    while (p < end) {
+        const char* lt = (const char*)std::memchr(p, '<', end - p);
+        if (lt == nullptr) break;
+        const char* te = _tag_end(lt, end);
+        p = te + 1;
+        if (_is_end_tag(lt) || !_tag_name(lt, te).equals("row")) {
+            continue;
+        }
+        X12Span row_number = _tag_attr(lt, te, "r");
+        if (row_number.is_null()) {
+            rowx += 1;
+        } else {
+            rowx = _parse_int(row_number) - 1;
+        }
+        if (!(0 <= rowx && rowx < X12_MAX_ROWS)) {
+            throw XLRDError(utils::str::format("Bad row number in rowx=%d", rowx));
+        }
+        if (_is_empty_tag(te)) {
+            continue;
+        }
+        int colx = -1;
+        while (p < end) {
+            lt = (const char*)std::memchr(p, '<', end - p);
+            if (lt == nullptr) return;
+            te = _tag_end(lt, end);
+            p = te + 1;
+            X12Span name = _tag_name(lt, te);
+            if (_is_end_tag(lt)) {
+                if (name.equals("row")) break;
+                continue;
+            }
+            if (!name.equals("c")) {
+                continue;
+            }
+            X12Span cell_name = _tag_attr(lt, te, "r");
+            if (cell_name.is_null()) {
+                colx += 1;
+            } else {
+                int cell_rowx;
+                if (!decode_cell_ref(cell_name, &cell_rowx, &colx)) {
+                    throw XLRDError(utils::str::format(
+                        "Bad cell name %s in rowx=%d", cell_name.str(), rowx));
+                }
+                if (!row_number.is_null() && cell_rowx != rowx) {
+                    throw XLRDError(utils::str::format(
+                        "cell name %s but row number is %s", cell_name.str(), row_number.str()));
+                }
+            }
+            X12Span xf = _tag_attr(lt, te, "s");
+            X12Span cell_type = _tag_attr(lt, te, "t");
+
+            X12CellRecord rec;
+            rec.rowx = rowx;
+            rec.colx = colx;
+            rec.xf_index = xf.is_null() ? 0 : _parse_int(xf);
+
+            X12Span tvalue;
+            const char* v_tag = nullptr;  // start tag of <v>, for _cooked_text
+            const char* v_tag_end = nullptr;
+            std::string text;
+            bool has_text = false;
+            if (!_is_empty_tag(te)) {
+                while (p < end) {
+                    lt = (const char*)std::memchr(p, '<', end - p);
+                    if (lt == nullptr) return;
+                    te = _tag_end(lt, end);
+                    X12Span child = _tag_name(lt, te);
+                    if (_is_end_tag(lt)) {
+                        p = te + 1;
+                        if (child.equals("c")) break;
+                        continue;
+                    }
+                    if (child.equals("v")) {
+                        v_tag = lt;
+                        v_tag_end = te;
+                        if (_is_empty_tag(te)) {
+                            tvalue = X12Span(te, te);
+                            p = te + 1;
+                        } else {
+                            const char* v_end = (const char*)std::memchr(te + 1, '<', end - te - 1);
+                            if (v_end == nullptr) v_end = end;
+                            tvalue = X12Span(te + 1, v_end);
+                            p = v_end;
+                        }
+                    } else if (child.equals("is") && !_is_empty_tag(te)) {
+                        p = _text_from_si_or_is(text, te + 1, end);
+                        has_text = true;
+                    } else if (want_formulas && child.equals("f")) {
+                        _scan_formula_attrs(rec, lt, te);
+                        if (_is_empty_tag(te)) {
+                            p = te + 1;
+                        } else {
+                            const char* f_end = (const char*)std::memchr(te + 1, '<', end - te - 1);
+                            if (f_end == nullptr) f_end = end;
+                            _append_xml_text(rec.formula, X12Span(te + 1, f_end));
+                            p = f_end;
+                        }
+                    } else {
+                        p = te + 1;
+                    }
+                }
+            }
+
+            if (cell_type.is_null() || cell_type.equals("n")) {
+                // n = number. Most frequent type.
+                if (tvalue.is_null() || tvalue.empty()) {
+                    if (!want_blanks && rec.formula_type == X12_FORMULA_NONE) continue;
+                    rec.ctype = XL_CELL_BLANK;
+                } else {
+                    rec.ctype = X12_CELL_BY_XF;
+                    if (!_parse_number(tvalue, &rec.number)) {
+                        throw XLRDError(utils::str::format(
+                            "Bad number %s in rowx=%d colx=%d", tvalue.str(), rowx, colx));
+                    }
+                }
+            } else if (cell_type.equals("s")) {
+                // s = index into shared string table. 2nd most frequent type
+                if (tvalue.is_null() || tvalue.empty()) {
+                    if (!want_blanks && rec.formula_type == X12_FORMULA_NONE) continue;
+                    rec.ctype = XL_CELL_BLANK;
+                } else {
+                    rec.ctype = XL_CELL_TEXT;
+                    rec.sst_index = _parse_int(tvalue);
+                }
+            } else if (cell_type.equals("str")) {
+                // str = string result from formula. <v> can contain escapes
+                rec.ctype = XL_CELL_TEXT;
+                if (!tvalue.is_null()) {
+                    _cooked_text(rec.text, v_tag, v_tag_end, end);
+                }
+            } else if (cell_type.equals("b")) {
+                rec.ctype = XL_CELL_BOOLEAN;
+                rec.number = tvalue.is_null() ? 0 : _parse_int(tvalue);
+            } else if (cell_type.equals("e")) {
+                rec.ctype = XL_CELL_ERROR;
+                std::string raw;
+                if (!tvalue.is_null()) _append_xml_text(raw, tvalue);
+                auto it = error_code_from_text.find(raw);
+                if (it == error_code_from_text.end()) {
+                    throw XLRDError(utils::str::format(
+                        "Unknown error text %s in rowx=%d colx=%d", raw, rowx, colx));
+                }
+                rec.number = it->second;
+            } else if (cell_type.equals("inlineStr")) {
+                if (!has_text && !tvalue.is_null()) {
+                    _append_xml_text(text, tvalue);
+                }
+                if (text.empty()) {
+                    if (!want_blanks && rec.formula_type == X12_FORMULA_NONE) continue;
+                    rec.ctype = XL_CELL_BLANK;
+                } else {
+                    rec.ctype = XL_CELL_TEXT;
+                    rec.text = std::move(text);
+                }
+            } else {
+                throw XLRDError(utils::str::format(
+                    "Unknown cell type %s in rowx=%d colx=%d", cell_type.str(), rowx, colx));
+            }
+            cells.push_back(std::move(rec));
+        }
+    }
+}
+
+////
+// Inflated worksheets smaller than this are always scanned on one thread.
+const size_t X12_PARALLEL_MIN_CHUNK = 1 << 20;
+
+////
+// Splits [begin, end) -- the content of <sheetData> -- into at most nchunks
+// byte ranges of roughly equal size, each starting at a "<row" start tag.
+// Returns the chunk boundaries: chunk i is [bounds[i], bounds[i+1]).
+inline std::vector<const char*>
+split_at_rows(const char* begin, const char* end, int nchunks)
+{
+    std::vector<const char*> bounds = {begin};
+    size_t total = end - begin;
+    for (int i = 1; i < nchunks; i++) {
+        const char* p = begin + total * i / nchunks;
+        if (p <= bounds.back()) continue;
+        const char* found = nullptr;
+        while (p < end) {
+            const char* lt = (const char*)std::memchr(p, '<', end - p);
+            if (lt == nullptr) break;
+            const char* te = _tag_end(lt, end);
+            if (!_is_end_tag(lt) && _tag_name(lt, te).equals("row")) {
+                found = lt;
+                break;
+            }
+            p = lt + 1;
+        }
+        if (found == nullptr) break;
+        bounds.push_back(found);
+    }
+    bounds.push_back(end);
+    return bounds;
+}
+
+////
+// Scans the <sheetData> of an inflated worksheet part into cells, in
+// document order. With nthreads != 1 (0 means one per hardware thread) the
+// rows are split by split_at_rows() and scanned concurrently. That needs
+// the first row of every chunk to carry an explicit r= attribute, because
+// a row without one is numbered from its predecessor; if any chunk does not
+// start that way the whole sheet is scanned serially instead.
+// The <dimension> element, if any, sets *dimnrows and *dimncols.
+// want_formulas is passed on to scan_rows().
+inline std::vector<X12CellRecord>
+scan_sheet_xml(const std::string& xml, bool want_blanks, int nthreads,
+               int* dimnrows=nullptr, int* dimncols=nullptr, bool want_formulas=false)
+{
+    const char* begin = xml.data();
+    const char* end = begin + xml.size();
+    const char* data_begin = nullptr;
+    const char* data_end = end;
+
+    const char* p = begin;
+    while (p < end) {
+        const char* lt = (const char*)std::memchr(p, '<', end - p);
+        if (lt == nullptr) break;
+        const char* te = _tag_end(lt, end);
+        X12Span name = _tag_name(lt, te);
+        p = te + 1;
+        if (_is_end_tag(lt)) {
+            continue;
+        }
+        if (name.equals("dimension") && dimnrows != nullptr) {
+            // example: "A1:Z99" or just "A1"
+            X12Span ref = _tag_attr(lt, te, "ref");
+            if (!ref.is_null() && !ref.empty()) {
+                const char* colon = (const char*)std::memchr(ref.begin, ':', ref.size());
+                int rowx, colx;
+                cell_name_to_rowx_colx(X12Span(colon ? colon + 1 : ref.begin, ref.end), &rowx, &colx);
+                *dimnrows = rowx + 1;
+                *dimncols = colx + 1;
+            }
+        } else if (name.equals("sheetData")) {
+            if (_is_empty_tag(te)) {
+                return {};
+            }
+            data_begin = p;
+            break;
+        }
+    }
+    std::vector<X12CellRecord> cells;
+    if (data_begin == nullptr) {
+        return cells;
+    }
+    const char* close = std::search(data_begin, end, "</", "</" + 2);
+    while (close != end) {
+        const char* te = _tag_end(close, end);
+        if (_tag_name(close, te).equals("sheetData")) {
+            data_end = close;
+            break;
+        }
+        close = std::search(close + 2, end, "</", "</" + 2);
+    }
+
+    if (nthreads <= 0) {
+        nthreads = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    size_t size = data_end - data_begin;
+    nthreads = std::min<size_t>(nthreads, std::max<size_t>(1, size / X12_PARALLEL_MIN_CHUNK));
+
+    std::vector<const char*> bounds;
+    if (nthreads > 1) {
+        bounds = split_at_rows(data_begin, data_end, nthreads);
+        for (size_t i = 1; i + 1 < bounds.size(); i++) {
+            const char* te = _tag_end(bounds[i], data_end);
+            if (_tag_attr(bounds[i], te, "r").is_null()) {
+                if (DEBUG) utils::pprint("no row number at chunk %d; scanning serially", (int)i);
+                bounds.clear();
+                break;
+            }
+        }
+    }
+    if (bounds.size() <= 2) {
+        scan_rows(data_begin, data_end, -1, want_blanks, cells, want_formulas);
+        return cells;
+    }
+
+    size_t nchunks = bounds.size() - 1;
+    std::vector<std::vector<X12CellRecord>> buffers(nchunks);
+    std::vector<std::exception_ptr> errors(nchunks);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < nchunks; i++) {
+        workers.emplace_back([&, i]() {
+            try {
+                scan_rows(bounds[i], bounds[i+1], -1, want_blanks, buffers[i], want_formulas);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (auto& worker: workers) {
+        worker.join();
+    }
+    size_t ncells = 0;
+    for (size_t i = 0; i < nchunks; i++) {
+        if (errors[i]) std::rethrow_exception(errors[i]);
+        ncells += buffers[i].size();
+    }
+    // Chunks are in document order, so concatenating them gives the
+    // same cell order as a serial scan.
+    cells.reserve(ncells);
+    for (auto& buffer: buffers) {
+        std::move(buffer.begin(), buffer.end(), std::back_inserter(cells));
+    }
+    return cells;
+}
+
+////
+// Stores scanned cells into the sheet. sst is anything indexable by a
+// shared string index (the book's shared string table).
+template<class SST>
+inline void
+put_cells(sheet::Sheet& sheet, const SST& sst, const std::vector<X12CellRecord>& cells)
+{
+    for (const auto& rec: cells) {
+        switch (rec.ctype) {
+        case X12_CELL_BY_XF:
+            sheet.put_cell(rec.rowx, rec.colx, X12_CELL_BY_XF, rec.number, rec.xf_index);
+            break;
+        case XL_CELL_TEXT:
+            if (rec.sst_index >= 0) {
+                sheet.put_cell(rec.rowx, rec.colx, XL_CELL_TEXT, std::string(sst[rec.sst_index]), rec.xf_index);
+            } else {
+                sheet.put_cell(rec.rowx, rec.colx, XL_CELL_TEXT, rec.text, rec.xf_index);
+            }
+            break;
+        case XL_CELL_BLANK:
+            // a formula cell without a value, kept for its formula
+            if (!sheet.formatting_info) break;
+            sheet.put_cell(rec.rowx, rec.colx, XL_CELL_BLANK, std::string(""), rec.xf_index);
+            break;
+        default:
+            sheet.put_cell(rec.rowx, rec.colx, rec.ctype, (int)rec.number, rec.xf_index);
+            break;
+        }
+    }
+}
+
+////
+// Loads the cells of one inflated worksheet part into sheet.
+// @param nthreads Number of scanning threads; 0 means one per hardware thread,
+// 1 forces a serial scan.
+// @param formulas If not null, the records of the cells with an <f> element
+// are appended to it, in document order. Formulas are not scanned otherwise.
+template<class SST>
+inline void
+process_sheet_xml(sheet::Sheet& sheet, const SST& sst, const std::string& xml, int nthreads=0,
+                  std::vector<X12CellRecord>* formulas=nullptr)
+{
+    sheet.utter_max_rows = X12_MAX_ROWS;
+    sheet.utter_max_cols = X12_MAX_COLS;
+    auto cells = scan_sheet_xml(xml, sheet.formatting_info != 0, nthreads,
+                                &sheet._dimnrows, &sheet._dimncols, formulas != nullptr);
+    put_cells(sheet, sst, cells);
+    sheet.tidy_dimensions();
+    if (formulas != nullptr) {
+        for (auto& rec: cells) {
+            if (rec.formula_type != X12_FORMULA_NONE) {
+                formulas->push_back(std::move(rec));
+            }
+        }
+    }
+}
+
+////
+// Shared string table read from an inflated sharedStrings.xml.
+// <p>In lazy mode only the offset of each &lt;si&gt; element is recorded while the
+// part is scanned; its text (runs concatenated, entities and _xHHHH_ escapes
+// replaced, as get_text_from_si_or_is) is decoded on first access and cached.
+// Otherwise every entry is decoded up front, as X12SST.process_stream does.</p>
+// <p>Lookups are not synchronised; put_cells() does them on one thread.</p>
+class X12SharedStrings
+{
+public:
+    X12SharedStrings() {}
+
+    X12SharedStrings(std::string xml, bool lazy=true) {
+        this->load(std::move(xml), lazy);
+    }
+
+    inline
+    void load(std::string xml, bool lazy=true) {
+        this->xml_ = std::move(xml);
+        this->offsets_.clear();
+        const char* begin = this->xml_.data();
+        const char* end = begin + this->xml_.size();
+        const char* p = begin;
+        while (p < end) {
+            const char* lt = (const char*)std::memchr(p, '<', end - p);
+            if (lt == nullptr) break;
+            const char* te = _tag_end(lt, end);
+            p = te + 1;
+            if (_is_end_tag(lt) || !_tag_name(lt, te).equals("si")) {
+                continue;
+            }
+            // <si/> is an empty string; npos marks it
+            this->offsets_.push_back(_is_empty_tag(te) ? std::string::npos : (size_t)(p - begin));
+        }
+        this->strings_.assign(this->offsets_.size(), std::string());
+        this->decoded_.assign(this->offsets_.size(), 0);
+        if (!lazy) {
+            for (size_t i = 0; i < this->offsets_.size(); i++) {
+                this->decode(i);
+            }
+            // nothing is left to decode from
+            this->xml_.clear();
+            this->xml_.shrink_to_fit();
+        }
+    }
+
+    size_t size() const {
+        return this->offsets_.size();
+    }
+
+    ////
+    // Text of shared string #index.
+    inline
+    const std::string& operator[](int index) const {
+        if (index < 0 || (size_t)index >= this->offsets_.size()) {
+            throw XLRDError(utils::str::format(
+                "Shared string index %d out of range (%d entries)", index, (int)this->offsets_.size()));
+        }
+        if (!this->decoded_[index]) {
+            this->decode(index);
+        }
+        return this->strings_[index];
+    }
+
+private:
+    inline
+    void decode(size_t index) const {
+        size_t offset = this->offsets_[index];
+        if (offset != std::string::npos) {
+            const char* begin = this->xml_.data();
+            _text_from_si_or_is(this->strings_[index], begin + offset, begin + this->xml_.size());
+        }
+        this->decoded_[index] = 1;
+    }
+
+    std::string xml_;
+    std::vector<size_t> offsets_;
+    mutable std::vector<std::string> strings_;
+    mutable std::vector<uint8_t> decoded_;
+};
+
+}  // namespace xlsx
+}  // namespace xlrd